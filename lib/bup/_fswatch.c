@@ -0,0 +1,311 @@
+#define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE 1
+#define PY_SSIZE_T_CLEAN 1
+#undef NDEBUG
+#include "../../config/config.h"
+
+// According to Python, its header has to go first:
+//   http://docs.python.org/2/c-api/intro.html#include-files
+#include <Python.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef BUP_HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+#ifdef BUP_HAVE_FANOTIFY
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#endif
+
+#include "_fswatch.h"
+#include "bup/pyutil.h"
+
+// cstr_argf: for byte vectors without null characters (e.g. paths)
+#define cstr_argf "y"
+
+
+#ifdef BUP_HAVE_INOTIFY
+
+PyObject *bup_inotify_init(PyObject *self, PyObject *args)
+{
+    const int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyLong_FromLong(fd);
+}
+
+PyObject *bup_inotify_add_watch(PyObject *self, PyObject *args)
+{
+    int fd;
+    char *path;
+    unsigned int mask;
+    if (!PyArg_ParseTuple(args, "i" cstr_argf "I", &fd, &path, &mask))
+        return NULL;
+    const int wd = inotify_add_watch(fd, path, mask);
+    if (wd < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    return PyLong_FromLong(wd);
+}
+
+#endif // BUP_HAVE_INOTIFY
+
+
+#ifdef BUP_HAVE_FANOTIFY
+
+PyObject *bup_fanotify_init(PyObject *self, PyObject *args)
+{
+    unsigned int flags, event_f_flags;
+    if (!PyArg_ParseTuple(args, "II", &flags, &event_f_flags))
+        return NULL;
+    const int fd = fanotify_init(flags, event_f_flags);
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyLong_FromLong(fd);
+}
+
+PyObject *bup_fanotify_mark(PyObject *self, PyObject *args)
+{
+    int fd;
+    unsigned int flags;
+    unsigned long long mask;
+    char *path;
+    if (!PyArg_ParseTuple(args, "iIK" cstr_argf, &fd, &flags, &mask, &path))
+        return NULL;
+    if (fanotify_mark(fd, flags, mask, AT_FDCWD, path) < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    Py_RETURN_NONE;
+}
+
+PyObject *bup_fanotify_fsid(PyObject *self, PyObject *args)
+{
+    char *path;
+    if (!PyArg_ParseTuple(args, cstr_argf, &path))
+        return NULL;
+    struct statfs st;
+    if (statfs(path, &st) < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    return PyBytes_FromStringAndSize((const char *) &st.f_fsid,
+                                     sizeof(st.f_fsid));
+}
+
+// Returns the (mask, fsid, handle, name) for the event, where fsid,
+// handle, and name are None when the event has no directory fid
+// information (e.g. FAN_Q_OVERFLOW), and name is None when the event
+// is about the directory itself.
+static PyObject *fanotify_event_tuple(const struct fanotify_event_metadata *ev)
+{
+    const char *p = (const char *) ev + ev->metadata_len;
+    const char *end = (const char *) ev + ev->event_len;
+    while (p + sizeof(struct fanotify_event_info_header) <= end)
+    {
+        const struct fanotify_event_info_fid *info = (const void *) p;
+        if (info->hdr.len < sizeof(*info) || p + info->hdr.len > end)
+            break;
+        if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
+            || info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID)
+        {
+            const struct file_handle *fh = (const void *) info->handle;
+            const char *fh_end = (const char *) fh->f_handle + fh->handle_bytes;
+            if (fh_end > p + info->hdr.len)
+                break;
+            const Py_ssize_t fh_len = fh_end - (const char *) fh;
+            if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID)
+                return Py_BuildValue("Ky#y#O", (unsigned long long) ev->mask,
+                                     (const char *) &info->fsid,
+                                     (Py_ssize_t) sizeof(info->fsid),
+                                     (const char *) fh, fh_len, Py_None);
+            const char *name = fh_end;
+            const size_t max_name = (p + info->hdr.len) - name;
+            const size_t name_len = strnlen(name, max_name);
+            if (name_len == max_name)
+                break;
+            return Py_BuildValue("Ky#y#y#", (unsigned long long) ev->mask,
+                                 (const char *) &info->fsid,
+                                 (Py_ssize_t) sizeof(info->fsid),
+                                 (const char *) fh, fh_len,
+                                 name, (Py_ssize_t) name_len);
+        }
+        p += info->hdr.len;
+    }
+    return Py_BuildValue("KOOO", (unsigned long long) ev->mask,
+                         Py_None, Py_None, Py_None);
+}
+
+PyObject *bup_fanotify_read(PyObject *self, PyObject *args)
+{
+    int fd;
+    if (!PyArg_ParseTuple(args, "i", &fd))
+        return NULL;
+    // The kernel requires room for at least one complete event
+    const size_t buf_size = 64 * 1024;
+    char *buf = checked_malloc(buf_size, 1);
+    if (!buf)
+        return NULL;
+    PyObject *result = NULL;
+    ssize_t len;
+    while (1)
+    {
+        Py_BEGIN_ALLOW_THREADS;
+        len = read(fd, buf, buf_size);
+        Py_END_ALLOW_THREADS;
+        if (len >= 0)
+            break;
+        if (errno != EINTR)
+        {
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto clean_and_return;
+        }
+        if (PyErr_CheckSignals())
+            goto clean_and_return;
+    }
+    result = PyList_New(0);
+    if (!result)
+        goto clean_and_return;
+    const struct fanotify_event_metadata *ev = (const void *) buf;
+    while (FAN_EVENT_OK(ev, len))
+    {
+        if (ev->vers != FANOTIFY_METADATA_VERSION)
+        {
+            PyErr_Format(PyExc_OSError,
+                         "unexpected fanotify metadata version %d",
+                         (int) ev->vers);
+            Py_CLEAR(result);
+            goto clean_and_return;
+        }
+        if (ev->fd >= 0)  // Only when not reporting fids
+            close(ev->fd);
+        PyObject *item = fanotify_event_tuple(ev);
+        if (!item || PyList_Append(result, item) < 0)
+        {
+            Py_XDECREF(item);
+            Py_CLEAR(result);
+            goto clean_and_return;
+        }
+        Py_DECREF(item);
+        ev = FAN_EVENT_NEXT(ev, len);
+    }
+ clean_and_return:
+    free(buf);
+    return result;
+}
+
+PyObject *bup_fanotify_handle_path(PyObject *self, PyObject *args)
+{
+    int mount_fd;
+    Py_buffer handle;
+    if (!PyArg_ParseTuple(args, "iy*", &mount_fd, &handle))
+        return NULL;
+    PyObject *result = NULL;
+    struct file_handle *fh = NULL;
+    int fd = -1;
+    if ((size_t) handle.len < sizeof(*fh))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid file handle");
+        goto clean_and_return;
+    }
+    // Copy it, since the buffer might not be suitably aligned
+    fh = checked_malloc(handle.len, 1);
+    if (!fh)
+        goto clean_and_return;
+    memcpy(fh, handle.buf, handle.len);
+    if (sizeof(*fh) + fh->handle_bytes > (size_t) handle.len)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid file handle");
+        goto clean_and_return;
+    }
+    fd = open_by_handle_at(mount_fd, fh, O_PATH | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ESTALE || errno == ENOENT)
+        {
+            // The directory has been deleted
+            result = Py_None;
+            Py_INCREF(result);
+            goto clean_and_return;
+        }
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto clean_and_return;
+    }
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    char path[PATH_MAX + 1];
+    const ssize_t len = readlink(proc_path, path, sizeof(path));
+    if (len < 0)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, proc_path);
+        goto clean_and_return;
+    }
+    if ((size_t) len == sizeof(path))
+    {
+        PyErr_SetString(PyExc_OSError, "fanotify directory path too long");
+        goto clean_and_return;
+    }
+    result = PyBytes_FromStringAndSize(path, len);
+ clean_and_return:
+    if (fd >= 0)
+        close(fd);
+    free(fh);
+    PyBuffer_Release(&handle);
+    return result;
+}
+
+#endif // BUP_HAVE_FANOTIFY
+
+
+static int add_constant(PyObject *m, const char *name, unsigned long long value)
+{
+    PyObject *py = PyLong_FromUnsignedLongLong(value);
+    if (!py)
+        return 0;
+    const int rc = PyObject_SetAttrString(m, name, py);
+    Py_DECREF(py);
+    return rc == 0;
+}
+
+int fswatch_setup(PyObject *m)
+{
+#define BUP_ADD_CONSTANT(x) if (!add_constant(m, #x, x)) return 0
+#ifdef BUP_HAVE_INOTIFY
+    BUP_ADD_CONSTANT(IN_ATTRIB);
+    BUP_ADD_CONSTANT(IN_CLOSE_WRITE);
+    BUP_ADD_CONSTANT(IN_CREATE);
+    BUP_ADD_CONSTANT(IN_DELETE);
+    BUP_ADD_CONSTANT(IN_DELETE_SELF);
+    BUP_ADD_CONSTANT(IN_DONT_FOLLOW);
+    BUP_ADD_CONSTANT(IN_IGNORED);
+    BUP_ADD_CONSTANT(IN_ISDIR);
+    BUP_ADD_CONSTANT(IN_MODIFY);
+    BUP_ADD_CONSTANT(IN_MOVED_FROM);
+    BUP_ADD_CONSTANT(IN_MOVED_TO);
+    BUP_ADD_CONSTANT(IN_MOVE_SELF);
+    BUP_ADD_CONSTANT(IN_ONLYDIR);
+    BUP_ADD_CONSTANT(IN_Q_OVERFLOW);
+#endif
+#ifdef BUP_HAVE_FANOTIFY
+    BUP_ADD_CONSTANT(FAN_ATTRIB);
+    BUP_ADD_CONSTANT(FAN_CLASS_NOTIF);
+    BUP_ADD_CONSTANT(FAN_CLOEXEC);
+    BUP_ADD_CONSTANT(FAN_CLOSE_WRITE);
+    BUP_ADD_CONSTANT(FAN_CREATE);
+    BUP_ADD_CONSTANT(FAN_DELETE);
+    BUP_ADD_CONSTANT(FAN_DELETE_SELF);
+    BUP_ADD_CONSTANT(FAN_MARK_ADD);
+    BUP_ADD_CONSTANT(FAN_MARK_FILESYSTEM);
+    BUP_ADD_CONSTANT(FAN_MODIFY);
+    BUP_ADD_CONSTANT(FAN_MOVED_FROM);
+    BUP_ADD_CONSTANT(FAN_MOVED_TO);
+    BUP_ADD_CONSTANT(FAN_MOVE_SELF);
+    BUP_ADD_CONSTANT(FAN_ONDIR);
+    BUP_ADD_CONSTANT(FAN_Q_OVERFLOW);
+    BUP_ADD_CONSTANT(FAN_REPORT_DFID_NAME);
+#endif
+#undef BUP_ADD_CONSTANT
+    return 1;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#ifdef BUP_HAVE_INOTIFY
+PyObject *bup_inotify_init(PyObject *self, PyObject *args);
+PyObject *bup_inotify_add_watch(PyObject *self, PyObject *args);
+#endif
+
+#ifdef BUP_HAVE_FANOTIFY
+PyObject *bup_fanotify_init(PyObject *self, PyObject *args);
+PyObject *bup_fanotify_mark(PyObject *self, PyObject *args);
+PyObject *bup_fanotify_fsid(PyObject *self, PyObject *args);
+PyObject *bup_fanotify_read(PyObject *self, PyObject *args);
+PyObject *bup_fanotify_handle_path(PyObject *self, PyObject *args);
+#endif
+
+int fswatch_setup(PyObject *m);
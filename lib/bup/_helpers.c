@@ -12,7 +12,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -69,6 +71,12 @@
 #include "bup/pyutil.h"
 #include "bupsplit.h"
 #include "_hashsplit.h"
+#include "_index.h"
+#include "_metadata.h"
+#include "_pack.h"
+#include "_tree.h"
+#include "_vint.h"
+#include "_fswatch.h"
 
 #if defined(FS_IOC_GETFLAGS) && defined(FS_IOC_SETFLAGS)
 #define BUP_HAVE_FILE_ATTRS 1
@@ -581,6 +589,173 @@ static PyObject *bloom_contains(PyObject *self, PyObject *args)
     return result;
 }
 
+// The bloom_add_many() workers may set bits in the same byte
+// concurrently, so they OR atomically.
+#define BLOOM_SET_BIT_ATOMIC(name, address, otype) \
+static void name(unsigned char *bloom, const unsigned char *buf, const int nbits)\
+{\
+    unsigned char bitmask;\
+    otype v;\
+    address(buf, nbits, &v, &bitmask);\
+    __atomic_fetch_or(&bloom[BLOOM2_HEADERLEN+v], bitmask, __ATOMIC_RELAXED);\
+}
+BLOOM_SET_BIT_ATOMIC(bloom_set_bit4_atomic, to_bloom_address_bitmask4, uint64_t)
+BLOOM_SET_BIT_ATOMIC(bloom_set_bit5_atomic, to_bloom_address_bitmask5, uint32_t)
+
+#define BLOOM_ADD_MAX_THREADS 256
+
+struct bloom_add_job {
+    unsigned char *bloom;
+    Py_buffer *tables;
+    Py_ssize_t n_tables;
+    Py_ssize_t start;  // first sha (across all tables) to add
+    Py_ssize_t end;  // one past the last sha to add
+    int nbits;
+    int k;
+    int atomic;
+};
+
+static void *bloom_add_job_run(void *arg)
+{
+    const struct bloom_add_job *job = arg;
+    void (*set_bit)(unsigned char *, const unsigned char *, const int);
+    if (job->k == 5)
+        set_bit = job->atomic ? bloom_set_bit5_atomic : bloom_set_bit5;
+    else
+        set_bit = job->atomic ? bloom_set_bit4_atomic : bloom_set_bit4;
+
+    Py_ssize_t table_start = 0;
+    for (Py_ssize_t i = 0; i < job->n_tables && table_start < job->end; i++)
+    {
+        const Py_ssize_t n = job->tables[i].len / 20;
+        const Py_ssize_t table_end = table_start + n;
+        if (table_end > job->start)
+        {
+            const Py_ssize_t lo = job->start > table_start
+                ? job->start - table_start : 0;
+            const Py_ssize_t hi = job->end < table_end
+                ? job->end - table_start : n;
+            const unsigned char *cur = (unsigned char *) job->tables[i].buf;
+            const unsigned char *end = cur + hi * 20;
+            for (cur += lo * 20; cur < end; cur += 20 / job->k)
+                set_bit(job->bloom, cur, job->nbits);
+        }
+        table_start = table_end;
+    }
+    return NULL;
+}
+
+static PyObject *bloom_add_many(PyObject *self, PyObject *args)
+{
+    Py_buffer bloom;
+    PyObject *py_tables;
+    int nbits = 0, k = 0, nthreads = 0;
+    if (!PyArg_ParseTuple(args, wbuf_argf "Oiii",
+                          &bloom, &py_tables, &nbits, &k, &nthreads))
+        return NULL;
+
+    PyObject *result = NULL;
+    PyObject *seq = NULL;
+    Py_buffer *tables = NULL;
+    Py_ssize_t n_tables = 0, n_init = 0;
+    struct bloom_add_job *jobs = NULL;
+    pthread_t *threads = NULL;
+
+    if (!((k == 5 && nbits <= 29) || (k == 4 && nbits <= 37)))
+    {
+        PyErr_Format(PyExc_ValueError, "invalid bloom k %d and bits %d",
+                     k, nbits);
+        goto clean_and_return;
+    }
+    if (bloom.len < BLOOM2_HEADERLEN + ((Py_ssize_t) 1 << nbits))
+    {
+        PyErr_SetString(PyExc_ValueError, "bloom map is too small");
+        goto clean_and_return;
+    }
+    if (bloom.readonly)
+    {
+        PyErr_SetString(PyExc_ValueError, "bloom map is read-only");
+        goto clean_and_return;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > BLOOM_ADD_MAX_THREADS)
+        nthreads = BLOOM_ADD_MAX_THREADS;
+
+    seq = PySequence_Fast(py_tables, "tables must be a sequence of buffers");
+    if (!seq)
+        goto clean_and_return;
+    n_tables = PySequence_Fast_GET_SIZE(seq);
+    if (!(tables = checked_calloc(n_tables ? n_tables : 1, sizeof(Py_buffer))))
+        goto clean_and_return;
+
+    Py_ssize_t total = 0;
+    for (; n_init < n_tables; n_init++)
+    {
+        PyObject *t = PySequence_Fast_GET_ITEM(seq, n_init);
+        if (PyObject_GetBuffer(t, &tables[n_init], PyBUF_SIMPLE) == -1)
+            goto clean_and_return;
+        if (tables[n_init].len % 20 != 0)
+        {
+            n_init++;
+            PyErr_SetString(PyExc_ValueError,
+                            "sha table length is not a multiple of 20");
+            goto clean_and_return;
+        }
+        total += tables[n_init].len / 20;
+    }
+
+    // Not worth a thread unless each one has a decent amount of work.
+    if (total / nthreads < 4096)
+        nthreads = total / 4096 > 1 ? total / 4096 : 1;
+    if (!(jobs = checked_malloc(nthreads, sizeof(struct bloom_add_job))))
+        goto clean_and_return;
+    if (!(threads = checked_malloc(nthreads, sizeof(pthread_t))))
+        goto clean_and_return;
+    for (int i = 0; i < nthreads; i++)
+    {
+        jobs[i].bloom = bloom.buf;
+        jobs[i].tables = tables;
+        jobs[i].n_tables = n_tables;
+        jobs[i].start = total / nthreads * i;
+        jobs[i].end = i == nthreads - 1 ? total : total / nthreads * (i + 1);
+        jobs[i].nbits = nbits;
+        jobs[i].k = k;
+        jobs[i].atomic = nthreads > 1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    int started = 0;
+    for (int i = 1; i < nthreads; i++)
+    {
+        // If we can't start a thread, just do its share ourselves.
+        if (pthread_create(&threads[i], NULL, bloom_add_job_run, &jobs[i]))
+            break;
+        started = i;
+    }
+    for (int i = started + 1; i < nthreads; i++)
+        bloom_add_job_run(&jobs[i]);
+    bloom_add_job_run(&jobs[0]);
+    for (int i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+    Py_END_ALLOW_THREADS;
+
+    result = PyLong_FromSsize_t(total);
+
+ clean_and_return:
+    free(threads);
+    free(jobs);
+    if (tables)
+    {
+        for (Py_ssize_t i = 0; i < n_init; i++)
+            PyBuffer_Release(&tables[i]);
+        free(tables);
+    }
+    Py_XDECREF(seq);
+    PyBuffer_Release(&bloom);
+    return result;
+}
+
 
 static uint32_t _extract_bits(unsigned char *buf, int nbits)
 {
@@ -785,6 +960,502 @@ static PyObject *merge_into(PyObject *self, PyObject *args)
     return result;
 }
 
+
+/*
+ * An OidMergeIter yields the unique oids from several sorted oid
+ * tables (e.g. the sha tables of pack idx and midx files), in order,
+ * like merge_iter() over the PackIdxes, but without a heap of python
+ * objects.  Each table is (buffer, stride), where the oids are the
+ * first 20 bytes of each stride byte record.
+ */
+
+typedef struct {
+    const unsigned char *cur, *end;
+    size_t stride;
+} OidMergeTable;
+
+typedef struct {
+    PyObject_HEAD
+    Py_buffer *bufs;
+    Py_ssize_t n_bufs;
+    // A min heap (by current oid) of the tables that aren't exhausted
+    OidMergeTable *heap;
+    Py_ssize_t heap_n;
+    unsigned char last[20];
+    int have_last;
+} OidMergeIter;
+
+static void OidMergeIter_release(OidMergeIter *self)
+{
+    for (Py_ssize_t i = 0; i < self->n_bufs; i++)
+        PyBuffer_Release(&self->bufs[i]);
+    free(self->bufs);
+    free(self->heap);
+    self->bufs = NULL;
+    self->heap = NULL;
+    self->n_bufs = self->heap_n = 0;
+}
+
+static void oid_heap_down(OidMergeTable *heap, Py_ssize_t n, Py_ssize_t i)
+{
+    while (1)
+    {
+        Py_ssize_t min = i;
+        const Py_ssize_t l = 2 * i + 1, r = l + 1;
+        if (l < n && memcmp(heap[l].cur, heap[min].cur, 20) < 0)
+            min = l;
+        if (r < n && memcmp(heap[r].cur, heap[min].cur, 20) < 0)
+            min = r;
+        if (min == i)
+            return;
+        const OidMergeTable tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+static int OidMergeIter_init(OidMergeIter *self, PyObject *args,
+                             PyObject *kwds)
+{
+    static char *argnames[] = { "tables", NULL };
+    PyObject *tables;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", argnames, &tables))
+        return -1;
+    OidMergeIter_release(self);
+    self->have_last = 0;
+    PyObject *seq = PySequence_Fast(tables, "tables must be a sequence");
+    if (!seq)
+        return -1;
+    int rc = -1;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    self->bufs = checked_calloc(n ? n : 1, sizeof(*self->bufs));
+    self->heap = checked_calloc(n ? n : 1, sizeof(*self->heap));
+    if (!self->bufs || !self->heap)
+        goto clean_and_return;
+    for (Py_ssize_t i = 0; i < n; i++)
+    {
+        PyObject *table;
+        Py_ssize_t stride;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "On",
+                              &table, &stride))
+            goto clean_and_return;
+        if (stride < 20)
+        {
+            PyErr_SetString(PyExc_ValueError, "oid table stride must be >= 20");
+            goto clean_and_return;
+        }
+        Py_buffer *buf = &self->bufs[self->n_bufs];
+        if (PyObject_GetBuffer(table, buf, PyBUF_SIMPLE) < 0)
+            goto clean_and_return;
+        self->n_bufs++;
+        // The last record may be truncated to its oid
+        const Py_ssize_t count = (buf->len + stride - 20) / stride;
+        if (!count)
+            continue;
+        OidMergeTable *t = &self->heap[self->heap_n++];
+        t->cur = buf->buf;
+        t->end = t->cur + count * stride;
+        t->stride = stride;
+    }
+    for (Py_ssize_t i = self->heap_n / 2; i-- > 0;)
+        oid_heap_down(self->heap, self->heap_n, i);
+    rc = 0;
+ clean_and_return:
+    if (rc)
+        OidMergeIter_release(self);
+    Py_DECREF(seq);
+    return rc;
+}
+
+static PyObject *OidMergeIter_iter(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject *OidMergeIter_iternext(OidMergeIter *self)
+{
+    while (self->heap_n)
+    {
+        OidMergeTable *top = &self->heap[0];
+        const unsigned char *oid = top->cur;
+        top->cur += top->stride;
+        const int dup = self->have_last && !memcmp(oid, self->last, 20);
+        if (!dup)
+        {
+            memcpy(self->last, oid, 20);
+            self->have_last = 1;
+        }
+        if (top->cur >= top->end)
+            self->heap[0] = self->heap[--self->heap_n];
+        if (self->heap_n)
+            oid_heap_down(self->heap, self->heap_n, 0);
+        if (!dup)
+            return PyBytes_FromStringAndSize((const char *) self->last, 20);
+    }
+    // Let go of the tables (e.g. so the maps can be closed)
+    OidMergeIter_release(self);
+    return NULL;
+}
+
+static void OidMergeIter_dealloc(OidMergeIter *self)
+{
+    OidMergeIter_release(self);
+    PyObject_Del(self);
+}
+
+static PyTypeObject OidMergeIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_helpers.OidMergeIter",
+    .tp_doc = "Iterator over the unique oids in several sorted oid tables",
+    .tp_basicsize = sizeof(OidMergeIter),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)OidMergeIter_init,
+    .tp_iter = OidMergeIter_iter,
+    .tp_iternext = (iternextfunc)OidMergeIter_iternext,
+    .tp_dealloc = (destructor)OidMergeIter_dealloc,
+};
+
+
+// Oid hash table (see oidhash.py): a header, then 2^bits 64 byte
+// buckets, each holding two 32 byte slots.  Each oid may live in one
+// of two buckets (cuckoo hashing), chosen by bits from the first and
+// second eight bytes of the (already uniformly distributed) oid.
+//
+// New idxes are added in place while other processes may be reading
+// the table, so the last eight bytes of the header are a (native
+// order) sequence count, odd while an insertion is moving entries,
+// that readers use to detect and retry lookups that overlap a move.
+
+#define OIDHASH_HEADERLEN 64
+#define OIDHASH_SEQ_OFS 56
+#define OIDHASH_BUCKET_SLOTS 2
+// The most slots an insertion will consider moving
+#define OIDHASH_MAX_STEPS 2048
+// How many times a lookup waits for an insertion to finish before
+// assuming the writer died mid-insertion (in which case the table
+// isn't changing, and the lookup is safe anyway).
+#define OIDHASH_MAX_TRIES 64
+
+struct oidhash_slot {
+    unsigned char oid[20];
+    uint32_t pack;  // network order, pack number + 1, 0 when empty
+    uint64_t ofs;  // network order
+};
+
+// Mix all of the oid into each bucket choice, since while real oids
+// are uniformly distributed, synthetic ones (e.g. in tests) may only
+// differ in a few bytes.
+static inline uint64_t oidhash_bucket(const unsigned char *oid, int which,
+                                      int bits)
+{
+    uint64_t v = which ? 0x9e3779b97f4a7c15ULL : 0xc2b2ae3d27d4eb4fULL;
+    if (!bits)
+        return 0;
+    for (int i = 0; i < 20; i += 4)
+    {
+        uint32_t w = ((uint32_t) oid[i] << 24) | ((uint32_t) oid[i + 1] << 16)
+            | ((uint32_t) oid[i + 2] << 8) | oid[i + 3];
+        v = (v ^ w) * 0xff51afd7ed558ccdULL;
+        v ^= v >> 29;
+    }
+    // splitmix64 finalizer
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v >> (64 - bits);
+}
+
+static inline struct oidhash_slot *oidhash_bucket_slots(unsigned char *table,
+                                                        int bits,
+                                                        const unsigned char *oid,
+                                                        int which)
+{
+    return (struct oidhash_slot *)
+        &table[oidhash_bucket(oid, which, bits)
+               * OIDHASH_BUCKET_SLOTS * sizeof(struct oidhash_slot)];
+}
+
+static struct oidhash_slot *oidhash_find_slot(unsigned char *table, int bits,
+                                              const unsigned char *oid)
+{
+    for (int which = 0; which < 2; which++)
+    {
+        struct oidhash_slot *slots =
+            oidhash_bucket_slots(table, bits, oid, which);
+        for (int i = 0; i < OIDHASH_BUCKET_SLOTS; i++)
+            if (slots[i].pack && memcmp(slots[i].oid, oid, 20) == 0)
+                return &slots[i];
+    }
+    return NULL;
+}
+
+struct oidhash_step {
+    struct oidhash_slot *slot;
+    int parent;  // index of the previous step, or -1
+};
+
+// Inserts item (which must not already be present), by first finding
+// (breadth first) the shortest path of displacements that ends in an
+// empty slot, and then moving the entries along it starting from the
+// empty end, so that each entry is copied to its new slot before its
+// old one is overwritten.  So a concurrent reader (given the sequence
+// count) never misses an existing entry, and when the table is too
+// full (returns false), nothing has changed.  A shortest path never
+// visits a slot twice, since the rest of the path after the second
+// visit could follow the first one instead.
+static int oidhash_insert(unsigned char *table, int bits, uint64_t *seq,
+                          struct oidhash_step *steps,
+                          struct oidhash_slot item)
+{
+    struct oidhash_slot *dest = NULL;
+    int n = 0, dest_parent = -1;
+    for (int which = 0; which < 2 && !dest; which++)
+    {
+        struct oidhash_slot *slots =
+            oidhash_bucket_slots(table, bits, item.oid, which);
+        for (int i = 0; i < OIDHASH_BUCKET_SLOTS; i++)
+        {
+            if (!slots[i].pack)
+            {
+                dest = &slots[i];
+                break;
+            }
+            steps[n++] = (struct oidhash_step) { &slots[i], -1 };
+        }
+    }
+    for (int next = 0; !dest && next < n; next++)
+    {
+        // Where could the entry in this step's slot move?
+        const struct oidhash_slot *from = steps[next].slot;
+        for (int which = 0; which < 2 && !dest; which++)
+        {
+            struct oidhash_slot *slots =
+                oidhash_bucket_slots(table, bits, from->oid, which);
+            if (from >= slots && from < slots + OIDHASH_BUCKET_SLOTS)
+                continue;
+            for (int i = 0; i < OIDHASH_BUCKET_SLOTS; i++)
+            {
+                if (!slots[i].pack)
+                {
+                    dest = &slots[i];
+                    dest_parent = next;
+                    break;
+                }
+                if (n < OIDHASH_MAX_STEPS)
+                    steps[n++] = (struct oidhash_step) { &slots[i], next };
+            }
+        }
+    }
+    if (!dest)
+        return 0;
+    __atomic_fetch_add(seq, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = dest_parent; i >= 0; i = steps[i].parent)
+    {
+        *dest = *steps[i].slot;
+        dest = steps[i].slot;
+    }
+    *dest = item;
+    __atomic_fetch_add(seq, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static PyObject *oidhash_add_idx(PyObject *self, PyObject *args)
+{
+    Py_buffer table, idx;
+    int bits = 0;
+    unsigned int pack = 0;
+    if (!PyArg_ParseTuple(args, wbuf_argf "i" wbuf_argf "I",
+                          &table, &bits, &idx, &pack))
+        return NULL;
+
+    PyObject *result = NULL;
+    struct oidhash_step *steps = NULL;
+    const unsigned char *map = idx.buf;
+    const unsigned char *shas, *ofs32s, *ofs64s;
+    Py_ssize_t sha_stride, ofs32_stride;
+    uint32_t n;
+
+    assert(sizeof(struct oidhash_slot) == 32);
+    if (bits < 0 || bits > 40
+        || table.len < OIDHASH_HEADERLEN
+                       + ((Py_ssize_t) 1 << bits) * OIDHASH_BUCKET_SLOTS
+                         * (Py_ssize_t) sizeof(struct oidhash_slot))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid oid hash table size");
+        goto clean_and_return;
+    }
+    if (table.readonly)
+    {
+        PyErr_SetString(PyExc_ValueError, "oid hash table is read-only");
+        goto clean_and_return;
+    }
+    if (pack >= UINT32_MAX)
+    {
+        PyErr_SetString(PyExc_OverflowError, "too many packs for oid hash");
+        goto clean_and_return;
+    }
+    if (idx.len >= 8 && memcmp(map, "\377tOc\0\0\0\2", 8) == 0)
+    {
+        if (idx.len < 8 + 256 * 4)
+            goto invalid_idx;
+        memcpy(&n, map + 8 + 255 * 4, 4);
+        n = ntohl(n);
+        shas = map + 8 + 256 * 4;
+        sha_stride = 20;
+        ofs32s = shas + (Py_ssize_t) n * 24;
+        ofs32_stride = 4;
+        ofs64s = ofs32s + (Py_ssize_t) n * 4;
+        if (idx.len < ofs64s - map)
+            goto invalid_idx;
+    }
+    else
+    {
+        if (idx.len < 256 * 4)
+            goto invalid_idx;
+        memcpy(&n, map + 255 * 4, 4);
+        n = ntohl(n);
+        ofs32s = map + 256 * 4;
+        ofs32_stride = 24;
+        shas = ofs32s + 4;
+        sha_stride = 24;
+        ofs64s = NULL;
+        if (idx.len < 256 * 4 + (Py_ssize_t) n * 24)
+            goto invalid_idx;
+    }
+
+    unsigned char *tbl = (unsigned char *) table.buf + OIDHASH_HEADERLEN;
+    uint64_t *seq = (uint64_t *) ((unsigned char *) table.buf + OIDHASH_SEQ_OFS);
+    uint32_t added = 0;
+    int complete = 1, bad_ofs = 0;
+    steps = PyMem_Malloc(OIDHASH_MAX_STEPS * sizeof(*steps));
+    if (!steps)
+    {
+        PyErr_NoMemory();
+        goto clean_and_return;
+    }
+    Py_BEGIN_ALLOW_THREADS;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        const unsigned char *oid = shas + (Py_ssize_t) i * sha_stride;
+        if (oidhash_find_slot(tbl, bits, oid))
+            continue;
+        uint32_t ofs32;
+        uint64_t ofs;
+        memcpy(&ofs32, ofs32s + (Py_ssize_t) i * ofs32_stride, 4);
+        ofs32 = ntohl(ofs32);
+        if (ofs64s && (ofs32 & 0x80000000))
+        {
+            const unsigned char *p = ofs64s + (Py_ssize_t) (ofs32 & 0x7fffffff) * 8;
+            if (p + 8 > map + idx.len)
+            {
+                bad_ofs = 1;
+                break;
+            }
+            ofs = 0;
+            for (int j = 0; j < 8; j++)
+                ofs = (ofs << 8) | p[j];
+        }
+        else
+            ofs = ofs32;
+        struct oidhash_slot item;
+        memcpy(item.oid, oid, 20);
+        item.pack = htonl(pack + 1);
+        item.ofs = htonll(ofs);
+        if (!oidhash_insert(tbl, bits, seq, steps, item))
+        {
+            complete = 0;
+            break;
+        }
+        added++;
+    }
+    Py_END_ALLOW_THREADS;
+    if (bad_ofs)
+        goto invalid_idx;
+
+    result = Py_BuildValue("kO", (unsigned long) added,
+                           complete ? Py_True : Py_False);
+    goto clean_and_return;
+
+ invalid_idx:
+    PyErr_SetString(PyExc_ValueError, "invalid or truncated pack idx");
+ clean_and_return:
+    PyMem_Free(steps);
+    PyBuffer_Release(&table);
+    PyBuffer_Release(&idx);
+    return result;
+}
+
+static PyObject *oidhash_find(PyObject *self, PyObject *args)
+{
+    Py_buffer table;
+    unsigned char *oid = NULL;
+    Py_ssize_t len = 0;
+    int bits = 0;
+    if (!PyArg_ParseTuple(args, wbuf_argf "i" rbuf_argf,
+                          &table, &bits, &oid, &len))
+        return NULL;
+
+    PyObject *result = NULL;
+    if (len != 20)
+    {
+        PyErr_SetString(PyExc_ValueError, "oid must be 20 bytes");
+        goto clean_and_return;
+    }
+    if (bits < 0 || bits > 40
+        || table.len < OIDHASH_HEADERLEN
+                       + ((Py_ssize_t) 1 << bits) * OIDHASH_BUCKET_SLOTS
+                         * (Py_ssize_t) sizeof(struct oidhash_slot))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid oid hash table size");
+        goto clean_and_return;
+    }
+    // A seqlock read; see oidhash_insert()
+    const uint64_t *seq =
+        (const uint64_t *) ((unsigned char *) table.buf + OIDHASH_SEQ_OFS);
+    struct oidhash_slot found;
+    int have = 0;
+    for (int tries = 0; ; tries++)
+    {
+        const uint64_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if ((before & 1) && tries < OIDHASH_MAX_TRIES)
+        {
+            sched_yield();
+            continue;
+        }
+        const struct oidhash_slot *slot =
+            oidhash_find_slot((unsigned char *) table.buf + OIDHASH_HEADERLEN,
+                              bits, oid);
+        if ((have = slot != NULL))
+            memcpy(&found, slot, sizeof(found));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before
+            || tries >= OIDHASH_MAX_TRIES)
+            break;
+    }
+    if (!have)
+    {
+        result = Py_None;
+        Py_INCREF(result);
+        goto clean_and_return;
+    }
+    const struct oidhash_slot *slot = &found;
+    uint64_t ofs = 0;
+    const unsigned char *p = (const unsigned char *) &slot->ofs;
+    for (int j = 0; j < 8; j++)
+        ofs = (ofs << 8) | p[j];
+    result = Py_BuildValue("kK", (unsigned long) (ntohl(slot->pack) - 1),
+                           (unsigned long long) ofs);
+
+ clean_and_return:
+    PyBuffer_Release(&table);
+    return result;
+}
+
 #define FAN_ENTRIES 256
 
 static PyObject *write_idx(PyObject *self, PyObject *args)
@@ -1092,54 +1763,6 @@ static PyObject *bup_set_linux_file_attr(PyObject *self, PyObject *args)
 }
 #endif /* def BUP_HAVE_FILE_ATTRS */
 
-static unsigned int vuint_encode(long long val, char *buf)
-{
-    unsigned int len = 0;
-
-    if (val < 0) {
-        PyErr_Format(PyExc_ValueError, "cannot encode negative value %llu", val);
-        return 0;
-    }
-
-    do {
-        buf[len] = val & 0x7f;
-
-        val >>= 7;
-        if (val)
-            buf[len] |= 0x80;
-
-        len++;
-    } while (val);
-
-    return len;
-}
-
-static unsigned int vint_encode(long long val, char *buf)
-{
-    unsigned int len = 1;
-    char sign = 0;
-
-    if (val < 0) {
-        sign = 0x40;
-        val = -val;
-    }
-
-    buf[0] = (val & 0x3f) | sign;
-    val >>= 6;
-    if (val)
-        buf[0] |= 0x80;
-
-    while (val) {
-        buf[len] = val & 0x7f;
-        val >>= 7;
-        if (val)
-            buf[len] |= 0x80;
-        len++;
-    }
-
-    return len;
-}
-
 static PyObject *bup_vuint_encode(PyObject *self, PyObject *args)
 {
     long long val;
@@ -1609,7 +2232,7 @@ static PyObject *bup_read_acl(PyObject *self, PyObject *args)
         if (rv)
             goto out;
 
-        ret = Py_BuildValue("[" cstr_argf cstr_argf cstr_argf cstr_argf "]",
+        ret = Py_BuildValue("(" cstr_argf cstr_argf cstr_argf cstr_argf ")",
                             acl_txt, acl_num, def_txt, def_num);
 
         if (def_txt)
@@ -1617,7 +2240,7 @@ static PyObject *bup_read_acl(PyObject *self, PyObject *args)
         if (def_num)
             acl_free((acl_t)def_num);
     } else {
-        ret = Py_BuildValue("[" cstr_argf cstr_argf "]",
+        ret = Py_BuildValue("(" cstr_argf cstr_argf ")",
                             acl_txt, acl_num);
     }
 
@@ -1758,6 +2381,155 @@ static PyObject *bup_limited_vint_pack(PyObject *self, PyObject *args)
     return NULL;
 }
 
+// Decode the vuint at buf[*ofs, len) as a python int of any size,
+// advancing *ofs.  Return NULL (without an exception) if the data ends
+// first.
+static PyObject *vuint_unpack_from(const unsigned char *buf, Py_ssize_t len,
+                                   Py_ssize_t *ofs)
+{
+    unsigned long long val;
+    Py_ssize_t i = *ofs;
+    const int rc = vuint_decode(buf, len, &i, &val);
+    if (rc == 0)
+        return NULL;
+    if (rc > 0)
+    {
+        *ofs = i;
+        return PyLong_FromUnsignedLongLong(val);
+    }
+    // Too big for 64 bits; accumulate from the most significant end
+    Py_ssize_t end = *ofs;
+    while (end < len && buf[end] & 0x80)
+        end++;
+    if (end == len)
+        return NULL;
+    PyObject *result = PyLong_FromLong(0);
+    PyObject *seven = PyLong_FromLong(7);
+    for (Py_ssize_t j = end; result && seven && j >= *ofs; j--)
+    {
+        PyObject *shifted = PyNumber_Lshift(result, seven);
+        Py_DECREF(result);
+        result = NULL;
+        if (!shifted)
+            break;
+        PyObject *bits = PyLong_FromLong(buf[j] & 0x7f);
+        if (bits)
+            result = PyNumber_Or(shifted, bits);
+        Py_DECREF(shifted);
+        Py_XDECREF(bits);
+    }
+    Py_XDECREF(seven);
+    if (result)
+        *ofs = end + 1;
+    return result;
+}
+
+static PyObject *vint_unpack_from(const unsigned char *buf, Py_ssize_t len,
+                                  Py_ssize_t *ofs)
+{
+    long long val;
+    Py_ssize_t i = *ofs;
+    const int rc = vint_decode(buf, len, &i, &val);
+    if (rc == 0)
+        return NULL;
+    if (rc > 0)
+    {
+        *ofs = i;
+        return PyLong_FromLongLong(val);
+    }
+    // Too big; the first byte has the sign and the low six bits
+    const unsigned char first = buf[*ofs];
+    i = *ofs + 1;
+    PyObject *rest = vuint_unpack_from(buf, len, &i);
+    if (!rest)
+        return NULL;
+    PyObject *result = NULL, *six = PyLong_FromLong(6);
+    PyObject *low = PyLong_FromLong(first & 0x3f);
+    PyObject *shifted = six ? PyNumber_Lshift(rest, six) : NULL;
+    if (shifted && low)
+        result = PyNumber_Or(shifted, low);
+    if (result && (first & 0x40))
+    {
+        PyObject *neg = PyNumber_Negative(result);
+        Py_DECREF(result);
+        result = neg;
+    }
+    Py_DECREF(rest);
+    Py_XDECREF(six);
+    Py_XDECREF(low);
+    Py_XDECREF(shifted);
+    if (result)
+        *ofs = i;
+    return result;
+}
+
+static PyObject *bup_vint_unpack_from(PyObject *self, PyObject *args)
+{
+    const char *fmt;
+    Py_buffer buf;
+    Py_ssize_t ofs = 0;
+
+    if (!PyArg_ParseTuple(args, "sy*|n", &fmt, &buf, &ofs))
+        return NULL;
+
+    PyObject *result = NULL;
+    const Py_ssize_t n = strlen(fmt);
+    PyObject *values = PyList_New(n);
+    if (!values)
+        goto clean_and_return;
+    if (ofs < 0 || ofs > buf.len)
+    {
+        PyErr_Format(PyExc_ValueError, "offset %zd is outside the buffer", ofs);
+        goto clean_and_return;
+    }
+    const unsigned char *p = buf.buf;
+    for (Py_ssize_t i = 0; i < n; i++)
+    {
+        PyObject *value;
+        switch (fmt[i]) {
+        case 'V':
+            value = vuint_unpack_from(p, buf.len, &ofs);
+            break;
+        case 'v':
+            value = vint_unpack_from(p, buf.len, &ofs);
+            break;
+        case 's': {
+            unsigned long long size;
+            Py_ssize_t start = ofs;
+            value = NULL;
+            if (vuint_decode(p, buf.len, &start, &size) > 0
+                && size <= (unsigned long long) (buf.len - start))
+            {
+                value = PyBytes_FromStringAndSize((const char *) p + start,
+                                                  size);
+                ofs = start + size;
+            }
+            break;
+        }
+        default:
+            PyErr_Format(PyExc_Exception,
+                         "unknown xunpack format string item %c", fmt[i]);
+            goto clean_and_return;
+        }
+        if (!value)
+        {
+            if (!PyErr_Occurred()) // the data ended first
+            {
+                result = Py_None;
+                Py_INCREF(result);
+            }
+            goto clean_and_return;
+        }
+        PyList_SET_ITEM(values, i, value);
+    }
+    result = Py_BuildValue("(On)", values, ofs);
+
+ clean_and_return:
+    Py_XDECREF(values);
+    PyBuffer_Release(&buf);
+    return result;
+}
+
 static PyMethodDef helper_methods[] = {
     { "write_sparsely", bup_write_sparsely, METH_VARARGS,
       "Write buf excepting zeros at the end. Return trailing zero count." },
@@ -1773,10 +2545,33 @@ static PyMethodDef helper_methods[] = {
 	"Check if a bloom filter of 2^nbits bytes contains an object" },
     { "bloom_add", bloom_add, METH_VARARGS,
 	"Add an object to a bloom filter of 2^nbits bytes" },
+    { "bloom_add_many", bloom_add_many, METH_VARARGS,
+	"Add all the objects in a sequence of sha tables to a bloom filter,"
+	" using up to nthreads threads." },
+    { "index_entry_decode", index_entry_decode, METH_VARARGS,
+	"Decode the bupindex record at offset ofs in buf into dict (with"
+	" the times as integer ns), skipping any fields already present." },
+    { "index_merge", index_merge, METH_VARARGS,
+	"Write the union of the bupindex maps to out_fd (positioned at"
+	" start), using names_fd for the name heap, and return the count." },
+    { "tree_encode", tree_encode, METH_VARARGS,
+	"Return the git tree object for the (mode, name, oid) sequence." },
+    { "apply_delta", apply_delta, METH_VARARGS,
+	"Return the result of applying the git delta to base." },
+    { "metadata_encode", metadata_encode, METH_VARARGS,
+	"Return the concatenated encodings of the Metadata objects (raising"
+	" OverflowError for anything the python code must handle)." },
+    { "metadata_decode", metadata_decode, METH_VARARGS,
+	"Decode the Metadata (an instance of cls) at ofs in buf, and return"
+	" (end, meta), (end, None) if it's empty, or None at the end of buf." },
     { "extract_bits", extract_bits, METH_VARARGS,
 	"Take the first 'nbits' bits from 'buf' and return them as an int." },
     { "merge_into", merge_into, METH_VARARGS,
 	"Merges a bunch of idx and midx files into a single midx." },
+    { "oidhash_add_idx", oidhash_add_idx, METH_VARARGS,
+	"Add the objects in a pack idx map to an oid hash table." },
+    { "oidhash_find", oidhash_find, METH_VARARGS,
+	"Return the (pack number, offset) for an oid in an oid hash table." },
     { "write_idx", write_idx, METH_VARARGS,
 	"Write a PackIdxV2 file from an idx list of lists of tuples" },
     { "write_random", write_random, METH_VARARGS,
@@ -1843,6 +2638,29 @@ static PyMethodDef helper_methods[] = {
     { "vint_encode", bup_vint_encode, METH_VARARGS, "encode an int to vint" },
     { "limited_vint_pack", bup_limited_vint_pack, METH_VARARGS,
       "Try to pack vint/vuint/str, throwing OverflowError when unable." },
+    { "vint_unpack_from", bup_vint_unpack_from, METH_VARARGS,
+      "Decode vint/vuint/str from buf at ofs, returning (values, end), or"
+      " None if buf ends first." },
+#ifdef BUP_HAVE_INOTIFY
+    { "inotify_init", bup_inotify_init, METH_NOARGS,
+      "Return a new (close on exec) inotify fd." },
+    { "inotify_add_watch", bup_inotify_add_watch, METH_VARARGS,
+      "inotify_add_watch(fd, path, mask) -> watch descriptor" },
+#endif
+#ifdef BUP_HAVE_FANOTIFY
+    { "fanotify_init", bup_fanotify_init, METH_VARARGS,
+      "fanotify_init(flags, event_f_flags) -> fd" },
+    { "fanotify_mark", bup_fanotify_mark, METH_VARARGS,
+      "fanotify_mark(fd, flags, mask, path)" },
+    { "fanotify_fsid", bup_fanotify_fsid, METH_VARARGS,
+      "Return the statfs() f_fsid of path, as reported by fanotify, as bytes." },
+    { "fanotify_read", bup_fanotify_read, METH_VARARGS,
+      "Wait for and return the next fanotify events from fd as a list of"
+      " (mask, fsid, directory handle, name) tuples." },
+    { "fanotify_handle_path", bup_fanotify_handle_path, METH_VARARGS,
+      "fanotify_handle_path(mount_fd, handle) -> current path of the"
+      " directory handle (from fanotify_read()), or None if it's gone." },
+#endif
     { NULL, NULL, 0, NULL },  // sentinel
 };
 
@@ -1927,6 +2745,9 @@ static int setup_module(PyObject *m)
     }
 #endif
 
+    if (!fswatch_setup(m))
+        return 0;
+
     e = getenv("BUP_FORCE_TTY");
     get_state(m)->istty2 = isatty(2) || (atoi(e ? e : "0") & 2);
     return 1;
@@ -1953,6 +2774,14 @@ PyMODINIT_FUNC PyInit__helpers(void)
 
     if (hashsplit_init())
         return NULL;
+    if (index_init())
+        return NULL;
+    if (tree_init())
+        return NULL;
+    if (metadata_init())
+        return NULL;
+    if (PyType_Ready(&OidMergeIterType) < 0)
+        return NULL;
 
     module = PyModule_Create(&helpers_def);
     if (module == NULL)
@@ -1982,5 +2811,41 @@ PyMODINIT_FUNC PyInit__helpers(void)
         return NULL;
     }
 
+    Py_INCREF(&IndexIterType);
+    if (PyModule_AddObject(module, "IndexIter",
+                           (PyObject *) &IndexIterType) < 0)
+    {
+        Py_DECREF(&IndexIterType);
+        Py_DECREF(&RecordHashSplitterType);
+        Py_DECREF(&HashSplitterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    Py_INCREF(&OidMergeIterType);
+    if (PyModule_AddObject(module, "OidMergeIter",
+                           (PyObject *) &OidMergeIterType) < 0)
+    {
+        Py_DECREF(&OidMergeIterType);
+        Py_DECREF(&IndexIterType);
+        Py_DECREF(&RecordHashSplitterType);
+        Py_DECREF(&HashSplitterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    Py_INCREF(&TreeEntriesType);
+    if (PyModule_AddObject(module, "TreeEntries",
+                           (PyObject *) &TreeEntriesType) < 0)
+    {
+        Py_DECREF(&TreeEntriesType);
+        Py_DECREF(&OidMergeIterType);
+        Py_DECREF(&IndexIterType);
+        Py_DECREF(&RecordHashSplitterType);
+        Py_DECREF(&HashSplitterType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
     return module;
 }
@@ -0,0 +1,973 @@
+#define _LARGEFILE64_SOURCE 1
+#define PY_SSIZE_T_CLEAN 1
+#undef NDEBUG
+#include "../../config/config.h"
+
+// According to Python, its header has to go first:
+//   http://docs.python.org/2/c-api/intro.html#include-files
+#include <Python.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "_index.h"
+#include "bup/pyutil.h"
+
+// Must match INDEX_SIG, NAME_SIG, and FOOTER_SIG in index.py
+#define INDEX_ENTLEN 142
+#define INDEX_FOOTLEN 16
+#define INDEX_OFS_CTIME 24
+#define INDEX_OFS_MTIME 40
+#define INDEX_OFS_ATIME 56
+#define INDEX_OFS_SIZE 72
+#define INDEX_OFS_MODE 80
+#define INDEX_OFS_GITMODE 84
+#define INDEX_OFS_SHA 88
+#define INDEX_OFS_FLAGS 108
+#define INDEX_OFS_CHILDREN_OFS 110
+#define INDEX_OFS_CHILDREN_N 118
+#define INDEX_OFS_META_OFS 122
+#define INDEX_OFS_NAME_OFS 130
+#define INDEX_OFS_NAME_LEN 138
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+        | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline uint16_t get_be16(const unsigned char *p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+// Return the timespec at p as integer nanoseconds, like
+// xstat.timespec_to_nsecs().
+static PyObject *index_nsecs(const unsigned char *p)
+{
+    const int64_t s = (int64_t) get_be64(p);
+    const uint64_t ns = get_be64(p + 8);
+    int64_t result;
+    if (ns <= INT64_MAX
+        && !__builtin_mul_overflow(s, (int64_t) 1000000000, &result)
+        && !__builtin_add_overflow(result, (int64_t) ns, &result))
+        return PyLong_FromLongLong(result);
+
+    // Out of int64 range; let python handle it
+    PyObject *py_s = NULL, *py_ns = NULL, *billion = NULL, *tmp = NULL;
+    PyObject *ret = NULL;
+    py_s = PyLong_FromLongLong(s);
+    if (!py_s) goto clean_and_return;
+    py_ns = PyLong_FromUnsignedLongLong(ns);
+    if (!py_ns) goto clean_and_return;
+    billion = PyLong_FromLong(1000000000);
+    if (!billion) goto clean_and_return;
+    tmp = PyNumber_Multiply(py_s, billion);
+    if (!tmp) goto clean_and_return;
+    ret = PyNumber_Add(tmp, py_ns);
+ clean_and_return:
+    Py_XDECREF(py_s);
+    Py_XDECREF(py_ns);
+    Py_XDECREF(billion);
+    Py_XDECREF(tmp);
+    return ret;
+}
+
+static int index_check_entry(Py_ssize_t len, unsigned long long ofs)
+{
+    if (ofs > (unsigned long long) len || len - ofs < INDEX_ENTLEN)
+    {
+        PyErr_Format(PyExc_ValueError,
+                     "index entry offset %llu beyond end of index", ofs);
+        return 0;
+    }
+    return 1;
+}
+
+// Return a pointer to the basename of the entry at ofs (which must
+// have been checked by index_check_entry()), whose length is the
+// record's name length, or set an exception and return NULL.
+static const unsigned char *index_name(const unsigned char *m, Py_ssize_t len,
+                                       unsigned long long ofs)
+{
+    if (len < INDEX_FOOTLEN)
+    {
+        PyErr_SetString(PyExc_ValueError, "index missing footer");
+        return NULL;
+    }
+    const unsigned long long heap_ofs = get_be64(m + len - INDEX_FOOTLEN);
+    const unsigned long long heap_len = len - INDEX_FOOTLEN - heap_ofs;
+    const unsigned long long name_ofs = get_be64(m + ofs + INDEX_OFS_NAME_OFS);
+    const unsigned long long name_len = get_be32(m + ofs + INDEX_OFS_NAME_LEN);
+    if (heap_ofs > (unsigned long long) len - INDEX_FOOTLEN
+        || name_len == 0
+        || name_ofs > heap_len || name_len > heap_len - name_ofs)
+    {
+        PyErr_Format(PyExc_ValueError,
+                     "invalid index entry name at offset %llu", ofs);
+        return NULL;
+    }
+    return m + heap_ofs + name_ofs;
+}
+
+// Field names in ExistingEntry order (interned by index_init())
+static const char *index_field_names[] = {
+    "dev", "ino", "nlink", "ctime", "mtime", "atime", "size", "mode",
+    "gitmode", "sha", "flags", "children_ofs", "children_n", "meta_ofs"
+};
+#define INDEX_FIELD_COUNT \
+    (sizeof(index_field_names) / sizeof(index_field_names[0]))
+static PyObject *index_field_keys[INDEX_FIELD_COUNT];
+
+static PyObject *index_field_value(const unsigned char *e, size_t i)
+{
+    switch (i) {
+    case 0: return PyLong_FromUnsignedLongLong(get_be64(e));
+    case 1: return PyLong_FromUnsignedLongLong(get_be64(e + 8));
+    case 2: return PyLong_FromUnsignedLongLong(get_be64(e + 16));
+    case 3: return index_nsecs(e + INDEX_OFS_CTIME);
+    case 4: return index_nsecs(e + INDEX_OFS_MTIME);
+    case 5: return index_nsecs(e + INDEX_OFS_ATIME);
+    case 6: return PyLong_FromUnsignedLongLong(get_be64(e + INDEX_OFS_SIZE));
+    case 7: return PyLong_FromUnsignedLong(get_be32(e + INDEX_OFS_MODE));
+    case 8: return PyLong_FromUnsignedLong(get_be32(e + INDEX_OFS_GITMODE));
+    case 9:
+        return PyBytes_FromStringAndSize((const char *) e + INDEX_OFS_SHA, 20);
+    case 10: return PyLong_FromUnsignedLong(get_be16(e + INDEX_OFS_FLAGS));
+    case 11:
+        return PyLong_FromUnsignedLongLong(get_be64(e + INDEX_OFS_CHILDREN_OFS));
+    case 12:
+        return PyLong_FromUnsignedLong(get_be32(e + INDEX_OFS_CHILDREN_N));
+    case 13:
+        return PyLong_FromUnsignedLongLong(get_be64(e + INDEX_OFS_META_OFS));
+    }
+    assert(0);
+    return NULL;
+}
+
+PyObject *index_entry_decode(PyObject *self, PyObject *args)
+{
+    PyObject *dict;
+    Py_buffer buf;
+    unsigned long long ofs;
+    if (!PyArg_ParseTuple(args, "O!y*K", &PyDict_Type, &dict, &buf, &ofs))
+        return NULL;
+    PyObject *result = NULL;
+    if (!index_check_entry(buf.len, ofs))
+        goto clean_and_return;
+    const unsigned char *e = (const unsigned char *) buf.buf + ofs;
+    for (size_t i = 0; i < INDEX_FIELD_COUNT; i++)
+    {
+        const int present = PyDict_Contains(dict, index_field_keys[i]);
+        if (present < 0)
+            goto clean_and_return;
+        if (present)
+            continue;
+        PyObject *value = index_field_value(e, i);
+        if (!value)
+            goto clean_and_return;
+        const int rc = PyDict_SetItem(dict, index_field_keys[i], value);
+        Py_DECREF(value);
+        if (rc < 0)
+            goto clean_and_return;
+    }
+    result = Py_None;
+    Py_INCREF(result);
+ clean_and_return:
+    PyBuffer_Release(&buf);
+    return result;
+}
+
+
+/*
+ * An IndexIter walks the descendants of an index entry in the same
+ * order as the original ExistingEntry.iter() generator did (each
+ * entry after its children), but with an explicit stack instead of a
+ * chain of nested generators, and without decoding any records
+ * itself.  Entries are created by calling the factory.
+ */
+
+typedef struct {
+    PyObject *entry, *name;
+    // Offset of the next child's record, and how many remain
+    unsigned long long ofs;
+    unsigned long long remaining;
+    // The most recent child (and its name), to be considered after
+    // its children
+    PyObject *pending, *pending_name;
+} IndexIterFrame;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *map, *filter_name, *filter_dname, *wantrecurse, *factory;
+    IndexIterFrame *stack;
+    size_t depth, stack_size;
+} IndexIter;
+
+static int IndexIter_push(IndexIter *self, const unsigned char *m,
+                          Py_ssize_t len, PyObject *entry, PyObject *name,
+                          unsigned long long ofs)
+{
+    if (!index_check_entry(len, ofs))
+        return 0;
+    if (self->depth == self->stack_size)
+    {
+        const size_t n = self->stack_size ? self->stack_size * 2 : 16;
+        IndexIterFrame *stack = checked_malloc(n, sizeof(*stack));
+        if (!stack)
+            return 0;
+        if (self->depth)
+            memcpy(stack, self->stack, self->depth * sizeof(*stack));
+        free(self->stack);
+        self->stack = stack;
+        self->stack_size = n;
+    }
+    const unsigned char *e = m + ofs;
+    IndexIterFrame *f = &self->stack[self->depth++];
+    Py_INCREF(entry);
+    Py_INCREF(name);
+    f->entry = entry;
+    f->name = name;
+    f->ofs = get_be64(e + INDEX_OFS_CHILDREN_OFS);
+    f->remaining = get_be32(e + INDEX_OFS_CHILDREN_N);
+    f->pending = f->pending_name = NULL;
+    return 1;
+}
+
+static void IndexIter_pop(IndexIter *self)
+{
+    assert(self->depth);
+    IndexIterFrame *f = &self->stack[--self->depth];
+    Py_CLEAR(f->entry);
+    Py_CLEAR(f->name);
+    Py_CLEAR(f->pending);
+    Py_CLEAR(f->pending_name);
+}
+
+static int bytes_startswith(PyObject *s, PyObject *prefix)
+{
+    const Py_ssize_t n = PyBytes_GET_SIZE(prefix);
+    return PyBytes_GET_SIZE(s) >= n
+        && memcmp(PyBytes_AS_STRING(s), PyBytes_AS_STRING(prefix), n) == 0;
+}
+
+// The iterator refers to the entries, the map, and the callbacks, any
+// of which may refer back to it, so it participates in the cyclic GC.
+
+static PyObject *IndexIter_new(PyTypeObject *type, PyObject *args,
+                               PyObject *kwds)
+{
+    IndexIter *self = PyObject_GC_New(IndexIter, type);
+    if (!self)
+        return NULL;
+    self->map = self->filter_name = self->filter_dname = NULL;
+    self->wantrecurse = self->factory = NULL;
+    self->stack = NULL;
+    self->depth = self->stack_size = 0;
+    PyObject_GC_Track(self);
+    return (PyObject *) self;
+}
+
+static int IndexIter_traverse(IndexIter *self, visitproc visit, void *arg)
+{
+    for (size_t i = 0; i < self->depth; i++)
+    {
+        const IndexIterFrame *f = &self->stack[i];
+        Py_VISIT(f->entry);
+        Py_VISIT(f->name);
+        Py_VISIT(f->pending);
+        Py_VISIT(f->pending_name);
+    }
+    Py_VISIT(self->map);
+    Py_VISIT(self->filter_name);
+    Py_VISIT(self->filter_dname);
+    Py_VISIT(self->wantrecurse);
+    Py_VISIT(self->factory);
+    return 0;
+}
+
+static int IndexIter_clear(IndexIter *self)
+{
+    while (self->depth)
+        IndexIter_pop(self);
+    Py_CLEAR(self->map);
+    Py_CLEAR(self->filter_name);
+    Py_CLEAR(self->filter_dname);
+    Py_CLEAR(self->wantrecurse);
+    Py_CLEAR(self->factory);
+    return 0;
+}
+
+static int IndexIter_init(IndexIter *self, PyObject *args, PyObject *kwds)
+{
+    static char *argnames[] = { "map", "entry", "name", "ofs", "filter_name",
+                                "wantrecurse", "factory", NULL };
+    PyObject *map, *entry, *name, *filter_name, *wantrecurse, *factory;
+    unsigned long long ofs;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOSKOOO", argnames,
+                                     &map, &entry, &name, &ofs, &filter_name,
+                                     &wantrecurse, &factory))
+        return -1;
+    if (filter_name != Py_None && !PyBytes_Check(filter_name))
+    {
+        PyErr_SetString(PyExc_TypeError, "filter_name must be bytes or None");
+        return -1;
+    }
+    Py_buffer buf;
+    if (PyObject_GetBuffer(map, &buf, PyBUF_SIMPLE) < 0)
+        return -1;
+    IndexIter_clear(self); // in case __init__ is called again
+
+    int rc = -1;
+    PyObject *dname = NULL;
+    if (filter_name != Py_None && PyBytes_GET_SIZE(filter_name))
+    {
+        const Py_ssize_t n = PyBytes_GET_SIZE(filter_name);
+        if (PyBytes_AS_STRING(filter_name)[n - 1] == '/')
+        {
+            Py_INCREF(filter_name);
+            dname = filter_name;
+        }
+        else
+        {
+            dname = PyBytes_FromStringAndSize(NULL, n + 1);
+            if (!dname)
+                goto clean_and_return;
+            memcpy(PyBytes_AS_STRING(dname), PyBytes_AS_STRING(filter_name), n);
+            PyBytes_AS_STRING(dname)[n] = '/';
+        }
+    }
+    Py_INCREF(map);
+    Py_INCREF(filter_name);
+    self->map = map;
+    self->filter_name = filter_name;
+    self->filter_dname = dname;
+    dname = NULL;
+    if (wantrecurse != Py_None)
+    {
+        Py_INCREF(wantrecurse);
+        self->wantrecurse = wantrecurse;
+    }
+    Py_INCREF(factory);
+    self->factory = factory;
+    if (!IndexIter_push(self, buf.buf, buf.len, entry, name, ofs))
+        goto clean_and_return;
+    rc = 0;
+ clean_and_return:
+    Py_XDECREF(dname);
+    PyBuffer_Release(&buf);
+    return rc;
+}
+
+static PyObject *IndexIter_iter(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+// Returns 1 if the child (named name) should be yielded, like the
+// final test in the original ExistingEntry.iter().
+static int IndexIter_wanted(IndexIter *self, PyObject *name)
+{
+    if (!self->filter_dname)
+        return 1;
+    if (bytes_startswith(name, self->filter_dname))
+        return 1;
+    return PyBytes_GET_SIZE(name) == PyBytes_GET_SIZE(self->filter_name)
+        && bytes_startswith(name, self->filter_name);
+}
+
+// Returns 1 if the walk should consider descending into name.
+static int IndexIter_in_path(IndexIter *self, PyObject *name)
+{
+    if (!self->filter_dname)
+        return 1;
+    if (bytes_startswith(name, self->filter_dname))
+        return 1;
+    const Py_ssize_t n = PyBytes_GET_SIZE(name);
+    return n && PyBytes_AS_STRING(name)[n - 1] == '/'
+        && bytes_startswith(self->filter_dname, name);
+}
+
+static PyObject *IndexIter_iternext(IndexIter *self)
+{
+    if (!self->depth)
+        return NULL;
+    Py_buffer buf;
+    if (PyObject_GetBuffer(self->map, &buf, PyBUF_SIMPLE) < 0)
+        return NULL;
+    const unsigned char *m = buf.buf;
+    PyObject *result = NULL;
+    while (self->depth)
+    {
+        IndexIterFrame *f = &self->stack[self->depth - 1];
+        if (f->pending)
+        {
+            PyObject *child = f->pending;
+            f->pending = NULL;
+            const int wanted = IndexIter_wanted(self, f->pending_name);
+            Py_CLEAR(f->pending_name);
+            if (wanted)
+            {
+                result = child;
+                goto clean_and_return;
+            }
+            Py_DECREF(child);
+            continue;
+        }
+        if (!f->remaining)
+        {
+            IndexIter_pop(self);
+            continue;
+        }
+        const unsigned long long ent_ofs = f->ofs;
+        if (!index_check_entry(buf.len, ent_ofs))
+            goto clean_and_return;
+        const unsigned char *basename = index_name(m, buf.len, ent_ofs);
+        if (!basename)
+            goto clean_and_return;
+        f->ofs = ent_ofs + INDEX_ENTLEN;
+        f->remaining--;
+
+        const Py_ssize_t parent_len = PyBytes_GET_SIZE(f->name);
+        const Py_ssize_t base_len = get_be32(m + ent_ofs + INDEX_OFS_NAME_LEN);
+        PyObject *py_base = PyBytes_FromStringAndSize((const char *) basename,
+                                                      base_len);
+        if (!py_base)
+            goto clean_and_return;
+        PyObject *name = PyBytes_FromStringAndSize(NULL, parent_len + base_len);
+        if (!name)
+        {
+            Py_DECREF(py_base);
+            goto clean_and_return;
+        }
+        memcpy(PyBytes_AS_STRING(name), PyBytes_AS_STRING(f->name), parent_len);
+        memcpy(PyBytes_AS_STRING(name) + parent_len, basename, base_len);
+        PyObject *child = PyObject_CallFunction(self->factory, "OOOOK",
+                                                f->entry, py_base, name,
+                                                self->map, ent_ofs);
+        Py_DECREF(py_base);
+        if (!child)
+        {
+            Py_DECREF(name);
+            goto clean_and_return;
+        }
+        // The factory may have run arbitrary code, but the stack
+        // can't have changed.
+        f = &self->stack[self->depth - 1];
+        f->pending = child;
+        f->pending_name = name;
+        Py_INCREF(name);
+        int descend = IndexIter_in_path(self, name);
+        if (descend && self->wantrecurse)
+        {
+            PyObject *want = PyObject_CallFunctionObjArgs(self->wantrecurse,
+                                                          child, NULL);
+            if (!want)
+            {
+                Py_DECREF(name);
+                goto clean_and_return;
+            }
+            descend = PyObject_IsTrue(want);
+            Py_DECREF(want);
+            if (descend < 0)
+            {
+                Py_DECREF(name);
+                goto clean_and_return;
+            }
+        }
+        if (descend && !IndexIter_push(self, m, buf.len, child, name, ent_ofs))
+        {
+            Py_DECREF(name);
+            goto clean_and_return;
+        }
+        Py_DECREF(name);
+    }
+ clean_and_return:
+    PyBuffer_Release(&buf);
+    return result;
+}
+
+static void IndexIter_dealloc(IndexIter *self)
+{
+    PyObject_GC_UnTrack(self);
+    IndexIter_clear(self);
+    free(self->stack);
+    self->stack = NULL;
+    PyObject_GC_Del(self);
+}
+
+PyTypeObject IndexIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_helpers.IndexIter",
+    .tp_doc = "Iterator over the descendants of an index entry",
+    .tp_basicsize = sizeof(IndexIter),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_new = IndexIter_new,
+    .tp_init = (initproc)IndexIter_init,
+    .tp_iter = IndexIter_iter,
+    .tp_iternext = (iternextfunc)IndexIter_iternext,
+    .tp_traverse = (traverseproc)IndexIter_traverse,
+    .tp_clear = (inquiry)IndexIter_clear,
+    .tp_dealloc = (destructor)IndexIter_dealloc,
+};
+
+
+/*
+ * index_merge() writes the union of several indexes, producing
+ * exactly what writing each of the entries from index.merge() via a
+ * Writer would (the record order, children offsets, and name heap
+ * layout), without creating any python objects.  Since each input
+ * is a complete tree (the Writer creates any missing directories),
+ * it merges the trees directory by directory: the children of a
+ * directory are merged from each input's (reverse sorted) children,
+ * descending into the subdirectories first, and then written as a
+ * block, just as the Writer's Levels are written when they're
+ * closed.  The whole merge runs without the GIL.
+ */
+
+#define INDEX_SIGLEN INDEX_OFS_NAME_OFS
+#define INDEX_IX_EXISTS 0x8000
+#define INDEX_IX_HASHVALID 0x4000
+
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t len, size;
+    // Logical file offset of the end of the buffered data
+    unsigned long long pos;
+} MergeOut;
+
+typedef struct {
+    const unsigned char *m;
+    unsigned long long len, heap_ofs, heap_len;
+} MergeInput;
+
+typedef struct {
+    MergeOut out, names;
+    MergeInput *inputs;
+    size_t n_inputs;
+    unsigned long long count;
+    // First failure (if any): an errno, or a corrupt input
+    int err;
+    unsigned long long bad_ofs;
+} Merge;
+
+// A pending child in a directory's block
+typedef struct {
+    unsigned char rec[INDEX_SIGLEN];
+    const unsigned char *name;
+    uint32_t name_len;
+} MergeChild;
+
+// Where each input's version of a directory's children are
+typedef struct {
+    size_t input;
+    unsigned long long ofs, n;
+} MergeSrc;
+
+static int merge_write_fd(Merge *mg, int fd, const unsigned char *p, size_t n)
+{
+    while (n)
+    {
+        const ssize_t rc = write(fd, p, n);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            mg->err = errno;
+            return 0;
+        }
+        p += rc;
+        n -= rc;
+    }
+    return 1;
+}
+
+static int merge_flush(Merge *mg, MergeOut *o)
+{
+    if (!merge_write_fd(mg, o->fd, o->buf, o->len))
+        return 0;
+    o->len = 0;
+    return 1;
+}
+
+static int merge_write(Merge *mg, MergeOut *o, const void *data, size_t n)
+{
+    if (o->len + n > o->size && !merge_flush(mg, o))
+        return 0;
+    if (n > o->size)
+    {
+        if (!merge_write_fd(mg, o->fd, data, n))
+            return 0;
+    }
+    else
+    {
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+    }
+    o->pos += n;
+    return 1;
+}
+
+static inline void put_be64(unsigned char *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+// Return the record at ofs in input i, or NULL (after noting the
+// corruption) if it's not a valid record with a valid name.
+static const unsigned char *merge_rec(Merge *mg, size_t i,
+                                      unsigned long long ofs,
+                                      const unsigned char **name,
+                                      uint32_t *name_len)
+{
+    const MergeInput *in = &mg->inputs[i];
+    if (ofs > in->heap_ofs || in->heap_ofs - ofs < INDEX_ENTLEN)
+        goto bad;
+    const unsigned char *e = in->m + ofs;
+    const unsigned long long nofs = get_be64(e + INDEX_OFS_NAME_OFS);
+    const uint32_t nlen = get_be32(e + INDEX_OFS_NAME_LEN);
+    if (!nlen || nofs > in->heap_len || nlen > in->heap_len - nofs)
+        goto bad;
+    *name = in->m + in->heap_ofs + nofs;
+    *name_len = nlen;
+    return e;
+ bad:
+    if (!mg->err)
+    {
+        mg->err = -1;
+        mg->bad_ofs = ofs;
+    }
+    return NULL;
+}
+
+static int merge_name_cmp(const unsigned char *a, uint32_t alen,
+                          const unsigned char *b, uint32_t blen)
+{
+    const int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c)
+        return c;
+    return (alen > blen) - (alen < blen);
+}
+
+// Entry._cmp() order for records with the same name: invalid before
+// valid, then real before fake.
+static int merge_pref_cmp(const unsigned char *a, const unsigned char *b)
+{
+    const uint16_t f = INDEX_IX_EXISTS | INDEX_IX_HASHVALID;
+    const int va = (get_be16(a + INDEX_OFS_FLAGS) & f) == f;
+    const int vb = (get_be16(b + INDEX_OFS_FLAGS) & f) == f;
+    if (va != vb)
+        return va - vb;
+    static const unsigned char zero[16];
+    const int fa = !memcmp(a + INDEX_OFS_CTIME, zero, 16);
+    const int fb = !memcmp(b + INDEX_OFS_CTIME, zero, 16);
+    return fa - fb;
+}
+
+// Write the block of children (records and names).
+static int merge_write_block(Merge *mg, const MergeChild *kids, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char tail[INDEX_ENTLEN - INDEX_SIGLEN];
+        put_be64(tail, mg->names.pos);
+        put_be32(tail + 8, kids[i].name_len);
+        if (!merge_write(mg, &mg->out, kids[i].rec, INDEX_SIGLEN)
+            || !merge_write(mg, &mg->out, tail, sizeof(tail))
+            || !merge_write(mg, &mg->names, kids[i].name, kids[i].name_len))
+            return 0;
+    }
+    mg->count += n;
+    return 1;
+}
+
+// Merge the children of the directory whose versions are in srcs
+// (which may be modified), and write them, returning the offset and
+// count of the block in *ofs and *n.
+static int merge_dir(Merge *mg, MergeSrc *srcs, size_t n_srcs,
+                     unsigned long long *ofs, uint32_t *n)
+{
+    int ok = 0;
+    MergeChild *kids = NULL;
+    size_t n_kids = 0, kids_size = 0;
+    MergeSrc *sub = NULL;
+    const unsigned char **cur = NULL, **cur_name = NULL;
+    uint32_t *cur_len = NULL;
+    if (n_srcs)
+    {
+        sub = malloc(n_srcs * sizeof(*sub));
+        cur = malloc(n_srcs * sizeof(*cur));
+        cur_name = malloc(n_srcs * sizeof(*cur_name));
+        cur_len = malloc(n_srcs * sizeof(*cur_len));
+        if (!sub || !cur || !cur_name || !cur_len)
+        {
+            mg->err = ENOMEM;
+            goto clean_and_return;
+        }
+    }
+    for (size_t i = 0; i < n_srcs; i++)
+    {
+        cur[i] = NULL;
+        if (srcs[i].n
+            && !(cur[i] = merge_rec(mg, srcs[i].input, srcs[i].ofs,
+                                    &cur_name[i], &cur_len[i])))
+            goto clean_and_return;
+    }
+    while (1)
+    {
+        // The next child is the greatest of the current names
+        const unsigned char *name = NULL;
+        uint32_t name_len = 0;
+        for (size_t i = 0; i < n_srcs; i++)
+            if (cur[i] && (!name || merge_name_cmp(cur_name[i], cur_len[i],
+                                                   name, name_len) > 0))
+            {
+                name = cur_name[i];
+                name_len = cur_len[i];
+            }
+        if (!name)
+            break;
+        const unsigned char *win = NULL;
+        size_t n_sub = 0;
+        for (size_t i = 0; i < n_srcs; i++)
+        {
+            if (!cur[i] || merge_name_cmp(cur_name[i], cur_len[i],
+                                          name, name_len) != 0)
+                continue;
+            if (!win || merge_pref_cmp(cur[i], win) < 0)
+                win = cur[i];
+            sub[n_sub].input = srcs[i].input;
+            sub[n_sub].ofs = get_be64(cur[i] + INDEX_OFS_CHILDREN_OFS);
+            sub[n_sub].n = get_be32(cur[i] + INDEX_OFS_CHILDREN_N);
+            n_sub++;
+            // Advance past this child
+            srcs[i].ofs += INDEX_ENTLEN;
+            if (--srcs[i].n)
+            {
+                if (!(cur[i] = merge_rec(mg, srcs[i].input, srcs[i].ofs,
+                                         &cur_name[i], &cur_len[i])))
+                    goto clean_and_return;
+            }
+            else
+                cur[i] = NULL;
+        }
+        if (n_kids == kids_size)
+        {
+            const size_t size = kids_size ? kids_size * 2 : 16;
+            MergeChild *k = realloc(kids, size * sizeof(*kids));
+            if (!k)
+            {
+                mg->err = ENOMEM;
+                goto clean_and_return;
+            }
+            kids = k;
+            kids_size = size;
+        }
+        MergeChild *kid = &kids[n_kids++];
+        memcpy(kid->rec, win, INDEX_SIGLEN);
+        kid->name = name;
+        kid->name_len = name_len;
+        unsigned long long kid_ofs;
+        uint32_t kid_n;
+        if (name[name_len - 1] == '/')
+        {
+            if (!merge_dir(mg, sub, n_sub, &kid_ofs, &kid_n))
+                goto clean_and_return;
+        }
+        else
+        {
+            kid_ofs = mg->out.pos;
+            kid_n = 0;
+        }
+        put_be64(kid->rec + INDEX_OFS_CHILDREN_OFS, kid_ofs);
+        put_be32(kid->rec + INDEX_OFS_CHILDREN_N, kid_n);
+    }
+    *ofs = mg->out.pos;
+    *n = n_kids;
+    ok = merge_write_block(mg, kids, n_kids);
+ clean_and_return:
+    free(kids);
+    free(sub);
+    free(cur);
+    free(cur_name);
+    free(cur_len);
+    return ok;
+}
+
+static int merge_copy_names(Merge *mg)
+{
+    if (!merge_flush(mg, &mg->names))
+        return 0;
+    unsigned long long ofs = 0;
+    while (ofs < mg->names.pos)
+    {
+        size_t want = mg->names.pos - ofs;
+        if (want > mg->names.size)
+            want = mg->names.size;
+        const ssize_t rc = pread(mg->names.fd, mg->names.buf, want, ofs);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            mg->err = errno;
+            return 0;
+        }
+        if (rc == 0)
+        {
+            mg->err = EIO;
+            return 0;
+        }
+        if (!merge_write(mg, &mg->out, mg->names.buf, rc))
+            return 0;
+        ofs += rc;
+    }
+    return 1;
+}
+
+static int merge_run(Merge *mg, unsigned long long start)
+{
+    mg->out.pos = start;
+    MergeSrc *roots = malloc((mg->n_inputs ? mg->n_inputs : 1)
+                             * sizeof(*roots));
+    if (!roots)
+    {
+        mg->err = ENOMEM;
+        return 0;
+    }
+    size_t n_roots = 0;
+    for (size_t i = 0; i < mg->n_inputs; i++)
+        if (mg->inputs[i].heap_ofs >= start + INDEX_ENTLEN)
+        {
+            // The root is the last record, and the only one in its block
+            roots[n_roots].input = i;
+            roots[n_roots].ofs = mg->inputs[i].heap_ofs - INDEX_ENTLEN;
+            roots[n_roots].n = 1;
+            n_roots++;
+        }
+    unsigned long long ofs_;
+    uint32_t n_;
+    const int ok = merge_dir(mg, roots, n_roots, &ofs_, &n_);
+    free(roots);
+    if (!ok)
+        return 0;
+    const unsigned long long heap_ofs = mg->out.pos;
+    if (!merge_copy_names(mg))
+        return 0;
+    unsigned char footer[INDEX_FOOTLEN];
+    put_be64(footer, heap_ofs);
+    put_be64(footer + 8, mg->count);
+    return merge_write(mg, &mg->out, footer, sizeof(footer))
+        && merge_flush(mg, &mg->out);
+}
+
+PyObject *index_merge(PyObject *self, PyObject *args)
+{
+    int out_fd, names_fd;
+    unsigned long long start;
+    PyObject *maps;
+    if (!PyArg_ParseTuple(args, "iiKO", &out_fd, &names_fd, &start, &maps))
+        return NULL;
+    PyObject *seq = PySequence_Fast(maps, "maps must be a sequence");
+    if (!seq)
+        return NULL;
+    const Py_ssize_t n_maps = PySequence_Fast_GET_SIZE(seq);
+    PyObject *result = NULL;
+    Py_ssize_t n_bufs = 0;
+    Merge mg = { .out = { .fd = out_fd }, .names = { .fd = names_fd } };
+    Py_buffer *bufs = checked_calloc(n_maps ? n_maps : 1, sizeof(*bufs));
+    mg.inputs = checked_calloc(n_maps ? n_maps : 1, sizeof(*mg.inputs));
+    mg.out.size = mg.names.size = 1 << 20;
+    mg.out.buf = checked_malloc(1, mg.out.size);
+    mg.names.buf = checked_malloc(1, mg.names.size);
+    if (!bufs || !mg.inputs || !mg.out.buf || !mg.names.buf)
+        goto clean_and_return;
+    for (; n_bufs < n_maps; n_bufs++)
+    {
+        PyObject *map = PySequence_Fast_GET_ITEM(seq, n_bufs);
+        if (PyObject_GetBuffer(map, &bufs[n_bufs], PyBUF_SIMPLE) < 0)
+            goto clean_and_return;
+        const unsigned char *m = bufs[n_bufs].buf;
+        const unsigned long long len = bufs[n_bufs].len;
+        if (len < start + INDEX_FOOTLEN)
+        {
+            PyErr_Format(PyExc_ValueError, "index %zd is too short", n_bufs);
+            n_bufs++;
+            goto clean_and_return;
+        }
+        const unsigned long long heap_ofs = get_be64(m + len - INDEX_FOOTLEN);
+        if (heap_ofs < start || heap_ofs > len - INDEX_FOOTLEN
+            || (heap_ofs - start) % INDEX_ENTLEN)
+        {
+            PyErr_Format(PyExc_ValueError,
+                         "index %zd has an invalid name heap offset",
+                         n_bufs);
+            n_bufs++;
+            goto clean_and_return;
+        }
+        MergeInput *in = &mg.inputs[mg.n_inputs++];
+        in->m = m;
+        in->len = len;
+        in->heap_ofs = heap_ofs;
+        in->heap_len = len - INDEX_FOOTLEN - heap_ofs;
+    }
+    int ok;
+    Py_BEGIN_ALLOW_THREADS;
+    ok = merge_run(&mg, start);
+    Py_END_ALLOW_THREADS;
+    if (!ok)
+    {
+        if (mg.err > 0)
+        {
+            errno = mg.err;
+            PyErr_SetFromErrno(PyExc_OSError);
+        }
+        else
+            PyErr_Format(PyExc_ValueError,
+                         "invalid index entry at offset %llu", mg.bad_ofs);
+        goto clean_and_return;
+    }
+    result = PyLong_FromUnsignedLongLong(mg.count);
+ clean_and_return:
+    for (Py_ssize_t i = 0; i < n_bufs; i++)
+        PyBuffer_Release(&bufs[i]);
+    free(bufs);
+    free(mg.inputs);
+    free(mg.out.buf);
+    free(mg.names.buf);
+    Py_DECREF(seq);
+    return result;
+}
+
+int index_init(void)
+{
+    for (size_t i = 0; i < INDEX_FIELD_COUNT; i++)
+    {
+        index_field_keys[i] = PyUnicode_InternFromString(index_field_names[i]);
+        if (!index_field_keys[i])
+            return -1;
+    }
+    if (PyType_Ready(&IndexIterType) < 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+extern PyTypeObject IndexIterType;
+
+PyObject *index_entry_decode(PyObject *self, PyObject *args);
+PyObject *index_merge(PyObject *self, PyObject *args);
+
+int index_init(void);
@@ -0,0 +1,681 @@
+#define _LARGEFILE64_SOURCE 1
+#define PY_SSIZE_T_CLEAN 1
+#undef NDEBUG
+#include "../../config/config.h"
+
+// According to Python, its header has to go first:
+//   http://docs.python.org/2/c-api/intro.html#include-files
+#include <Python.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "_metadata.h"
+#include "_vint.h"
+
+// Encodes and decodes the Metadata records (see metadata.py) that make
+// up .bupm files.  Anything unusual (e.g. integers that don't fit in
+// 64 bits, unexpected types, or v1 ACL records) raises OverflowError,
+// and metadata.py falls back to the python implementation.
+
+// Must match the _rec_tag_* values in metadata.py
+#define REC_TAG_END 0
+#define REC_TAG_PATH 1
+#define REC_TAG_COMMON_V1 2
+#define REC_TAG_SYMLINK_TARGET 3
+#define REC_TAG_POSIX1E_ACL_V1 4
+#define REC_TAG_LINUX_ATTR 6
+#define REC_TAG_LINUX_XATTR 7
+#define REC_TAG_HARDLINK_TARGET 8
+#define REC_TAG_COMMON_V2 9
+#define REC_TAG_COMMON_V3 10
+#define REC_TAG_POSIX1E_ACL_V2 11
+
+enum {
+    F_MODE, F_UID, F_GID, F_USER, F_GROUP, F_RDEV, F_ATIME, F_MTIME,
+    F_CTIME, F_PATH, F_SIZE, F_SYMLINK_TARGET, F_HARDLINK_TARGET,
+    F_LINUX_ATTR, F_LINUX_XATTR, F_POSIX1E_ACL, F_FROZEN
+};
+static const char *meta_field_names[] = {
+    "mode", "uid", "gid", "user", "group", "rdev", "atime", "mtime",
+    "ctime", "path", "size", "symlink_target", "hardlink_target",
+    "linux_attr", "linux_xattr", "posix1e_acl", "_frozen"
+};
+#define META_FIELD_COUNT \
+    (sizeof(meta_field_names) / sizeof(meta_field_names[0]))
+static PyObject *meta_field_keys[META_FIELD_COUNT];
+
+static PyObject *meta_unhandled(void)
+{
+    PyErr_SetString(PyExc_OverflowError, "unhandled metadata value");
+    return NULL;
+}
+
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} meta_out;
+
+static int out_reserve(meta_out *o, size_t n)
+{
+    if (o->cap - o->len >= n)
+        return 1;
+    size_t cap = o->cap ? o->cap : 256;
+    while (cap - o->len < n)
+        cap *= 2;
+    char *buf = realloc(o->buf, cap);
+    if (!buf)
+    {
+        PyErr_NoMemory();
+        return 0;
+    }
+    o->buf = buf;
+    o->cap = cap;
+    return 1;
+}
+
+static int out_vuint(meta_out *o, unsigned long long val)
+{
+    if (val > LLONG_MAX)
+        return !!meta_unhandled();
+    if (!out_reserve(o, 10))
+        return 0;
+    o->len += vuint_encode(val, o->buf + o->len);
+    return 1;
+}
+
+static int out_bvec(meta_out *o, const char *s, size_t n)
+{
+    if (!out_vuint(o, n) || !out_reserve(o, n))
+        return 0;
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+    return 1;
+}
+
+// Append the "v" (signed) or "V" int
+static int out_int(meta_out *o, PyObject *x, int is_signed)
+{
+    if (!PyLong_Check(x))
+        return !!meta_unhandled();
+    const long long val = PyLong_AsLongLong(x);
+    if (val == -1 && PyErr_Occurred())
+        return 0; // OverflowError
+    if (!is_signed)
+    {
+        if (val < 0)
+            return !!meta_unhandled();
+        return out_vuint(o, val);
+    }
+    if (val == LLONG_MIN)
+        return !!meta_unhandled();
+    if (!out_reserve(o, 10))
+        return 0;
+    o->len += vint_encode(val, o->buf + o->len);
+    return 1;
+}
+
+static int out_bytes(meta_out *o, PyObject *x)
+{
+    if (!PyBytes_Check(x))
+        return !!meta_unhandled();
+    return out_bvec(o, PyBytes_AS_STRING(x), PyBytes_GET_SIZE(x));
+}
+
+// Append the seconds and (non-negative) nanoseconds for ns
+static int out_timespec(meta_out *o, PyObject *ns)
+{
+    if (!PyLong_Check(ns))
+        return !!meta_unhandled();
+    long long t = PyLong_AsLongLong(ns);
+    if (t == -1 && PyErr_Occurred())
+        return 0;
+    long long secs = t / 1000000000, nsecs = t % 1000000000;
+    if (nsecs < 0)
+    {
+        nsecs += 1000000000;
+        secs--;
+    }
+    if (!out_reserve(o, 20))
+        return 0;
+    o->len += vint_encode(secs, o->buf + o->len);
+    o->len += vuint_encode(nsecs, o->buf + o->len);
+    return 1;
+}
+
+static int out_record(meta_out *o, unsigned tag, const meta_out *rec)
+{
+    return out_vuint(o, tag) && out_bvec(o, rec->buf, rec->len);
+}
+
+static int encode_common(meta_out *rec, PyObject **f)
+{
+    if (!out_int(rec, f[F_MODE], 1)
+        || !out_int(rec, f[F_UID], 1)
+        || !out_bytes(rec, f[F_USER])
+        || !out_int(rec, f[F_GID], 1)
+        || !out_bytes(rec, f[F_GROUP])
+        || !out_int(rec, f[F_RDEV], 1)
+        || !out_timespec(rec, f[F_ATIME])
+        || !out_timespec(rec, f[F_MTIME])
+        || !out_timespec(rec, f[F_CTIME]))
+        return 0;
+    if (f[F_SIZE] == Py_None)
+    {
+        if (!out_reserve(rec, 1))
+            return 0;
+        rec->len += vint_encode(-1, rec->buf + rec->len);
+        return 1;
+    }
+    return out_int(rec, f[F_SIZE], 1);
+}
+
+static int encode_acl(meta_out *rec, PyObject *acl)
+{
+    PyObject *seq = PySequence_Fast(acl, "posix1e_acl must be a sequence");
+    if (!seq)
+        return 0;
+    int rc = 0;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if (n != 2 && n != 4)
+    {
+        meta_unhandled();
+        goto clean_and_return;
+    }
+    for (Py_ssize_t i = 0; i < n; i++)
+        if (!out_bytes(rec, PySequence_Fast_GET_ITEM(seq, i)))
+            goto clean_and_return;
+    if (n == 2 && !(out_bvec(rec, "", 0) && out_bvec(rec, "", 0)))
+        goto clean_and_return;
+    rc = 1;
+ clean_and_return:
+    Py_DECREF(seq);
+    return rc;
+}
+
+static int encode_xattrs(meta_out *rec, PyObject *xattrs)
+{
+    PyObject *seq = PySequence_Fast(xattrs, "linux_xattr must be a sequence");
+    if (!seq)
+        return 0;
+    int rc = 0;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if (!out_vuint(rec, n))
+        goto clean_and_return;
+    for (Py_ssize_t i = 0; i < n; i++)
+    {
+        PyObject *kv = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyTuple_Check(kv) || PyTuple_GET_SIZE(kv) != 2)
+        {
+            meta_unhandled();
+            goto clean_and_return;
+        }
+        if (!out_bytes(rec, PyTuple_GET_ITEM(kv, 0))
+            || !out_bytes(rec, PyTuple_GET_ITEM(kv, 1)))
+            goto clean_and_return;
+    }
+    rc = 1;
+ clean_and_return:
+    Py_DECREF(seq);
+    return rc;
+}
+
+// Append the encoding of meta (cf. Metadata.encode()) to o, using rec
+// as scratch space.
+static int encode_meta(meta_out *o, meta_out *rec, PyObject *meta,
+                       int include_path)
+{
+    PyObject *f[F_FROZEN] = { NULL };
+    int rc = 0;
+    for (size_t i = 0; i < F_FROZEN; i++)
+    {
+        f[i] = PyObject_GetAttr(meta, meta_field_keys[i]);
+        if (!f[i])
+            goto clean_and_return;
+    }
+
+    int present;
+    if (include_path)
+    {
+        if ((present = PyObject_IsTrue(f[F_PATH])) < 0)
+            goto clean_and_return;
+        if (present)
+        {
+            rec->len = 0;
+            if (!out_bytes(rec, f[F_PATH])
+                || !out_record(o, REC_TAG_PATH, rec))
+                goto clean_and_return;
+        }
+    }
+    if ((present = PyObject_IsTrue(f[F_MODE])) < 0)
+        goto clean_and_return;
+    if (present)
+    {
+        rec->len = 0;
+        if (!encode_common(rec, f) || !out_record(o, REC_TAG_COMMON_V3, rec))
+            goto clean_and_return;
+    }
+    const struct { unsigned tag; size_t field; } targets[] = {
+        { REC_TAG_SYMLINK_TARGET, F_SYMLINK_TARGET },
+        { REC_TAG_HARDLINK_TARGET, F_HARDLINK_TARGET }
+    };
+    for (size_t i = 0; i < 2; i++)
+    {
+        PyObject *target = f[targets[i].field];
+        if ((present = PyObject_IsTrue(target)) < 0)
+            goto clean_and_return;
+        if (!present)
+            continue;
+        if (!PyBytes_Check(target))
+        {
+            meta_unhandled();
+            goto clean_and_return;
+        }
+        if (!out_vuint(o, targets[i].tag)
+            || !out_bvec(o, PyBytes_AS_STRING(target), PyBytes_GET_SIZE(target)))
+            goto clean_and_return;
+    }
+    if ((present = PyObject_IsTrue(f[F_POSIX1E_ACL])) < 0)
+        goto clean_and_return;
+    if (present)
+    {
+        rec->len = 0;
+        if (!encode_acl(rec, f[F_POSIX1E_ACL])
+            || !out_record(o, REC_TAG_POSIX1E_ACL_V2, rec))
+            goto clean_and_return;
+    }
+    if ((present = PyObject_IsTrue(f[F_LINUX_ATTR])) < 0)
+        goto clean_and_return;
+    if (present)
+    {
+        rec->len = 0;
+        if (!out_int(rec, f[F_LINUX_ATTR], 0)
+            || !out_record(o, REC_TAG_LINUX_ATTR, rec))
+            goto clean_and_return;
+    }
+    if ((present = PyObject_IsTrue(f[F_LINUX_XATTR])) < 0)
+        goto clean_and_return;
+    if (present)
+    {
+        rec->len = 0;
+        if (!encode_xattrs(rec, f[F_LINUX_XATTR])
+            || !out_record(o, REC_TAG_LINUX_XATTR, rec))
+            goto clean_and_return;
+    }
+    rc = out_vuint(o, REC_TAG_END);
+
+ clean_and_return:
+    for (size_t i = 0; i < F_FROZEN; i++)
+        Py_XDECREF(f[i]);
+    return rc;
+}
+
+PyObject *metadata_encode(PyObject *self, PyObject *args)
+{
+    PyObject *metas;
+    int include_path;
+    if (!PyArg_ParseTuple(args, "Op", &metas, &include_path))
+        return NULL;
+    PyObject *it = PyObject_GetIter(metas);
+    if (!it)
+        return NULL;
+    PyObject *result = NULL, *meta;
+    meta_out o = { NULL }, rec = { NULL };
+    while ((meta = PyIter_Next(it)))
+    {
+        const int ok = encode_meta(&o, &rec, meta, include_path);
+        Py_DECREF(meta);
+        if (!ok)
+            goto clean_and_return;
+    }
+    if (PyErr_Occurred())
+        goto clean_and_return;
+    result = PyBytes_FromStringAndSize(o.buf, o.len);
+ clean_and_return:
+    free(o.buf);
+    free(rec.buf);
+    Py_DECREF(it);
+    return result;
+}
+
+
+typedef struct {
+    const unsigned char *buf;
+    Py_ssize_t len, ofs;
+} meta_in;
+
+static PyObject *meta_eof(const char *what)
+{
+    PyErr_Format(PyExc_EOFError, "EOF while reading %s", what);
+    return NULL;
+}
+
+static int in_vuint(meta_in *in, unsigned long long *val, const char *what)
+{
+    const int rc = vuint_decode(in->buf, in->len, &in->ofs, val);
+    if (rc > 0)
+        return 1;
+    if (rc == 0)
+        meta_eof(what);
+    else
+        meta_unhandled();
+    return 0;
+}
+
+static int in_bvec(meta_in *in, meta_in *data, const char *what)
+{
+    unsigned long long n;
+    if (!in_vuint(in, &n, what))
+        return 0;
+    if (n > (unsigned long long) (in->len - in->ofs))
+        return !!meta_eof(what);
+    data->buf = in->buf + in->ofs;
+    data->len = n;
+    data->ofs = 0;
+    in->ofs += n;
+    return 1;
+}
+
+static PyObject *in_bytes(meta_in *in, const char *what)
+{
+    meta_in data;
+    if (!in_bvec(in, &data, what))
+        return NULL;
+    return PyBytes_FromStringAndSize((const char *) data.buf, data.len);
+}
+
+static PyObject *in_int(meta_in *in, int is_signed, const char *what)
+{
+    if (!is_signed)
+    {
+        unsigned long long val;
+        if (!in_vuint(in, &val, what))
+            return NULL;
+        return PyLong_FromUnsignedLongLong(val);
+    }
+    long long val;
+    const int rc = vint_decode(in->buf, in->len, &in->ofs, &val);
+    if (rc > 0)
+        return PyLong_FromLongLong(val);
+    return rc ? meta_unhandled() : meta_eof(what);
+}
+
+// Return the ns for a (signed) seconds, (unsigned) nanoseconds pair
+static PyObject *in_timespec(meta_in *in)
+{
+    const char *what = "metadata common record time";
+    long long secs;
+    unsigned long long nsecs;
+    const int rc = vint_decode(in->buf, in->len, &in->ofs, &secs);
+    if (rc <= 0)
+        return rc ? meta_unhandled() : meta_eof(what);
+    if (!in_vuint(in, &nsecs, what))
+        return NULL;
+    long long t;
+    if (nsecs > LLONG_MAX
+        || __builtin_mul_overflow(secs, 1000000000LL, &t)
+        || __builtin_add_overflow(t, (long long) nsecs, &t))
+        return meta_unhandled();
+    return PyLong_FromLongLong(t);
+}
+
+static void set_field(PyObject **f, size_t i, PyObject *x)
+{
+    PyObject *prev = f[i];
+    f[i] = x;
+    Py_DECREF(prev);
+}
+
+static int decode_common(meta_in *in, PyObject **f, unsigned version)
+{
+    const int s = version > 1; // v1 had unsigned ids
+    const char *what = "metadata common record";
+    PyObject *x;
+#define DECODE_FIELD(field, expr) \
+    if (!(x = (expr))) \
+        return 0; \
+    set_field(f, field, x)
+    DECODE_FIELD(F_MODE, in_int(in, s, what));
+    DECODE_FIELD(F_UID, in_int(in, s, what));
+    DECODE_FIELD(F_USER, in_bytes(in, what));
+    DECODE_FIELD(F_GID, in_int(in, s, what));
+    DECODE_FIELD(F_GROUP, in_bytes(in, what));
+    DECODE_FIELD(F_RDEV, in_int(in, s, what));
+    DECODE_FIELD(F_ATIME, in_timespec(in));
+    DECODE_FIELD(F_MTIME, in_timespec(in));
+    DECODE_FIELD(F_CTIME, in_timespec(in));
+#undef DECODE_FIELD
+    if (version == 3)
+    {
+        long long size;
+        const int rc = vint_decode(in->buf, in->len, &in->ofs, &size);
+        if (rc <= 0)
+            return rc ? !!meta_unhandled() : !!meta_eof(what);
+        if (size >= 0)
+        {
+            if (!(x = PyLong_FromLongLong(size)))
+                return 0;
+            set_field(f, F_SIZE, x);
+        }
+    }
+    return 1;
+}
+
+static int decode_acl(meta_in *in, PyObject **f)
+{
+    const char *what = "POSIX1e ACL metadata";
+    PyObject *acls[4];
+    for (int i = 0; i < 4; i++)
+    {
+        acls[i] = in_bytes(in, what);
+        if (!acls[i])
+        {
+            while (i--)
+                Py_DECREF(acls[i]);
+            return 0;
+        }
+    }
+    // A tuple, like the python decoder's (and read_acl()'s) result
+    const int n = PyBytes_GET_SIZE(acls[2]) ? 4 : 2;
+    PyObject *acl = PyTuple_New(n);
+    if (!acl)
+    {
+        for (int i = 0; i < 4; i++)
+            Py_DECREF(acls[i]);
+        return 0;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (i < n)
+            PyTuple_SET_ITEM(acl, i, acls[i]);
+        else
+            Py_DECREF(acls[i]);
+    }
+    set_field(f, F_POSIX1E_ACL, acl);
+    return 1;
+}
+
+static int decode_xattrs(meta_in *in, PyObject **f)
+{
+    const char *what = "Linux xattr metadata";
+    unsigned long long n;
+    if (!in_vuint(in, &n, what))
+        return 0;
+    // Every pair takes at least two bytes
+    if (n > (unsigned long long) (in->len - in->ofs) / 2)
+        return !!meta_eof(what);
+    PyObject *list = PyList_New(n);
+    if (!list)
+        return 0;
+    for (Py_ssize_t i = 0; i < (Py_ssize_t) n; i++)
+    {
+        PyObject *k = in_bytes(in, what);
+        PyObject *v = k ? in_bytes(in, what) : NULL;
+        PyObject *kv = v ? PyTuple_Pack(2, k, v) : NULL;
+        Py_XDECREF(k);
+        Py_XDECREF(v);
+        if (!kv)
+        {
+            Py_DECREF(list);
+            return 0;
+        }
+        PyList_SET_ITEM(list, i, kv);
+    }
+    set_field(f, F_LINUX_XATTR, list);
+    return 1;
+}
+
+static int decode_record(meta_in *in, PyObject **f, unsigned long long tag)
+{
+    meta_in data;
+    PyObject *x;
+    switch (tag)
+    {
+    case REC_TAG_PATH:
+        if (!in_bvec(in, &data, "metadata path record"))
+            return 0;
+        if (!(x = in_bytes(&data, "metadata path record")))
+            return 0;
+        set_field(f, F_PATH, x);
+        return 1;
+    case REC_TAG_COMMON_V1:
+    case REC_TAG_COMMON_V2:
+    case REC_TAG_COMMON_V3:
+        if (!in_bvec(in, &data, "metadata common records"))
+            return 0;
+        return decode_common(&data, f,
+                             tag == REC_TAG_COMMON_V3 ? 3
+                             : tag == REC_TAG_COMMON_V2 ? 2 : 1);
+    case REC_TAG_SYMLINK_TARGET:
+        if (!(x = in_bytes(in, "metadata symlink target")))
+            return 0;
+        set_field(f, F_SYMLINK_TARGET, x);
+        if (f[F_SIZE] == Py_None)
+        {
+            if (!(x = PyLong_FromSsize_t(PyBytes_GET_SIZE(f[F_SYMLINK_TARGET]))))
+                return 0;
+            set_field(f, F_SIZE, x);
+        }
+        else
+        {
+            const long long size = PyLong_AsLongLong(f[F_SIZE]);
+            if (size != PyBytes_GET_SIZE(f[F_SYMLINK_TARGET]))
+            {
+                PyErr_SetString(PyExc_AssertionError,
+                                "symlink target length does not match size");
+                return 0;
+            }
+        }
+        return 1;
+    case REC_TAG_HARDLINK_TARGET:
+        if (!(x = in_bytes(in, "metadata hardlink target")))
+            return 0;
+        set_field(f, F_HARDLINK_TARGET, x);
+        return 1;
+    case REC_TAG_POSIX1E_ACL_V2:
+        if (!in_bvec(in, &data, "POSIX1e ACL metadata"))
+            return 0;
+        return decode_acl(&data, f);
+    case REC_TAG_POSIX1E_ACL_V1:
+        // Needs _correct_posix1e_v1_delimiters()
+        return !!meta_unhandled();
+    case REC_TAG_LINUX_ATTR:
+        if (!in_bvec(in, &data, "Linux attr metadata"))
+            return 0;
+        if (!(x = in_int(&data, 0, "Linux attr metadata")))
+            return 0;
+        set_field(f, F_LINUX_ATTR, x);
+        return 1;
+    case REC_TAG_LINUX_XATTR:
+        if (!in_bvec(in, &data, "Linux xattr metadata"))
+            return 0;
+        return decode_xattrs(&data, f);
+    default:
+        // Unknown record (like vint.skip_bvec(), reject empty ones)
+        if (!in_bvec(in, &data, "unknown metadata record"))
+            return 0;
+        if (!data.len)
+            return !!meta_eof("unknown metadata record");
+        return 1;
+    }
+}
+
+PyObject *metadata_decode(PyObject *self, PyObject *args)
+{
+    Py_buffer buf;
+    Py_ssize_t ofs;
+    PyObject *cls;
+    if (!PyArg_ParseTuple(args, "y*nO", &buf, &ofs, &cls))
+        return NULL;
+
+    PyObject *result = NULL;
+    PyObject *f[META_FIELD_COUNT] = { NULL };
+    meta_in in = { buf.buf, buf.len, ofs };
+    if (ofs < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "negative metadata offset");
+        goto clean_and_return;
+    }
+    if (ofs >= buf.len)
+    {
+        result = Py_None;
+        Py_INCREF(result);
+        goto clean_and_return;
+    }
+    unsigned long long tag;
+    if (!in_vuint(&in, &tag, "Metadata entry"))
+        goto clean_and_return;
+    if (tag == REC_TAG_END)
+    {
+        result = Py_BuildValue("(nO)", in.ofs, Py_None);
+        goto clean_and_return;
+    }
+    for (size_t i = 0; i < META_FIELD_COUNT; i++)
+    {
+        f[i] = Py_None;
+        Py_INCREF(Py_None);
+    }
+    while (tag != REC_TAG_END)
+    {
+        if (!decode_record(&in, f, tag))
+            goto clean_and_return;
+        if (!in_vuint(&in, &tag, "Metadata entry"))
+            goto clean_and_return;
+    }
+
+    PyObject *meta = PyObject_CallMethod(cls, "__new__", "O", cls);
+    if (!meta)
+        goto clean_and_return;
+    set_field(f, F_FROZEN, Py_True);
+    Py_INCREF(Py_True);
+    for (size_t i = 0; i < META_FIELD_COUNT; i++)
+    {
+        if (PyObject_SetAttr(meta, meta_field_keys[i], f[i]) < 0)
+        {
+            Py_DECREF(meta);
+            goto clean_and_return;
+        }
+    }
+    result = Py_BuildValue("(nN)", in.ofs, meta);
+
+ clean_and_return:
+    for (size_t i = 0; i < META_FIELD_COUNT; i++)
+        Py_XDECREF(f[i]);
+    PyBuffer_Release(&buf);
+    return result;
+}
+
+int metadata_init(void)
+{
+    for (size_t i = 0; i < META_FIELD_COUNT; i++)
+    {
+        meta_field_keys[i] = PyUnicode_InternFromString(meta_field_names[i]);
+        if (!meta_field_keys[i])
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+PyObject *metadata_encode(PyObject *self, PyObject *args);
+PyObject *metadata_decode(PyObject *self, PyObject *args);
+
+int metadata_init(void);
@@ -0,0 +1,120 @@
+#define _LARGEFILE64_SOURCE 1
+#define PY_SSIZE_T_CLEAN 1
+#undef NDEBUG
+#include "../../config/config.h"
+
+// According to Python, its header has to go first:
+//   http://docs.python.org/2/c-api/intro.html#include-files
+#include <Python.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "_pack.h"
+
+// Decode one of the little endian, 7 bits at a time sizes at the start
+// of a git delta.
+static int delta_size(const unsigned char **p, const unsigned char *end,
+                      uint64_t *size)
+{
+    uint64_t result = 0;
+    unsigned int shift = 0;
+    while (1)
+    {
+        if (*p >= end || shift > 63)
+            return 0;
+        const unsigned char c = *(*p)++;
+        result |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            break;
+        shift += 7;
+    }
+    *size = result;
+    return 1;
+}
+
+// Apply the delta ops in [p, end) to src, writing exactly out_end - out
+// bytes.  Return 0 if the delta is invalid.
+static int delta_apply(const unsigned char *src, uint64_t base_size,
+                       const unsigned char *p, const unsigned char *end,
+                       unsigned char *out, unsigned char * const out_end)
+{
+    while (p < end)
+    {
+        const unsigned char op = *p++;
+        if (op & 0x80) // copy from the base
+        {
+            uint64_t ofs = 0, n = 0;
+            for (int i = 0; i < 4; i++)
+                if (op & (1 << i))
+                {
+                    if (p >= end)
+                        return 0;
+                    ofs |= (uint64_t) *p++ << (8 * i);
+                }
+            for (int i = 0; i < 3; i++)
+                if (op & (0x10 << i))
+                {
+                    if (p >= end)
+                        return 0;
+                    n |= (uint64_t) *p++ << (8 * i);
+                }
+            if (n == 0)
+                n = 0x10000;
+            if (ofs > base_size || n > base_size - ofs
+                || n > (uint64_t) (out_end - out))
+                return 0;
+            memcpy(out, src + ofs, n);
+            out += n;
+        }
+        else if (op) // insert the next op bytes
+        {
+            if (op > end - p || op > out_end - out)
+                return 0;
+            memcpy(out, p, op);
+            p += op;
+            out += op;
+        }
+        else
+            return 0;
+    }
+    return out == out_end;
+}
+
+PyObject *apply_delta(PyObject *self, PyObject *args)
+{
+    Py_buffer base, delta;
+    if (!PyArg_ParseTuple(args, "y*y*", &base, &delta))
+        return NULL;
+
+    PyObject *result = NULL;
+    const unsigned char *p = delta.buf;
+    const unsigned char * const end = p + delta.len;
+    uint64_t base_size, result_size;
+    if (!delta_size(&p, end, &base_size) || !delta_size(&p, end, &result_size))
+        goto invalid;
+    if (base_size != (uint64_t) base.len || result_size > PY_SSIZE_T_MAX)
+        goto invalid;
+    result = PyBytes_FromStringAndSize(NULL, result_size);
+    if (!result)
+        goto clean_and_return;
+    unsigned char *out = (unsigned char *) PyBytes_AS_STRING(result);
+    int ok;
+    // The buffers are held, and the result isn't visible yet
+    Py_BEGIN_ALLOW_THREADS;
+    ok = delta_apply(base.buf, base_size, p, end, out, out + result_size);
+    Py_END_ALLOW_THREADS;
+    if (!ok)
+        goto invalid;
+    goto clean_and_return;
+
+ invalid:
+    Py_XDECREF(result);
+    result = NULL;
+    PyErr_SetString(PyExc_ValueError, "invalid git delta");
+ clean_and_return:
+    PyBuffer_Release(&base);
+    PyBuffer_Release(&delta);
+    return result;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+PyObject *apply_delta(PyObject *self, PyObject *args);
@@ -0,0 +1,332 @@
+#define _LARGEFILE64_SOURCE 1
+#define PY_SSIZE_T_CLEAN 1
+#undef NDEBUG
+#include "../../config/config.h"
+
+// According to Python, its header has to go first:
+//   http://docs.python.org/2/c-api/intro.html#include-files
+#include <Python.h>
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "_tree.h"
+#include "bup/pyutil.h"
+
+// Git tree objects are a sequence of "<octal mode> <name>\0<oid>"
+// entries, sorted by name, except that directory names sort as if
+// they ended with a "/".
+
+
+typedef struct {
+    Py_buffer name, oid;
+    unsigned long mode;
+    int is_dir;
+    Py_ssize_t i; // original position, so the sort is stable
+} tree_enc_item;
+
+static int tree_item_cmp(const void *x, const void *y)
+{
+    const tree_enc_item *a = x, *b = y;
+    const Py_ssize_t alen = a->name.len, blen = b->name.len;
+    const Py_ssize_t min = alen < blen ? alen : blen;
+    const int c = memcmp(a->name.buf, b->name.buf, min);
+    if (c)
+        return c;
+    // Compare the rest of the keys, i.e. name, plus "/" for dirs
+    const Py_ssize_t akey = alen + a->is_dir, bkey = blen + b->is_dir;
+    if (min < akey && min < bkey)
+    {
+        const unsigned char ac = min < alen ? ((unsigned char *) a->name.buf)[min] : '/';
+        const unsigned char bc = min < blen ? ((unsigned char *) b->name.buf)[min] : '/';
+        if (ac != bc)
+            return ac < bc ? -1 : 1;
+    }
+    if (akey != bkey)
+        return akey < bkey ? -1 : 1;
+    return a->i < b->i ? -1 : (a->i > b->i);
+}
+
+static int octal_len(unsigned long mode)
+{
+    int n = 1;
+    while (mode >>= 3)
+        n++;
+    return n;
+}
+
+PyObject *tree_encode(PyObject *self, PyObject *args)
+{
+    PyObject *shalist;
+    if (!PyArg_ParseTuple(args, "O", &shalist))
+        return NULL;
+    PyObject *seq = PySequence_Fast(shalist, "shalist must be iterable");
+    if (!seq)
+        return NULL;
+
+    PyObject *result = NULL;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    Py_ssize_t n_items = 0;
+    tree_enc_item *items = checked_calloc(n ? n : 1, sizeof(*items));
+    if (!items)
+        goto clean_and_return;
+
+    Py_ssize_t size = 0;
+    for (Py_ssize_t i = 0; i < n; i++)
+    {
+        PyObject *ent = PySequence_Fast(PySequence_Fast_GET_ITEM(seq, i),
+                                        "shalist items must be sequences");
+        if (!ent)
+            goto clean_and_return;
+        if (PySequence_Fast_GET_SIZE(ent) != 3)
+        {
+            PyErr_SetString(PyExc_ValueError,
+                            "shalist items must be (mode, name, oid)");
+            Py_DECREF(ent);
+            goto clean_and_return;
+        }
+        tree_enc_item *it = &items[n_items];
+        it->i = i;
+        PyObject *py_mode = PySequence_Fast_GET_ITEM(ent, 0);
+        if (!PyLong_Check(py_mode))
+        {
+            PyErr_Format(PyExc_TypeError, "tree entry mode %R is not an int",
+                         py_mode);
+            Py_DECREF(ent);
+            goto clean_and_return;
+        }
+        it->mode = PyLong_AsUnsignedLong(py_mode);
+        if (it->mode == (unsigned long) -1 && PyErr_Occurred())
+        {
+            Py_DECREF(ent);
+            goto clean_and_return;
+        }
+        // A zero mode would encode as "0", and git trees do not allow
+        // 0-padded octal
+        if (!it->mode)
+        {
+            PyErr_SetString(PyExc_ValueError, "tree entry mode must not be 0");
+            Py_DECREF(ent);
+            goto clean_and_return;
+        }
+        it->is_dir = S_ISDIR(it->mode) ? 1 : 0;
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(ent, 1), &it->name,
+                               PyBUF_SIMPLE) < 0)
+        {
+            Py_DECREF(ent);
+            goto clean_and_return;
+        }
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(ent, 2), &it->oid,
+                               PyBUF_SIMPLE) < 0)
+        {
+            PyBuffer_Release(&it->name);
+            Py_DECREF(ent);
+            goto clean_and_return;
+        }
+        // The buffers hold their own references
+        Py_DECREF(ent);
+        n_items++;
+        if (!it->name.len || memchr(it->name.buf, 0, it->name.len))
+        {
+            PyErr_SetString(PyExc_ValueError,
+                            "tree entry name must be non-empty and contain no NUL");
+            goto clean_and_return;
+        }
+        if (it->oid.len != 20)
+        {
+            PyErr_Format(PyExc_ValueError,
+                         "tree entry oid length is %zd, not 20", it->oid.len);
+            goto clean_and_return;
+        }
+        size += octal_len(it->mode) + 1 + it->name.len + 1 + 20;
+    }
+
+    qsort(items, n_items, sizeof(*items), tree_item_cmp);
+
+    result = PyBytes_FromStringAndSize(NULL, size);
+    if (!result)
+        goto clean_and_return;
+    char *p = PyBytes_AS_STRING(result);
+    for (Py_ssize_t i = 0; i < n_items; i++)
+    {
+        const tree_enc_item *it = &items[i];
+        const int mlen = octal_len(it->mode);
+        unsigned long mode = it->mode;
+        for (int j = mlen - 1; j >= 0; j--, mode >>= 3)
+            p[j] = '0' + (mode & 7);
+        p += mlen;
+        *p++ = ' ';
+        memcpy(p, it->name.buf, it->name.len);
+        p += it->name.len;
+        *p++ = '\0';
+        memcpy(p, it->oid.buf, 20);
+        p += 20;
+    }
+    assert(p == PyBytes_AS_STRING(result) + size);
+
+ clean_and_return:
+    if (items)
+    {
+        for (Py_ssize_t i = 0; i < n_items; i++)
+        {
+            PyBuffer_Release(&items[i].name);
+            PyBuffer_Release(&items[i].oid);
+        }
+        free(items);
+    }
+    Py_DECREF(seq);
+    return result;
+}
+
+
+/*
+ * TreeEntries parses git tree data once, recording where each entry's
+ * name starts along with the name length and mode, and then provides
+ * a read-only sequence of (mode, name, oid) tuples over the data
+ * (which it keeps a buffer on), rather than a list of all of them.
+ */
+
+typedef struct {
+    Py_ssize_t name_ofs;
+    Py_ssize_t name_len;
+    unsigned long mode;
+} tree_dec_ent;
+
+typedef struct {
+    PyObject_HEAD
+    Py_buffer data;
+    int have_data;
+    tree_dec_ent *ents;
+    Py_ssize_t n;
+} TreeEntries;
+
+static void TreeEntries_release(TreeEntries *self)
+{
+    if (self->have_data)
+        PyBuffer_Release(&self->data);
+    self->have_data = 0;
+    free(self->ents);
+    self->ents = NULL;
+    self->n = 0;
+}
+
+static int tree_parse(TreeEntries *self)
+{
+    const unsigned char * const buf = self->data.buf;
+    const Py_ssize_t len = self->data.len;
+    Py_ssize_t cap = 0, ofs = 0;
+    while (ofs < len)
+    {
+        const Py_ssize_t start = ofs;
+        unsigned long mode = 0;
+        while (ofs < len && buf[ofs] >= '0' && buf[ofs] <= '7')
+        {
+            if (mode > (ULONG_MAX >> 3))
+                goto invalid;
+            mode = (mode << 3) | (buf[ofs++] - '0');
+        }
+        if (ofs == start || ofs == len || buf[ofs] != ' ')
+            goto invalid;
+        const Py_ssize_t name_ofs = ++ofs;
+        const unsigned char *z = memchr(buf + ofs, 0, len - ofs);
+        if (!z || z == buf + name_ofs)
+            goto invalid;
+        ofs = z - buf + 1;
+        if (len - ofs < 20)
+            goto invalid;
+        ofs += 20;
+        if (self->n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            tree_dec_ent *ents = realloc(self->ents, cap * sizeof(*ents));
+            if (!ents)
+            {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->ents = ents;
+        }
+        tree_dec_ent *ent = &self->ents[self->n++];
+        ent->name_ofs = name_ofs;
+        ent->name_len = (z - buf) - name_ofs;
+        ent->mode = mode;
+        continue;
+    invalid:
+        PyErr_Format(PyExc_ValueError, "invalid git tree entry at offset %zd",
+                     start);
+        return -1;
+    }
+    return 0;
+}
+
+static int TreeEntries_init(TreeEntries *self, PyObject *args, PyObject *kwds)
+{
+    static char *argnames[] = { "data", NULL };
+    PyObject *data;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", argnames, &data))
+        return -1;
+    TreeEntries_release(self);
+    if (PyObject_GetBuffer(data, &self->data, PyBUF_SIMPLE) < 0)
+        return -1;
+    self->have_data = 1;
+    if (tree_parse(self) < 0)
+    {
+        TreeEntries_release(self);
+        return -1;
+    }
+    return 0;
+}
+
+static Py_ssize_t TreeEntries_length(TreeEntries *self)
+{
+    return self->n;
+}
+
+static PyObject *TreeEntries_item(TreeEntries *self, Py_ssize_t i)
+{
+    if (i < 0 || i >= self->n)
+    {
+        PyErr_SetString(PyExc_IndexError, "tree entry index out of range");
+        return NULL;
+    }
+    const tree_dec_ent *ent = &self->ents[i];
+    const char *name = (const char *) self->data.buf + ent->name_ofs;
+    return Py_BuildValue("(ky#y#)", ent->mode,
+                         name, ent->name_len,
+                         name + ent->name_len + 1, (Py_ssize_t) 20);
+}
+
+static void TreeEntries_dealloc(TreeEntries *self)
+{
+    TreeEntries_release(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PySequenceMethods TreeEntries_as_sequence = {
+    .sq_length = (lenfunc) TreeEntries_length,
+    .sq_item = (ssizeargfunc) TreeEntries_item,
+};
+
+PyTypeObject TreeEntriesType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_helpers.TreeEntries",
+    .tp_doc = "Sequence of the (mode, name, oid) entries in git tree data",
+    .tp_basicsize = sizeof(TreeEntries),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) TreeEntries_init,
+    .tp_as_sequence = &TreeEntries_as_sequence,
+    .tp_dealloc = (destructor) TreeEntries_dealloc,
+};
+
+int tree_init(void)
+{
+    if (PyType_Ready(&TreeEntriesType) < 0)
+        return -1;
+    return 0;
+}
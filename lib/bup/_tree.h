@@ -0,0 +1,7 @@
+#pragma once
+
+extern PyTypeObject TreeEntriesType;
+
+PyObject *tree_encode(PyObject *self, PyObject *args);
+
+int tree_init(void);
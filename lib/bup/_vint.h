@@ -0,0 +1,106 @@
+#pragma once
+
+// Variable length integers (see vint.py).  The encoders need room for
+// up to 10 bytes.
+
+static inline unsigned int vuint_encode(long long val, char *buf)
+{
+    unsigned int len = 0;
+
+    if (val < 0) {
+        PyErr_Format(PyExc_ValueError, "cannot encode negative value %llu", val);
+        return 0;
+    }
+
+    do {
+        buf[len] = val & 0x7f;
+
+        val >>= 7;
+        if (val)
+            buf[len] |= 0x80;
+
+        len++;
+    } while (val);
+
+    return len;
+}
+
+static inline unsigned int vint_encode(long long val, char *buf)
+{
+    unsigned int len = 1;
+    char sign = 0;
+
+    if (val < 0) {
+        sign = 0x40;
+        val = -val;
+    }
+
+    buf[0] = (val & 0x3f) | sign;
+    val >>= 6;
+    if (val)
+        buf[0] |= 0x80;
+
+    while (val) {
+        buf[len] = val & 0x7f;
+        val >>= 7;
+        if (val)
+            buf[len] |= 0x80;
+        len++;
+    }
+
+    return len;
+}
+
+// Decode a vuint from buf[*ofs, len), advancing *ofs past it.  Return
+// 1 on success, 0 if the data ends first, and -1 if the value doesn't
+// fit in 64 bits.
+static inline int vuint_decode(const unsigned char *buf, Py_ssize_t len,
+                               Py_ssize_t *ofs, unsigned long long *val)
+{
+    unsigned long long result = 0;
+    unsigned int shift = 0;
+    Py_ssize_t i = *ofs;
+    while (1)
+    {
+        if (i >= len)
+            return 0;
+        const unsigned char b = buf[i++];
+        const unsigned long long bits = b & 0x7f;
+        if (bits && (shift >= 64 || (bits << shift) >> shift != bits))
+            return -1;
+        if (shift < 64)
+            result |= bits << shift;
+        if (!(b & 0x80))
+            break;
+        shift += 7;
+    }
+    *ofs = i;
+    *val = result;
+    return 1;
+}
+
+// Decode a vint like vuint_decode(), returning -1 if the value doesn't
+// fit in a long long.
+static inline int vint_decode(const unsigned char *buf, Py_ssize_t len,
+                              Py_ssize_t *ofs, long long *val)
+{
+    Py_ssize_t i = *ofs;
+    if (i >= len)
+        return 0;
+    const unsigned char b = buf[i++];
+    const int negative = b & 0x40;
+    unsigned long long result = b & 0x3f;
+    if (b & 0x80)
+    {
+        unsigned long long rest;
+        const int rc = vuint_decode(buf, len, &i, &rest);
+        if (rc <= 0)
+            return rc;
+        if (rest > (LLONG_MAX >> 6))
+            return -1;
+        result |= rest << 6;
+    }
+    *ofs = i;
+    *val = negative ? -(long long) result : (long long) result;
+    return 1;
+}
@@ -97,6 +97,7 @@ _total_steps = 0
 
 bloom_contains = _helpers.bloom_contains
 bloom_add = _helpers.bloom_add
+bloom_add_many = _helpers.bloom_add_many
 
 # FIXME: check bloom create() and ShaBloom handling/ownership of "f".
 # The ownership semantics should be clarified since the caller needs
@@ -104,7 +105,9 @@ bloom_add = _helpers.bloom_add
 
 class ShaBloom:
     """Wrapper which contains data from multiple index files. """
-    def __init__(self, filename, f=None, readwrite=False, expected=-1):
+    def __init__(self, filename, f=None, readwrite=False, expected=-1, *,
+                 prefault=None, hugepages=False):
+        """See mmap_read() for prefault and hugepages."""
         self.closed = False
         self.name = filename
         self.readwrite = readwrite
@@ -137,13 +140,18 @@ class ShaBloom:
             self.delaywrite = expected > pages
             debug1('bloom: delaywrite=%r\n' % self.delaywrite)
             if self.delaywrite:
-                self.map = mmap_readwrite_private(self.file, close=False)
+                self.map = mmap_readwrite_private(self.file, close=False,
+                                                  prefault=prefault,
+                                                  hugepages=hugepages)
             else:
-                self.map = mmap_readwrite(self.file, close=False)
+                self.map = mmap_readwrite(self.file, close=False,
+                                          prefault=prefault,
+                                          hugepages=hugepages)
         else:
             # pylint: disable-next=consider-using-with
             self.file = f or open(filename, 'rb')
-            self.map = mmap_read(self.file)
+            self.map = mmap_read(self.file, prefault=prefault,
+                                 hugepages=hugepages)
         got = self.map[0:4]
         if got != b'BLOM':
             log('Warning: invalid BLOM header (%r) in %r\n' % (got, filename))
@@ -221,6 +229,17 @@ class ShaBloom:
         self.add(ix.shatable)
         self.idxnames.append(os.path.basename(ix.name))
 
+    def add_idxs(self, ixs, threads=1):
+        """Add the objects from all of the ixs to the filter, using up
+        to threads threads (the GIL is released while they run).
+
+        """
+        if not self.map:
+            raise Exception("Cannot add to closed bloom")
+        self.entries += bloom_add_many(self.map, [ix.shatable for ix in ixs],
+                                       self.bits, self.k, threads)
+        self.idxnames.extend(os.path.basename(ix.name) for ix in ixs)
+
     def exists(self, sha):
         """Return nonempty if the object probably exists in the bloom filter.
 
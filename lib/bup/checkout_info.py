@@ -0,0 +1,3 @@
+commit='2df8436b0bbb5e5d01f4960409693d7a5c5ced40'
+date='2026-10-19 06:41:22 +0000'
+modified=True
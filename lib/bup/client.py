@@ -495,7 +495,7 @@ class Client:
         return idx
 
     def new_packwriter(self, compression_level=None,
-                       max_pack_size=None, max_pack_objects=None):
+                       max_pack_size=None, max_pack_objects=None, jobs=1):
         self._require_command(b'receive-objects-v2')
         self.check_busy()
         def set_busy():
@@ -512,7 +512,8 @@ class Client:
         return PackWriter(store=store,
                           compression_level=compression_level,
                           max_pack_size=max_pack_size,
-                          max_pack_objects=max_pack_objects)
+                          max_pack_objects=max_pack_objects,
+                          jobs=jobs)
 
     def read_ref(self, refname):
         with self._call('read-ref', refname):
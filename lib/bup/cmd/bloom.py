@@ -1,4 +1,5 @@
 
+from contextlib import ExitStack
 import os, glob
 
 from bup import options, git, bloom
@@ -23,6 +24,7 @@ o,output=  output bloom filename (default: auto)
 d,dir=     input directory to look for idx files (default: auto)
 k,hashes=  number of hash functions to use (4 or 5) (default: auto)
 c,check=   check given *.idx or *.midx file against the bloom filter
+j,jobs=    number of threads to use when adding objects (default: CPU count)
 """
 
 
@@ -63,8 +65,12 @@ def check_bloom(path, bloomfilename, idx):
                     add_error('bloom: ERROR: object %s missing' % oid.hex())
 
 
+# Add this many idxs to the filter per bloom_add_many() call; bounds
+# the number of open idxs and sets the progress granularity.
+_ADD_BATCH_SIZE = 64
+
 _first = None
-def do_bloom(path, outfilename, k, force):
+def do_bloom(path, outfilename, k, force, jobs=1):
     global _first
     assert k in (None, 4, 5)
     b = None
@@ -136,15 +142,15 @@ def do_bloom(path, outfilename, k, force):
         if b is None:
             tfname = os.path.join(path, b'bup.tmp.bloom')
             b = bloom.create(tfname, expected=add_count, k=k)
-        count = 0
         icount = 0
-        for name in add:
-            with git.open_idx(name) as ix:
+        for i in range(0, len(add), _ADD_BATCH_SIZE):
+            with ExitStack() as ixs_ctx:
                 qprogress('bloom: writing %.2f%% (%d/%d objects)\r'
                           % (icount*100.0/add_count, icount, add_count))
-                b.add_idx(ix)
-                count += 1
-                icount += len(ix)
+                ixs = [ixs_ctx.enter_context(git.open_idx(name))
+                       for name in add[i:i + _ADD_BATCH_SIZE]]
+                b.add_idxs(ixs, threads=jobs)
+                icount += sum(len(ix) for ix in ixs)
 
     finally:  # This won't handle pending exceptions correctly in py2
         # Currently, there's an open file object for tfname inside b.
@@ -165,6 +171,11 @@ def main(argv):
     if not opt.check and opt.k and opt.k not in (4,5):
         o.fatal('only k values of 4 and 5 are supported')
 
+    if opt.jobs is not None and (not isinstance(opt.jobs, int)
+                                 or opt.jobs < 1):
+        o.fatal('--jobs must be a positive integer')
+    jobs = opt.jobs or os.cpu_count() or 1
+
     if opt.check:
         opt.check = argv_bytes(opt.check)
 
@@ -183,4 +194,4 @@ def main(argv):
     elif opt.ruin:
         ruin_bloom(outfilename)
     else:
-        do_bloom(path, outfilename, opt.k, opt.force)
+        do_bloom(path, outfilename, opt.k, opt.force, jobs=jobs)
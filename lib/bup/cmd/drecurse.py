@@ -1,6 +1,6 @@
 
 from os.path import relpath
-import sys
+import os, sys
 
 from bup import options, drecurse
 from bup.compat import argv_bytes
@@ -16,6 +16,7 @@ exclude= a path to exclude from the backup (can be used more than once)
 exclude-from= a file that contains exclude paths (can be used more than once)
 exclude-rx= skip paths matching the unanchored regex (may be repeated)
 exclude-rx-from= skip --exclude-rx patterns in file (may be repeated)
+j,jobs=  number of directories to read concurrently (default: CPU count)
 q,quiet  don't actually print filenames
 profile  run under the python profiler
 """
@@ -26,6 +27,9 @@ def main(argv):
 
     if len(extra) != 1:
         o.fatal("exactly one filename expected")
+    if opt.jobs is not None and (not isinstance(opt.jobs, int)
+                                 or opt.jobs < 1):
+        o.fatal('--jobs must be a positive integer')
 
     drecurse_top = argv_bytes(extra[0])
     excluded_paths = parse_excludes(flags, o.fatal)
@@ -34,7 +38,8 @@ def main(argv):
     exclude_rxs = parse_rx_excludes(flags, o.fatal)
     it = drecurse.recursive_dirlist([drecurse_top], opt.xdev,
                                     excluded_paths=excluded_paths,
-                                    exclude_rxs=exclude_rxs)
+                                    exclude_rxs=exclude_rxs,
+                                    threads=opt.jobs or os.cpu_count() or 1)
     if opt.profile:
         import cProfile # pylint: disable=import-outside-toplevel
         cProfile.runctx('for _ in it: pass', globals(), locals())
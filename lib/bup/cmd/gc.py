@@ -1,6 +1,8 @@
 
 
-from bup import git, options
+import sys
+
+from bup import git, lookupstats, options
 from bup.gc import bup_gc
 
 
@@ -12,6 +14,7 @@ threshold=     only rewrite a packfile if it's over this percent garbage [10]
 #,compress=    set compression level to # (0-9, 9 is highest) [1]
 ignore-missing don't halt halt for missing objects
 unsafe         use the command even though it may be DANGEROUS
+stats=         write object lookup statistics to stderr in the given format (json)
 """
 
 # FIXME: server mode?
@@ -35,9 +38,13 @@ def main(argv):
         if opt.threshold < 0 or opt.threshold > 100:
             o.fatal('threshold must be an integer percentage value')
 
+    if opt.stats and opt.stats not in lookupstats.formats:
+        o.fatal(f'unsupported --stats format {opt.stats!r}')
+
     git.check_repo_or_die()
 
-    bup_gc(threshold=opt.threshold,
-           compression=opt.compress,
-           verbosity=opt.verbose,
-           ignore_missing=opt.ignore_missing)
+    with lookupstats.reporting(opt.stats, sys.stderr):
+        bup_gc(threshold=opt.threshold,
+               compression=opt.compress,
+               verbosity=opt.verbose,
+               ignore_missing=opt.ignore_missing)
@@ -9,7 +9,7 @@ from typing import NoReturn, Optional, Union
 from uuid import uuid4
 import os, re, sys, textwrap, time
 
-from bup import client, compat, git, hashsplit, vfs
+from bup import client, compat, git, hashsplit, lookupstats, vfs
 from bup.commit import commit_message
 from bup.compat import dataclass, dataclass_frozen_for_testing, get_argvb
 from bup.git import MissingObject, get_cat_data, parse_commit, walk_object
@@ -72,6 +72,8 @@ argspec = (
       ('--no-excludes', 'forget any preceeding exclude options'),
       ('--bwlimit BWLIMIT', 'maximum bytes/sec to transmit to server'),
       ('--[no-]ignore-missing', 'ignore missing objects (*dangerous*)'),
+      ('--stats FORMAT',
+       'write object lookup statistics to stderr in FORMAT (json)'),
       ('-0, -1, -2, -3, -4, -5, -6, -7, -8, -9, --compress LEVEL',
        'set compression LEVEL (default: 1)'))),
 
@@ -164,6 +166,7 @@ def parse_args(args):
         print_trees: bool = False
         print_tags: bool = False
         bwlimit: Optional[int] = None
+        stats: Optional[str] = None
         compress: Optional[int] = None
         source: Optional[bytes] = None
         remote: Optional[bytes] = None
@@ -294,6 +297,11 @@ def parse_args(args):
                 opt.bwlimit = parse_num(opt.bwlimit)
             except ValueError as ex:
                 misuse(f'invalid --bwlimit ({str(ex)})')
+        elif arg == b'--stats':
+            (val,), remaining = require_n_args_or_die(1, remaining)
+            opt.stats = val.decode('ascii', errors='replace')
+            if opt.stats not in lookupstats.formats:
+                misuse(f'unsupported --stats format {opt.stats!r}')
         elif arg.startswith(b'-') and len(arg) > 2 and arg[1] != b'-'[0]:
             # Try to interpret this as -xyz, i.e. "-xyz -> -x -y -z".
             # We do this last so that --foo -bar is valid if --foo
@@ -968,4 +976,5 @@ def main(argv):
     git.check_repo_or_die()
     if opt.bwlimit:
         client.bwlimit = opt.bwlimit
-    return get_everything(opt)
+    with lookupstats.reporting(opt.stats, sys.stderr):
+        return get_everything(opt)
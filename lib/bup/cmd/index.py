@@ -2,9 +2,9 @@
 from binascii import hexlify
 import errno, os, stat, sys, time
 
-from bup import metadata, options, index, hlinkdb
+from bup import fsjournal, metadata, options, index, hlinkdb, xstat
 from bup.compat import argv_bytes
-from bup.drecurse import recursive_dirlist
+from bup.drecurse import dirlist, recursive_dirlist
 from bup.hashsplit import GIT_MODE_FILE
 from bup.helpers import \
     (add_error,
@@ -13,7 +13,8 @@ from bup.helpers import \
      parse_excludes,
      parse_rx_excludes,
      progress,
-     qprogress)
+     qprogress,
+     should_rx_exclude_path)
 from bup.io import byte_stream, path_msg
 from bup.path import default_fsindex, defaultrepo, flat_fsindex
 
@@ -71,14 +72,140 @@ def clear_index(fsindex, verbose):
                 raise
     rm(fsindex.stat)
     rm(fsindex.meta)
+    rm(fsindex.meta + b'.ix')
     rm(fsindex.hlink)
+    # The watcher's journal is no longer relevant to the new index
+    rm(fsjournal.Journal(fsindex.journal).state_path)
+
+
+class _Progress:
+    def __init__(self, out, verbose):
+        self.out = out
+        self.verbose = verbose
+        self.total = 0
+        self.start = time.time()
+
+    def _rate(self):
+        elapsed = time.time() - self.start
+        return self.total / elapsed if elapsed else 0
+
+    def __call__(self, path, pst):
+        verbose = self.verbose
+        if verbose>=2 or (verbose == 1 and stat.S_ISDIR(pst.st_mode)):
+            self.out.write(b'%s\n' % path)
+            self.out.flush()
+            qprogress('Indexing: %d (%d paths/s)\r' % (self.total, self._rate()))
+        elif not (self.total % 128):
+            qprogress('Indexing: %d (%d paths/s)\r' % (self.total, self._rate()))
+        self.total += 1
+
+    def done(self):
+        progress('Indexing: %d, done (%d paths/s).\n'
+                 % (self.total, self._rate()))
+
+
+def _fake_hash(name_):
+    return (GIT_MODE_FILE, index.FAKE_SHA)
+
+
+def _update_entries(walk, rig, msw, hlinks, add, progress,
+                    check_device, fake_hash, fake_invalid):
+    """Update the index entries produced by rig to match the (path,
+    stat) pairs produced by walk (in the same order), and call
+    add(path, stat, meta_ofs) for each path that's not in the index."""
+    for path, pst in walk:
+        progress(path, pst)
+
+        while rig.cur and rig.cur.name > path:  # deleted paths
+            if rig.cur.exists():
+                rig.cur.set_deleted()
+                rig.cur.repack()
+                if rig.cur.nlink > 1 and not stat.S_ISDIR(rig.cur.mode):
+                    hlinks.del_path(rig.cur.name)
+            rig.next()
+
+        if rig.cur and rig.cur.name == path:    # paths that already existed
+            need_repack = False
+            if(rig.cur.stale(pst, check_device=check_device)):
+                try:
+                    meta = metadata.from_path(path, statinfo=pst)
+                except (OSError, IOError) as e:
+                    add_error(e)
+                    rig.next()
+                    continue
+                if not stat.S_ISDIR(rig.cur.mode) and rig.cur.nlink > 1:
+                    hlinks.del_path(rig.cur.name)
+                if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
+                    hlinks.add_path(path, pst.st_dev, pst.st_ino)
+                # Clear these so they don't bloat the store -- they're
+                # already in the index (since they vary a lot and they're
+                # fixed length).  If you've noticed "tmax", you might
+                # wonder why it's OK to do this, since that code may
+                # adjust (mangle) the index mtime and ctime -- producing
+                # fake values which must not end up in a .bupm.  However,
+                # it looks like that shouldn't be possible:  (1) When
+                # "save" validates the index entry, it always reads the
+                # metadata from the filesytem. (2) Metadata is only
+                # read/used from the index if hashvalid is true. (3)
+                # "faked" entries will be stale(), and so we'll invalidate
+                # them below.
+                meta.thaw()
+                meta.ctime = meta.mtime = meta.atime = 0
+                meta.freeze()
+                meta_ofs = msw.store(meta)
+                rig.cur.update_from_stat(pst, meta_ofs)
+                rig.cur.invalidate()
+                need_repack = True
+            if not (rig.cur.flags & index.IX_HASHVALID):
+                if fake_hash:
+                    if rig.cur.sha == index.EMPTY_SHA:
+                        rig.cur.gitmode, rig.cur.sha = fake_hash(path)
+                    rig.cur.flags |= index.IX_HASHVALID
+                    need_repack = True
+            if fake_invalid:
+                rig.cur.invalidate()
+                need_repack = True
+            if need_repack:
+                rig.cur.repack()
+            rig.next()
+        else:  # new paths
+            try:
+                meta = metadata.from_path(path, statinfo=pst)
+            except (OSError, IOError) as e:
+                add_error(e)
+                continue
+            # See same assignment to 0, above, for rationale.
+            meta.thaw()
+            meta.atime = meta.mtime = meta.ctime = 0
+            meta.freeze()
+            add(path, pst, msw.store(meta))
+
+
+def _merge_update(ri, wi, fsindex, check, verbose):
+    """Replace the index with the merge of ri and the new entries in
+    wi."""
+    if not ri.exists():
+        wi.close()
+        return
+    ri.save()
+    wi.flush()
+    if wi.count:
+        with wi.new_reader() as wr:
+            if check:
+                log('check: before merging: oldfile\n')
+                check_index(ri, verbose)
+                log('check: before merging: newfile\n')
+                check_index(wr, verbose)
+            # FIXME: shouldn't we remove deleted entries
+            # eventually?  When?
+            index.write_merged(fsindex.stat, (ri, wr))
 
 
 def update_index(top, excluded_paths, exclude_rxs, fsindex,
                  check=False, check_device=True,
                  xdev=False, xdev_exceptions=frozenset(),
                  fake_valid=False, fake_invalid=False,
-                 out=None, verbose=0):
+                 out=None, verbose=0, jobs=1):
     # tmax must be epoch nanoseconds.
     tmax = (time.time() - 1) * 10**9
 
@@ -88,126 +215,248 @@ def update_index(top, excluded_paths, exclude_rxs, fsindex,
          index.Reader(fsindex.stat) as ri:
 
         rig = IterHelper(ri.iter(name=top))
+        fake_hash = _fake_hash if fake_valid else None
+
+        def add(path, pst, meta_ofs):
+            wi.add(path, pst, meta_ofs, hashgen=fake_hash)
+            if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
+                hlinks.add_path(path, pst.st_dev, pst.st_ino)
+
+        prog = _Progress(out, verbose)
+        walk = recursive_dirlist([top],
+                                 xdev=xdev,
+                                 bup_dir=os.path.abspath(defaultrepo()),
+                                 excluded_paths=excluded_paths,
+                                 exclude_rxs=exclude_rxs,
+                                 xdev_exceptions=xdev_exceptions,
+                                 threads=jobs)
+        _update_entries(walk, rig, msw, hlinks, add, prog,
+                        check_device=check_device, fake_hash=fake_hash,
+                        fake_invalid=fake_invalid)
+        prog.done()
+
+        hlinks.prepare_save()
+        _merge_update(ri, wi, fsindex, check, verbose)
+        hlinks.commit_save()
+
 
-        if fake_valid:
-            def fake_hash(name_): return (GIT_MODE_FILE, index.FAKE_SHA)
+def _journal_units(ri, top, records):
+    """Return the reverse sorted (kind, dir) pairs describing the
+    parts of top that must be revisited to apply the journal records,
+    where kind is b'd' (the directory's entries) or b'r' (the whole
+    tree).  Records for paths that aren't (live) directories in the
+    index and on disk are moved up to the nearest ancestor that is,
+    and records within a tree that's being rescanned are dropped."""
+    def indexed_dir(path):
+        e = ri.find(path)
+        if not e or not e.exists() or not stat.S_ISDIR(e.mode):
+            return False
+        try:
+            return stat.S_ISDIR(os.lstat(path).st_mode)
+        except OSError:
+            return False
+    units = {}
+    for rec in records:
+        kind, path = rec[:1], rec[1:]
+        if not path.startswith(top):
+            continue
+        while path != top and not indexed_dir(path):
+            path = fsjournal.parent_dir(path)
+            kind = b'd'
+        if kind == b'r' or path not in units:
+            units[path] = kind
+    result = []
+    for path, kind in units.items():
+        p = path
+        while p != top:
+            p = fsjournal.parent_dir(p)
+            if units.get(p) == b'r':
+                break
         else:
-            fake_hash = None
+            result.append((kind, path))
+    result.sort(key=lambda x: index.pathsplit(x[1]), reverse=True)
+    return result
+
+
+def _journal_unit_excluded(path, top, top_dev, bup_dir, excluded_paths,
+                           exclude_rxs, xdev_exceptions):
+    """Return true if the full walk of top wouldn't list the contents
+    of the directory path."""
+    while path != top:
+        if excluded_paths and os.path.normpath(path) in excluded_paths:
+            return True
+        if exclude_rxs and should_rx_exclude_path(path, exclude_rxs):
+            return True
+        if os.path.normpath(path) == bup_dir:
+            return True
+        if top_dev is not None and path not in xdev_exceptions:
+            try:
+                if os.lstat(path).st_dev != top_dev:
+                    return True
+            except OSError:
+                return True
+        path = fsjournal.parent_dir(path)
+    return False
+
+
+def update_index_from_journal(tops, records, excluded_paths, exclude_rxs,
+                              fsindex, check=False, check_device=True,
+                              xdev=False, xdev_exceptions=frozenset(),
+                              fake_valid=False, fake_invalid=False,
+                              out=None, verbose=0, jobs=1):
+    """Update the index entries for the directories in tops (which
+    must already be in the index) to reflect the journal records,
+    instead of walking all of them."""
+    # tmax must be epoch nanoseconds.
+    tmax = (time.time() - 1) * 10**9
 
-        total = 0
+    with index.MetaStoreWriter(fsindex.meta) as msw, \
+         hlinkdb.HLinkDB(fsindex.hlink) as hlinks, \
+         index.Writer(fsindex.stat, msw, tmax) as wi, \
+         index.Reader(fsindex.stat) as ri:
+
+        fake_hash = _fake_hash if fake_valid else None
         bup_dir = os.path.abspath(defaultrepo())
-        index_start = time.time()
-        for path, pst in recursive_dirlist([top],
-                                           xdev=xdev,
-                                           bup_dir=bup_dir,
-                                           excluded_paths=excluded_paths,
-                                           exclude_rxs=exclude_rxs,
-                                           xdev_exceptions=xdev_exceptions):
-            if verbose>=2 or (verbose == 1 and stat.S_ISDIR(pst.st_mode)):
-                out.write(b'%s\n' % path)
-                out.flush()
-                elapsed = time.time() - index_start
-                paths_per_sec = total / elapsed if elapsed else 0
-                qprogress('Indexing: %d (%d paths/s)\r' % (total, paths_per_sec))
-            elif not (total % 128):
-                elapsed = time.time() - index_start
-                paths_per_sec = total / elapsed if elapsed else 0
-                qprogress('Indexing: %d (%d paths/s)\r' % (total, paths_per_sec))
-            total += 1
-
-            while rig.cur and rig.cur.name > path:  # deleted paths
-                if rig.cur.exists():
-                    rig.cur.set_deleted()
-                    rig.cur.repack()
-                    if rig.cur.nlink > 1 and not stat.S_ISDIR(rig.cur.mode):
-                        hlinks.del_path(rig.cur.name)
-                rig.next()
-
-            if rig.cur and rig.cur.name == path:    # paths that already existed
-                need_repack = False
-                if(rig.cur.stale(pst, check_device=check_device)):
+        walk_opts = dict(bup_dir=bup_dir,
+                         excluded_paths=excluded_paths,
+                         exclude_rxs=exclude_rxs,
+                         xdev_exceptions=xdev_exceptions)
+
+        # The units may overlap (e.g. a directory's own entry is
+        # revisited by its parent's unit), so collect the new entries
+        # and add them in order at the end.
+        new = {}
+        def add(path, pst, meta_ofs):
+            if path in new:
+                return
+            new[path] = (pst, meta_ofs)
+            if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
+                hlinks.add_path(path, pst.st_dev, pst.st_ino)
+
+        prog = _Progress(out, verbose)
+        for top in tops:
+            try:
+                top_dev = os.lstat(top).st_dev if xdev else None
+            except OSError as e:
+                add_error(e)
+                continue
+            for kind, path in _journal_units(ri, top, records):
+                if _journal_unit_excluded(path, top, top_dev, **walk_opts):
+                    continue
+                if kind == b'r':
+                    walk = recursive_dirlist([path], xdev=xdev,
+                                             threads=jobs, **walk_opts)
+                    rig = IterHelper(ri.iter(name=path))
+                else:
                     try:
-                        meta = metadata.from_path(path, statinfo=pst)
-                    except (OSError, IOError) as e:
-                        add_error(e)
-                        rig.next()
+                        entries = dirlist(path, top_dev, **walk_opts)
+                    except OSError as e:
+                        add_error('%s: %s' % (path_msg(path), e))
                         continue
-                    if not stat.S_ISDIR(rig.cur.mode) and rig.cur.nlink > 1:
-                        hlinks.del_path(rig.cur.name)
-                    if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
-                        hlinks.add_path(path, pst.st_dev, pst.st_ino)
-                    # Clear these so they don't bloat the store -- they're
-                    # already in the index (since they vary a lot and they're
-                    # fixed length).  If you've noticed "tmax", you might
-                    # wonder why it's OK to do this, since that code may
-                    # adjust (mangle) the index mtime and ctime -- producing
-                    # fake values which must not end up in a .bupm.  However,
-                    # it looks like that shouldn't be possible:  (1) When
-                    # "save" validates the index entry, it always reads the
-                    # metadata from the filesytem. (2) Metadata is only
-                    # read/used from the index if hashvalid is true. (3)
-                    # "faked" entries will be stale(), and so we'll invalidate
-                    # them below.
-                    meta.thaw()
-                    meta.ctime = meta.mtime = meta.atime = 0
-                    meta.freeze()
-                    meta_ofs = msw.store(meta)
-                    rig.cur.update_from_stat(pst, meta_ofs)
-                    rig.cur.invalidate()
-                    need_repack = True
-                if not (rig.cur.flags & index.IX_HASHVALID):
-                    if fake_hash:
-                        if rig.cur.sha == index.EMPTY_SHA:
-                            rig.cur.gitmode, rig.cur.sha = fake_hash(path)
-                        rig.cur.flags |= index.IX_HASHVALID
-                        need_repack = True
-                if fake_invalid:
-                    rig.cur.invalidate()
-                    need_repack = True
-                if need_repack:
-                    rig.cur.repack()
-                rig.next()
-            else:  # new paths
-                try:
-                    meta = metadata.from_path(path, statinfo=pst)
-                except (OSError, IOError) as e:
-                    add_error(e)
-                    continue
-                # See same assignment to 0, above, for rationale.
-                meta.thaw()
-                meta.atime = meta.mtime = meta.ctime = 0
-                meta.freeze()
-                meta_ofs = msw.store(meta)
-                wi.add(path, pst, meta_ofs, hashgen=fake_hash)
-                if not stat.S_ISDIR(pst.st_mode) and pst.st_nlink > 1:
-                    hlinks.add_path(path, pst.st_dev, pst.st_ino)
-
-        elapsed = time.time() - index_start
-        paths_per_sec = total / elapsed if elapsed else 0
-        progress('Indexing: %d, done (%d paths/s).\n' % (total, paths_per_sec))
+                    walk, wantrecurse = \
+                        _journal_dir_walk(ri, path, entries, xdev, jobs,
+                                          walk_opts)
+                    rig = IterHelper(ri.iter(name=path,
+                                             wantrecurse=wantrecurse))
+                _update_entries(walk, rig, msw, hlinks, add, prog,
+                                check_device=check_device,
+                                fake_hash=fake_hash,
+                                fake_invalid=fake_invalid)
+        prog.done()
 
         hlinks.prepare_save()
+        for path in sorted(new, key=index.pathsplit, reverse=True):
+            pst, meta_ofs = new[path]
+            wi.add(path, pst, meta_ofs, hashgen=fake_hash)
+        _merge_update(ri, wi, fsindex, check, verbose)
+        hlinks.commit_save()
 
-        if not ri.exists():
-            wi.close()
-        else:
-            ri.save()
-            wi.flush()
-            if wi.count:
-                with wi.new_reader() as wr:
-                    if check:
-                        log('check: before merging: oldfile\n')
-                        check_index(ri, verbose)
-                        log('check: before merging: newfile\n')
-                        check_index(wr, verbose)
-                    with index.Writer(fsindex.stat, msw, tmax) as mi:
-                        for e in index.merge(ri, wr):
-                            # FIXME: shouldn't we remove deleted entries
-                            # eventually?  When?
-                            mi.add_ixentry(e)
-                        mi.close()
 
-        hlinks.commit_save()
+def _journal_dir_walk(ri, path, entries, xdev, jobs, walk_opts):
+    """Return the walk of the directory path's entries (as produced
+    by dirlist()), descending into the subdirectories that aren't
+    live in the index, along with the wantrecurse function for the
+    matching iteration over the index."""
+    known = set()
+    for p, pst, descend in entries:
+        if descend:
+            e = ri.find(p)
+            if e and e.exists():
+                known.add(p)
+    def walk():
+        for p, pst, descend in entries:
+            if descend and p not in known:
+                yield from recursive_dirlist([p], xdev=xdev, threads=jobs,
+                                             **walk_opts)
+            else:
+                yield p, pst
+        try:
+            yield path, xstat.lstat(path)
+        except OSError as e:
+            add_error(e)
+    def wantrecurse(e):
+        # Descend to path, and then anywhere the walk does, or where
+        # the walk will have nothing (so that the entries are marked
+        # deleted).
+        return path.startswith(e.name) or e.name not in known
+    return walk(), wantrecurse
+
+
+def update_index_with_journal(paths, excluded_paths, exclude_rxs, fsindex,
+                              **kwargs):
+    """Update the index for the (resolved path, path) pairs in paths
+    via the journal maintained by bup index --watch where possible,
+    and via a full walk otherwise."""
+    jnl = fsjournal.Journal(fsindex.journal)
+    watcher = jnl.watcher()
+    # Make sure every change so far is in the records we rotate out
+    synced = watcher and jnl.sync(watcher)
+    pending = jnl.rotate()
+    records = jnl.read(pending)
+    tops = [rp for rp, path_ in paths]
+
+    if not watcher:
+        reason = 'no watcher is running'
+    elif not synced:
+        reason = 'unable to synchronize with the watcher'
+    elif jnl.state() != watcher.id:
+        reason = 'the index predates the watcher'
+    elif b'o' in records:
+        reason = 'the watcher missed events'
+    else:
+        reason = None
+
+    incremental, full = [], tops
+    if reason:
+        log('bup: not using the journal (%s)\n' % reason)
+    else:
+        with index.Reader(fsindex.stat) as ri:
+            def usable(top):
+                if not top.endswith(b'/') or not watcher.covers(top):
+                    return False
+                e = ri.find(top)
+                return e and e.exists()
+            incremental = [top for top in tops if usable(top)]
+            full = [top for top in tops if not usable(top)]
+    if incremental:
+        update_index_from_journal(incremental, records,
+                                  excluded_paths, exclude_rxs, fsindex,
+                                  **kwargs)
+    for top in full:
+        update_index(top, excluded_paths, exclude_rxs, fsindex, **kwargs)
+
+    if not watcher:
+        jnl.finish(pending, (), None)
+    elif all(any(root.startswith(top) for top in tops)
+             for root in watcher.roots):
+        # Every root has been brought up to date
+        jnl.finish(pending, (), watcher.id)
+    elif reason:
+        jnl.finish(pending, [b'o'] if b'o' in records else (), None)
+    else:
+        leftovers = [r for r in records
+                     if not any(r[1:].startswith(top) for top in tops)]
+        jnl.finish(pending, leftovers, None)
 
 
 optspec = """
@@ -220,6 +469,7 @@ s,status   print each filename with a status char (A/M/D) (implies -p)
 u,update   recursively update the index entries for the given file/dir names (default if no mode is specified)
 check      carefully check index file integrity
 clear      clear the default index
+watch      record the changes beneath the given paths until killed (see --journal)
  Options:
 H,hash     print the hash for each object next to its name
 l,long     print more information about each file
@@ -233,6 +483,9 @@ exclude-rx= skip paths matching the unanchored regex (may be repeated)
 exclude-rx-from= skip --exclude-rx patterns in file (may be repeated)
 v,verbose  increase log output (can be used more than once)
 x,xdev,one-file-system  don't cross filesystem boundaries
+j,jobs=    number of directories to read concurrently (default: CPU count)
+journal    only revisit what a running --watch recorded as changed (with -u)
+watch-method= use fanotify or inotify with --watch (default: auto)
 """
 
 def main(argv):
@@ -244,8 +497,19 @@ def main(argv):
             opt.status or \
             opt.update or \
             opt.check or \
-            opt.clear):
+            opt.clear or \
+            opt.watch):
         opt.update = 1
+    if opt.watch and (opt.modified or opt['print'] or opt.status
+                      or opt.update or opt.check or opt.clear):
+        o.fatal('--watch is incompatible with the other modes')
+    if opt.journal and not opt.update:
+        o.fatal('--journal is meaningless without -u')
+    if opt.watch_method and not opt.watch:
+        o.fatal('--watch-method is meaningless without --watch')
+    if opt.watch_method and opt.watch_method not in fsjournal.methods:
+        o.fatal('--watch-method must be one of %s'
+                % ', '.join(fsjournal.methods))
     if (opt.fake_valid or opt.fake_invalid) and not opt.update:
         o.fatal('--fake-{in,}valid are meaningless without -u')
     if opt.fake_valid and opt.fake_invalid:
@@ -253,6 +517,27 @@ def main(argv):
     if opt.clear and opt.indexfile:
         o.fatal('cannot clear an external index (via -f)')
     if opt.indexfile: opt.indexfile = argv_bytes(opt.indexfile)
+    if opt.jobs is not None and (not isinstance(opt.jobs, int)
+                                 or opt.jobs < 1):
+        o.fatal('--jobs must be a positive integer')
+    jobs = opt.jobs or os.cpu_count() or 1
+
+    if opt.watch:
+        if not extra:
+            o.fatal('--watch requested but no paths given')
+        handle_ctrl_c()
+        roots = [rp for rp, path_ in
+                 index.reduce_paths([argv_bytes(x) for x in extra])]
+        for rp in roots:
+            if not rp.endswith(b'/'):
+                o.fatal('cannot watch non-directory %s' % path_msg(rp))
+        fsindex = flat_fsindex(opt.indexfile) if opt.indexfile \
+            else default_fsindex()
+        try:
+            fsjournal.watch(fsindex.journal, sorted(roots),
+                            method=opt.watch_method or 'auto')
+        except fsjournal.Error as ex:
+            o.fatal(str(ex))
 
     # FIXME: remove this once we account for timestamp races, i.e. index;
     # touch new-file; index.  It's possible for this to happen quickly
@@ -268,6 +553,10 @@ def main(argv):
 
     fsindex = flat_fsindex(opt.indexfile) if opt.indexfile else default_fsindex()
 
+    if opt.update:
+        # Only the writer converts older indexes; readers refuse them
+        index.convert_v7(fsindex.stat)
+
     if opt.check:
         log('check: starting initial check.\n')
         with index.Reader(fsindex.stat) as reader:
@@ -287,13 +576,19 @@ def main(argv):
         excluded_paths = parse_excludes(flags, o.fatal)
         exclude_rxs = parse_rx_excludes(flags, o.fatal)
         xexcept = index.unique_resolved_paths(extra)
-        for rp, path_ in index.reduce_paths(extra):
-            update_index(rp, excluded_paths, exclude_rxs, fsindex,
-                         check=opt.check, check_device=opt.check_device,
-                         xdev=opt.xdev, xdev_exceptions=xexcept,
-                         fake_valid=opt.fake_valid,
-                         fake_invalid=opt.fake_invalid,
-                         out=out, verbose=opt.verbose)
+        update_opts = dict(check=opt.check, check_device=opt.check_device,
+                           xdev=opt.xdev, xdev_exceptions=xexcept,
+                           fake_valid=opt.fake_valid,
+                           fake_invalid=opt.fake_invalid,
+                           out=out, verbose=opt.verbose, jobs=jobs)
+        if opt.journal:
+            update_index_with_journal(index.reduce_paths(extra),
+                                      excluded_paths, exclude_rxs, fsindex,
+                                      **update_opts)
+        else:
+            for rp, path_ in index.reduce_paths(extra):
+                update_index(rp, excluded_paths, exclude_rxs, fsindex,
+                             **update_opts)
 
     if opt['print'] or opt.status or opt.modified:
         extra = [argv_bytes(x) for x in extra]
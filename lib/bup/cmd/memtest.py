@@ -1,4 +1,5 @@
 
+from functools import partial
 import re, resource, sys, time
 
 from bup import git, bloom, midx, options, _helpers
@@ -68,6 +69,8 @@ n,number=  number of objects per cycle [10000]
 c,cycles=  number of cycles to run [100]
 ignore-midx  ignore .midx files, use only .idx files
 existing   test with existing objects instead of fake ones
+prefault=  prefault the midx and bloom maps (none, willneed, or populate)
+hugepages  request transparent huge pages for the midx and bloom maps
 """
 
 def main(argv):
@@ -78,6 +81,17 @@ def main(argv):
         o.fatal('no arguments expected')
 
     git.check_repo_or_die()
+    advice = git.index_map_configuration(partial(git.git_config_get,
+                                                 git.repo_config_file(None)))
+    if opt.prefault is not None:
+        if opt.prefault not in ('none', 'willneed', 'populate'):
+            o.fatal(f'invalid --prefault value {opt.prefault!r}')
+        advice['prefault'] = None if opt.prefault == 'none' else opt.prefault
+    if opt.hugepages:
+        advice['hugepages'] = True
+    if advice['prefault'] == 'populate' and advice['hugepages']:
+        o.fatal('populate prefaulting is incompatible with huge pages')
+
     sys.stdout.flush()
     out = byte_stream(sys.stdout)
 
@@ -85,8 +99,11 @@ def main(argv):
     _helpers.random_sha()
     report(0, out)
 
+    open_start = time.time()
     with git.PackIdxList(git.repo(b'objects/pack'),
-                         ignore_midx=opt.ignore_midx) as m:
+                         ignore_midx=opt.ignore_midx, **advice) as m:
+        open_ms = (time.time() - open_start) * 1000
+        report(0, out)
 
         if opt.existing:
             def foreverit(mi):
@@ -121,4 +138,7 @@ def main(argv):
         out.write(b'idx: %d objects searched in %d steps: avg %.3f steps/object\n'
                   % (git._total_searches, git._total_steps,
                      git._total_steps*1.0/git._total_searches))
+    out.write(b'maps: opened in %.3fms (prefault %s, hugepages %s)\n'
+              % (open_ms, (advice['prefault'] or 'none').encode('ascii'),
+                 b'on' if advice['hugepages'] else b'off'))
     out.write(b'Total time: %.3fs\n' % (time.time() - start))
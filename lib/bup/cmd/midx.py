@@ -3,7 +3,7 @@ from binascii import hexlify
 from contextlib import ExitStack
 import glob, os, math, resource, struct, sys
 
-from bup import options, git, midx, _helpers, xstat
+from bup import options, git, midx, oidhash, _helpers, xstat
 from bup.compat import argv_bytes
 from bup.helpers import \
     (Sha1,
@@ -30,6 +30,7 @@ a,auto     automatically use all existing .midx/.idx files as input
 f,force    merge produce exactly one .midx containing all objects
 p,print    print names of generated midx files
 check      validate contents of the given midx files (with -a, all midx files)
+hash       create or update the bup.oidhash table (with -f, rebuild it)
 max-files= maximum number of idx files to open at once [-1]
 d,dir=     directory containing idx/midx files
 """
@@ -279,6 +280,8 @@ def main(argv):
 
     if extra and (opt.auto or opt.force):
         o.fatal("you can't use -f/-a and also provide filenames")
+    if opt.hash and (extra or opt.auto or opt.check or opt.output):
+        o.fatal("--hash can only be combined with -f and --dir")
     if opt.check and (not extra and not opt.auto):
         o.fatal("if using --check, you must provide filenames or -a")
 
@@ -299,7 +302,10 @@ def main(argv):
 
     extra = [argv_bytes(x) for x in extra]
 
-    if opt.check:
+    if opt.hash:
+        debug1('midx: updating oid hash in %s\n' % path_msg(path))
+        oidhash.update(path, git.open_idx, force=opt.force)
+    elif opt.check:
         # check existing midx files
         if extra:
             midxes = extra
@@ -322,5 +328,8 @@ def main(argv):
             do_midx_dir(path, opt.output, byte_stream(sys.stdout),
                         auto=opt.auto, force=opt.force,
                         max_files=opt.max_files)
+            # Keep any existing oid hash up to date as packs arrive.
+            if opt.auto and os.path.exists(os.path.join(path, b'bup.oidhash')):
+                oidhash.update(path, git.open_idx)
         else:
             o.fatal("you must use -f or -a or provide input filenames")
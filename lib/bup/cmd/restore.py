@@ -1,9 +1,12 @@
 
+from binascii import hexlify
+from collections import OrderedDict, deque
+from concurrent.futures import ThreadPoolExecutor
 from copy import deepcopy
 from stat import S_ISDIR
 import errno, os, re, stat, sys
 
-from bup import options, vfs
+from bup import git, options, vfs
 from bup._helpers import write_sparsely
 from bup.compat import argv_bytes, fsencode
 from bup.helpers import (add_error, chunkyreader,
@@ -27,6 +30,8 @@ map-user=   given OLD=NEW, restore OLD user as NEW user
 map-group=  given OLD=NEW, restore OLD group as NEW group
 map-uid=    given OLD=NEW, restore OLD uid as NEW uid
 map-gid=    given OLD=NEW, restore OLD gid as NEW gid
+j,jobs=     number of files to write at once (default: CPU count)
+pack-order  read the file contents in repository (pack) order
 q,quiet     don't show progress meter
 """
 
@@ -150,8 +155,190 @@ def write_file_content_sparsely(repo, dest_path, vfs_file):
         finally:
             os.close(outfd)
 
+def restore_file_content(repo, path, item, sparse, numeric_ids, owner_map):
+    if sparse:
+        write_file_content_sparsely(repo, path, item)
+    else:
+        write_file_content(repo, path, item)
+    apply_metadata(item.meta, path, numeric_ids, owner_map)
+
+
+class ContentWriter:
+    """Run the file content writes, and the metadata updates that must
+    follow them, either immediately, or when jobs is greater than one,
+    in that many threads (with a bounded number outstanding).  Each
+    deferred call runs, in order, once all of the writes requested
+    before it have finished.  When concurrent, the calls must not
+    depend on the current directory (so use absolute paths), and the
+    repo must allow reads from any thread.
+
+    """
+    def __init__(self, jobs):
+        self.concurrent = jobs > 1
+        self._executor = ThreadPoolExecutor(max_workers=jobs) \
+            if self.concurrent else None
+        self._max_pending = 4 * jobs
+        self._pending = deque() # futures
+        self._submitted = self._finished = 0
+        self._deferred = deque() # (submitted count, fn, args)
+
+    def __enter__(self): return self
+
+    def __exit__(self, type, value, traceback):
+        if self._executor:
+            executor, self._executor = self._executor, None
+            for write in self._pending:
+                write.cancel()
+            executor.shutdown()
+
+    def write_file(self, repo, path, item, sparse, numeric_ids, owner_map):
+        args = repo, path, item, sparse, numeric_ids, owner_map
+        if not self._executor:
+            restore_file_content(*args)
+            return
+        self._pending.append(self._executor.submit(restore_file_content,
+                                                   *args))
+        self._submitted += 1
+        while len(self._pending) > self._max_pending:
+            self._finish_oldest()
+
+    def after_writes(self, fn, *args):
+        if not self._executor \
+           or (not self._deferred and self._finished == self._submitted):
+            fn(*args)
+            return
+        self._deferred.append((self._submitted, fn, args))
+
+    def _finish_oldest(self):
+        self._pending.popleft().result()
+        self._finished += 1
+        while self._deferred and self._deferred[0][0] <= self._finished:
+            _, fn, args = self._deferred.popleft()
+            fn(*args)
+
+    def finish(self):
+        while self._pending:
+            self._finish_oldest()
+        while self._deferred:
+            _, fn, args = self._deferred.popleft()
+            fn(*args)
+
+
+def file_chunks(repo, item):
+    """Yield (offset, oid) for each of the blobs in the regular file
+    item."""
+    if not isinstance(item, vfs.Chunky):
+        yield 0, item.oid
+        return
+    def chunks(oid, base):
+        _, obj_t, _, it = vfs.get_oidx(repo, hexlify(oid))
+        assert obj_t == b'tree'
+        # name is the chunk's hex offset in the original file
+        for mode, name, ent_oid in git.tree_entries(b''.join(it)):
+            if S_ISDIR(mode):
+                yield from chunks(ent_oid, base + int(name, 16))
+            else:
+                yield base + int(name, 16), ent_oid
+    yield from chunks(item.oid, 0)
+
+
+class PackOrderedWriter:
+    """Write file contents by reading the blobs for a batch of (at
+    most max_chunks) chunks in the order they're stored in the (local)
+    repository's packs, and writing each one to its offset in its
+    file, so that the packs are read sequentially.  A large file's
+    chunks may span batches.  Each file's metadata is applied after
+    the batch that finishes it, followed by any after_writes() calls
+    made before the next file, in order.  Paths must be absolute.
+
+    """
+    concurrent = True
+    _max_open = 128
+
+    def __init__(self, repo, *, max_chunks=256 * 1024):
+        self._repo = repo
+        self._reader = git.ObjectReader(repo.repo_dir)
+        self._max_chunks = max_chunks
+        # file index -> (path, item, sparse, numeric_ids, owner_map)
+        self._files = {}
+        self._next_file = 0
+        self._truncated = set() # file indexes
+        self._chunks = [] # (location, offset, file index, oid)
+        self._deferred = deque() # (file count, fn, args)
+
+    def __enter__(self): return self
+
+    def __exit__(self, type, value, traceback):
+        self._reader.close()
+
+    def write_file(self, repo, path, item, sparse, numeric_ids, owner_map):
+        assert repo is self._repo
+        i = self._next_file
+        self._next_file += 1
+        self._files[i] = path, item, sparse, numeric_ids, owner_map
+        for ofs, oid in file_chunks(repo, item):
+            # Anything that's not in a pack (e.g. from an alternate)
+            # sorts first, and is read via the repo.
+            self._chunks.append((self._reader.locate(oid) or (b'', 0),
+                                 ofs, i, oid))
+            if len(self._chunks) >= self._max_chunks:
+                self._flush(i)
+
+    def after_writes(self, fn, *args):
+        if not self._files:
+            fn(*args)
+            return
+        self._deferred.append((self._next_file, fn, args))
+
+    def _flush(self, done):
+        """Write the pending chunks, and then finish the files before
+        file index done, i.e. all but any file still being added."""
+        chunks, self._chunks = self._chunks, []
+        chunks.sort(key=lambda x: x[0])
+        fds = OrderedDict() # file index -> fd
+        try:
+            for loc, ofs, i, oid in chunks:
+                fd = fds.get(i)
+                if fd is not None:
+                    fds.move_to_end(i)
+                else:
+                    if len(fds) >= self._max_open:
+                        os.close(fds.popitem(last=False)[1])
+                    path, item = self._files[i][:2]
+                    fd = os.open(path, os.O_WRONLY)
+                    fds[i] = fd
+                    if i not in self._truncated:
+                        os.ftruncate(fd, item.meta.size)
+                        self._truncated.add(i)
+                if loc[0]:
+                    obj_t, data = self._reader.read_at(loc)
+                else:
+                    _, obj_t, _, it = vfs.get_oidx(self._repo, hexlify(oid))
+                    data = b''.join(it)
+                assert obj_t == b'blob'
+                if self._files[i][2]: # sparse
+                    os.lseek(fd, ofs, os.SEEK_SET)
+                    # Any trailing zeros are covered by the ftruncate
+                    write_sparsely(fd, data, 512, 0)
+                else:
+                    os.pwrite(fd, data, ofs)
+        finally:
+            for fd in fds.values():
+                os.close(fd)
+        for i in sorted(i for i in self._files if i < done):
+            path, item, _, numeric_ids, owner_map = self._files.pop(i)
+            self._truncated.discard(i)
+            apply_metadata(item.meta, path, numeric_ids, owner_map)
+        while self._deferred and self._deferred[0][0] <= done:
+            _, fn, args = self._deferred.popleft()
+            fn(*args)
+
+    def finish(self):
+        self._flush(self._next_file)
+
+
 def restore(repo, parent_path, name, item, top, sparse, numeric_ids, owner_map,
-            exclude_rxs, verbosity, hardlinks):
+            exclude_rxs, verbosity, hardlinks, writer):
     global total_restored
     mode = vfs.item_mode(item)
     treeish = S_ISDIR(mode)
@@ -195,9 +382,12 @@ def restore(repo, parent_path, name, item, top, sparse, numeric_ids, owner_map,
             for sub_name, sub_item in sub_items:
                 restore(repo, fullname, sub_name, sub_item, top, sparse,
                         numeric_ids, owner_map, exclude_rxs, verbosity,
-                        hardlinks)
+                        hardlinks, writer)
             os.chdir(b'..')
-            apply_metadata(meta, name, numeric_ids, owner_map)
+            # After the contents, since that may make the dir read-only, etc.
+            writer.after_writes(apply_metadata, meta,
+                                top + fullname if writer.concurrent else name,
+                                numeric_ids, owner_map)
         else:
             created_hardlink = False
             if meta.hardlink_target:
@@ -205,16 +395,17 @@ def restore(repo, parent_path, name, item, top, sparse, numeric_ids, owner_map,
                                                         hardlinks)
             if not created_hardlink:
                 meta.create_path(name)
-                if stat.S_ISREG(meta.mode):
-                    if sparse:
-                        write_file_content_sparsely(repo, name, item)
-                    else:
-                        write_file_content(repo, name, item)
             total_restored += 1
             if verbosity >= 0:
                 qprogress('Restoring: %d\r' % total_restored)
             if not created_hardlink:
-                apply_metadata(meta, name, numeric_ids, owner_map)
+                if stat.S_ISREG(meta.mode):
+                    writer.write_file(repo,
+                                      top + fullname if writer.concurrent
+                                      else name,
+                                      item, sparse, numeric_ids, owner_map)
+                else:
+                    apply_metadata(meta, name, numeric_ids, owner_map)
     finally:
         os.chdir(orig_cwd)
 
@@ -232,6 +423,12 @@ def main(argv):
 
     exclude_rxs = parse_rx_excludes(flags, o.fatal)
 
+    if opt.jobs is not None and (not isinstance(opt.jobs, int)
+                                 or opt.jobs < 1):
+        o.fatal('--jobs must be a positive integer')
+    if opt.pack_order and opt.jobs:
+        o.fatal('--pack-order is incompatible with --jobs')
+
     owner_map = {}
     for map_type in ('user', 'group', 'uid', 'gid'):
         owner_map[map_type] = parse_owner_mappings(map_type, flags, o.fatal)
@@ -240,7 +437,15 @@ def main(argv):
         mkdirp(opt.outdir)
         os.chdir(opt.outdir)
 
-    with repo_for_location(loc) as src:
+    def content_writer(repo):
+        if opt.pack_order:
+            if repo.is_remote():
+                o.fatal('--pack-order requires a local repository')
+            return PackOrderedWriter(repo)
+        return ContentWriter(1 if repo.is_remote() else
+                             opt.jobs or os.cpu_count() or 1)
+
+    with repo_for_location(loc) as src, content_writer(src) as writer:
         top = fsencode(os.getcwd())
         hardlinks = {}
         for path in [argv_bytes(x) for x in extra]:
@@ -285,16 +490,18 @@ def main(argv):
                     for sub_name, sub_item in items:
                         restore(src, b'', sub_name, sub_item, top,
                                 opt.sparse, opt.numeric_ids, owner_map,
-                                exclude_rxs, verbosity, hardlinks)
+                                exclude_rxs, verbosity, hardlinks, writer)
                     if path_name == b'.':
                         leaf_item = vfs.augment_item_meta(src, leaf_item,
                                                           include_size=True)
-                        apply_metadata(leaf_item.meta, b'.',
-                                       opt.numeric_ids, owner_map)
+                        writer.after_writes(apply_metadata, leaf_item.meta,
+                                            top if writer.concurrent else b'.',
+                                            opt.numeric_ids, owner_map)
             else:
                 restore(src, b'', leaf_name, leaf_item, top,
                         opt.sparse, opt.numeric_ids, owner_map,
-                        exclude_rxs, verbosity, hardlinks)
+                        exclude_rxs, verbosity, hardlinks, writer)
+        writer.finish()
 
     if verbosity >= 0:
         progress('Restoring: %d, done.\n' % total_restored)
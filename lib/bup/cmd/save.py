@@ -5,7 +5,7 @@ from os import O_NOFOLLOW, O_RDONLY
 import math, os, stat, sys, time
 
 from bup import hashsplit, options, index, client, metadata
-from bup import hlinkdb
+from bup import hlinkdb, lookupstats
 from bup.commit import commit_message
 from bup.compat import MAYBE_NOATIME, argv_bytes, get_argvb
 from bup.config import ConfigError
@@ -55,6 +55,8 @@ strip      strips the path to every filename given
 strip-path= path-prefix to be stripped when saving
 graft=     a graft point *old_path*=*new_path* (can be used more than once)
 #,compress=  set compression level to # (0-9, 9 is highest)
+j,jobs=    number of threads to use when compressing (default: CPU count)
+stats=     write object lookup statistics to stderr in the given format (json)
 """
 
 
@@ -105,6 +107,14 @@ def opts_from_cmdline(o, argv):
     if opt.strip and opt.strip_path:
         o.fatal("--strip is incompatible with --strip-path")
 
+    if opt.jobs is not None and (not isinstance(opt.jobs, int)
+                                 or opt.jobs < 1):
+        o.fatal('--jobs must be a positive integer')
+    opt.jobs = opt.jobs or os.cpu_count() or 1
+
+    if opt.stats and opt.stats not in lookupstats.formats:
+        o.fatal(f'unsupported --stats format {opt.stats!r}')
+
     opt.repo = main_repo_location(opt.remote, o.fatal)
     opt.sources = [argv_bytes(x) for x in extra]
 
@@ -446,14 +456,10 @@ def commit_tree(tree, parent, date, argv, repo):
                              commit_message(b'bup save', argv))
 
 
-def main(argv):
-    handle_ctrl_c()
-    opt_parser = options.Options(optspec)
-    opt = opts_from_cmdline(opt_parser, argv)
-    client.bwlimit = opt.bwlimit
-
+def save(opt_parser, opt):
     try:
-        dest = repo_for_location(opt.repo, compression_level=opt.compress)
+        dest = repo_for_location(opt.repo, compression_level=opt.compress,
+                                 jobs=opt.jobs)
     except client.ClientError as e:
         log('error: %s' % e)
         sys.exit(EXIT_FAILURE)
@@ -496,3 +502,13 @@ def main(argv):
 
         if opt.name:
             dest.update_ref(refname, commit, parent)
+
+
+def main(argv):
+    handle_ctrl_c()
+    opt_parser = options.Options(optspec)
+    opt = opts_from_cmdline(opt_parser, argv)
+    client.bwlimit = opt.bwlimit
+
+    with lookupstats.reporting(opt.stats, sys.stderr):
+        save(opt_parser, opt)
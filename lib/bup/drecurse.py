@@ -1,6 +1,8 @@
-
-from os import O_NOFOLLOW
-import stat, os
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor
+from os import O_DIRECTORY, O_NOFOLLOW
+from time import perf_counter_ns
+import stat, os, threading
 
 from bup.compat import MAYBE_LARGEFILE
 from bup.helpers \
@@ -13,35 +15,128 @@ from bup import xstat
 from bup.io import path_msg
 
 
-# the use of fchdir() and lstat() is for two reasons:
+# Every directory is opened, listed, and its entries lstat()ed
+# relative to the fd of its parent (openat(), fstatat()) for two
+# reasons:
 #  - help out the kernel by not making it repeatedly look up the absolute path
 #  - avoid race conditions caused by doing listdir() on a changing symlink
+#
+# Since that never requires changing the working directory, the
+# listing and lstat()ing of upcoming subdirectories can be handed to
+# a pool of threads (the calls release the GIL) while the caller is
+# still consuming the current one, which matters most when the
+# metadata isn't cached, or is on a network filesystem.  The results
+# are still consumed (and yielded) in the same order.
+#
+# The read ahead is bounded across the whole walk (not per level), and
+# the threads close each directory once it's been listed, reopening it
+# (relative to its parent) when the walk actually descends into it.
+# So only the directories along the current path, plus one per
+# running thread, are open at any time, however deep the tree.
+
+
+_dir_flags = os.O_RDONLY|MAYBE_LARGEFILE|O_NOFOLLOW|os.O_NDELAY
 
 
 def finalized_fd(path):
-    fd = os.open(path, os.O_RDONLY|MAYBE_LARGEFILE|O_NOFOLLOW|os.O_NDELAY)
+    fd = os.open(path, _dir_flags)
     return finalized(fd, os.close)
 
 
-def _dirlist():
-    l = []
-    for n in os.listdir(b'.'):
+# Directories with more entries than this have their lstat()s split
+# into batches of (at most) this size.  If the first batch shows that
+# the lstat()s are slow (i.e. they're round trips to a network
+# filesystem or the disk, not dentry cache hits), the rest are handed
+# to the stat pool to run concurrently, so that one huge directory
+# doesn't serialize the walk.  When they're fast, the threads would
+# mostly just contend for the GIL.
+_stat_batch_size = 512
+_slow_lstat_ns = 20000
+
+
+def _lstat_batch(fd, names, prepend):
+    result = []
+    errors = []
+    for n in names:
         try:
-            st = xstat.lstat(n)
+            st = xstat.lstat(n, dir_fd=fd)
         except OSError as e:
-            add_error(Exception('%s: %s' % (resolve_parent(n), str(e))))
+            errors.append(Exception('%s: %s' % (resolve_parent(prepend + n),
+                                                str(e))))
             continue
         if stat.S_ISDIR(st.st_mode):
             n += b'/'
-        l.append((n,st))
+        result.append((n,st))
+    return result, errors
+
+
+def _dirlist(fd, prepend, stat_pool=None):
+    """Return the reverse sorted list of (name, stat) for the entries
+    in the directory open as fd (whose path is prepend), with '/'
+    appended to the names of directories, along with a list of the
+    errors encountered.
+
+    """
+    names = [os.fsencode(n) for n in os.listdir(fd)]
+    if not stat_pool or len(names) <= _stat_batch_size:
+        l, errors = _lstat_batch(fd, names, prepend)
+    else:
+        start = perf_counter_ns()
+        l, errors = _lstat_batch(fd, names[:_stat_batch_size], prepend)
+        elapsed = perf_counter_ns() - start
+        if elapsed < _slow_lstat_ns * _stat_batch_size:
+            batch_l, batch_errors = \
+                _lstat_batch(fd, names[_stat_batch_size:], prepend)
+            l.extend(batch_l)
+            errors.extend(batch_errors)
+        else:
+            batches = [stat_pool.submit(_lstat_batch, fd,
+                                        names[i:i + _stat_batch_size],
+                                        prepend)
+                       for i in range(_stat_batch_size, len(names),
+                                      _stat_batch_size)]
+            for batch in batches:
+                batch_l, batch_errors = batch.result()
+                l.extend(batch_l)
+                errors.extend(batch_errors)
     l.sort(reverse=True)
-    return l
+    return l, errors
 
-def _recursive_dirlist(prepend, xdev, bup_dir=None,
-                       excluded_paths=None,
-                       exclude_rxs=None,
-                       xdev_exceptions=frozenset()):
-    for (name,pst) in _dirlist():
+
+def _open_subdir(parent_fd, name):
+    return os.open(name[:-1], _dir_flags|O_DIRECTORY, dir_fd=parent_fd)
+
+
+def _read_subdir(parent_fd, name, prepend, stat_pool):
+    """Open, list, and close the subdirectory name (ending in '/') of
+    the directory open as parent_fd (whose path is prepend).  Return
+    ((st_dev, st_ino), listing, errors), or None if that fails, in
+    which case the walker will retry (and report the failure) when it
+    descends into the directory.  Runs in the walker's threads, so it
+    mustn't call add_error() itself.
+
+    """
+    try:
+        fd = _open_subdir(parent_fd, name)
+    except OSError:
+        return None
+    try:
+        st = os.fstat(fd)
+        listing, errors = _dirlist(fd, prepend + name, stat_pool)
+    except OSError:
+        return None
+    finally:
+        os.close(fd)
+    return (st.st_dev, st.st_ino), listing, errors
+
+
+def _filtered(prepend, listing, xdev, bup_dir, excluded_paths, exclude_rxs,
+              xdev_exceptions):
+    """Return the (name, path, stat, descend) for each of the listing's
+    entries that isn't excluded, where descend indicates whether the
+    walk should descend into it."""
+    entries = []
+    for (name,pst) in listing:
         path = prepend + name
         if excluded_paths:
             if os.path.normpath(path) in excluded_paths:
@@ -49,6 +144,7 @@ def _recursive_dirlist(prepend, xdev, bup_dir=None,
                 continue
         if exclude_rxs and should_rx_exclude_path(path, exclude_rxs):
             continue
+        descend = False
         if name.endswith(b'/'):
             if bup_dir is not None:
                 if os.path.normpath(path) == bup_dir:
@@ -59,59 +155,168 @@ def _recursive_dirlist(prepend, xdev, bup_dir=None,
                 debug1('Skipping contents of %r: different filesystem.\n'
                        % path_msg(path))
             else:
+                descend = True
+        entries.append((name, path, pst, descend))
+    return entries
+
+
+def _recursive_dirlist(fd, prepend, listing, xdev, bup_dir=None,
+                       excluded_paths=None,
+                       exclude_rxs=None,
+                       xdev_exceptions=frozenset(),
+                       pool=None, stat_pool=None, budget=None):
+    entries = _filtered(prepend, listing, xdev, bup_dir, excluded_paths,
+                        exclude_rxs, xdev_exceptions)
+
+    # Read the subdirectories ahead of the one we're descending into,
+    # as long as the walk's budget (shared with the levels above and
+    # below) allows.
+    subdirs = iter([name for name, path_, pst_, descend in entries if descend])
+    pending = deque()
+    def read_ahead():
+        while budget.acquire(blocking=False):
+            name = next(subdirs, None)
+            if name is None:
+                budget.release()
+                return
+            pending.append(pool.submit(_read_subdir, fd, name, prepend,
+                                       stat_pool))
+
+    try:
+        for name, path, pst, descend in entries:
+            if descend:
+                ahead = None
+                if pool:
+                    read_ahead()
+                    if pending:
+                        ahead = pending.popleft().result()
+                        budget.release()
+                    else:
+                        next(subdirs)
                 try:
-                    with finalized_fd(name) as fd:
-                        os.fchdir(fd)
+                    sub_fd = _open_subdir(fd, name)
                 except OSError as e:
                     add_error('%s: %s' % (prepend, e))
-                else:
-                    yield from _recursive_dirlist(prepend=prepend+name, xdev=xdev,
-                                                  bup_dir=bup_dir,
-                                                  excluded_paths=excluded_paths,
-                                                  exclude_rxs=exclude_rxs,
-                                                  xdev_exceptions=xdev_exceptions)
-                    os.chdir(b'..')
-        yield (path, pst)
+                    sub_fd = None
+                if sub_fd is not None:
+                    try:
+                        try:
+                            if ahead:
+                                sub_st = os.fstat(sub_fd)
+                                if ahead[0] != (sub_st.st_dev, sub_st.st_ino):
+                                    ahead = None # replaced since it was read
+                            if ahead:
+                                sub_listing, errors = ahead[1:]
+                            else:
+                                sub_listing, errors = \
+                                    _dirlist(sub_fd, path, stat_pool)
+                        except OSError as e:
+                            add_error('%s: %s' % (prepend, e))
+                            sub_listing, errors = [], []
+                        for e in errors:
+                            add_error(e)
+                        yield from _recursive_dirlist(sub_fd, path, sub_listing,
+                                                      xdev=xdev,
+                                                      bup_dir=bup_dir,
+                                                      excluded_paths=excluded_paths,
+                                                      exclude_rxs=exclude_rxs,
+                                                      xdev_exceptions=xdev_exceptions,
+                                                      pool=pool,
+                                                      stat_pool=stat_pool,
+                                                      budget=budget)
+                    finally:
+                        os.close(sub_fd)
+            yield (path, pst)
+    finally:
+        # Only non-empty if we're being closed early
+        for sub in pending:
+            sub.cancel()
+            budget.release()
+
+
+def dirlist(path, xdev, bup_dir=None,
+            excluded_paths=None,
+            exclude_rxs=None,
+            xdev_exceptions=frozenset()):
+    """Return the (path, stat, descend) for each of the entries in the
+    directory path (ending in '/') that recursive_dirlist() would
+    yield, in the same order, where descend indicates whether it
+    would descend into the entry.  Unlike recursive_dirlist(), xdev
+    is the device to stay within, or None.
+
+    """
+    with finalized_fd(path) as fd:
+        listing, errors = _dirlist(fd, path)
+    for e in errors:
+        add_error(e)
+    return [(p, pst, descend)
+            for name_, p, pst, descend
+            in _filtered(path, listing, xdev, bup_dir, excluded_paths,
+                         exclude_rxs, xdev_exceptions)]
 
 
 def recursive_dirlist(paths, xdev, bup_dir=None,
                       excluded_paths=None,
                       exclude_rxs=None,
-                      xdev_exceptions=frozenset()):
-    with finalized_fd(b'.') as startdir:
-        try:
-            assert not isinstance(paths, str)
-            for path in paths:
-                try:
-                    pst = xstat.lstat(path)
-                    if stat.S_ISLNK(pst.st_mode):
-                        yield (path, pst)
-                        continue
-                except OSError as e:
-                    add_error('recursive_dirlist: %s' % e)
-                    continue
-                try:
-                    opened_pfile = finalized_fd(path)
-                except OSError as e:
-                    add_error(e)
+                      xdev_exceptions=frozenset(),
+                      threads=1):
+    """Yield (path, stat) for each of the paths and (recursively)
+    everything beneath them, in reverse sorted order (within each
+    directory), with each directory after its contents.  Read up to
+    threads directories concurrently.
+
+    """
+    assert not isinstance(paths, str)
+    pool = stat_pool = budget = None
+    if threads > 1:
+        # The directory readers wait on the stat batches, so they need
+        # their own pool.
+        pool = ThreadPoolExecutor(max_workers=threads)
+        stat_pool = ThreadPoolExecutor(max_workers=threads)
+        budget = threading.BoundedSemaphore(threads)
+    try:
+        for path in paths:
+            try:
+                pst = xstat.lstat(path)
+                if stat.S_ISLNK(pst.st_mode):
+                    yield (path, pst)
                     continue
-                with opened_pfile as pfile:
-                    pst = xstat.fstat(pfile)
-                    if xdev:
-                        xdev = pst.st_dev
-                    else:
-                        xdev = None
-                    if stat.S_ISDIR(pst.st_mode):
-                        os.fchdir(pfile)
-                        prepend = os.path.join(path, b'')
-                        yield from _recursive_dirlist(prepend=prepend, xdev=xdev,
-                                                      bup_dir=bup_dir,
-                                                      excluded_paths=excluded_paths,
-                                                      exclude_rxs=exclude_rxs,
-                                                      xdev_exceptions=xdev_exceptions)
-                        os.fchdir(startdir)
-                    else:
-                        prepend = path
-                yield (prepend,pst)
-        finally:
-            os.fchdir(startdir)
+            except OSError as e:
+                add_error('recursive_dirlist: %s' % e)
+                continue
+            try:
+                opened_pfile = finalized_fd(path)
+            except OSError as e:
+                add_error(e)
+                continue
+            with opened_pfile as pfile:
+                pst = xstat.fstat(pfile)
+                if xdev:
+                    xdev = pst.st_dev
+                else:
+                    xdev = None
+                if stat.S_ISDIR(pst.st_mode):
+                    prepend = os.path.join(path, b'')
+                    try:
+                        listing, errors = _dirlist(pfile, prepend, stat_pool)
+                    except OSError as e:
+                        add_error('%s: %s' % (path, e))
+                        listing, errors = [], []
+                    for e in errors:
+                        add_error(e)
+                    yield from _recursive_dirlist(pfile, prepend, listing,
+                                                  xdev=xdev,
+                                                  bup_dir=bup_dir,
+                                                  excluded_paths=excluded_paths,
+                                                  exclude_rxs=exclude_rxs,
+                                                  xdev_exceptions=xdev_exceptions,
+                                                  pool=pool,
+                                                  stat_pool=stat_pool,
+                                                  budget=budget)
+                else:
+                    prepend = path
+            yield (prepend,pst)
+    finally:
+        if pool:
+            pool.shutdown()
+            stat_pool.shutdown()
@@ -0,0 +1,461 @@
+"""Filesystem change journal for bup index --watch and --journal.
+
+A watcher (bup index --watch PATH...) asks the kernel (via fanotify
+when possible, otherwise inotify) to report the changes beneath the
+paths, and appends the directories whose entries changed to a
+journal.  bup index --journal can then update just those parts of the
+index instead of walking everything.
+
+The journal lives in a directory next to the index (e.g.
+BUP_DIR/bupindex.journal) containing:
+
+  watcher    -- flock()ed exclusively by the watcher as long as it's
+                running, and once all of its watches are in place,
+                containing its (random) id and NUL separated roots
+  lock       -- flock()ed while appending to or rotating current
+  current    -- the records the watcher is appending to
+  pending-N  -- records rotated out of current by bup index, removed
+                once they've been applied
+  state      -- the id of the watcher the index is in sync with,
+                i.e. the one that was running (and watching) when
+                the index last walked all of the watcher's roots
+  sync-TOKEN -- created by the watcher once it has written all of
+                the records for the changes made before bup index
+                created the corresponding sentinel (see sync())
+
+Each record is terminated by a NUL and starts with a type byte: 'd'
+followed by a directory path (ending in '/') means the directory's
+entries may have changed, 'r' followed by a directory path means the
+whole tree beneath it must be rescanned (it was created or moved in),
+and 'o' means events were lost.
+
+"""
+
+from binascii import hexlify
+from contextlib import contextmanager
+from time import monotonic, sleep
+import errno, fcntl, os, select, struct
+
+from bup import _helpers
+from bup.helpers import atomically_replaced_file, log, mkdirp, slashappend
+from bup.io import path_msg
+
+
+class Error(Exception):
+    pass
+
+
+# How long the watcher accumulates (and dedups) records before
+# appending them to the journal.
+_flush_interval = 1.0
+
+# Files created (and removed) in the watched roots by sync().
+_sync_prefix = b'.bup-journal-sync-'
+
+# How long sync() waits for the watcher to respond.
+_sync_timeout = 10.0
+
+
+def parent_dir(path):
+    """Return the parent of path (ending in '/'), which must be a
+    directory path (ending in '/')."""
+    assert path.endswith(b'/'), path
+    parent = os.path.dirname(path[:-1])
+    return slashappend(parent) if parent else b'/'
+
+
+class Watcher:
+    def __init__(self, id, roots):
+        self.id = id
+        self.roots = roots
+
+    def covers(self, path):
+        return any(path.startswith(r) for r in self.roots)
+
+
+class Journal:
+    def __init__(self, path):
+        self.path = path
+        self.current_path = os.path.join(path, b'current')
+        self.lock_path = os.path.join(path, b'lock')
+        self.watcher_path = os.path.join(path, b'watcher')
+        self.state_path = os.path.join(path, b'state')
+
+    @contextmanager
+    def _locked(self):
+        fd = os.open(self.lock_path, os.O_RDWR|os.O_CREAT|os.O_CLOEXEC, 0o600)
+        try:
+            fcntl.flock(fd, fcntl.LOCK_EX)
+            yield
+        finally:
+            os.close(fd)
+
+    def watcher(self):
+        """Return the Watcher that's currently running, or None if
+        there isn't one, or it hasn't finished adding its watches."""
+        try:
+            f = open(self.watcher_path, 'rb')
+        except FileNotFoundError:
+            return None
+        with f:
+            try:
+                fcntl.flock(f.fileno(), fcntl.LOCK_SH|fcntl.LOCK_NB)
+                return None  # nobody's holding it
+            except BlockingIOError:
+                pass
+            data = f.read()
+        if b'\n' not in data:
+            return None
+        wid, roots = data.split(b'\n', 1)
+        return Watcher(wid, [r for r in roots.split(b'\0') if r])
+
+    def sync(self, watcher):
+        """Wait until the watcher has appended the records for every
+        change made before the call to the current file, and return
+        true, or return false if that's not possible, or the watcher
+        doesn't respond within _sync_timeout.  Since the kernel queues
+        events in order, it's enough to create a sentinel in each of
+        the watcher's roots and wait for the watcher to report (via a
+        sync-TOKEN file) that it has flushed everything up to the
+        sentinel's creation."""
+        token = hexlify(os.urandom(8))
+        acks = []
+        try:
+            for i, root in enumerate(watcher.roots):
+                root_token = token + b'-%d' % i
+                sentinel = root + _sync_prefix + root_token
+                acks.append(os.path.join(self.path, b'sync-' + root_token))
+                try:
+                    fd = os.open(sentinel,
+                                 os.O_WRONLY|os.O_CREAT|os.O_EXCL|os.O_CLOEXEC,
+                                 0o600)
+                    os.close(fd)
+                    os.unlink(sentinel)
+                except OSError as ex:
+                    log('bup: unable to create journal sentinel %s: %s\n'
+                        % (path_msg(sentinel), ex))
+                    return False
+            deadline = monotonic() + _sync_timeout
+            while not all(os.path.exists(ack) for ack in acks):
+                if monotonic() >= deadline:
+                    return False
+                sleep(0.01)
+            return True
+        finally:
+            for ack in acks:
+                try:
+                    os.unlink(ack)
+                except FileNotFoundError:
+                    pass
+
+    def _ack_sync(self, token):
+        fd = os.open(os.path.join(self.path, b'sync-' + token),
+                     os.O_WRONLY|os.O_CREAT|os.O_CLOEXEC, 0o600)
+        os.close(fd)
+
+    def state(self):
+        """Return the id of the watcher the index is in sync with, or
+        None."""
+        try:
+            with open(self.state_path, 'rb') as f:
+                return f.read().strip() or None
+        except FileNotFoundError:
+            return None
+
+    def _pending(self):
+        result = []
+        for name in os.listdir(self.path):
+            if name.startswith(b'pending-'):
+                n = name[len(b'pending-'):]
+                if n.isdigit():
+                    result.append((int(n), os.path.join(self.path, name)))
+        result.sort()
+        return result
+
+    def _next_pending_path(self):
+        pending = self._pending()
+        n = pending[-1][0] + 1 if pending else 1
+        return os.path.join(self.path, b'pending-%d' % n)
+
+    def rotate(self):
+        """Move the current records aside, so that the watcher will
+        start a new file, and return the paths of all of the pending
+        record files (oldest first)."""
+        if not os.path.isdir(self.path):
+            return []
+        with self._locked():
+            if os.path.exists(self.current_path):
+                os.rename(self.current_path, self._next_pending_path())
+        return [path for n_, path in self._pending()]
+
+    def read(self, pending):
+        """Return the set of records in the pending files."""
+        records = set()
+        for path in pending:
+            with open(path, 'rb') as f:
+                data = f.read()
+            # A partial final record can only be the result of a crash
+            records.update(data.split(b'\0')[:-1])
+        records.discard(b'')
+        return records
+
+    def finish(self, pending, leftovers, state):
+        """Replace the pending files with a single file containing the
+        leftovers (if any), and record that the index is in sync with
+        the watcher whose id is state (unless state is None)."""
+        if not os.path.isdir(self.path):
+            return
+        if leftovers:
+            with atomically_replaced_file(self._next_pending_path(), 'wb') as f:
+                f.write(b''.join(r + b'\0' for r in sorted(leftovers)))
+                f.flush()
+                os.fsync(f.fileno())
+        for path in pending:
+            os.unlink(path)
+        if state is not None:
+            with atomically_replaced_file(self.state_path, 'wb') as f:
+                f.write(state + b'\n')
+                f.flush()
+                os.fsync(f.fileno())
+
+
+class _Recorder:
+    """Accumulates records and appends them to the journal's current
+    file, following its rotation."""
+    def __init__(self, journal):
+        self.journal = journal
+        self.fd = None
+        self.records = set()
+
+    def flush(self):
+        if not self.records:
+            return
+        data = memoryview(b''.join(r + b'\0' for r in sorted(self.records)))
+        jnl = self.journal
+        with jnl._locked():
+            if self.fd is not None:
+                try:
+                    rotated = os.stat(jnl.current_path).st_ino \
+                        != os.fstat(self.fd).st_ino
+                except FileNotFoundError:
+                    rotated = True
+                if rotated:
+                    os.close(self.fd)
+                    self.fd = None
+            if self.fd is None:
+                self.fd = os.open(jnl.current_path,
+                                  os.O_WRONLY|os.O_APPEND|os.O_CREAT|os.O_CLOEXEC,
+                                  0o600)
+            while data:
+                data = data[os.write(self.fd, data):]
+        self.records.clear()
+
+
+class _InotifySource:
+    """Watches every directory beneath the roots individually."""
+    name = 'inotify'
+
+    def __init__(self, roots, ignored):
+        self.roots = roots
+        self.ignored = ignored
+        self.mask = (_helpers.IN_ATTRIB | _helpers.IN_CLOSE_WRITE
+                     | _helpers.IN_CREATE | _helpers.IN_DELETE
+                     | _helpers.IN_MODIFY | _helpers.IN_MOVED_FROM
+                     | _helpers.IN_MOVED_TO | _helpers.IN_DONT_FOLLOW
+                     | _helpers.IN_ONLYDIR)
+        self.fd = _helpers.inotify_init()
+        self.dirs = {}
+        for root in roots:
+            self._watch_tree(root)
+
+    def _watch_tree(self, top):
+        # Adding a watch to an already watched directory returns its
+        # existing descriptor, so this also updates the paths of moved
+        # trees.
+        todo = [top]
+        while todo:
+            path = todo.pop()
+            if path.startswith(self.ignored):
+                continue
+            try:
+                wd = _helpers.inotify_add_watch(self.fd, path, self.mask)
+                self.dirs[wd] = path
+                with os.scandir(path) as entries:
+                    for ent in entries:
+                        if ent.is_dir(follow_symlinks=False):
+                            todo.append(ent.path + b'/')
+            except OSError as ex:
+                # Already gone (or replaced); the parent will report it
+                if ex.errno not in (errno.ENOENT, errno.ENOTDIR):
+                    raise
+
+    def read(self):
+        records = []
+        data = os.read(self.fd, 64 * 1024)
+        hdr_len = struct.calcsize('iIII')
+        ofs = 0
+        while ofs + hdr_len <= len(data):
+            wd, mask, cookie_, name_len = struct.unpack_from('iIII', data, ofs)
+            name = data[ofs + hdr_len : ofs + hdr_len + name_len].rstrip(b'\0')
+            ofs += hdr_len + name_len
+            if mask & _helpers.IN_Q_OVERFLOW:
+                records.append(b'o')
+                continue
+            if mask & _helpers.IN_IGNORED:
+                self.dirs.pop(wd, None)
+                continue
+            path = self.dirs.get(wd)
+            if path is None or path.startswith(self.ignored):
+                continue
+            if name.startswith(_sync_prefix):
+                if mask & _helpers.IN_CREATE:
+                    records.append(b's' + name[len(_sync_prefix):])
+                continue
+            records.append(b'd' + path)
+            if name and mask & _helpers.IN_ISDIR \
+               and mask & (_helpers.IN_CREATE | _helpers.IN_MOVED_TO):
+                sub = path + name + b'/'
+                records.append(b'r' + sub)
+                try:
+                    self._watch_tree(sub)
+                except OSError as ex:
+                    log('bup: unable to watch %s: %s\n' % (path_msg(sub), ex))
+                    records.append(b'o')
+        return records
+
+
+class _FanotifySource:
+    """Watches the entire filesystems containing the roots, reporting
+    the parent directory and name of each change."""
+    name = 'fanotify'
+
+    def __init__(self, roots, ignored):
+        self.roots = roots
+        self.ignored = ignored
+        mask = (_helpers.FAN_ATTRIB | _helpers.FAN_CLOSE_WRITE
+                | _helpers.FAN_CREATE | _helpers.FAN_DELETE
+                | _helpers.FAN_MODIFY | _helpers.FAN_MOVED_FROM
+                | _helpers.FAN_MOVED_TO | _helpers.FAN_ONDIR)
+        self.fd = _helpers.fanotify_init(_helpers.FAN_CLASS_NOTIF
+                                         | _helpers.FAN_CLOEXEC
+                                         | _helpers.FAN_REPORT_DFID_NAME,
+                                         os.O_RDONLY | os.O_CLOEXEC)
+        self.mounts = {}
+        try:
+            for root in roots:
+                _helpers.fanotify_mark(self.fd,
+                                       _helpers.FAN_MARK_ADD
+                                       | _helpers.FAN_MARK_FILESYSTEM,
+                                       mask, root)
+                fsid = _helpers.fanotify_fsid(root)
+                if fsid not in self.mounts:
+                    self.mounts[fsid] = os.open(root, os.O_RDONLY
+                                                | os.O_DIRECTORY
+                                                | os.O_CLOEXEC)
+        except BaseException:
+            os.close(self.fd)
+            for fd in self.mounts.values():
+                os.close(fd)
+            raise
+
+    def _covered(self, path):
+        return any(path.startswith(r) for r in self.roots) \
+            and not path.startswith(self.ignored)
+
+    def read(self):
+        records = []
+        dirs = {}
+        for mask, fsid, handle, name in _helpers.fanotify_read(self.fd):
+            if mask & _helpers.FAN_Q_OVERFLOW:
+                records.append(b'o')
+                continue
+            mount = self.mounts.get(fsid)
+            if handle is None or mount is None:
+                continue
+            key = fsid + handle
+            path = dirs.get(key, False)
+            if path is False:
+                path = _helpers.fanotify_handle_path(mount, handle)
+                if path is not None:
+                    path = slashappend(path)
+                dirs[key] = path
+            if path is None or not self._covered(path):
+                continue
+            if name and name.startswith(_sync_prefix):
+                if mask & _helpers.FAN_CREATE:
+                    records.append(b's' + name[len(_sync_prefix):])
+                continue
+            records.append(b'd' + path)
+            if name and mask & _helpers.FAN_ONDIR \
+               and mask & (_helpers.FAN_CREATE | _helpers.FAN_MOVED_TO):
+                records.append(b'r' + path + name + b'/')
+        return records
+
+
+methods = ('auto', 'fanotify', 'inotify')
+
+
+def _source(roots, method, ignored):
+    assert method in methods, method
+    if method in ('auto', 'fanotify'):
+        if hasattr(_helpers, 'fanotify_init'):
+            try:
+                return _FanotifySource(roots, ignored)
+            except OSError as ex:
+                # e.g. EPERM without CAP_SYS_ADMIN, or a filesystem
+                # that can't produce file handles
+                if method == 'fanotify':
+                    raise Error('unable to watch via fanotify: %s' % ex)
+                log('bup: unable to watch via fanotify (%s), using inotify\n'
+                    % ex)
+        elif method == 'fanotify':
+            raise Error('fanotify is not supported on this system')
+    if not hasattr(_helpers, 'inotify_init'):
+        raise Error('filesystem watching is not supported on this system')
+    try:
+        return _InotifySource(roots, ignored)
+    except OSError as ex:
+        raise Error('unable to watch via inotify: %s' % ex)
+
+
+def watch(journal_path, roots, method='auto'):
+    """Record the changes beneath roots (resolved directory paths
+    ending in '/') in the journal at journal_path until killed."""
+    mkdirp(journal_path)
+    jnl = Journal(journal_path)
+    with open(jnl.watcher_path, 'ab') as wf:
+        try:
+            fcntl.flock(wf.fileno(), fcntl.LOCK_EX|fcntl.LOCK_NB)
+        except BlockingIOError:
+            raise Error('%s is already being watched'
+                        % path_msg(journal_path))
+        wf.truncate(0)
+        source = _source(roots, method,
+                         slashappend(os.path.realpath(journal_path)))
+        # Only advertise the watcher once everything's being watched.
+        wf.write(hexlify(os.urandom(16)) + b'\n' + b'\0'.join(roots))
+        wf.flush()
+        log('bup: watching %d path(s) via %s\n' % (len(roots), source.name))
+        recorder = _Recorder(jnl)
+        deadline = None
+        while True:
+            timeout = None if deadline is None \
+                else max(0, deadline - monotonic())
+            if select.select([source.fd], [], [], timeout)[0]:
+                syncs = []
+                for rec in source.read():
+                    if rec[:1] == b's':
+                        syncs.append(rec[1:])
+                    else:
+                        recorder.records.add(rec)
+                if syncs:
+                    # Everything before the sentinels has been read
+                    recorder.flush()
+                    deadline = None
+                    for token in syncs:
+                        jnl._ack_sync(token)
+                if deadline is None and recorder.records:
+                    deadline = monotonic() + _flush_interval
+            if deadline is not None and monotonic() >= deadline:
+                recorder.flush()
+                deadline = None
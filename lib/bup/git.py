@@ -3,20 +3,25 @@ bup repositories are in Git format. This library allows us to
 interact with the Git data structures.
 """
 
-import os, sys, zlib, subprocess, struct, stat, re, glob
+import os, sys, zlib, subprocess, struct, stat, re, glob, threading
 from array import array
 from binascii import hexlify, unhexlify
-from contextlib import ExitStack
+from collections import OrderedDict, deque
+from concurrent.futures import ThreadPoolExecutor
+from contextlib import ExitStack, contextmanager
 from dataclasses import replace
+from functools import partial
 from itertools import islice
 from os import fsdecode
 from shutil import rmtree
 from subprocess import DEVNULL, PIPE, Popen, run
 from sys import stderr
+from time import time_ns
 from typing import Literal, Optional, Union
 
-from bup import _helpers, hashsplit, midx, bloom, xstat
+from bup import _helpers, hashsplit, lookupstats, midx, bloom, oidhash, xstat
 from bup.commit import create_commit_blob, parse_commit
+from bup.config import ConfigError
 from bup.compat import dataclass_frozen_for_testing, environ
 from bup.helpers import (EXIT_FAILURE,
                          OBJECT_EXISTS,
@@ -220,30 +225,12 @@ def shalist_item_sort_key(ent):
 
 def tree_encode(shalist):
     """Generate a git tree object from (mode,name,hash) tuples."""
-    shalist = sorted(shalist, key = shalist_item_sort_key)
-    l = []
-    for (mode,name,bin) in shalist:
-        assert(mode)
-        assert(mode+0 == mode)
-        assert(name)
-        assert(len(bin) == 20)
-        s = b'%o %s\0%s' % (mode,name,bin)
-        assert not s.startswith(b'0'), 'git trees do not allow 0-padded octal'
-        l.append(s)
-    return b''.join(l)
+    return _helpers.tree_encode(shalist)
 
 
 def tree_iter(tree_data):
     """Yield (mode, name, hash) for each entry in the git tree_data."""
-    ofs = 0
-    while ofs < len(tree_data):
-        z = tree_data.find(b'\0', ofs)
-        assert z > ofs
-        mode_end = tree_data.find(b' ', ofs)
-        name = tree_data[mode_end+1:z]
-        mode = tree_data[ofs:mode_end]
-        ofs = z + 21
-        yield int(mode, 8), name, tree_data[z+1:z+1+20]
+    return iter(_helpers.TreeEntries(tree_data))
 
 
 def tree_entries(tree_data):
@@ -251,18 +238,7 @@ def tree_entries(tree_data):
     tree_data.
 
     """
-    result = []
-    ofs = 0
-    while ofs < len(tree_data):
-        z = tree_data.find(b'\0', ofs)
-        assert z > ofs
-        mode_end = tree_data.find(b' ', ofs)
-        name = tree_data[mode_end+1:z]
-        mode = tree_data[ofs:mode_end]
-        ent = int(mode, 8), name, tree_data[z+1:z+1+20]
-        result.append(ent)
-        ofs = z + 21
-    return result
+    return list(_helpers.TreeEntries(tree_data))
 
 
 def find_tree_entry(named, tree_data):
@@ -292,22 +268,7 @@ def find_tree_entry(named, tree_data):
 
 
 def last_tree_entry(tree_data):
-    oid_start = len(tree_data) - 20
-    oid = tree_data[oid_start:]
-    last_ent = 0
-    z = 0
-    while True:
-        z = tree_data.find(b'\0', z)
-        if z == -1:
-            break
-        z += 21
-        if z < len(tree_data):
-            last_ent = z
-    mode_end = tree_data.find(b' ', last_ent)
-    assert mode_end > 0
-    mode = tree_data[last_ent:mode_end]
-    name = tree_data[mode_end+1:oid_start-1]
-    return int(mode, 8), name, oid
+    return _helpers.TreeEntries(tree_data)[-1]
 
 
 def _encode_packobj(type, content, compression_level=1):
@@ -444,6 +405,10 @@ class PackIdxV1(PackIdx):
         for ofs in range(start, start + 24 * self.nsha, 24):
             yield self.map[ofs : ofs + 20]
 
+    def oid_table(self):
+        """Return (buffer, stride) for the sorted oids (see idxmerge())."""
+        return self.shatable[4:], 24
+
     def oid_offsets_and_idxs(self):
         end = self.sha_ofs + self.nsha * 24
         for i, ofs in enumerate(range(self.sha_ofs, end, 24)):
@@ -513,6 +478,10 @@ class PackIdxV2(PackIdx):
         for ofs in range(start, start + 20 * self.nsha, 20):
             yield self.map[ofs : ofs + 20]
 
+    def oid_table(self):
+        """Return (buffer, stride) for the sorted oids (see idxmerge())."""
+        return self.shatable, 20
+
     def close(self):
         self.closed = True
         if self.map is not None:
@@ -529,20 +498,399 @@ class PackIdxV2(PackIdx):
         assert self.closed
 
 
-_mpi_count = 0
+class _SharedMaps:
+    """Process-wide, reference counted table of the open idx, midx,
+    and bloom maps, so that every PackIdxSnapshot that includes the
+    same (unchanged) file shares a single mapping of it.  Files are
+    identified by path, device, inode, size, and mtime, so a
+    replaced or rewritten file is opened afresh.
+
+    """
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._maps = {} # key -> [map, refcount]
+        self._keys = {} # id(map) -> key
+
+    def acquire(self, path, open_map):
+        """Return a new reference to the shared map for path, calling
+        open_map(path) to create it if needed.  Return None if
+        open_map returns None.
+
+        """
+        st = xstat.stat(path)
+        key = (path, st.st_dev, st.st_ino, st.st_size, st.st_mtime_ns)
+        with self._lock:
+            entry = self._maps.get(key)
+            if entry:
+                entry[1] += 1
+                return entry[0]
+        # Open without the lock; if we race with another thread,
+        # keep whichever map was registered first.
+        new = open_map(path)
+        if new is None:
+            return None
+        with self._lock:
+            entry = self._maps.get(key)
+            if not entry:
+                self._maps[key] = [new, 1]
+                self._keys[id(new)] = key
+                return new
+            entry[1] += 1
+        new.close()
+        return entry[0]
+
+    def add_ref(self, ix):
+        with self._lock:
+            self._maps[self._keys[id(ix)]][1] += 1
+
+    def release(self, ix):
+        with self._lock:
+            key = self._keys[id(ix)]
+            entry = self._maps[key]
+            entry[1] -= 1
+            if entry[1]:
+                return
+            del self._maps[key]
+            del self._keys[id(ix)]
+        ix.close()
+
+_shared_maps = _SharedMaps()
+
+
+def index_map_configuration(config_get):
+    """Return the PackIdxList keyword arguments (prefault and
+    hugepages) requested by the bup.maps.* settings provided by
+    config_get."""
+    prefault = config_get(b'bup.maps.prefault')
+    if prefault in (None, b'none'):
+        prefault = None
+    elif prefault in (b'willneed', b'populate'):
+        prefault = prefault.decode('ascii')
+    else:
+        raise ConfigError(f'invalid bup.maps.prefault setting {prefault!r}')
+    hugepages = config_get(b'bup.maps.hugepages', opttype='bool')
+    if prefault == 'populate' and hugepages:
+        raise ConfigError('bup.maps.prefault populate is incompatible'
+                          ' with bup.maps.hugepages')
+    return {'prefault': prefault, 'hugepages': bool(hugepages)}
+
+
+class PackIdxSnapshot:
+    """An immutable, reference counted set of the idx, midx, and bloom
+    maps for a pack directory.  It may be queried by any number of
+    threads at once.  The creator owns the first reference; call
+    acquire() for each additional holder, and release() (or exit
+    the context) when done.
+
+    """
+    def __init__(self, dir, packs, bloom, *, oid_hash=None, map_advice=None):
+        """Takes ownership of a _shared_maps reference to each of the
+        packs, the bloom, and the oid_hash.  Any map_advice (see
+        index_map_configuration()) is applied to the midx, bloom, and
+        oid hash maps opened by refreshed().
+
+        """
+        self.dir = dir
+        self.packs = tuple(packs)
+        self.bloom = bloom
+        self.oid_hash = oid_hash
+        self.map_advice = map_advice or {}
+        # The packs with content the oid_hash doesn't cover.
+        if oid_hash:
+            covered = frozenset(oid_hash.idxnames)
+            self.hash_rest = tuple(p for p in self.packs
+                                   if any(os.path.basename(n) not in covered
+                                          for n in p.idxnames))
+        else:
+            self.hash_rest = self.packs
+        self._refs = 1
+        self._lock = threading.Lock()
+
+    def acquire(self):
+        with self._lock:
+            assert self._refs > 0
+            self._refs += 1
+        return self
+
+    def release(self):
+        with self._lock:
+            assert self._refs > 0
+            self._refs -= 1
+            if self._refs:
+                return
+        with ExitStack() as contexts:
+            for pack in self.packs:
+                contexts.callback(_shared_maps.release, pack)
+            if self.bloom:
+                contexts.callback(_shared_maps.release, self.bloom)
+            if self.oid_hash:
+                contexts.callback(_shared_maps.release, self.oid_hash)
+
+    def __enter__(self): return self
+    def __exit__(self, type, value, traceback): self.release()
+
+    def __iter__(self):
+        return iter(idxmerge(self.packs))
+
+    def __len__(self):
+        return sum(len(pack) for pack in self.packs)
+
+    def exists(self, hash, want_source=False, want_offset=False):
+        """Return an ObjectLocation if the object exists in this
+           snapshot, otherwise None."""
+        if lookupstats.enabled:
+            return lookupstats.timed(self._exists, hash, want_source,
+                                     want_offset)
+        return self._exists(hash, want_source, want_offset)
+
+    def _exists(self, hash, want_source, want_offset):
+        if self.oid_hash:
+            return _oid_hash_find(self.dir, self.oid_hash, self.hash_rest,
+                                  hash, want_source, want_offset)
+        if self.bloom and not self.bloom.exists(hash):
+            if lookupstats.enabled:
+                lookupstats.count('bloom.negatives')
+            return None
+        ret = _packs_find(self.dir, self.packs, hash, want_source,
+                          want_offset)[0]
+        if self.bloom and lookupstats.enabled:
+            lookupstats.count('bloom.true_positives' if ret
+                              else 'bloom.false_positives')
+        return ret
+
+    def without_temps(self):
+        """Return a new snapshot with everything except the bloom,
+        oid hash, and midx files."""
+        packs = [p for p in self.packs if not isinstance(p, midx.PackMidx)]
+        for pack in packs:
+            _shared_maps.add_ref(pack)
+        return PackIdxSnapshot(self.dir, packs, None,
+                               map_advice=self.map_advice)
+
+    def refreshed(self, skip_midx=False):
+        """Return a new snapshot reflecting the current state of the
+        directory, sharing the maps that are still relevant.
+
+        This method verifies if .midx files were superseded (e.g. all
+        of its contents are in another, bigger .midx file) and removes
+        the superseded files.
+
+        If skip_midx is True, all work on .midx files will be skipped
+        and .midx files will be excluded from the snapshot.
+
+        """
+        with ExitStack() as contexts:
+            # Every map in "held" has a reference owned by this call,
+            # to be handed to the new snapshot or released.
+            held = []
+            def acquire(path, open_map):
+                ix = _shared_maps.acquire(path, open_map)
+                if ix is not None:
+                    held.append(ix)
+                return ix
+            def release_held():
+                for ix in held:
+                    _shared_maps.release(ix)
+            contexts.callback(release_held)
+
+            d = dict((p.name, p) for p in self.packs
+                     if not skip_midx or not isinstance(p, midx.PackMidx))
+            bloom_ix = hash_ix = None
+            if os.path.exists(self.dir):
+                if not skip_midx:
+                    midxl = []
+                    midxes = set(glob.glob(os.path.join(self.dir, b'*.midx')))
+                    # remove any *.midx files from our list that no longer exist
+                    for ix in list(d.values()):
+                        if not isinstance(ix, midx.PackMidx):
+                            continue
+                        if ix.name in midxes:
+                            continue
+                        del d[ix.name]
+                    for ix in list(d.values()):
+                        if isinstance(ix, midx.PackMidx):
+                            for name in ix.idxnames:
+                                d[os.path.join(self.dir, name)] = ix
+                    for full in midxes:
+                        if not d.get(full):
+                            mx, missing = None, None
+                            try:
+                                mx = acquire(full, partial(open_midx,
+                                                           ignore_missing=False,
+                                                           **self.map_advice))
+                            except midx.MissingIdxs as ex:
+                                missing = ex.paths
+                            except FileNotFoundError:
+                                continue
+                            if not missing:
+                                if mx: midxl.append(mx)
+                            else:
+                                mxf = os.path.split(full)[1]
+                                for n in missing:
+                                    log(('warning: index %s missing\n'
+                                         '  used by %s\n')
+                                        % (path_msg(n), path_msg(mxf)))
+                                unlink(full)
+                    midxl.sort(key=lambda ix:
+                               (-len(ix), -xstat.stat(ix.name).st_mtime))
+                    for ix in midxl:
+                        any_needed = False
+                        for sub in ix.idxnames:
+                            found = d.get(os.path.join(self.dir, sub))
+                            if not found or isinstance(found, PackIdx):
+                                # doesn't exist, or exists but not in a midx
+                                any_needed = True
+                                break
+                        if any_needed:
+                            d[ix.name] = ix
+                            for name in ix.idxnames:
+                                d[os.path.join(self.dir, name)] = ix
+                        else:
+                            debug1('midx: removing redundant: %s\n'
+                                   % path_msg(os.path.basename(ix.name)))
+                            unlink(ix.name)
+                for full in glob.glob(os.path.join(self.dir, b'*.idx')):
+                    if not d.get(full):
+                        try:
+                            ix = acquire(full, open_idx)
+                        except GitError as e:
+                            add_error(e)
+                            continue
+                        except FileNotFoundError:
+                            continue
+                        d[full] = ix
+                new_packs = set(d.values())
+                hfull = os.path.join(self.dir, b'bup.oidhash')
+                if not skip_midx and os.path.exists(hfull):
+                    try:
+                        hash_ix = acquire(hfull,
+                                          partial(oidhash.OidHash,
+                                                  **self.map_advice))
+                    except FileNotFoundError:
+                        pass
+                    # Any idx it covers that's gone (e.g. after gc)
+                    # makes it stale, and unsafe to trust.
+                    if hash_ix and not (hash_ix.valid()
+                                        and all(os.path.join(self.dir, n) in d
+                                                for n in hash_ix.idxnames)):
+                        debug1('oidhash: ignoring stale or invalid table\n')
+                        hash_ix = None
+                bfull = os.path.join(self.dir, b'bup.bloom')
+                if os.path.exists(bfull):
+                    try:
+                        bloom_ix = acquire(bfull,
+                                           partial(bloom.ShaBloom,
+                                                   **self.map_advice))
+                    except FileNotFoundError:
+                        pass
+            else:
+                new_packs = set(d.values())
+            new_packs = list(new_packs)
+            new_packs.sort(reverse=True, key=len)
+            # Take our own reference to everything we're keeping.
+            for p in new_packs:
+                _shared_maps.add_ref(p)
+            if bloom_ix:
+                if bloom_ix.valid() \
+                   and len(bloom_ix) >= sum(len(p) for p in new_packs):
+                    _shared_maps.add_ref(bloom_ix)
+                else:
+                    bloom_ix = None
+            if hash_ix:
+                _shared_maps.add_ref(hash_ix)
+            return PackIdxSnapshot(self.dir, new_packs, bloom_ix,
+                                   oid_hash=hash_ix,
+                                   map_advice=self.map_advice)
+
+
+def _note_snapshot(snapshot):
+    """Record the shape of the snapshot for lookupstats."""
+    lookupstats.note('lookups',
+                     midxes=sum(isinstance(p, midx.PackMidx)
+                                for p in snapshot.packs),
+                     idxes=sum(not isinstance(p, midx.PackMidx)
+                               for p in snapshot.packs),
+                     objects=len(snapshot))
+    b = snapshot.bloom
+    if b:
+        lookupstats.note('bloom', bits=b.bits, k=b.k, entries=len(b),
+                         expected_false_positive_rate=b.pfalse_positive())
+    h = snapshot.oid_hash
+    if h:
+        lookupstats.note('oidhash', bits=h.bits, entries=len(h),
+                         load=h.load())
+
+
+def _packs_find(dir, packs, hash, want_source, want_offset):
+    """Return (location, pack) for the first of the packs containing
+    hash, or (None, None)."""
+    global _total_searches
+    stats = lookupstats.enabled
+    for p in packs:
+        if want_offset and isinstance(p, midx.PackMidx):
+            get_src = True
+            get_ofs = False
+        else:
+            get_src = want_source
+            get_ofs = want_offset
+        _total_searches -= 1  # will be incremented by sub-pack
+        if stats:
+            kind = 'midx' if isinstance(p, midx.PackMidx) else 'idx'
+            steps = midx._total_steps + _total_steps
+        ret = p.exists(hash, want_source=get_src, want_offset=get_ofs)
+        if stats:
+            lookupstats.count(kind + '.searches')
+            lookupstats.count(kind + '.steps',
+                              midx._total_steps + _total_steps - steps)
+            if ret:
+                lookupstats.count(kind + '.hits')
+        if ret:
+            if want_offset and ret.offset is None:
+                if stats:
+                    lookupstats.count('idx.offset_fallbacks')
+                with open_idx(os.path.join(dir, ret.pack)) as np:
+                    ret = np.exists(hash, want_source=want_source,
+                                    want_offset=True)
+                assert ret
+            return ret, p
+    return None, None
+
+
+def _oid_hash_find(dir, oid_hash, rest, hash, want_source, want_offset):
+    ret = oid_hash.exists(hash, want_source=want_source,
+                          want_offset=want_offset)
+    if lookupstats.enabled:
+        lookupstats.count('oidhash.hits' if ret else 'oidhash.misses')
+    if ret:
+        return ret
+    return _packs_find(dir, rest, hash, want_source, want_offset)[0]
+
+
 class PackIdxList:
-    def __init__(self, dir, ignore_midx=False):
-        global _mpi_count
+    """A handle on the current PackIdxSnapshot for a pack directory.
+    Any number of handles may be open at once (their unchanged idx,
+    midx, and bloom maps are shared).  A handle is for use by one
+    thread at a time; other threads should query their own
+    snapshot().
+
+    The prefault and hugepages arguments are passed along when
+    mapping the midx and bloom files (see mmap_read()), but note that
+    a map that's already shared is unaffected.
+
+    """
+    def __init__(self, dir, ignore_midx=False, *, prefault=None,
+                 hugepages=False):
         self.open = False # for __del__
-        # Q: was this also intended to prevent opening multiple repos?
-        assert(_mpi_count == 0) # these things suck tons of VM; don't waste it
-        _mpi_count += 1
-        self.open = True
         self.dir = dir
         self.packs = []
         self.do_bloom = False
-        self.bloom = None
         self.ignore_midx = ignore_midx
+        self._snapshot_lock = threading.Lock()
+        self._snapshot = \
+            PackIdxSnapshot(dir, (), None,
+                            map_advice={'prefault': prefault,
+                                        'hugepages': hugepages})
+        self.open = True
         try:
             self.refresh()
         except BaseException as ex:
@@ -550,25 +898,37 @@ class PackIdxList:
             raise ex
 
     def close(self):
-        global _mpi_count
         if not self.open:
-            assert _mpi_count == 0
             return
-        _mpi_count -= 1
-        assert _mpi_count == 0
-        self.bloom, tmp_bloom = None, self.bloom
-        self.packs, tmp_packs = None, self.packs
         self.open = False
-        with ExitStack() as stack:
-            for pack in tmp_packs:
-                stack.enter_context(pack)
-            if tmp_bloom:
-                tmp_bloom.close()
+        self.packs = None
+        self._publish(None)
 
     def __enter__(self): return self
     def __exit__(self, type, value, traceback): self.close()
     def __del__(self): assert not self.open
 
+    @property
+    def bloom(self):
+        return self._snapshot.bloom if self._snapshot else None
+
+    def snapshot(self):
+        """Return a new reference to the current PackIdxSnapshot,
+        which the caller must release()."""
+        with self._snapshot_lock:
+            return self._snapshot.acquire()
+
+    def _publish(self, snapshot):
+        with self._snapshot_lock:
+            self._snapshot, prev = snapshot, self._snapshot
+        if snapshot:
+            self.packs = list(snapshot.packs)
+            self.do_bloom = bool(snapshot.bloom)
+            if lookupstats.enabled:
+                _note_snapshot(snapshot)
+        if prev:
+            prev.release()
+
     def __iter__(self):
         return iter(idxmerge(self.packs))
 
@@ -578,153 +938,64 @@ class PackIdxList:
     def exists(self, hash, want_source=False, want_offset=False):
         """Return an ObjectLocation if the object exists in this
            index, otherwise None."""
+        if lookupstats.enabled:
+            return lookupstats.timed(self._exists, hash, want_source,
+                                     want_offset)
+        return self._exists(hash, want_source, want_offset)
+
+    def _exists(self, hash, want_source, want_offset):
         global _total_searches
         _total_searches += 1
-        if self.do_bloom and self.bloom:
-            if self.bloom.exists(hash):
+        snapshot = self._snapshot
+        if snapshot.oid_hash:
+            _total_searches -= 1  # will be counted by the oid hash
+            return _oid_hash_find(self.dir, snapshot.oid_hash,
+                                  snapshot.hash_rest, hash, want_source,
+                                  want_offset)
+        bloom = snapshot.bloom
+        consulted_bloom = self.do_bloom and bloom
+        if consulted_bloom:
+            if bloom.exists(hash):
                 self.do_bloom = False
             else:
                 _total_searches -= 1  # was counted by bloom
+                if lookupstats.enabled:
+                    lookupstats.count('bloom.negatives')
                 return None
-        for i, p in enumerate(self.packs):
-            if want_offset and isinstance(p, midx.PackMidx):
-                get_src = True
-                get_ofs = False
-            else:
-                get_src = want_source
-                get_ofs = want_offset
-            _total_searches -= 1  # will be incremented by sub-pack
-            ret = p.exists(hash, want_source=get_src, want_offset=get_ofs)
-            if ret:
-                # reorder so most recently used packs are searched first
-                self.packs = [p] + self.packs[:i] + self.packs[i+1:]
-                if want_offset and ret.offset is None:
-                    with open_idx(os.path.join(self.dir, ret.pack)) as np:
-                        ret = np.exists(hash, want_source=want_source,
-                                        want_offset=True)
-                    assert ret
-                return ret
+        elif bloom and lookupstats.enabled:
+            # Skipped after the previous positive (see below)
+            lookupstats.count('bloom.bypassed')
+        ret, p = _packs_find(self.dir, self.packs, hash, want_source,
+                             want_offset)
+        if consulted_bloom and lookupstats.enabled:
+            lookupstats.count('bloom.true_positives' if ret
+                              else 'bloom.false_positives')
+        if ret:
+            # reorder so most recently used packs are searched first
+            i = self.packs.index(p)
+            self.packs = [p] + self.packs[:i] + self.packs[i+1:]
+            return ret
         self.do_bloom = True
         return None
 
     def close_temps(self):
         '''
-        Close all the temporary files (bloom/midx) so that you can safely call
-        auto_midx() without potentially deleting files that are open/mapped.
-        Note that you should call refresh() again afterwards to reload any new
-        ones, otherwise performance will suffer.
+        Drop all the temporary files (bloom/midx) from this handle so
+        that you can safely call auto_midx().  Note that you should
+        call refresh() again afterwards to reload any new ones,
+        otherwise performance will suffer.
         '''
-        if self.bloom is not None:
-            self.bloom.close()
-            self.bloom = None
-        for ix in list(self.packs):
-            if not isinstance(ix, midx.PackMidx):
-                continue
-            ix.close()
-            self.packs.remove(ix)
+        self._publish(self._snapshot.without_temps())
 
     def refresh(self, skip_midx = False):
-        """Refresh the index list.
-        This method verifies if .midx files were superseded (e.g. all of its
-        contents are in another, bigger .midx file) and removes the superseded
-        files.
-
-        If skip_midx is True, all work on .midx files will be skipped and .midx
-        files will be removed from the list.
+        """Refresh the index list, and publish the result as this
+        handle's new snapshot.  See PackIdxSnapshot.refreshed().
 
         The instance variable 'ignore_midx' can force this function to
         always act as if skip_midx was True.
         """
-        if self.bloom is not None:
-            self.bloom.close()
-        self.bloom = None # Always reopen the bloom as it may have been relaced
-        self.do_bloom = False
         skip_midx = skip_midx or self.ignore_midx
-        d = dict((p.name, p) for p in self.packs
-                 if not skip_midx or not isinstance(p, midx.PackMidx))
-        if os.path.exists(self.dir):
-            if not skip_midx:
-                midxl = []
-                midxes = set(glob.glob(os.path.join(self.dir, b'*.midx')))
-                # remove any *.midx files from our list that no longer exist
-                for ix in list(d.values()):
-                    if not isinstance(ix, midx.PackMidx):
-                        continue
-                    if ix.name in midxes:
-                        continue
-                    # remove the midx
-                    del d[ix.name]
-                    ix.close()
-                    self.packs.remove(ix)
-                for ix in self.packs:
-                    if isinstance(ix, midx.PackMidx):
-                        for name in ix.idxnames:
-                            d[os.path.join(self.dir, name)] = ix
-                for full in midxes:
-                    if not d.get(full):
-                        mx, missing = None, None
-                        try:
-                            mx = open_midx(full, ignore_missing=False)
-                        except midx.MissingIdxs as ex:
-                            missing = ex.paths
-                        if not missing:
-                            if mx: midxl.append(mx)
-                        else:
-                            mxf = os.path.split(full)[1]
-                            for n in missing:
-                                log(('warning: index %s missing\n'
-                                     '  used by %s\n')
-                                    % (path_msg(n), path_msg(mxf)))
-                            unlink(full)
-                midxl.sort(key=lambda ix:
-                           (-len(ix), -xstat.stat(ix.name).st_mtime))
-                for ix in midxl:
-                    any_needed = False
-                    for sub in ix.idxnames:
-                        found = d.get(os.path.join(self.dir, sub))
-                        if not found or isinstance(found, PackIdx):
-                            # doesn't exist, or exists but not in a midx
-                            any_needed = True
-                            break
-                    if any_needed:
-                        d[ix.name] = ix
-                        for name in ix.idxnames:
-                            d[os.path.join(self.dir, name)] = ix
-                    else:
-                        debug1('midx: removing redundant: %s\n'
-                               % path_msg(os.path.basename(ix.name)))
-                        ix.close()
-                        unlink(ix.name)
-            for full in glob.glob(os.path.join(self.dir, b'*.idx')):
-                if not d.get(full):
-                    try:
-                        ix = open_idx(full)
-                    except GitError as e:
-                        add_error(e)
-                        continue
-                    d[full] = ix
-            bfull = os.path.join(self.dir, b'bup.bloom')
-            new_packs = set(d.values())
-            for p in self.packs:
-                if not p in new_packs:
-                    p.close()
-            new_packs = list(new_packs)
-            new_packs.sort(reverse=True, key=len)
-            self.packs = new_packs
-            if self.bloom is None and os.path.exists(bfull):
-                self.bloom = bloom.ShaBloom(bfull)
-            try:
-                if self.bloom and self.bloom.valid() and len(self.bloom) >= len(self):
-                    self.do_bloom = True
-                else:
-                    if self.bloom:
-                        self.bloom, bloom_tmp = None, self.bloom
-                        bloom_tmp.close()
-            except BaseException as ex:
-                if self.bloom:
-                    self.bloom.close()
-                raise ex
-
+        self._publish(self._snapshot.refreshed(skip_midx=skip_midx))
         debug1('PackIdxList: using %d index%s.\n'
             % (len(self.packs), len(self.packs)!=1 and 'es' or ''))
 
@@ -758,15 +1029,34 @@ def open_object_idx(filename):
     raise GitError('pack index filenames must end with .idx or .midx')
 
 
+def _native_idxmerge(idxlist, pfreq, pfunc, pfinal):
+    total = sum(len(ix) for ix in idxlist)
+    merged = _helpers.OidMergeIter([ix.oid_table() for ix in idxlist])
+    # Only an approximation of merge_iter()'s count (which includes
+    # the duplicates), but only the progress messages depend on it.
+    count = 0
+    pfunc(count, total)
+    while True:
+        oids = list(islice(merged, pfreq))
+        if not oids:
+            break
+        yield from oids
+        count += len(oids)
+        pfunc(count, total)
+    pfinal(total, total)
+
+
 def idxmerge(idxlist, final_progress=True):
     """Generate a list of all the objects reachable in a PackIdxList."""
     def pfunc(count, total):
         qprogress('Reading indexes: %.2f%% (%d/%d)\r'
-                  % (count*100.0/total, count, total))
+                  % (count*100.0/total if total else 100, count, total))
     def pfinal(count, total):
         if final_progress:
             progress('Reading indexes: %.2f%% (%d/%d), done.\n'
                      % (100, count, total))
+    if all(hasattr(ix, 'oid_table') for ix in idxlist):
+        return _native_idxmerge(idxlist, 10024, pfunc, pfinal)
     return merge_iter(idxlist, 10024, pfunc, pfinal)
 
 
@@ -801,8 +1091,11 @@ class LocalPackStore():
 
         """
         if self._objcache is None:
+            cfg = repo_config_file(self._repo_dir)
+            advice = index_map_configuration(partial(git_config_get, cfg))
             self._objcache = \
-                PackIdxList(repo(b'objects/pack', repo_dir=self._repo_dir))
+                PackIdxList(repo(b'objects/pack', repo_dir=self._repo_dir),
+                            **advice)
         return self._objcache.exists(oid, want_source=want_source)
 
     def _open(self):
@@ -904,11 +1197,22 @@ class LocalPackStore():
 class PackWriter:
     """Write Git objects to pack files."""
 
+    # Limits on the objects queued for compression and appending when
+    # jobs > 1 (i.e. the memory used by the pipeline).
+    _max_queued_bytes = 32 * 1024 * 1024
+    _max_queued_objects = 1024
+
     def __init__(self, *, store, compression_level=None,
-                 max_pack_size=None, max_pack_objects=None):
+                 max_pack_size=None, max_pack_objects=None, jobs=1):
+        """When jobs is greater than one, compress objects in up to
+        jobs threads, and append them to the store in another, while
+        the caller continues.  The objects are still appended in the
+        order they're written, and the oids are still computed (and
+        deduplicated) immediately, so the results are the same."""
         self._byte_count = 0
         self._obj_count = 0
         self._store = store
+        self._store_lock = threading.Lock()
         self._pending_oids = set()
         if compression_level is None:
             compression_level = 1
@@ -917,32 +1221,98 @@ class PackWriter:
         # cache memory usage is about 83 bytes per object
         self.max_pack_objects = max_pack_objects if max_pack_objects \
                                 else max(1, self.max_pack_size // 5000)
+        self._encoders = self._appender = None
+        if jobs > 1:
+            self._encoders = ThreadPoolExecutor(max_workers=jobs)
+            self._appender = ThreadPoolExecutor(max_workers=1)
+        self._queued = deque() # [(append future, content size), ...]
+        self._queued_bytes = 0
+        self._append_failed = self._append_error_reported = False
 
     def __enter__(self): return self
     def __exit__(self, type, value, traceback): self.close()
 
-    def byte_count(self): return self._byte_count
-    def object_count(self): return self._obj_count
+    def byte_count(self):
+        self._wait_for_queued()
+        return self._byte_count
+
+    def object_count(self):
+        self._wait_for_queued()
+        return self._obj_count
+
+    def _finish_pack(self):
+        with self._store_lock:
+            result = self._store.finish_pack()
+        self._byte_count = self._obj_count = 0
+        return result
+
+    def _append(self, sha, encoded):
+        # Runs in the appender thread when jobs > 1
+        if self._append_failed:
+            raise GitError('not writing %s after an earlier failure'
+                           % hexlify(sha).decode('ascii'))
+        try:
+            if not isinstance(encoded, tuple):
+                encoded = encoded.result()
+            with self._store_lock:
+                size, crc_ = self._store.write(encoded, sha=sha)
+            exp_size = sum(len(x) for x in encoded)
+            assert exp_size == size, f'unexpected: {exp_size} != {size} {crc_}'
+            self._byte_count += exp_size
+            self._obj_count += 1
+            if self._byte_count >= self.max_pack_size \
+               or self._obj_count >= self.max_pack_objects:
+                self._finish_pack()
+        except BaseException:
+            self._append_failed = True
+            raise
+
+    def _wait_for_oldest(self):
+        append, size = self._queued.popleft()
+        self._queued_bytes -= size
+        try:
+            append.result()
+        except BaseException:
+            # Everything after a failure fails too, so only report it once
+            if not self._append_error_reported:
+                self._append_error_reported = True
+                raise
+
+    def _wait_for_queued(self):
+        while self._queued:
+            self._wait_for_oldest()
+
+    def _shutdown_pipeline(self):
+        encoders, appender = self._encoders, self._appender
+        self._encoders = self._appender = None
+        if appender:
+            appender.shutdown()
+            encoders.shutdown()
 
     def _write(self, sha, type, content):
         if verbose:
             log('>')
         assert sha
-        encoded = _encode_packobj(type, content, self.compression_level)
-        size, crc_ = self._store.write(encoded, sha=sha)
-        exp_size = sum(len(x) for x in encoded)
-        assert exp_size == size, f'unexpected: {exp_size} != {size} {crc_}'
-        self._byte_count += exp_size
-        self._obj_count += 1
-        if self._byte_count >= self.max_pack_size \
-           or self._obj_count >= self.max_pack_objects:
-            self.breakpoint()
+        if not self._encoders:
+            self._append(sha, _encode_packobj(type, content,
+                                              self.compression_level))
+            return sha
+        encoded = self._encoders.submit(_encode_packobj, type, content,
+                                        self.compression_level)
+        self._queued.append((self._appender.submit(self._append, sha, encoded),
+                             len(content)))
+        self._queued_bytes += len(content)
+        while self._queued_bytes > self._max_queued_bytes \
+              or len(self._queued) > self._max_queued_objects:
+            self._wait_for_oldest()
         return sha
 
     def exists(self, oid, want_source=False):
         """Return non-empty if an object is found in the object cache."""
-        return oid in self._pending_oids \
-            or self._store.exists(oid, want_source=want_source)
+        if oid in self._pending_oids:
+            return True
+        with self._store_lock:
+            return self._store.exists(oid, want_source=want_source)
 
     def just_write(self, sha, type, content):
         """Write an object to the pack file without deduplication."""
@@ -983,16 +1353,26 @@ class PackWriter:
 
     def abort(self):
         """Remove the pack file from disk."""
+        self._append_failed = True # drop anything still queued
+        self._queued.clear()
+        self._shutdown_pipeline()
         self._store.abort()
 
     def breakpoint(self):
         """Clear byte and object counts and return the last processed id."""
-        result = self._store.finish_pack()
-        self._byte_count = self._obj_count = 0
-        return result
+        self._wait_for_queued()
+        return self._finish_pack()
 
     def close(self):
         """Close the pack file and move it to its definitive path."""
+        try:
+            self._wait_for_queued()
+        except BaseException:
+            self._queued.clear()
+            self._shutdown_pipeline()
+            self._store.close()
+            raise
+        self._shutdown_pipeline()
         return self._store.close()
 
 
@@ -1329,6 +1709,22 @@ def require_suitable_git(ver_str=None):
     assert False
 
 
+def _read_cat_header(p, ref):
+    """Return (oidx, type, size) from the next cat-file --batch
+    response header, or (None, None, None) if ref is missing."""
+    hdr = p.stdout.readline()
+    if not hdr:
+        raise GitError('unexpected cat-file EOF (last request: %r, exit: %s)'
+                       % (ref, p.poll() or 'none'))
+    if hdr.endswith(b' missing\n'):
+        return None, None, None
+    info = hdr.split(b' ')
+    if len(info) != 3 or len(info[0]) != 40:
+        raise GitError('expected object (id, type, size), got %r' % info)
+    oidx, typ, size = info
+    return oidx, typ, int(size)
+
+
 class CatPipe:
     """Link to 'git cat-file' that is used to retrieve blob data."""
     def __init__(self, repo_dir = None):
@@ -1419,19 +1815,11 @@ class CatPipe:
                 p.stdin.write(b'info ')
         p.stdin.write(ref + b'\n')
         p.stdin.flush()
-        hdr = p.stdout.readline()
-        if not hdr:
-            raise GitError('unexpected cat-file EOF (last request: %r, exit: %s)'
-                           % (ref, p.poll() or 'none'))
-        if hdr.endswith(b' missing\n'):
+        oidx, typ, size = _read_cat_header(p, ref)
+        if not oidx:
             self.inprogress = None
             yield None, None, None
             return
-        info = hdr.split(b' ')
-        if len(info) != 3 or len(info[0]) != 40:
-            raise GitError('expected object (id, type, size), got %r' % info)
-        oidx, typ, size = info
-        size = int(size)
 
         if not include_data:
             self.inprogress = None
@@ -1448,18 +1836,523 @@ class CatPipe:
             self.close()
             raise ex
 
+    def get_batch(self, refs, include_data=True, *, window=64):
+        """Yield (oidx, type, size, data) for each of the refs, in
+        order, with up to window requests written to cat-file before
+        their responses are read.  For a missing ref, yield (None,
+        None, None, None).  The data is None when include_data is
+        false.
+
+        """
+        if not self.p or self.p.poll() is not None:
+            self.restart()
+        assert not self.inprogress, \
+            f'starting batch while {self.inprogress.decode("ascii")} is open'
+        if include_data:
+            p = self.p
+            cmd = b'contents ' if self.have_batch_command else b''
+        else:
+            self._open_check()
+            p = self.pcheck
+            cmd = b'info ' if self.have_batch_command else b''
+        self.inprogress = b'batch'
+        refs = iter(refs)
+        pending = deque()
+        try:
+            while True:
+                # Each request is small enough that the window of them
+                # fits in the pipe, so writing them can't block while
+                # cat-file is waiting for us to read a response.
+                wrote = False
+                while len(pending) < window:
+                    ref = next(refs, None)
+                    if ref is None:
+                        break
+                    assert ref.find(b'\n') < 0
+                    assert ref.find(b'\r') < 0
+                    assert not ref.startswith(b'-')
+                    p.stdin.write(cmd + ref + b'\n')
+                    pending.append(ref)
+                    wrote = True
+                if not pending:
+                    break
+                if wrote:
+                    p.stdin.flush()
+                ref = pending.popleft()
+                oidx, typ, size = _read_cat_header(p, ref)
+                if not oidx:
+                    yield None, None, None, None
+                    continue
+                data = None
+                if include_data:
+                    data = p.stdout.read(size)
+                    if len(data) != size or p.stdout.readline() != b'\n':
+                        raise GitError(f'unexpected cat-file EOF reading {ref!r}')
+                yield oidx, typ, size, data
+            self.inprogress = None
+        except BaseException:
+            # Including GeneratorExit, since responses may be pending
+            self.close()
+            raise
+
+
+_hex_oid_rx = re.compile(br'[0-9a-f]{40}')
+
+def _pack_inflated(m, ofs, size, blocksize=1 << 20):
+    """Yield the inflated content of the size byte object whose zlib
+    stream starts at offset ofs in the pack (map) m."""
+    d = zlib.decompressobj()
+    n = 0
+    # Start with enough input for the whole stream in the common case.
+    buf = m[ofs : ofs + min(size + 64, blocksize)]
+    ofs += len(buf)
+    while True:
+        out = d.decompress(buf, blocksize)
+        if out:
+            n += len(out)
+            yield out
+        if d.eof:
+            break
+        buf = d.unconsumed_tail
+        if not buf:
+            if ofs >= len(m):
+                raise GitError('truncated object in pack')
+            buf = m[ofs : ofs + blocksize]
+            ofs += len(buf)
+    if n != size:
+        raise GitError(f'pack object size {n} does not match header size {size}')
+
+
+def _mtime_ns(path):
+    try:
+        return os.stat(path).st_mtime_ns
+    except FileNotFoundError:
+        return -1
+
+
+class _PackLocator:
+    """Find objects in a pack directory for any number of
+    ObjectReaders (in any threads), via a single PackIdxList that's
+    only rescanned when the directory has changed.
+
+    """
+    def __init__(self, pack_dir):
+        self.dir = pack_dir
+        self._lock = threading.Lock()
+        self._idxl = None
+        self._mtime = None # st_mtime_ns when _idxl was refreshed
+        self._missing = set() # oids not found since then
+
+    def close(self):
+        with self._lock:
+            idxl, self._idxl = self._idxl, None
+            self._mtime = None
+            self._missing.clear()
+        if idxl is not None:
+            idxl.close()
+
+    def _note_mtime(self, mtime):
+        # If the mtime is too recent, a change in the same timestamp
+        # tick wouldn't change it, so don't trust it until it's older.
+        racy = time_ns() - mtime < 2 * 10**9
+        self._mtime = None if racy else mtime
+
+    def _refresh_if_changed(self):
+        """Refresh _idxl and return true if the pack directory may
+        have changed since _idxl was created or last refreshed."""
+        mtime = _mtime_ns(self.dir)
+        if mtime == self._mtime:
+            return False
+        self._note_mtime(mtime)
+        self._idxl.refresh()
+        self._missing.clear()
+        return True
+
+    def locate(self, oid):
+        """Return the name of the idx for the pack containing oid, or
+        None."""
+        with self._lock:
+            if self._idxl is None: # (empty when there are no packs)
+                mtime = _mtime_ns(self.dir)
+                self._idxl = PackIdxList(self.dir)
+                self._note_mtime(mtime)
+            # Only rescan the pack directory when it has changed, since
+            # loose objects and nonexistent oids miss every time.
+            loc = None
+            if oid not in self._missing:
+                loc = self._idxl.exists(oid, want_source=True)
+            if not loc and self._refresh_if_changed():
+                loc = self._idxl.exists(oid, want_source=True)
+            if not loc:
+                if len(self._missing) >= 65536:
+                    self._missing.clear()
+                self._missing.add(oid)
+                return None
+            return loc.pack
+
+
+class _PackMap:
+    """A mapping of a pack and its idx, as shared via _shared_maps
+    (keyed by the pack's path, since the idx's is used for the
+    PackIdxSnapshot maps)."""
+    def __init__(self, pack_path):
+        self.idx = open_idx(pack_path[:-5] + b'.idx')
+        try:
+            # pylint: disable-next=consider-using-with
+            self.map = mmap_read(open(pack_path, 'rb'))
+        except BaseException:
+            self.idx.close()
+            raise
+
+    def close(self):
+        try:
+            self.idx.close()
+        finally:
+            self.map.close()
+
+
+class ObjectReader:
+    """Read objects directly from the repository's packs, finding them
+    via the idx and midx files and inflating them (and applying any
+    deltas, as produced by git gc/repack) in process, rather than
+    asking git cat-file.  Anything not found that way (refs rather
+    than object ids, loose objects, objects from alternates, etc.) is
+    handed to a CatPipe.  Provides the same get() and close() as
+    CatPipe.  The max_open most recently used packs are kept mapped,
+    and up to max_base_bytes of recently used delta bases are cached.
+    Readers given the same locator (a _PackLocator) share its
+    PackIdxList, and all readers share the maps of the packs they
+    have in common.
+
+    """
+    def __init__(self, repo_dir=None, *, max_open=64,
+                 max_base_bytes=32 * 1024 * 1024, locator=None):
+        self.repo_dir = repo_dir
+        self._max_open = max_open
+        self._max_base_bytes = max_base_bytes
+        self._locator = locator
+        self._own_locator = locator is None
+        self._packs = OrderedDict() # idx name -> _PackMap
+        self._bases = OrderedDict() # (idx name, offset) -> (type, data)
+        self._base_bytes = 0
+        self._cp = None
+
+    def close(self, wait=False):
+        locator = None
+        if self._own_locator:
+            locator, self._locator = self._locator, None
+        packs, self._packs = self._packs, OrderedDict()
+        cp, self._cp = self._cp, None
+        self._bases.clear()
+        self._base_bytes = 0
+        with ExitStack() as contexts:
+            if locator is not None:
+                contexts.callback(locator.close)
+            for pm in packs.values():
+                contexts.callback(_shared_maps.release, pm)
+            if cp:
+                return cp.close(wait=wait)
+        return 0 if wait else None
+
+    def __del__(self):
+        self.close()
+
+    def restart(self):
+        """Drop everything that's open (e.g. packs that have since
+        been removed); it will all be reopened as needed."""
+        self.close()
+
+    def locate(self, oid):
+        """Return the (pack name, offset) of oid if it's in one of the
+        packs, otherwise None.  Sorting locations gives pack order."""
+        found = self._locate(oid)
+        return (found[0], found[2]) if found else None
+
+    def read_at(self, location):
+        """Return the (type, data) of the object at a locate()d
+        location."""
+        name, ofs = location
+        _, m = self._pack(name)
+        return self._read(name, m, ofs)
+
+    def abandon(self):
+        """Prepare for more requests after a get() whose data wasn't
+        all read."""
+        # Only the cat-file pipe has any state to clear
+        if self._cp and self._cp.inprogress:
+            self._cp.close()
+
+    def _pack(self, name):
+        pm = self._packs.get(name)
+        if pm:
+            self._packs.move_to_end(name)
+            return pm.idx, pm.map
+        # Other readers may be using the same maps, so only drop our
+        # reference to any that are evicted.
+        pack_dir = repo(b'objects/pack', repo_dir=self.repo_dir)
+        pack = os.path.join(pack_dir, name[:-4] + b'.pack')
+        pm = _shared_maps.acquire(pack, _PackMap)
+        self._packs[name] = pm
+        while len(self._packs) > self._max_open:
+            _, old = self._packs.popitem(last=False)
+            _shared_maps.release(old)
+        return pm.idx, pm.map
+
+    def _locate(self, oid):
+        """Return (idx name, pack map, offset) for oid, or None."""
+        if self._locator is None:
+            self._locator = \
+                _PackLocator(repo(b'objects/pack', repo_dir=self.repo_dir))
+        name = self._locator.locate(oid)
+        if not name:
+            return None
+        try:
+            idx, m = self._pack(name)
+        except FileNotFoundError: # e.g. removed by a concurrent gc
+            return None
+        ofs = idx.find_offset(oid)
+        if ofs is None:
+            return None
+        return name, m, ofs
+
+    def _header(self, m, ofs):
+        """Return (type number, size, data offset) for the pack object
+        at ofs."""
+        c = m[ofs]
+        kind = (c >> 4) & 7
+        size = c & 0xf
+        shift = 4
+        ofs += 1
+        while c & 0x80:
+            c = m[ofs]
+            ofs += 1
+            size |= (c & 0x7f) << shift
+            shift += 7
+        return kind, size, ofs
+
+    def _delta_base(self, name, m, obj_ofs, kind, ofs):
+        """Return ((idx name, pack map, offset) of the base, delta
+        data offset) for the delta object at obj_ofs, whose header
+        _header() returned as kind and ofs."""
+        if kind == 6: # OFS_DELTA
+            c = m[ofs]
+            ofs += 1
+            rel = c & 0x7f
+            while c & 0x80:
+                c = m[ofs]
+                ofs += 1
+                rel = ((rel + 1) << 7) | (c & 0x7f)
+            return (name, m, obj_ofs - rel), ofs
+        # REF_DELTA
+        base_oid = m[ofs : ofs + 20]
+        found = self._locate(base_oid)
+        if not found:
+            raise GitError(f'missing delta base {base_oid.hex()}')
+        return found, ofs + 20
+
+    def _resolve_delta(self, name, m, obj_ofs, kind, size, ofs):
+        """Return (type, data) for the delta object at obj_ofs, whose
+        header _header() returned as kind, size, and ofs."""
+        # Git allows chains thousands of deltas deep, so rather than
+        # recursing, find the (cached or undeltified) base, and then
+        # apply the deltas on the way back up.
+        chain = [] # (idx name, pack map, offset, size, delta data offset)
+        while True:
+            base, delta_ofs = self._delta_base(name, m, obj_ofs, kind, ofs)
+            chain.append((name, m, obj_ofs, size, delta_ofs))
+            name, m, obj_ofs = base
+            ent = self._bases.get((name, obj_ofs))
+            if ent:
+                self._bases.move_to_end((name, obj_ofs))
+                typ, data = ent
+                break
+            kind, size, ofs = self._header(m, obj_ofs)
+            if kind in (1, 2, 3, 4):
+                typ = _typermap[kind]
+                data = b''.join(_pack_inflated(m, ofs, size))
+                self._note_base(name, obj_ofs, typ, data)
+                break
+            if kind not in (6, 7):
+                raise GitError(f'unexpected pack object type {kind}')
+        for i in range(len(chain) - 1, -1, -1):
+            name, m, obj_ofs, size, delta_ofs = chain[i]
+            delta = b''.join(_pack_inflated(m, delta_ofs, size))
+            data = _helpers.apply_delta(data, delta)
+            if i:
+                self._note_base(name, obj_ofs, typ, data)
+        return typ, data
+
+    def _read(self, name, m, obj_ofs):
+        """Return (type, data) for the pack object at obj_ofs."""
+        kind, size, ofs = self._header(m, obj_ofs)
+        if kind in (1, 2, 3, 4):
+            return _typermap[kind], b''.join(_pack_inflated(m, ofs, size))
+        if kind not in (6, 7):
+            raise GitError(f'unexpected pack object type {kind}')
+        return self._resolve_delta(name, m, obj_ofs, kind, size, ofs)
+
+    def _note_base(self, name, ofs, typ, data):
+        """Cache the (type, data) of the delta base at ofs, if it's
+        not too big."""
+        size = len(data)
+        if size > self._max_base_bytes // 4:
+            return
+        self._bases[name, ofs] = typ, data
+        self._base_bytes += size
+        while self._base_bytes > self._max_base_bytes:
+            _, (_, old) = self._bases.popitem(last=False)
+            self._base_bytes -= len(old)
+
+    def get(self, ref, include_data=True):
+        """Yield (oidx, type, size), followed by the data referred to by ref.
+        If ref does not exist, only yield (None, None, None).
+
+        """
+        found = None
+        if _hex_oid_rx.fullmatch(ref):
+            found = self._locate(unhexlify(ref))
+        if not found:
+            if not self._cp:
+                self._cp = CatPipe(self.repo_dir)
+            yield from self._cp.get(ref, include_data=include_data)
+            return
+        name, m, obj_ofs = found
+        kind, size, ofs = self._header(m, obj_ofs)
+        if kind in (6, 7):
+            typ, data = self._resolve_delta(name, m, obj_ofs, kind, size,
+                                            ofs)
+            yield ref, typ, len(data)
+            if include_data and data:
+                yield data
+            return
+        typ = _typermap.get(kind)
+        if not typ:
+            raise GitError(f'unexpected pack object type {kind}')
+        yield ref, typ, size
+        if include_data:
+            yield from _pack_inflated(m, ofs, size)
+
+    def get_batch(self, refs, include_data=True):
+        """Yield (oidx, type, size, data) for each of the refs, as
+        CatPipe.get_batch() does."""
+        for ref in refs:
+            it = self.get(ref, include_data=include_data)
+            oidx, typ, size = next(it)
+            data = b''.join(it) if include_data and oidx else None
+            yield oidx, typ, size, data
+
+
+class ReaderPool:
+    """A thread-safe pool of ObjectReaders for repo_dir, so that
+    objects can be read by several threads at once, either by
+    borrowing a reader(), or via get_batch(), which fetches batches
+    of the requested objects in up to jobs threads.
+
+    """
+    _batch_size = 64
+
+    def __init__(self, repo_dir=None, *, jobs=None):
+        self.closed = True # for __del__
+        self.repo_dir = repo_dir
+        self.jobs = jobs or os.cpu_count() or 1
+        self._lock = threading.Lock()
+        self._locator = None # shared by all the readers
+        self._readers = []
+        self._idle = []
+        self._executor = None
+        self.closed = False
+
+    def close(self):
+        if self.closed:
+            return
+        self.closed = True
+        executor, self._executor = self._executor, None
+        if executor:
+            executor.shutdown()
+        with self._lock:
+            readers, self._readers, self._idle = self._readers, [], []
+            locator, self._locator = self._locator, None
+        with ExitStack() as contexts:
+            if locator:
+                contexts.callback(locator.close)
+            for r in readers:
+                contexts.callback(r.close)
+
+    def __enter__(self): return self
+    def __exit__(self, type, value, traceback): self.close()
+    def __del__(self): assert self.closed
+
+    @contextmanager
+    def reader(self):
+        """Return a context manager providing an ObjectReader for the
+        exclusive use of the caller until the context exits."""
+        with self._lock:
+            assert not self.closed
+            if self._idle:
+                r = self._idle.pop()
+            else:
+                if not self._locator:
+                    pack_dir = repo(b'objects/pack', repo_dir=self.repo_dir)
+                    self._locator = _PackLocator(pack_dir)
+                r = ObjectReader(self.repo_dir, locator=self._locator)
+                self._readers.append(r)
+        try:
+            yield r
+        except BaseException:
+            # The reader may have been abandoned mid-request
+            r.abandon()
+            raise
+        finally:
+            with self._lock:
+                if not self.closed:
+                    self._idle.append(r)
+
+    def _fetch(self, refs, include_data):
+        with self.reader() as r:
+            return list(r.get_batch(refs, include_data))
+
+    def get_batch(self, refs, include_data=True):
+        """Yield (oidx, type, size, data) for each of the refs, in
+        order, as CatPipe.get_batch() does, while fetching up to
+        2 * jobs batches of them in parallel."""
+        if self.jobs == 1:
+            with self.reader() as r:
+                yield from r.get_batch(refs, include_data)
+            return
+        with self._lock:
+            if not self._executor:
+                self._executor = ThreadPoolExecutor(max_workers=self.jobs)
+            executor = self._executor
+        refs = iter(refs)
+        pending = deque()
+        try:
+            while True:
+                while len(pending) < 2 * self.jobs:
+                    batch = list(islice(refs, self._batch_size))
+                    if not batch:
+                        break
+                    pending.append(executor.submit(self._fetch, batch,
+                                                   include_data))
+                if not pending:
+                    break
+                yield from pending.popleft().result()
+        finally:
+            for fetch in pending:
+                fetch.cancel()
+
 
 _catpipe_for = {}
 
 def catpipe(repo_dir=None):
-    """Create a CatPipe object or reuse the already existing one."""
+    """Create an ObjectReader (which provides the CatPipe get()) or
+    reuse the already existing one."""
     global repodir
     if not repo_dir:
         repo_dir = repodir or repo()
     repo_dir = os.path.abspath(repo_dir)
     cp = _catpipe_for.get(repo_dir)
     if not cp:
-        cp = CatPipe(repo_dir)
+        cp = ObjectReader(repo_dir)
         _catpipe_for[repo_dir] = cp
     return cp
 
@@ -444,6 +444,16 @@ class BaseConn:
         self.outp.flush()
         return self._read(size)
 
+    def _peek(self, size):
+        raise NotImplementedError("Subclasses must implement _peek")
+
+    def peek(self, size):
+        """Return some of the buffered input without consuming it,
+        reading more if there is none (like BufferedReader.peek()).
+        May return b'' if the input can't be buffered."""
+        self.outp.flush()
+        return self._peek(size)
+
     def _readline(self):
         raise NotImplementedError("Subclasses must implement _readline")
 
@@ -507,6 +517,10 @@ class Conn(BaseConn):
     def _read(self, size):
         return self.inp.read(size)
 
+    def _peek(self, size):
+        peek = getattr(self.inp, 'peek', None)
+        return peek(size) if peek else b''
+
     def _readline(self):
         return self.inp.readline()
 
@@ -646,6 +660,10 @@ class DemuxConn(BaseConn):
             return csize[0]
         return b''.join(self._read_parts(until_size))
 
+    def _peek(self, size):
+        self._load_buf(None)
+        return self.buf or b''
+
     def has_input(self):
         return self._load_buf(0)
 
@@ -723,7 +741,7 @@ class atomically_replaced_file:
         self._path_parent_fd = None
         self._path_parent, self._path_base = os.path.split(self.path)
         if not self._path_parent:
-            self._path_parent = '.'
+            self._path_parent = b'.' if isinstance(path, bytes) else '.'
         assert self._path_base, f'{self._path_base} is a directory'
         ctx = ExitStack()
         self._cleanup = ctx
@@ -771,7 +789,12 @@ def slashappend(s):
     return s
 
 
-def _mmap_do(f, sz, flags, prot, close):
+def _mmap_do(f, sz, flags, prot, close, prefault=None, hugepages=False):
+    assert prefault in (None, 'willneed', 'populate'), prefault
+    if prefault == 'populate' and hugepages:
+        # Huge pages must be requested before the faults, and so
+        # can't be combined with MAP_POPULATE.
+        raise ValueError('cannot populate a map with huge pages')
     with ExitStack() as contexts:
         if close:
             contexts.enter_context(f)
@@ -783,32 +806,60 @@ def _mmap_do(f, sz, flags, prot, close):
             # string has all the same behaviour of a zero-length map, ie. it has
             # no elements :)
             return b''
-        return io.mmap(f.fileno(), sz, flags, prot)
+        # Fault everything in up front via MAP_POPULATE if we can
+        populate = getattr(mmap, 'MAP_POPULATE', None)
+        if prefault == 'populate' and populate:
+            flags |= populate
+            prefault = None
+        m = io.mmap(f.fileno(), sz, flags, prot)
+        # These are only hints, so ignore any the platform rejects.
+        if hugepages and hasattr(mmap, 'MADV_HUGEPAGE'):
+            try:
+                m.madvise(mmap.MADV_HUGEPAGE)
+            except OSError:
+                pass
+        if prefault and hasattr(mmap, 'MADV_WILLNEED'):
+            try:
+                m.madvise(mmap.MADV_WILLNEED)
+            except OSError:
+                pass
+        return m
 
 
-def mmap_read(f, sz = 0, close=True):
+def mmap_read(f, sz = 0, close=True, *, prefault=None, hugepages=False):
     """Create a read-only memory mapped region on file 'f'.
     If sz is 0, the region will cover the entire file.
+
+    The optional paging hints are applied when the platform supports
+    them: a prefault of 'willneed' starts reading the region in the
+    background (MADV_WILLNEED), 'populate' faults it all in before
+    returning (MAP_POPULATE), and hugepages requests transparent huge
+    pages (MADV_HUGEPAGE).  Since huge pages must be requested before
+    the region is faulted in, 'populate' and hugepages can't be
+    combined (ValueError).
     """
-    return _mmap_do(f, sz, mmap.MAP_PRIVATE, mmap.PROT_READ, close)
+    return _mmap_do(f, sz, mmap.MAP_PRIVATE, mmap.PROT_READ, close,
+                    prefault, hugepages)
 
 
-def mmap_readwrite(f, sz = 0, close=True):
+def mmap_readwrite(f, sz = 0, close=True, *, prefault=None, hugepages=False):
     """Create a read-write memory mapped region on file 'f'.
     If sz is 0, the region will cover the entire file.
+    See mmap_read() for the paging hints.
     """
     return _mmap_do(f, sz, mmap.MAP_SHARED, mmap.PROT_READ|mmap.PROT_WRITE,
-                    close)
+                    close, prefault, hugepages)
 
 
-def mmap_readwrite_private(f, sz = 0, close=True):
+def mmap_readwrite_private(f, sz = 0, close=True, *, prefault=None,
+                           hugepages=False):
     """Create a read-write memory mapped region on file 'f'.
     If sz is 0, the region will cover the entire file.
     The map is private, which means the changes are never flushed back to the
-    file.
+    file.  See mmap_read() for the paging hints.
     """
     return _mmap_do(f, sz, mmap.MAP_PRIVATE, mmap.PROT_READ|mmap.PROT_WRITE,
-                    close)
+                    close, prefault, hugepages)
 
 
 def parse_timestamp(epoch_str):
@@ -1,8 +1,39 @@
-
 from contextlib import ExitStack
-import pickle
+from heapq import merge
+from shutil import copyfileobj
+from tempfile import TemporaryFile
+import pickle, struct
+
+from bup.helpers import \
+    (Sha1,
+     atomically_replaced_file,
+     fsync,
+     mmap_read,
+     unlink)
+
 
-from bup.helpers import atomically_replaced_file, fsync, unlink
+# The database is a header, followed by the node records, sorted by
+# (dev, ino), followed by the path hash records, sorted by (hash, dev,
+# ino), followed by a heap of each node's paths (each preceded by its
+# length).  The paths for a node are consecutive in the heap, in the
+# order they were added, so the first one is the oldest.  Version 1
+# was a pickle of the "dev:ino" -> paths dict, and is converted when
+# it's opened.
+HLINKDB_HDR = b'BUPH\0\0\0\x02'
+_COUNTS = struct.Struct('!'
+                        'Q'     # node count
+                        'Q')    # path count
+_NODE = struct.Struct('!'
+                      'Q'       # dev
+                      'Q'       # ino
+                      'Q'       # paths offset (within the heap)
+                      'I')      # path count
+_HASH = struct.Struct('!'
+                      'Q'       # path hash
+                      'Q'       # dev
+                      'Q')      # ino
+_PATH_LEN = struct.Struct('!I')
+_HDRLEN = len(HLINKDB_HDR) + _COUNTS.size
 
 
 def pickle_load(filename):
@@ -14,6 +45,10 @@ def pickle_load(filename):
         return pickle.load(f, encoding='bytes')
 
 
+def _path_hash(path):
+    return int.from_bytes(Sha1(path).digest()[:8], 'big')
+
+
 class Error(Exception):
     pass
 
@@ -23,26 +58,170 @@ class HLinkDB:
         self._cleanup = ExitStack()
         self._filename = filename
         self._pending_save = None
-        # Map a "dev:ino" node to a list of paths associated with that node.
-        self._node_paths = pickle_load(filename) or {}
-        # Map a path to a "dev:ino" node (a reverse hard link index).
-        self._path_node = {}
-        for node, paths in self._node_paths.items():
+        self._prepared = False
+        self._m = b''
+        self._node_count = self._path_count = 0
+        # Changes not yet in the file: map a (dev, ino) node to the
+        # list of paths added to it, map each added path to its node,
+        # and map each of the file's paths that has been removed to
+        # its node.
+        self._added = {}
+        self._added_path = {}
+        self._deleted = {}
+        self._dirty = False
+        try:
+            f = open(filename, 'rb')
+        except FileNotFoundError:
+            return
+        with f:
+            if f.read(len(HLINKDB_HDR)) != HLINKDB_HDR:
+                self._convert_v1()
+                return
+            self._node_count, self._path_count = \
+                _COUNTS.unpack(f.read(_COUNTS.size))
+            self._m = mmap_read(f, close=False)
+        self._hash_start = _HDRLEN + self._node_count * _NODE.size
+        self._heap_start = self._hash_start + self._path_count * _HASH.size
+
+    def _convert_v1(self):
+        for node, paths in pickle_load(self._filename).items():
+            dev, ino = (int(x) for x in node.split(b':'))
             for path in paths:
-                self._path_node[path] = node
+                self.add_path(path, dev, ino)
+        self._dirty = True
+
+    def _close_map(self):
+        m, self._m = self._m, b''
+        if m:
+            m.close()
+
+    def _file_node(self, i):
+        return _NODE.unpack_from(self._m, _HDRLEN + i * _NODE.size)
+
+    def _file_hash(self, i):
+        return _HASH.unpack_from(self._m, self._hash_start + i * _HASH.size)
+
+    def _file_paths(self, ofs, n):
+        m, paths = self._m, []
+        ofs += self._heap_start
+        for _ in range(n):
+            plen = _PATH_LEN.unpack_from(m, ofs)[0]
+            ofs += _PATH_LEN.size
+            paths.append(m[ofs:ofs + plen])
+            ofs += plen
+        return paths
+
+    def _file_node_paths(self, node):
+        lo, hi = 0, self._node_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._file_node(mid)[:2] < node:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self._node_count:
+            dev, ino, ofs, n = self._file_node(lo)
+            if (dev, ino) == node:
+                return self._file_paths(ofs, n)
+        return []
+
+    def _file_path_node(self, path):
+        h = _path_hash(path)
+        lo, hi = 0, self._path_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._file_hash(mid)[0] < h:
+                lo = mid + 1
+            else:
+                hi = mid
+        while lo < self._path_count:
+            ph, dev, ino = self._file_hash(lo)
+            if ph != h:
+                break
+            if path in self._file_node_paths((dev, ino)):
+                return dev, ino
+            lo += 1
+        return None
+
+    def _path_node(self, path):
+        node = self._added_path.get(path)
+        if node:
+            return node
+        if path in self._deleted:
+            return None
+        return self._file_path_node(path)
+
+    def _write(self, f):
+        deleted_hashes = {}
+        for path, node in self._deleted.items():
+            key = (_path_hash(path),) + node
+            deleted_hashes[key] = deleted_hashes.get(key, 0) + 1
+        def old_hashes():
+            for i in range(self._path_count):
+                rec = self._file_hash(i)
+                n = deleted_hashes.get(rec)
+                if n:
+                    deleted_hashes[rec] = n - 1
+                    continue
+                yield rec
+        new_hashes = sorted((_path_hash(path),) + node
+                            for path, node in self._added_path.items())
+        def old_nodes():
+            for i in range(self._node_count):
+                dev, ino, ofs, n = self._file_node(i)
+                yield (dev, ino), ofs, n
+        new_nodes = ((node, None, 0) for node in sorted(self._added))
+
+        node_count = path_count = 0
+        f.write(HLINKDB_HDR)
+        f.write(_COUNTS.pack(0, 0))
+        with TemporaryFile() as hashes, TemporaryFile() as heap:
+            for rec in merge(old_hashes(), new_hashes):
+                hashes.write(_HASH.pack(*rec))
+                path_count += 1
+            heap_ofs = 0
+            prev_old = None
+            # Ties go to the file's node, which includes any additions
+            for node, ofs, n in merge(old_nodes(), new_nodes,
+                                      key=lambda x: x[0]):
+                if ofs is None:
+                    if node == prev_old:
+                        continue
+                    paths = self._added[node]
+                else:
+                    prev_old = node
+                    paths = [p for p in self._file_paths(ofs, n)
+                             if self._deleted.get(p) != node]
+                    paths.extend(self._added.get(node, ()))
+                if not paths:
+                    continue
+                f.write(_NODE.pack(node[0], node[1], heap_ofs, len(paths)))
+                node_count += 1
+                for path in paths:
+                    heap.write(_PATH_LEN.pack(len(path)))
+                    heap.write(path)
+                    heap_ofs += _PATH_LEN.size + len(path)
+            for tmp in (hashes, heap):
+                tmp.seek(0)
+                copyfileobj(tmp, f)
+        f.seek(len(HLINKDB_HDR))
+        f.write(_COUNTS.pack(node_count, path_count))
 
     def prepare_save(self):
         """ Commit all of the relevant data to disk.  Do as much work
         as possible without actually making the changes visible."""
         if self._pending_save:
             raise Error('save of %r already in progress' % self._filename)
+        self._prepared = True
+        if not self._dirty:
+            return
         with self._cleanup:
-            if self._node_paths:
+            if self._path_count - len(self._deleted) + len(self._added_path):
                 self._pending_save = atomically_replaced_file(self._filename,
                                                               mode='wb',
                                                               buffering=65536)
                 with self._cleanup.enter_context(self._pending_save) as f:
-                    pickle.dump(self._node_paths, f, 2)
+                    self._write(f)
                     f.flush()
                     fsync(f.fileno())
             else: # No data
@@ -53,7 +232,8 @@ class HLinkDB:
         if self.closed:
             return
         self.closed = True
-        if self._node_paths and not self._pending_save:
+        self._close_map()
+        if self._dirty and not self._prepared:
             raise Error('cannot commit save of %r; no save prepared'
                         % self._filename)
         self._cleanup.close()
@@ -63,6 +243,7 @@ class HLinkDB:
         if self.closed:
             return
         self.closed = True
+        self._close_map()
         with self._cleanup:
             if self._pending_save:
                 self._pending_save.cancel()
@@ -78,34 +259,37 @@ class HLinkDB:
         assert self.closed
 
     def add_path(self, path, dev, ino):
-        # Assume path is new.
-        node = b'%d:%d' % (dev, ino)
-        self._path_node[path] = node
-        link_paths = self._node_paths.get(node)
-        if link_paths and path not in link_paths:
-            link_paths.append(path)
-        else:
-            self._node_paths[node] = [path]
-
-    def _del_node_path(self, node, path):
-        link_paths = self._node_paths[node]
-        link_paths.remove(path)
-        if not link_paths:
-            del self._node_paths[node]
+        node = (dev, ino)
+        prev_node = self._path_node(path)
+        if prev_node == node:
+            return
+        if prev_node:
+            self.del_path(path)
+        self._added.setdefault(node, []).append(path)
+        self._added_path[path] = node
+        self._dirty = True
 
     def change_path(self, path, new_dev, new_ino):
-        prev_node = self._path_node.get(path)
-        if prev_node:
-            self._del_node_path(prev_node, path)
-        self.add_path(new_dev, new_ino, path)
+        self.add_path(path, new_dev, new_ino)
 
     def del_path(self, path):
         # Path may not be in db (if updating a pre-hardlink support index).
-        node = self._path_node.get(path)
+        node = self._added_path.pop(path, None)
         if node:
-            self._del_node_path(node, path)
-            del self._path_node[path]
+            link_paths = self._added[node]
+            link_paths.remove(path)
+            if not link_paths:
+                del self._added[node]
+            self._dirty = True
+        elif path not in self._deleted:
+            node = self._file_path_node(path)
+            if node:
+                self._deleted[path] = node
+                self._dirty = True
 
     def node_paths(self, dev, ino):
-        node = b'%d:%d' % (dev, ino)
-        return self._node_paths[node]
+        node = (dev, ino)
+        paths = [p for p in self._file_node_paths(node)
+                 if self._deleted.get(p) != node]
+        paths.extend(self._added.get(node, ()))
+        return paths
@@ -1,9 +1,13 @@
 
+from array import array
+from bisect import bisect_left
 from contextlib import ExitStack
-import os, stat, struct
+from shutil import copyfileobj
+from tempfile import TemporaryFile
+import fcntl, os, stat, struct
 
 from bup import metadata, xstat
-from bup._helpers import UINT_MAX, bytescmp
+from bup._helpers import IndexIter, bytescmp, index_entry_decode, index_merge
 from bup.helpers import \
     (add_error,
      atomically_replaced_file,
@@ -11,18 +15,30 @@ from bup.helpers import \
      log,
      merge_iter,
      mkdirp,
+     mmap_read,
      mmap_readwrite,
      progress,
      qprogress,
      resolve_parent,
+     Sha1,
      slashappend)
+from bup.io import path_msg
 from bup.metadata import empty_metadata
 
 
 EMPTY_SHA = b'\0' * 20
 FAKE_SHA = b'\x01' * 20
 
-INDEX_HDR = b'BUPI\0\0\0\7'
+INDEX_HDR = b'BUPI\0\0\0\x08'
+_INDEX_HDR_V7 = b'BUPI\0\0\0\7'
+
+# An index is the header, followed by the fixed length entry records,
+# followed by a heap of the entries' names (basenames), followed by
+# the footer.  Each directory's children are consecutive (in reverse
+# order by name), and children_ofs is the file offset of the first
+# one's record.  The records are written in the order the Writer's
+# Levels are closed, so each directory comes after its children, and
+# the root (/) is last.
 
 # Time values are handled as integer nanoseconds since the epoch in
 # memory, but are written as xstat/metadata timespecs.  This behavior
@@ -47,8 +63,17 @@ INDEX_SIG = ('!'
              'I'                # children_n
              'Q')               # meta_ofs
 
-ENTLEN = struct.calcsize(INDEX_SIG)
-FOOTER_SIG = '!Q'
+# Follows the INDEX_SIG fields in each record.  Repacking an existing
+# entry only rewrites the INDEX_SIG fields.
+NAME_SIG = ('!'
+            'Q'                 # name offset (within the name heap)
+            'I')                # name length
+
+SIGLEN = struct.calcsize(INDEX_SIG)
+ENTLEN = SIGLEN + struct.calcsize(NAME_SIG)
+FOOTER_SIG = ('!'
+              'Q'               # name heap offset
+              'Q')              # entry count
 FOOTLEN = struct.calcsize(FOOTER_SIG)
 
 IX_EXISTS = 0x8000        # file exists on filesystem
@@ -79,42 +104,195 @@ class MetaStoreReader:
         return metadata.Metadata.read(self._file)
 
 
+# The MetaStoreWriter's dedup table (e.g. bupindex.meta.ix) is an
+# open addressed (linear probing) hash table mapping the sha1 of each
+# encoded metadata record to its offset in the metastore.  It's just a
+# cache; whenever it can't be trusted, it's rebuilt from the metastore.
+# The header records the metastore (dev, ino) and the size it covers,
+# and is marked dirty while a writer has it open.
+_META_TABLE_MAGIC = b'BMIX'
+_META_TABLE_VERSION = 1
+_META_TABLE_HDR = struct.Struct('!'
+                                '4s'   # magic
+                                'I'    # version
+                                'Q'    # metastore size covered
+                                'Q'    # entry count
+                                'Q'    # metastore dev
+                                'Q'    # metastore ino
+                                'I'    # log2(slot count)
+                                'I')   # dirty
+# Each slot is a sha1 followed by 1 + the offset (0 for an empty slot)
+_META_SLOT = struct.Struct('!20sQ')
+_META_TABLE_MIN_BITS = 13
+
+
+class _MetaTable:
+    def __init__(self, path, m):
+        self.path = path
+        self.m = m
+        self.magic, self.version, self.covered, self.count, self.dev, \
+            self.ino, self.bits, self.dirty = _META_TABLE_HDR.unpack_from(m)
+        self.mask = (1 << self.bits) - 1
+
+    @staticmethod
+    def _mapped(f, bits):
+        f.truncate(_META_TABLE_HDR.size + _META_SLOT.size * (1 << bits))
+        return mmap_readwrite(f, close=False)
+
+    @classmethod
+    def create(cls, path, dev, ino, bits=_META_TABLE_MIN_BITS):
+        # Replace any existing table (as _grow() does) rather than
+        # truncating it, since another writer may have it mapped.
+        with atomically_replaced_file(path, mode='w+b') as f:
+            m = cls._mapped(f, bits)
+            _META_TABLE_HDR.pack_into(m, 0, _META_TABLE_MAGIC,
+                                      _META_TABLE_VERSION,
+                                      0, 0, dev, ino, bits, 0)
+            m.flush()
+        return cls(path, m)
+
+    @classmethod
+    def open(cls, path, st):
+        """Return the existing table at path if it's usable for the
+        metastore described by st, otherwise None."""
+        try:
+            f = open(path, 'r+b') # pylint: disable=consider-using-with
+        except FileNotFoundError:
+            return None
+        with f:
+            if os.fstat(f.fileno()).st_size < _META_TABLE_HDR.size:
+                return None
+            m = mmap_readwrite(f, close=False)
+        t = cls(path, m)
+        if t.magic == _META_TABLE_MAGIC \
+           and t.version == _META_TABLE_VERSION \
+           and not t.dirty \
+           and (t.dev, t.ino) == (st.st_dev, st.st_ino) \
+           and t.covered <= st.st_size \
+           and len(m) == _META_TABLE_HDR.size + _META_SLOT.size * (1 << t.bits):
+            return t
+        m.close()
+        return None
+
+    def _sync_header(self):
+        _META_TABLE_HDR.pack_into(self.m, 0, self.magic, self.version,
+                                  self.covered, self.count, self.dev, self.ino,
+                                  self.bits, self.dirty)
+
+    def set_dirty(self, dirty):
+        self.dirty = 1 if dirty else 0
+        self._sync_header()
+        self.m.flush()
+
+    def _slot(self, digest):
+        """Return the position of digest's slot, or of the empty
+        slot where it belongs, along with the stored offset (+ 1)."""
+        m, mask, slot_size = self.m, self.mask, _META_SLOT.size
+        i = int.from_bytes(digest[:8], 'big') & mask
+        while True:
+            pos = _META_TABLE_HDR.size + i * slot_size
+            key, ofs = _META_SLOT.unpack_from(m, pos)
+            if not ofs or key == digest:
+                return pos, ofs
+            i = (i + 1) & mask
+
+    def get(self, digest):
+        ofs = self._slot(digest)[1]
+        return ofs - 1 if ofs else None
+
+    def add(self, digest, ofs):
+        # Keep the load factor under 2/3
+        if (self.count + 1) * 3 > (self.mask + 1) * 2:
+            self._grow()
+        pos, prev = self._slot(digest)
+        if not prev:
+            _META_SLOT.pack_into(self.m, pos, digest, ofs + 1)
+            self.count += 1
+
+    def _grow(self):
+        old = self.m
+        self.bits += 1
+        self.mask = (1 << self.bits) - 1
+        with atomically_replaced_file(self.path, mode='w+b') as f:
+            self.m = self._mapped(f, self.bits)
+            self.count = 0
+            self._sync_header()
+            for key, ofs in _META_SLOT.iter_unpack(old[_META_TABLE_HDR.size:]):
+                if ofs:
+                    pos = self._slot(key)[0]
+                    _META_SLOT.pack_into(self.m, pos, key, ofs)
+                    self.count += 1
+            self.m.flush()
+        old.close()
+
+    def close(self):
+        m, self.m = self.m, None
+        if m:
+            m.close()
+
+
 class MetaStoreWriter:
     # For now, we just append to the file, and try to handle any
     # truncation or corruption somewhat sensibly.
 
     def __init__(self, filename):
         self._closed = False
-        # Map metadata hashes to bupindex.meta offsets.
-        self._offsets = {}
         self._filename = filename
         self._file = None
+        self._offsets = None
         dirname = os.path.dirname(filename)
         if dirname:
             mkdirp(dirname)
-        # FIXME: see how slow this is; does it matter?
-        with open(filename, 'ab+') as m_file:
-            m_file.seek(0)
+        self._file = open(filename, 'ab') # pylint: disable=consider-using-with
+        try:
+            st = os.fstat(self._file.fileno())
+            table_path = filename + b'.ix'
+            self._offsets = _MetaTable.open(table_path, st)
+            if not self._offsets:
+                self._offsets = _MetaTable.create(table_path,
+                                                  st.st_dev, st.st_ino)
+            # Mark it dirty so that it'll be rebuilt if we don't finish
+            self._offsets.set_dirty(True)
+            if self._offsets.covered < st.st_size:
+                self._add_existing(self._offsets.covered)
+        except:
+            self.close(abort=True)
+            raise
+
+    def _add_existing(self, start):
+        # Add any records the table doesn't cover yet (i.e. all of
+        # them when it's new).
+        with open(self._filename, 'rb') as m_file:
+            m_file.seek(start)
             try:
                 m_off = m_file.tell()
                 m = metadata.Metadata.read(m_file)
                 while m:
-                    m_encoded = m.encode()
-                    self._offsets[m_encoded] = m_off
+                    self._offsets.add(Sha1(m.encode(include_path=False)).digest(),
+                                      m_off)
                     m_off = m_file.tell()
                     m = metadata.Metadata.read(m_file)
             except EOFError:
                 pass
             except:
-                log('index metadata in %r appears to be corrupt\n' % filename)
+                log('index metadata in %r appears to be corrupt\n'
+                    % self._filename)
                 raise
-        self._file = open(filename, 'ab') # pylint: disable=consider-using-with
 
-    def close(self):
+    def close(self, abort=False):
+        # When aborting, leave the table dirty so that it'll be rebuilt
         self._closed = True
-        if self._file:
-            self._file.close()
-            self._file = None
+        f, self._file = self._file, None
+        offsets, self._offsets = self._offsets, None
+        try:
+            if f:
+                f.close()
+                if offsets and not abort:
+                    offsets.covered = os.stat(self._filename).st_size
+                    offsets.set_dirty(False)
+        finally:
+            if offsets:
+                offsets.close()
 
     def __del__(self): assert self._closed
     def __enter__(self): return self
@@ -122,12 +300,13 @@ class MetaStoreWriter:
 
     def store(self, meta):
         meta_encoded = meta.encode(include_path=False)
-        ofs = self._offsets.get(meta_encoded)
-        if ofs:
+        digest = Sha1(meta_encoded).digest()
+        ofs = self._offsets.get(digest)
+        if ofs is not None:
             return ofs
         ofs = self._file.tell()
         self._file.write(meta_encoded)
-        self._offsets[meta_encoded] = ofs
+        self._offsets.add(digest, ofs)
         return ofs
 
 
@@ -138,27 +317,27 @@ class Level:
         self.list = []
         self.count = 0
 
-    def write(self, f):
+    def write(self, f, names):
         (ofs,n) = (f.tell(), len(self.list))
         if self.list:
             count = len(self.list)
             #log('popping %r with %d entries\n'
             #    % (''.join(self.ename), count))
             for e in self.list:
-                e.write(f)
+                e.write(f, names)
             if self.parent:
                 self.parent.count += count + self.count
         return (ofs,n)
 
 
-def _golevel(level, f, ename, newentry, metastore, tmax):
+def _golevel(level, f, names, ename, newentry, metastore, tmax):
     # close nodes back up the tree
     assert(level)
     default_meta_ofs = metastore.store(empty_metadata)
     while ename[:len(level.ename)] != level.ename:
         n = BlankNewEntry(level.ename[-1], default_meta_ofs, tmax)
         n.flags |= IX_EXISTS
-        (n.children_ofs,n.children_n) = level.write(f)
+        (n.children_ofs,n.children_n) = level.write(f, names)
         level.parent.list.append(n)
         level = level.parent
 
@@ -170,7 +349,7 @@ def _golevel(level, f, ename, newentry, metastore, tmax):
     assert(ename == level.ename)
     n = newentry or \
         BlankNewEntry(ename and level.ename[-1] or None, default_meta_ofs, tmax)
-    (n.children_ofs,n.children_n) = level.write(f)
+    (n.children_ofs,n.children_n) = level.write(f, names)
     if level.parent:
         level.parent.list.append(n)
     level = level.parent
@@ -200,24 +379,27 @@ class Entry:
                    self.flags, self.meta_ofs,
                    self.children_ofs, self.children_n))
 
-    def packed(self):
+    def _pack(self, pack, *args):
         try:
             ctime = xstat.nsecs_to_timespec(self.ctime)
             mtime = xstat.nsecs_to_timespec(self.mtime)
             atime = xstat.nsecs_to_timespec(self.atime)
-            return struct.pack(INDEX_SIG,
-                               self.dev, self.ino, self.nlink,
-                               ctime[0], ctime[1],
-                               mtime[0], mtime[1],
-                               atime[0], atime[1],
-                               self.size, self.mode,
-                               self.gitmode, self.sha, self.flags,
-                               self.children_ofs, self.children_n,
-                               self.meta_ofs)
+            return pack(INDEX_SIG, *args,
+                        self.dev, self.ino, self.nlink,
+                        ctime[0], ctime[1],
+                        mtime[0], mtime[1],
+                        atime[0], atime[1],
+                        self.size, self.mode,
+                        self.gitmode, self.sha, self.flags,
+                        self.children_ofs, self.children_n,
+                        self.meta_ofs)
         except (DeprecationWarning, struct.error) as e:
             log('pack error: %s (%r)\n' % (e, self))
             raise
 
+    def packed(self):
+        return self._pack(struct.pack)
+
     def stale(self, st, check_device=True):
         if self.size != st.st_size:
             return True
@@ -331,8 +513,12 @@ class Entry:
     def __ge__(self, other):
         return self._cmp(other) >= 0
 
-    def write(self, f):
-        f.write(self.basename + b'\0' + self.packed())
+    def write(self, f, names):
+        """Write the record to f, and the basename to names, the
+        name heap."""
+        f.write(self.packed()
+                + struct.pack(NAME_SIG, names.tell(), len(self.basename)))
+        names.write(self.basename)
 
 
 class NewEntry(Entry):
@@ -356,20 +542,38 @@ class BlankNewEntry(NewEntry):
                           0, EMPTY_SHA, 0, meta_ofs, 0, 0)
 
 
+_existing_entry_fields = frozenset(('dev', 'ino', 'nlink',
+                                   'ctime', 'mtime', 'atime',
+                                   'size', 'mode', 'gitmode', 'sha', 'flags',
+                                   'children_ofs', 'children_n', 'meta_ofs'))
+
 class ExistingEntry(Entry):
+    """An entry in an existing (mmapped) index.  The fields of the
+    record aren't decoded until one of them is needed, since walks
+    (e.g. via filter()) often only look at a fraction of the entries
+    they visit."""
+
     def __init__(self, parent, basename, name, m, ofs):
-        Entry.__init__(self, basename, name, None, None)
+        # Not Entry.__init__(), which would set some of the fields
+        # that should be decoded lazily (see __getattr__).
+        assert basename is None or isinstance(basename, bytes)
+        assert name is None or isinstance(name, bytes)
+        self.basename = basename
+        self.name = name
+        self.tmax = None
         self.parent = parent
         self._m = m
         self._ofs = ofs
-        (self.dev, self.ino, self.nlink,
-         self.ctime, ctime_ns, self.mtime, mtime_ns, self.atime, atime_ns,
-         self.size, self.mode, self.gitmode, self.sha,
-         self.flags, self.children_ofs, self.children_n, self.meta_ofs
-         ) = struct.unpack(INDEX_SIG, m[ofs : ofs + ENTLEN])
-        self.atime = xstat.timespec_to_nsecs((self.atime, atime_ns))
-        self.mtime = xstat.timespec_to_nsecs((self.mtime, mtime_ns))
-        self.ctime = xstat.timespec_to_nsecs((self.ctime, ctime_ns))
+
+    def __getattr__(self, attr):
+        # Only called when attr hasn't been set yet.
+        if attr not in _existing_entry_fields:
+            raise AttributeError(attr)
+        # Decodes all the fields, but doesn't clobber any that have
+        # already been assigned (e.g. by update_from_stat()).
+        d = self.__dict__
+        index_entry_decode(d, self._m, self._ofs)
+        return d[attr]
 
     # effectively, we don't bother messing with IX_SHAMISSING if
     # not IX_HASHVALID, since it's redundant, and repacking is more
@@ -390,39 +594,97 @@ class ExistingEntry(Entry):
             self.repack()
 
     def repack(self):
-        self._m[self._ofs:self._ofs+ENTLEN] = self.packed()
+        # Update the record in place
+        self._pack(struct.pack_into, self._m, self._ofs)
         if self.parent and not self.is_valid():
             self.parent.invalidate()
             self.parent.repack()
 
     def iter(self, name=None, wantrecurse=None):
-        dname = name
-        if dname and not dname.endswith(b'/'):
-            dname += b'/'
-        ofs = self.children_ofs
-        assert(ofs <= len(self._m))
-        assert(self.children_n <= UINT_MAX)  # i.e. python struct 'I'
-        for _ in range(self.children_n):
-            eon = self._m.find(b'\0', ofs)
-            assert(eon >= 0)
-            assert(eon >= ofs)
-            assert(eon > ofs)
-            basename = self._m[ofs : ofs + (eon - ofs)]
-            child = ExistingEntry(self, basename, self.name + basename,
-                                  self._m, eon+1)
-            if (not dname
-                 or child.name.startswith(dname)
-                 or child.name.endswith(b'/') and dname.startswith(child.name)):
-                if not wantrecurse or wantrecurse(child):
-                    yield from child.iter(name=name, wantrecurse=wantrecurse)
-            if not name or child.name == name or child.name.startswith(dname):
-                yield child
-            ofs = eon + 1 + ENTLEN
+        """Return an iterator over the entries below this one, each
+        after its own children, restricted to the path name (if any),
+        and only descending into the entries for which wantrecurse
+        (if any) returns true."""
+        return IndexIter(self._m, self, self.name, self._ofs, name,
+                         wantrecurse, ExistingEntry)
 
     def __iter__(self):
         return self.iter()
 
 
+def _name_at(m, heap_ofs, ofs):
+    name_ofs, name_len = struct.unpack_from(NAME_SIG, m, ofs + SIGLEN)
+    name_ofs += heap_ofs
+    return m[name_ofs : name_ofs + name_len]
+
+
+def _convert_v7(path, f):
+    """Rewrite the version 7 index f (at path) in the current format,
+    preserving all of the entries, in the same order."""
+    log('bup: converting index %s to version 8\n' % path_msg(path))
+    entlen_v7 = SIGLEN
+    footlen_v7 = 8
+    # children_ofs, children_n, and meta_ofs are last
+    children_at = SIGLEN - struct.calcsize('!QIQ')
+    st = os.fstat(f.fileno())
+    with mmap_read(f, close=False) as m, \
+         atomically_replaced_file(path, mode='wb', buffering=65536) as out, \
+         _name_heap(path) as names:
+        out.write(INDEX_HDR)
+        # The v7 offsets of the entries so far, to translate children_ofs
+        starts = array('Q')
+        ofs = len(_INDEX_HDR_V7)
+        end = st.st_size - footlen_v7
+        while ofs + entlen_v7 <= end:
+            eon = m.find(b'\0', ofs)
+            if eon <= ofs:
+                raise Error('%s: invalid v7 entry name at offset %d'
+                            % (path_msg(path), ofs))
+            rec = bytearray(m[eon + 1 : eon + 1 + entlen_v7])
+            children_ofs, children_n = \
+                struct.unpack_from('!QI', rec, children_at)
+            i = bisect_left(starts, children_ofs)
+            if children_n and (i == len(starts) or starts[i] != children_ofs):
+                raise Error('%s: invalid v7 children offset %d'
+                            % (path_msg(path), children_ofs))
+            struct.pack_into('!Q', rec, children_at,
+                             len(INDEX_HDR) + i * ENTLEN)
+            out.write(rec + struct.pack(NAME_SIG, names.tell(), eon - ofs))
+            names.write(m[ofs:eon])
+            starts.append(ofs)
+            ofs = eon + 1 + entlen_v7
+        _write_names_and_footer(out, names, len(starts))
+        out.flush()
+        fsync(out.fileno())
+
+
+def convert_v7(filename):
+    """If filename is a version 7 index, rewrite it in the current
+    format, and return true.  Holds an exclusive flock() on the old
+    index while converting, so that concurrent callers don't both
+    convert it.  Only the index writer (bup index) should call this;
+    Reader refuses version 7 indexes rather than modifying them."""
+    while True:
+        try:
+            # pylint: disable-next=consider-using-with
+            f = open(filename, 'rb')
+        except FileNotFoundError:
+            return False
+        with f:
+            fcntl.flock(f.fileno(), fcntl.LOCK_EX)
+            if f.read(len(_INDEX_HDR_V7)) != _INDEX_HDR_V7:
+                return False
+            try:
+                st = os.stat(filename)
+            except FileNotFoundError:
+                return False
+            fst = os.fstat(f.fileno())
+            if (st.st_dev, st.st_ino) != (fst.st_dev, fst.st_ino):
+                continue  # replaced (e.g. converted) while we waited
+            _convert_v7(filename, f)
+            return True
+
+
 class Reader:
     def __init__(self, filename):
         self.closed = False
@@ -430,6 +692,7 @@ class Reader:
         self.m = b''
         self.writable = False
         self.count = 0
+        self.heap_ofs = 0
         with ExitStack() as ctx:
             try:
                 # pylint: disable-next=consider-using-with
@@ -437,6 +700,11 @@ class Reader:
             except FileNotFoundError:
                 return
             b = f.read(len(INDEX_HDR))
+            if b == _INDEX_HDR_V7:
+                self.closed = True
+                raise Error('%s: index has an older format;'
+                            ' run "bup index -u" to convert it'
+                            % path_msg(filename))
             if b != INDEX_HDR:
                 log('warning: %s: header: expected %r, got %r\n'
                                  % (filename, INDEX_HDR, b))
@@ -447,9 +715,9 @@ class Reader:
                 ctx.pop_all()
                 ctx.enter_context(m)
                 self.writable = True
-                self.count = struct.unpack(FOOTER_SIG,
-                                           m[st.st_size - FOOTLEN
-                                             : st.st_size])[0]
+                self.heap_ofs, self.count = \
+                    struct.unpack(FOOTER_SIG,
+                                  m[st.st_size - FOOTLEN : st.st_size])
                 self.m = m
                 ctx.pop_all()
 
@@ -459,24 +727,35 @@ class Reader:
     def __len__(self):
         return int(self.count)
 
+    def _entries(self):
+        """Return the number of entry records."""
+        if not self.m:
+            return 0
+        return (self.heap_ofs - len(INDEX_HDR)) // ENTLEN
+
+    def entry(self, i):
+        """Return the i'th entry in the file (each directory comes
+        after its children, and / is last), named by its basename."""
+        if not 0 <= i < self._entries():
+            raise IndexError(i)
+        ofs = len(INDEX_HDR) + i * ENTLEN
+        basename = _name_at(self.m, self.heap_ofs, ofs)
+        return ExistingEntry(None, basename, basename, self.m, ofs)
+
     def forward_iter(self):
-        ofs = len(INDEX_HDR)
-        while ofs+ENTLEN <= len(self.m)-FOOTLEN:
-            eon = self.m.find(b'\0', ofs)
-            assert(eon >= 0)
-            assert(eon >= ofs)
-            assert(eon > ofs)
-            basename = self.m[ofs : ofs + (eon - ofs)]
-            yield ExistingEntry(None, basename, basename, self.m, eon+1)
-            ofs = eon + 1 + ENTLEN
+        for i in range(self._entries()):
+            yield self.entry(i)
+
+    def _root(self):
+        return ExistingEntry(None, b'/', b'/',
+                             self.m, self.heap_ofs - ENTLEN)
 
     def iter(self, name=None, wantrecurse=None):
-        if len(self.m) > len(INDEX_HDR)+ENTLEN:
+        if self._entries():
             dname = name
             if dname and not dname.endswith(b'/'):
                 dname += b'/'
-            root = ExistingEntry(None, b'/', b'/',
-                                 self.m, len(self.m)-FOOTLEN-ENTLEN)
+            root = self._root()
             yield from root.iter(name=name, wantrecurse=wantrecurse)
             if not dname or dname == root.name:
                 yield root
@@ -485,9 +764,30 @@ class Reader:
         return self.iter()
 
     def find(self, name):
-        return next((e for e in self.iter(name, wantrecurse=lambda x : True)
-                     if e.name == name),
-                    None)
+        """Return the entry for name, or None.  Finds each of the
+        path's elements via a binary search of the (reverse sorted)
+        children of the previous one."""
+        if not self._entries():
+            return None
+        m, heap_ofs = self.m, self.heap_ofs
+        parts = pathsplit(name)
+        if not parts or parts[0] != b'/':
+            return None
+        e = self._root()
+        for part in parts[1:]:
+            lo, hi = 0, e.children_n
+            first = e.children_ofs
+            while lo < hi:
+                mid = (lo + hi) // 2
+                if _name_at(m, heap_ofs, first + mid * ENTLEN) > part:
+                    lo = mid + 1
+                else:
+                    hi = mid
+            ofs = first + lo * ENTLEN
+            if lo == e.children_n or _name_at(m, heap_ofs, ofs) != part:
+                return None
+            e = ExistingEntry(e, part, e.name + part, m, ofs)
+        return e
 
     def exists(self):
         return self.m
@@ -536,12 +836,24 @@ def pathsplit(p):
     return l
 
 
+def _name_heap(index_path):
+    return TemporaryFile(dir=os.path.dirname(index_path),
+                         prefix=b'.tmp-names-', buffering=65536)
+
+
+def _write_names_and_footer(f, names, count):
+    heap_ofs = f.tell()
+    names.seek(0)
+    copyfileobj(names, f)
+    f.write(struct.pack(FOOTER_SIG, heap_ofs, count))
+
+
 class Writer:
     def __init__(self, filename, metastore, tmax):
         self.closed = False
         self.rootlevel = self.level = Level([], None)
         self.pending_index = None
-        self.f = None
+        self.f = self.names = None
         self.count = 0
         self.lastfile = None
         self.filename = None
@@ -555,6 +867,7 @@ class Writer:
             self.f = self.cleanup.enter_context(self.pending_index)
             self.cleanup.enter_context(self.f)
             self.f.write(INDEX_HDR)
+            self.names = self.cleanup.enter_context(_name_heap(self.filename))
             self.cleanup = self.cleanup.pop_all()
 
     def __enter__(self): return self
@@ -565,12 +878,12 @@ class Writer:
 
     def flush(self):
         if self.level:
-            self.level = _golevel(self.level, self.f, [], None,
+            self.level = _golevel(self.level, self.f, self.names, [], None,
                                   self.metastore, self.tmax)
             self.count = self.rootlevel.count
             if self.count:
                 self.count += 1
-            self.f.write(struct.pack(FOOTER_SIG, self.count))
+            _write_names_and_footer(self.f, self.names, self.count)
             self.f.flush()
         assert(self.level is None)
 
@@ -593,7 +906,7 @@ class Writer:
             raise Error('%r must come before %r'
                              % (''.join(ename), ''.join(self.lastfile)))
         self.lastfile = ename
-        self.level = _golevel(self.level, self.f, ename, entry,
+        self.level = _golevel(self.level, self.f, self.names, ename, entry,
                               self.metastore, self.tmax)
 
     def add(self, name, st, meta_ofs, hashgen = None):
@@ -681,3 +994,22 @@ def merge(*iters):
     def pfinal(count, total):
         progress('bup: merging indexes (%d/%d), done.\n' % (count, total))
     return merge_iter(iters, 1024, pfunc, pfinal, key='name')
+
+
+def write_merged(filename, readers):
+    """Replace filename with the union of the readers' indexes, just
+    as if each of the entries produced by merge(*readers) had been
+    added to a Writer via add_ixentry(), but without creating any
+    entries.  Among otherwise equally preferred entries with the same
+    name, the one from the earliest reader wins."""
+    total = sum(len(r) for r in readers)
+    qprogress('bup: merging indexes (0/%d)\r' % total)
+    filename = resolve_parent(filename)
+    with atomically_replaced_file(filename, mode='wb') as f, \
+         _name_heap(filename) as names:
+        f.write(INDEX_HDR)
+        f.flush()
+        index_merge(f.fileno(), names.fileno(), len(INDEX_HDR),
+                    [r.m for r in readers if r.m])
+        fsync(f.fileno())
+    progress('bup: merging indexes (%d/%d), done.\n' % (total, total))
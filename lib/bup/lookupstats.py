@@ -0,0 +1,137 @@
+"""Optional statistics for the object lookup path.
+
+Once enabled (e.g. via --stats=json), each PackIdxList (and
+PackIdxSnapshot) lookup is timed, and its page faults counted, and the
+oid hash, bloom, midx, and idx searches beneath it are tallied, so
+that parameters like the bloom filter size and the midx thresholds can
+be chosen from real numbers.  When disabled, the lookup path only pays
+for a check of the enabled flag.  The counters aren't locked, so
+they're approximate when several threads are performing lookups.
+
+"""
+
+from contextlib import contextmanager
+from time import perf_counter_ns
+import json, resource
+
+from bup.helpers import log
+
+
+enabled = False
+
+_counts = {}
+_latency = {}
+_info = {}
+_faults = [0, 0]
+
+# Only count the faults incurred by the current thread, when possible.
+_rusage_who = getattr(resource, 'RUSAGE_THREAD', resource.RUSAGE_SELF)
+
+formats = ('json',)
+
+
+def enable():
+    global enabled
+    enabled = True
+
+
+def reset():
+    _counts.clear()
+    _latency.clear()
+    _info.clear()
+    _faults[:] = [0, 0]
+
+
+def count(name, n=1):
+    """Add n to the counter name, e.g. 'bloom.negatives'."""
+    _counts[name] = _counts.get(name, 0) + n
+
+
+def note(section, **info):
+    """Record descriptive (non-cumulative) information, e.g. the
+    parameters of the bloom filter in use."""
+    _info.setdefault(section, {}).update(info)
+
+
+def timed(lookup, *args):
+    """Call lookup(*args), recording its latency (in the 'hit' or
+    'miss' histogram, according to the result) and page faults, and
+    return its result."""
+    ru = resource.getrusage(_rusage_who)
+    start = perf_counter_ns()
+    result = lookup(*args)
+    elapsed = perf_counter_ns() - start
+    ru_end = resource.getrusage(_rusage_who)
+    _faults[0] += ru_end.ru_minflt - ru.ru_minflt
+    _faults[1] += ru_end.ru_majflt - ru.ru_majflt
+    kind = 'hit' if result else 'miss'
+    hist = _latency.get(kind)
+    if not hist:
+        hist = _latency[kind] = [0] * 64
+    hist[min(elapsed.bit_length(), 63)] += 1
+    return result
+
+
+def _histogram(hist):
+    """Summarize a histogram whose bucket i holds the lookups taking
+    less than 2^i ns (and at least 2^(i-1))."""
+    total = sum(hist)
+    result = {'count': total,
+              'buckets': [{'lt_ns': 2**i, 'count': n}
+                          for i, n in enumerate(hist) if n]}
+    for name, fraction in (('p50_lt_ns', 0.5), ('p90_lt_ns', 0.9),
+                           ('p99_lt_ns', 0.99)):
+        seen = 0
+        for i, n in enumerate(hist):
+            seen += n
+            if seen >= total * fraction:
+                result[name] = 2**i
+                break
+    return result
+
+
+def report():
+    """Return the current statistics as a dict suitable for JSON."""
+    result = {}
+    for name, n in sorted(_counts.items()):
+        section, key = name.split('.', 1)
+        result.setdefault(section, {})[key] = n
+    for section, info in _info.items():
+        result.setdefault(section, {}).update(info)
+    lookups = result.setdefault('lookups', {})
+    lookups['minor_faults'], lookups['major_faults'] = _faults
+    lookups['latency'] = dict((kind, _histogram(hist))
+                              for kind, hist in sorted(_latency.items()))
+    b = result.get('bloom')
+    if b:
+        negatives = b.get('negatives', 0)
+        false_positives = b.get('false_positives', 0)
+        if negatives + false_positives:
+            b['observed_false_positive_rate'] = \
+                false_positives / (negatives + false_positives)
+    return result
+
+
+def write(fmt, f):
+    assert fmt in formats, fmt
+    f.write(json.dumps(report(), sort_keys=True))
+    f.write('\n')
+    f.flush()
+
+
+@contextmanager
+def reporting(fmt, f):
+    """Enable the statistics if fmt isn't None, and write them to f
+    in that format (currently only 'json') on the way out."""
+    if not fmt:
+        yield
+        return
+    assert fmt in formats, fmt
+    enable()
+    try:
+        yield
+    finally:
+        try:
+            write(fmt, f)
+        except OSError as ex:
+            log(f'error: unable to write lookup statistics: {ex}\n')
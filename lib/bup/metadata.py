@@ -12,7 +12,7 @@ from os import environb as environ
 from time import gmtime, strftime
 import copy, errno, os, sys, stat, socket, struct
 
-from bup import vint, xstat
+from bup import _helpers, vint, xstat
 from bup.drecurse import recursive_dirlist
 from bup.helpers import \
     (EXIT_FAILURE,
@@ -606,7 +606,8 @@ class Metadata:
             acl_rep = acl_rep[:2]
         if version == 1:
             acl_rep = self._correct_posix1e_v1_delimiters(acl_rep, self.path)
-        self.posix1e_acl = acl_rep
+        # A tuple (as from read_acl()), so that frozen instances hash
+        self.posix1e_acl = tuple(acl_rep) if acl_rep is not None else None
 
     def _apply_posix1e_acl_rec(self, path, restore_numeric_ids=False):
         if not self.posix1e_acl:
@@ -901,6 +902,12 @@ class Metadata:
         port.write(self.encode(include_path=include_path))
 
     def encode(self, include_path=True):
+        try:
+            return _helpers.metadata_encode((self,), include_path)
+        except OverflowError:
+            return self._encode(include_path)
+
+    def _encode(self, include_path):
         ret = []
         records = [(_rec_tag_path, self._encode_path())] if include_path else []
         records.extend([(_rec_tag_common_v3, self._encode_common()),
@@ -925,11 +932,34 @@ class Metadata:
         Return either a valid Metadata object, None on EOF, or empty
         (defaulting to metadata.empty_metadata) if there was no
         information at all (just a _rec_tag_end).  Throw an Exception
-        if a valid object could not be read completely.
+        if a valid object could not be read completely.  Reads from a
+        BytesIO (e.g. a whole .bupm), or whatever a port with a peek()
+        method has buffered, are handled in C.
 
         """
         if empty is _use_empty_metadata:
             empty = empty_metadata
+        if type(port) is BytesIO:
+            try:
+                with port.getbuffer() as buf:
+                    res = _helpers.metadata_decode(buf, port.tell(), Metadata)
+            except OverflowError:
+                pass # something unusual, let the code below handle it
+            else:
+                if res is None:
+                    return None
+                end, result = res
+                port.seek(end)
+                return empty if result is None else result
+        elif hasattr(port, 'peek'): # e.g. a BufferedReader or bup Conn
+            try:
+                res = _helpers.metadata_decode(port.peek(1), 0, Metadata)
+            except (OverflowError, EOFError):
+                res = None # unusual, or not all buffered
+            if res:
+                end, result = res
+                port.read(end)
+                return empty if result is None else result
         tag = vint.read_vuint(port)
         if tag is None:
             return None
@@ -1007,6 +1037,15 @@ class Metadata:
 empty_metadata = Metadata()
 
 
+def encode_all(metas, include_path=True):
+    """Return the concatenated encodings of metas, e.g. for a .bupm."""
+    metas = tuple(metas)
+    try:
+        return _helpers.metadata_encode(metas, include_path)
+    except OverflowError:
+        return b''.join(m.encode(include_path=include_path) for m in metas)
+
+
 def from_path(path, statinfo=None, archive_path=None,
               save_symlinks=True, hardlink_target=None,
               normalized=False, after_stat=None):
@@ -143,20 +143,27 @@ class PackMidx:
         for ofs in range(start, start + self.nsha * 20, 20):
             yield self.map[ofs : ofs + 20]
 
+    def oid_table(self):
+        """Return (buffer, stride) for the sorted oids (see idxmerge())."""
+        end = self.sha_ofs + self.nsha * 20
+        return memoryview(self.map)[self.sha_ofs : end], 20
+
     def __len__(self):
         return int(self.nsha)
 
 
-def open_midx(path, *, ignore_missing=True):
+def open_midx(path, *, ignore_missing=True, prefault=None, hugepages=False):
     """Return a PackMidx for path.  Return None if path exists but is
     either too old or too new.  If any of the constituent indexes are
     missing, raise MissingIdxs if ignore_missing is false otherwise
-    return None.
+    return None.  See mmap_read() for prefault and hugepages.
 
     """
     # FIXME: eventually note_error when not raising?
     assert path.endswith(b'.midx') # FIXME: wanted/needed?
-    mmap = mmap_read(open(path, mode='rb')) # pylint: disable=consider-using-with
+    # pylint: disable-next=consider-using-with
+    mmap = mmap_read(open(path, mode='rb'), prefault=prefault,
+                     hugepages=hugepages)
     with ExitStack() as contexts:
         contexts.enter_context(mmap)
         if _midx_header(mmap) != MIDX_HEADER:
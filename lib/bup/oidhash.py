@@ -0,0 +1,358 @@
+"""Persistent, memory-mapped oid -> (idx, offset) hash table.
+
+A bup.oidhash file maps every object in a set of pack idx files to the
+idx it's in and its offset in the corresponding pack, so that a lookup
+only costs one or two cache misses, no matter how many idx or midx
+files the repository has.  It's optional; when present (see bup midx
+--hash), PackIdxList consults it before any idx/midx file that it
+doesn't cover.
+
+The file is a 64 byte header:
+
+  magic 'OIDH', version, bits, flags, entries, idx count (all
+  in network byte order), and in the last 8 bytes, a native order
+  sequence count for readers (see oidhash_insert() in _helpers.c)
+
+followed by 2^bits 64 byte buckets of two 32 byte slots each:
+
+  oid (20 bytes), idx number + 1 (4 bytes, 0 means empty),
+  pack offset (8 bytes)
+
+followed by the NUL-separated names of the covered idx files.  Each oid
+lives in one of two buckets (cuckoo hashing), chosen by two different
+hashes of the whole oid.
+
+New idxes are added to the table in place (by one writer at a time,
+holding an exclusive flock() on the table), and any process that
+already has the table open ignores the new entries.  The table is only
+rebuilt (and atomically replaced) when it's too full, or when some of
+the idxes it covers have been removed.
+
+"""
+
+from contextlib import contextmanager
+import fcntl, os, struct
+
+from bup import _helpers
+from bup.helpers import (OBJECT_EXISTS,
+                         ObjectLocation,
+                         atomically_replaced_file,
+                         debug1,
+                         fsync,
+                         log,
+                         mmap_read,
+                         mmap_readwrite,
+                         qprogress,
+                         unlink)
+from bup.io import path_msg
+
+
+OIDHASH_HEADER = b'OIDH'
+OIDHASH_VERSION = 1
+HEADER_LEN = 64
+BUCKET_LEN = 64
+SLOTS_PER_BUCKET = 2
+MAX_BITS = 40
+
+# When (re)building, size the table for at most this load, so that
+# there's room to add new packs incrementally, and rebuild instead of
+# adding once the load would exceed MAX_LOAD (cuckoo insertion starts
+# failing for two-way, two-slot buckets around 0.9).
+BUILD_LOAD = 0.6
+MAX_LOAD = 0.85
+
+FLAG_DIRTY = 1
+
+_header_fmt = '!4sIIIQI'
+
+oidhash_add_idx = _helpers.oidhash_add_idx
+oidhash_find = _helpers.oidhash_find
+
+_total_searches = 0
+
+
+class TableFull(Exception):
+    pass
+
+
+def _capacity(bits):
+    return 2**bits * SLOTS_PER_BUCKET
+
+
+def _table_len(bits):
+    return HEADER_LEN + 2**bits * BUCKET_LEN
+
+
+class OidHash:
+    """An open bup.oidhash file.  Open it readwrite to add_idx() more
+    idxes; the table is marked dirty (and so ignored by readers) until
+    close() finishes successfully.
+
+    """
+    def __init__(self, filename, f=None, readwrite=False, *,
+                 prefault=None, hugepages=False):
+        """See mmap_read() for prefault and hugepages."""
+        self.closed = False
+        self.name = filename
+        self.readwrite = readwrite
+        self.file = None
+        self.map = None
+        self.bits = self.entries = 0
+        self.idxnames = []
+        self.dirty = False
+        # pylint: disable-next=consider-using-with
+        self.file = f = f or open(filename, 'r+b' if readwrite else 'rb')
+        f.seek(0)
+        hdr = f.read(HEADER_LEN)
+        if len(hdr) < HEADER_LEN or hdr[0:4] != OIDHASH_HEADER:
+            log('Warning: invalid oid hash header in %s\n' % path_msg(filename))
+            self._init_failed()
+            return
+        magic_, ver, bits, flags, entries, nidx = \
+            struct.unpack_from(_header_fmt, hdr)
+        if ver != OIDHASH_VERSION:
+            log('Warning: ignoring %s oid hash (v%d) %s\n'
+                % ('old-style' if ver < OIDHASH_VERSION else 'too-new', ver,
+                   path_msg(filename)))
+            self._init_failed()
+            return
+        if bits > MAX_BITS or os.fstat(f.fileno()).st_size < _table_len(bits):
+            log('Warning: truncated oid hash %s\n' % path_msg(filename))
+            self._init_failed()
+            return
+        self.dirty = bool(flags & FLAG_DIRTY)
+        self.bits, self.entries = bits, entries
+        f.seek(_table_len(bits))
+        names = f.read()
+        self.idxnames = names.split(b'\0') if names else []
+        if len(self.idxnames) != nidx:
+            log('Warning: inconsistent idx list in oid hash %s\n'
+                % path_msg(filename))
+            self._init_failed()
+            return
+        if readwrite:
+            self.map = mmap_readwrite(f, _table_len(bits), close=False,
+                                      prefault=prefault, hugepages=hugepages)
+        else:
+            self.map = mmap_read(f, _table_len(bits), close=False,
+                                 prefault=prefault, hugepages=hugepages)
+
+    def _init_failed(self):
+        self.idxnames = []
+        self.bits = self.entries = 0
+        self.map, tmp_map = None, self.map
+        self.file, tmp_file = None, self.file
+        try:
+            if tmp_map:
+                tmp_map.close()
+        finally:
+            if tmp_file:
+                tmp_file.close()
+
+    def valid(self):
+        return bool(self.map) and not self.dirty
+
+    def _write_header(self, flags):
+        self.map[0:struct.calcsize(_header_fmt)] = \
+            struct.pack(_header_fmt, OIDHASH_HEADER, OIDHASH_VERSION,
+                        self.bits, flags, self.entries, len(self.idxnames))
+
+    def discard(self):
+        """Close the table without finishing any pending update (so it
+        remains dirty, if it was)."""
+        self.readwrite = False
+        self.close()
+
+    def close(self):
+        self.closed = True
+        try:
+            if self.map and self.readwrite and self.dirty:
+                self.file.seek(_table_len(self.bits))
+                self.file.truncate()
+                self.file.write(b'\0'.join(self.idxnames))
+                self.file.flush()
+                self.map.flush()
+                fsync(self.file.fileno())
+                self._write_header(0)
+                self.map.flush()
+                self.dirty = False
+        finally:
+            self._init_failed()
+
+    def __del__(self): assert self.closed
+    def __enter__(self): return self
+    def __exit__(self, type, value, traceback): self.close()
+
+    def __len__(self):
+        return int(self.entries)
+
+    def load(self, additional=0):
+        return (self.entries + additional) / _capacity(self.bits)
+
+    def add_idx(self, ix):
+        """Add the objects in ix (a PackIdx) to the table.  Raise
+        TableFull if the table can't hold them, after which it must
+        be discarded.
+
+        """
+        assert self.readwrite
+        if not self.map:
+            raise Exception('Cannot add to closed oid hash')
+        if not self.dirty:
+            # Anyone who sees the table before we close() will
+            # ignore it.
+            self.dirty = True
+            self._write_header(FLAG_DIRTY)
+            self.map.flush()
+        added, complete = \
+            oidhash_add_idx(self.map, self.bits, ix.map, len(self.idxnames))
+        self.entries += added
+        self.idxnames.append(os.path.basename(ix.name))
+        if not complete:
+            raise TableFull()
+
+    def exists(self, hash, want_source=False, want_offset=False):
+        """Return an ObjectLocation if the object is in one of the
+        covered idxes, otherwise None."""
+        global _total_searches
+        _total_searches += 1
+        if not self.map:
+            return None
+        found = oidhash_find(self.map, self.bits, hash)
+        if not found:
+            return None
+        i, ofs = found
+        if i >= len(self.idxnames):  # added after we opened the table
+            return None
+        if not (want_source or want_offset):
+            return OBJECT_EXISTS
+        return ObjectLocation(self.idxnames[i] if want_source else None,
+                              ofs if want_offset else None)
+
+
+def _bits_for(entries, load):
+    bits = 0
+    while bits < MAX_BITS and entries > _capacity(bits) * load:
+        bits += 1
+    return bits
+
+
+def create(name, f, expected, load=BUILD_LOAD):
+    """Initialize f (named name) as an empty table with room for
+    expected entries at the given load, and return it as a readwrite
+    OidHash."""
+    bits = _bits_for(expected, load)
+    debug1('oidhash: using %d buckets (%d bits)\n' % (2**bits, bits))
+    f.seek(0)
+    f.truncate(0)
+    f.write(struct.pack(_header_fmt, OIDHASH_HEADER, OIDHASH_VERSION, bits,
+                        FLAG_DIRTY, 0, 0))
+    f.truncate(_table_len(bits))
+    f.flush()
+    return OidHash(name, f=f, readwrite=True)
+
+
+def _add_idxs(h, names, open_idx, total, done=0):
+    for name in names:
+        qprogress('oidhash: adding %.2f%% (%d/%d objects)\r'
+                  % (done * 100.0 / (total or 1), done, total))
+        with open_idx(name) as ix:
+            h.add_idx(ix)
+            done += len(ix)
+    return done
+
+
+@contextmanager
+def _writer_lock(path):
+    """Hold an exclusive flock() on the existing table at path (if
+    any), so that there's only one writer at a time."""
+    while True:
+        try:
+            # pylint: disable-next=consider-using-with
+            f = open(path, 'rb')
+        except FileNotFoundError:
+            yield
+            return
+        with f:
+            fcntl.flock(f.fileno(), fcntl.LOCK_EX)
+            try:
+                st = os.stat(path)
+            except FileNotFoundError:
+                continue
+            fst = os.fstat(f.fileno())
+            if (st.st_dev, st.st_ino) != (fst.st_dev, fst.st_ino):
+                continue  # replaced (e.g. rebuilt) while we waited
+            yield
+            return
+
+
+def _update(dir, path, open_idx, force):
+    present = set(os.path.basename(p) for p in os.listdir(dir)
+                  if p.endswith(b'.idx'))
+    sizes = {}
+    def size_of(name):
+        if name not in sizes:
+            with open_idx(os.path.join(dir, name)) as ix:
+                sizes[name] = len(ix)
+        return sizes[name]
+
+    if not force and os.path.exists(path):
+        with OidHash(path, readwrite=True) as h:
+            if not h.valid():
+                debug1('oidhash: existing table invalid, rebuilding\n')
+            elif not set(h.idxnames) <= present:
+                debug1('oidhash: covered idxes have been removed, rebuilding\n')
+            else:
+                new = sorted(present - set(h.idxnames))
+                if not new:
+                    debug1('oidhash: nothing to do.\n')
+                    return
+                additional = sum(size_of(n) for n in new)
+                if h.load(additional) > MAX_LOAD:
+                    debug1('oidhash: adding %d objects would exceed the max'
+                           ' load, rebuilding\n' % additional)
+                else:
+                    try:
+                        _add_idxs(h, [os.path.join(dir, n) for n in new],
+                                  open_idx, additional)
+                        return
+                    except TableFull:
+                        debug1('oidhash: table full, rebuilding\n')
+                        h.discard()  # leave it dirty so no one trusts it
+
+    names = sorted(present)
+    total = sum(size_of(n) for n in names)
+    load = BUILD_LOAD
+    while True:
+        replacement = atomically_replaced_file(path, 'w+b')
+        with replacement as f, create(path, f, total, load) as h:
+            try:
+                _add_idxs(h, [os.path.join(dir, n) for n in names],
+                          open_idx, total)
+                return
+            except TableFull:
+                debug1('oidhash: table full, retrying with a larger table\n')
+                h.discard()
+                replacement.cancel()
+            except BaseException:
+                h.discard()
+                raise
+        load /= 2
+        if load < BUILD_LOAD / 16:
+            raise Exception('unable to build oid hash %s' % path_msg(path))
+
+
+def update(dir, open_idx, *, force=False):
+    """Create or incrementally update dir/bup.oidhash so that it
+    covers all of the idx files in dir.  Rebuild it from scratch if
+    force is true, if any of the idxes it covers have disappeared, or
+    if it can't hold the new ones.
+
+    """
+    path = os.path.join(dir, b'bup.oidhash')
+    with _writer_lock(path):
+        _update(dir, path, open_idx, force)
+
+
+def clear_oidhash(dir):
+    unlink(os.path.join(dir, b'bup.oidhash'))
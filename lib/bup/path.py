@@ -53,9 +53,11 @@ class FSIndexPaths:
     stat: bytes
     meta: bytes
     hlink: bytes
+    journal: bytes
 
 def flat_fsindex(stem):
-    return FSIndexPaths(stat=stem, meta=stem + b'.meta', hlink=stem + b'.hlink')
+    return FSIndexPaths(stat=stem, meta=stem + b'.meta', hlink=stem + b'.hlink',
+                        journal=stem + b'.journal')
 
 def default_fsindex():
     return flat_fsindex(os.path.join(defaultrepo(), b'bupindex'))
@@ -336,8 +336,10 @@ class Server:
     def cat_batch(self, dummy_):
         self.init_session()
         # For now, avoid potential deadlock by just reading them all
-        for ref in tuple(lines_until_sentinel(self.conn, b'\n', Exception)):
-            ref = ref[:-1]
+        refs = tuple(ref[:-1] for ref
+                     in lines_until_sentinel(self.conn, b'\n', Exception))
+        # Stream each object rather than holding whole batches of them
+        for ref in refs:
             it = self.repo.cat(ref)
             info = next(it)
             if not info[0]:
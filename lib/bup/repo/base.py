@@ -74,6 +74,18 @@ class RepoProtocol:
         (oidx, type, size), and then all of the data associated with ref.
         """
 
+    @notimplemented
+    def cat_batch(self, refs):
+        """
+        For each of the refs, in order, yield (None, None, None, None)
+        if it does not exist, otherwise yield (oidx, type, size, it),
+        where it yields all of the data associated with the ref, as
+        cat() does, and must be exhausted before the next item is
+        requested.  This may be much faster than calling cat() for
+        each ref.  The iterator must be exhausted before making other
+        requests.
+        """
+
     @notimplemented
     def refs(self, patterns=None, limit_to_heads=False, limit_to_tags=False):
         """
@@ -15,9 +15,11 @@ class LocalRepo(RepoProtocol):
     def __init__(self, repo_dir=None, compression_level=None,
                  max_pack_size=None, max_pack_objects=None,
                  allow_duplicates=None, server=False, run_midx=None,
-                 on_pack_finish=None):
+                 on_pack_finish=None, jobs=1):
         """When allow_duplicates is false, (at some cost) avoid
         writing duplicates of objects that already in the repository.
+        When jobs is greater than one, compress and write new objects
+        in the background (see git.PackWriter).
 
         """
         # allow_duplicates instead of deduplicate_writes so None can
@@ -27,10 +29,10 @@ class LocalRepo(RepoProtocol):
         self._base = _make_base(self.config_get, compression_level,
                                 max_pack_size, max_pack_objects)
         self._on_pack_finish = on_pack_finish
+        self._jobs = jobs
         self._packwriter = None
         self.write_symlink = self.write_data
         self.write_bupm = self.write_data
-        self._cp = git.catpipe(self.repo_dir)
         self.rev_list = partial(git.rev_list, repo_dir=self.repo_dir)
 
         if server:
@@ -52,6 +54,9 @@ class LocalRepo(RepoProtocol):
                 self._deduplicate_writes = False
             else:
                 self._deduplicate_writes = True
+        # Each read borrows a reader from the pool, so that reads
+        # (e.g. via the vfs) may be made from any number of threads.
+        self._readers = git.ReaderPool(self.repo_dir, jobs=1)
         self.closed = False
 
     def __repr__(self):
@@ -62,7 +67,10 @@ class LocalRepo(RepoProtocol):
     def close(self):
         if not self.closed:
             self.closed = True
-            self.finish_writing()
+            try:
+                self.finish_writing()
+            finally:
+                self._readers.close()
 
     def __del__(self): assert self.closed
     def __enter__(self): return self
@@ -102,7 +110,8 @@ class LocalRepo(RepoProtocol):
             writer = PackWriter(store=store,
                                 compression_level=self._base.compression_level,
                                 max_pack_size=self._base.max_pack_size,
-                                max_pack_objects=self._base.max_pack_objects)
+                                max_pack_objects=self._base.max_pack_objects,
+                                jobs=self._jobs)
             self._packwriter = writer
 
     def update_ref(self, refname, newval, oldval):
@@ -110,12 +119,17 @@ class LocalRepo(RepoProtocol):
         return git.update_ref(refname, newval, oldval, repo_dir=self.repo_dir)
 
     def cat(self, ref):
-        it = self._cp.get(ref)
-        info = next(it, None) # cannot return None
-        oidx = info[0]
-        yield info
-        if oidx: yield from it
-        assert not next(it, None)
+        with self._readers.reader() as reader:
+            it = reader.get(ref)
+            info = next(it, None) # cannot return None
+            oidx = info[0]
+            yield info
+            if oidx: yield from it
+            assert not next(it, None)
+
+    def cat_batch(self, refs):
+        for oidx, typ, size, data in self._readers.get_batch(refs):
+            yield oidx, typ, size, iter((data,)) if oidx else None
 
     def join(self, ref):
         return vfs.join(self, ref)
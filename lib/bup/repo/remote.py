@@ -8,9 +8,23 @@ from bup.repo.base import _make_base, RepoProtocol
 
 _oidx_rx = re.compile(br'[0-9a-fA-F]{40}')
 
+def _verified(ref, typ, size, it):
+    """Yield the data from it, and if ref is an oid, throw if the data
+    doesn't actually have that oid."""
+    if not _oidx_rx.fullmatch(ref):
+        yield from it
+        return
+    actual_oid = git.start_sha1(typ, size)
+    for data in it:
+        actual_oid.update(data)
+        yield data
+    actual_oid = actual_oid.digest()
+    if hexlify(actual_oid) != ref:
+        raise Exception(f'received {actual_oid.hex()}, expected oid {ref}')
+
 class RemoteRepo(RepoProtocol):
     def __init__(self, location, create=False, compression_level=None,
-                 max_pack_size=None, max_pack_objects=None):
+                 max_pack_size=None, max_pack_objects=None, jobs=1):
         # The location must be a URL or a client.Config, and Client()
         # handles the validation.
         self._location = location
@@ -29,6 +43,7 @@ class RemoteRepo(RepoProtocol):
         self.join = self.client.join
         self.refs = self.client.refs
         self.resolve = self.client.resolve
+        self._jobs = jobs
         self._packwriter = None
 
     def __repr__(self):
@@ -57,7 +72,8 @@ class RemoteRepo(RepoProtocol):
             self._packwriter = self.client.new_packwriter(
                                     compression_level=self._base.compression_level,
                                     max_pack_size=self._base.max_pack_size,
-                                    max_pack_objects=self._base.max_pack_objects)
+                                    max_pack_objects=self._base.max_pack_objects,
+                                    jobs=self._jobs)
 
     def is_remote(self): return True
 
@@ -72,16 +88,21 @@ class RemoteRepo(RepoProtocol):
         oidx, typ, size, it = info = next(items, None) # cannot return None
         yield info[:-1]
         if oidx:
-            if not _oidx_rx.fullmatch(ref):
-                yield from it
-            else:
-                actual_oid = git.start_sha1(typ, size)
-                for data in it:
-                    actual_oid.update(data)
-                    yield data
-                actual_oid = actual_oid.digest()
-                if hexlify(actual_oid) != ref:
-                    raise Exception(f'received {actual_oid.hex()}, expected oid {ref}')
+            yield from _verified(ref, typ, size, it)
+        assert not next(items, None)
+
+    def cat_batch(self, refs):
+        # As with cat(), the data for each item must all be read
+        # before the next is requested, or we'd be out of sync with
+        # the server.
+        refs = tuple(refs)
+        items = self.client.cat_batch(refs)
+        for ref in refs:
+            oidx, typ, size, it = next(items)
+            if not oidx:
+                yield None, None, None, None
+                continue
+            yield oidx, typ, size, _verified(ref, typ, size, it)
         assert not next(items, None)
 
     def write_commit(self, tree, parent,
@@ -11,7 +11,7 @@ from bup.hashsplit import \
 from bup.git import shalist_item_sort_key, mangle_name
 from bup.helpers import add_error
 from bup.io import path_msg
-from bup.metadata import Metadata, empty_metadata
+from bup.metadata import Metadata, empty_metadata, encode_all
 from bup.vfs import LostMetadata
 
 
@@ -104,12 +104,19 @@ def _abbreviate_item_names(items, level):
 
 
 class StackDir:
-    __slots__ = 'name', 'items', 'meta'
+    __slots__ = ('name', 'items', 'meta', 'pending', 'closed', 'parent_path',
+                 'parent_pending', 'on_oid')
 
     def __init__(self, name, meta):
         self.name = name
         self.meta = meta
         self.items = []
+        self.pending = 0 # items appended via append_pending, not complete
+        # Set when the dir is popped with pending items
+        self.closed = False
+        self.parent_path = None
+        self.parent_pending = None
+        self.on_oid = None
     def __repr__(self):
         cls = self.__class__
         return f'<{cls.__module__}.{cls.__name__} object at {hex(id(self))}' \
@@ -160,7 +167,26 @@ def _dir_metadata(dir_meta, items, repair):
     return None
 
 
+class PendingItem:
+    """An item whose oid isn't known yet (see Stack.append_pending)."""
+    __slots__ = 'dir', 'item'
+    def __init__(self, dir, item):
+        self.dir = dir
+        self.item = item
+
+
 class Stack:
+    """Accumulate the items for the trees along the current path, and
+    write each tree when it's popped.  Items may also be added before
+    their oids are known (e.g. while a worker is still saving them)
+    via append_pending(), and then reported in any order via
+    complete().  A directory that still has pending items when it's
+    popped is written as soon as the last of them is complete (and
+    then reported to its parent), and because the items keep their
+    places, the resulting trees and .bupm files are the same as if
+    everything had been appended in order.  All of the calls must be
+    made from the same thread."""
+
     def __init__(self, repo, split_config, *, repair=False):
         self._stack = []
         self._repo = repo
@@ -183,12 +209,12 @@ class Stack:
         assert isinstance(meta, (Metadata, int, type(None))), meta
         self._stack.append(StackDir(name, meta))
 
-    def _clean(self, tree):
+    def _clean(self, tree, path):
         names_seen = set()
         items = []
         for item in tree.items:
             if item.name in names_seen:
-                parent_path = b'/'.join(n for n in self.path()) + b'/'
+                parent_path = b'/'.join(n for n in path) + b'/'
                 add_error('error: ignoring duplicate path %s in %s'
                           % (path_msg(item.name), path_msg(parent_path)))
             else:
@@ -209,7 +235,7 @@ class Stack:
                                          for entry in items])
 
         metalist.sort(key = lambda x: x[0])
-        metadata = BytesIO(b''.join(m[1].encode() for m in metalist))
+        metadata = BytesIO(encode_all(m[1] for m in metalist))
         splitter = hashsplit.from_config([metadata], self._split_config)
         mode, oid = split_to_blob_or_tree(self._repo.write_bupm,
                                           self._repo.write_tree,
@@ -295,25 +321,67 @@ class Stack:
         assert newtree
         return self._write_split_tree(dir_meta, newtree, level + 1)
 
-    def _write(self, tree):
-        items = self._clean(tree)
+    def _write(self, tree, path):
+        items = self._clean(tree, path)
         if not self._split_config['trees']:
             return self._write_tree(tree.meta, items)
         items.sort(key=lambda x: x.name)
         return self._write_split_tree(tree.meta, items)
 
-    def pop(self, override_tree=None, override_meta=None):
+    def pop(self, override_tree=None, override_meta=None, on_oid=None):
+        """Finish the current directory and return its oid, or None if
+        it has pending items, in which case it'll be written when
+        they're complete.  Either way, call on_oid(oid) (if
+        specified) once it's written, and add it to the parent."""
         tree = self._stack.pop()
         if override_meta is not None:
             tree.meta = override_meta
         if not override_tree: # caution - False happens, not just None
-            tree_oid = self._write(tree)
+            if tree.pending:
+                tree.closed = True
+                tree.parent_path = self.path()
+                tree.on_oid = on_oid
+                if len(self):
+                    tree.parent_pending = \
+                        self.append_pending(tree.name, GIT_MODE_TREE,
+                                            GIT_MODE_TREE, None)
+                return None
+            tree_oid = self._write(tree, self.path())
         else:
             tree_oid = override_tree
         if len(self):
             self.append_to_current(tree.name, GIT_MODE_TREE, GIT_MODE_TREE,
                                    tree_oid, None)
+        if on_oid:
+            on_oid(tree_oid)
         return tree_oid
 
     def append_to_current(self, name, mode, gitmode, oid, meta):
         self._stack[-1].items.append(TreeItem(name, mode, gitmode, oid, meta))
+
+    def append_pending(self, name, mode, gitmode, meta):
+        """Add an item whose oid will be provided later via
+        complete(), and return the PendingItem to pass to it."""
+        current = self._stack[-1]
+        item = TreeItem(name, mode, gitmode, b'', meta)
+        current.items.append(item)
+        current.pending += 1
+        return PendingItem(current, item)
+
+    def complete(self, pending, oid, meta=None):
+        """Provide the oid (and optionally replace the metadata) for a
+        pending item."""
+        assert isinstance(oid, bytes) and oid, oid
+        tree, item = pending.dir, pending.item
+        assert not item.oid, item
+        item.oid = oid
+        if meta is not None:
+            item.meta = meta
+        tree.pending -= 1
+        if tree.pending or not tree.closed:
+            return
+        tree_oid = self._write(tree, tree.parent_path)
+        if tree.on_oid:
+            tree.on_oid(tree_oid)
+        if tree.parent_pending:
+            self.complete(tree.parent_pending, tree_oid)
@@ -69,9 +69,12 @@ item.coid.
 """
 
 from binascii import hexlify, unhexlify
+from bisect import bisect_right
 from collections import namedtuple
+from concurrent.futures import ThreadPoolExecutor
 from copy import deepcopy
 from errno import EINVAL, ELOOP, ENOTDIR
+from io import BytesIO
 from itertools import tee
 from random import randrange
 from stat import \
@@ -91,7 +94,7 @@ from stat import \
      S_IXOTH,
      S_IXUSR)
 from time import localtime, strftime
-import builtins, re
+import builtins, re, threading
 
 from bup import git
 from bup.git import \
@@ -100,10 +103,8 @@ from bup.git import \
      MissingObject,
      GitError,
      find_tree_entry,
-     last_tree_entry,
      parse_commit,
-     tree_entries,
-     tree_iter)
+     tree_entries)
 from bup.helpers import EXIT_FAILURE, debug2
 from bup.io import path_msg
 from bup.metadata import Metadata, empty_metadata
@@ -163,48 +164,182 @@ def get_oidx(repo, oidx, *, throw_missing=True):
         raise MissingObject(unhexlify(oidx))
     return result
 
+class _SplitTree:
+    """The entries of one of a chunked file's split trees, with the
+    (relative) offsets parsed from the names, so that the entry
+    containing an offset can be found via a binary search."""
+    __slots__ = ('offsets', 'modes', 'oids')
+    def __init__(self, tree_data):
+        entries = tree_entries(tree_data)
+        # name is the chunk's hex offset in the original file
+        self.offsets = [int(name, 16) for _, name, _ in entries]
+        self.modes = [mode for mode, _, _ in entries]
+        self.oids = [oid for _, _, oid in entries]
+    def index(self, offset):
+        """Return the index of the entry containing offset."""
+        return max(0, bisect_right(self.offsets, offset) - 1)
+
+def _split_tree(repo, oid, tree_data=None):
+    """Return the (cached) _SplitTree for oid, or None if oid is a
+    blob.  If tree_data is provided, it must be oid's data."""
+    key = b'spl:' + oid
+    tree = cache_get(key)
+    if tree:
+        return tree
+    if tree_data is None:
+        _, obj_t, _, it = get_oidx(repo, hexlify(oid))
+        if obj_t != b'tree':
+            return None
+        tree_data = b''.join(it)
+    tree = _SplitTree(tree_data)
+    cache_notice(key, tree)
+    return tree
+
 def _normal_or_chunked_file_size(repo, oid):
     """Return the size of the normal or chunked file indicated by oid."""
     # FIXME: --batch-format CatPipe?
-    _, obj_t, _, it = get_oidx(repo, hexlify(oid))
     ofs = 0
+    tree = cache_get(b'spl:' + oid)
+    while tree:
+        ofs += tree.offsets[-1]
+        oid = tree.oids[-1]
+        tree = cache_get(b'spl:' + oid)
+    _, obj_t, _, it = get_oidx(repo, hexlify(oid))
     while obj_t == b'tree':
-        mode_, name, last_oid = last_tree_entry(b''.join(it))
-        ofs += int(name, 16)
-        _, obj_t, _, it = get_oidx(repo, hexlify(last_oid))
+        tree = _split_tree(repo, oid, b''.join(it))
+        ofs += tree.offsets[-1]
+        oid = tree.oids[-1]
+        _, obj_t, _, it = get_oidx(repo, hexlify(oid))
     return ofs + sum(len(b) for b in it)
 
-def _skip_chunks_before_offset(tree_data, offset):
-    entries = tree_entries(tree_data)
-    for i, entry in enumerate(entries):
-        ent_ofs = int(entry[1], 16)
-        if ent_ofs > offset:
-            return entries[i - 1:]
-        if ent_ofs == offset:
-            return entries[i:]
-    return entries[-1:]
-
-def _tree_chunks(repo, tree_data, startofs):
+# Read objects via cat_batch() in batches that start with one object
+# (e.g. for small reads) and double, up to this many objects, or about
+# this many bytes, judged by the known sizes, or failing that, the
+# sizes seen so far.
+_max_cat_ahead = 64
+_max_cat_ahead_bytes = 8 * 1024 * 1024
+
+_prefetch_executor = None
+_prefetch_lock = threading.Lock()
+
+def _prefetcher():
+    global _prefetch_executor
+    with _prefetch_lock:
+        if not _prefetch_executor:
+            _prefetch_executor = \
+                ThreadPoolExecutor(max_workers=4,
+                                   thread_name_prefix='vfs-prefetch')
+        return _prefetch_executor
+
+def _cat_ahead_end(start, count, sizes, n):
+    """Return the end of the batch of at most count objects starting
+    at start, ending early (but after at least one object) if the
+    sizes reach _max_cat_ahead_bytes."""
+    end = min(n, start + count)
+    if start >= n or not sizes:
+        return end
+    total = sizes[start]
+    for i in range(start + 1, end):
+        if total >= _max_cat_ahead_bytes:
+            return i
+        total += sizes[i]
+    return end
+
+def _cat_ahead(repo, oids, sizes=None, *, prefetch=False):
+    """Yield (oidx, type, size, data) for the oids, as cat_batch()
+    does, except that data is all of the object's data (or None if
+    it's missing), fetching them in growing batches, each completely,
+    so that the caller can make other requests in between.  When
+    prefetch is true, which requires a repo that allows reads from any
+    thread, and the caller has consumed more than the first batch
+    (i.e. appears to be reading sequentially), fetch each following
+    batch in the background while the current one is consumed."""
+    def fetch(start, end):
+        refs = [hexlify(oid) for oid in oids[start:end]]
+        return [(oidx, typ, size, b''.join(it) if oidx else None)
+                for oidx, typ, size, it in repo.cat_batch(refs)]
+    n = len(oids)
+    start, count, k = 0, 1, 0
+    end = _cat_ahead_end(start, count, sizes, n)
+    ahead = None
+    try:
+        while start < n:
+            if ahead:
+                results, ahead = ahead.result(), None
+            else:
+                results = fetch(start, end)
+            count = min(count * 2, _max_cat_ahead)
+            if not sizes:
+                seen = sum(len(x[3]) for x in results if x[0])
+                if seen:
+                    avg = seen // len(results) or 1
+                    count = max(1, min(count, _max_cat_ahead_bytes // avg))
+            start, end = end, _cat_ahead_end(end, count, sizes, n)
+            if prefetch and k > 0 and start < n:
+                ahead = _prefetcher().submit(fetch, start, end)
+            k += 1
+            yield from results
+    finally:
+        # Don't leave a read running against a repo that may be closed
+        if ahead and not ahead.cancel():
+            ahead.exception()
+
+def _chunk_batches(repo, tree, start, prefetch):
+    """Yield (mode, offset, data) for the tree entries from start on,
+    where data is a _SplitTree for subtrees, fetching any that aren't
+    cached via _cat_ahead()."""
+    subtrees = {}
+    need = []
+    for j in range(start, len(tree.oids)):
+        if S_ISDIR(tree.modes[j]):
+            sub = cache_get(b'spl:' + tree.oids[j])
+            if sub:
+                subtrees[j] = sub
+                continue
+        need.append(j)
+    # Only the blob sizes count toward the read-ahead budget
+    offsets = tree.offsets
+    sizes = [0 if S_ISDIR(tree.modes[j]) or j + 1 == len(offsets)
+             else offsets[j + 1] - offsets[j]
+             for j in need]
+    fetched = _cat_ahead(repo, [tree.oids[j] for j in need], sizes,
+                         prefetch=prefetch)
+    for j in range(start, len(tree.oids)):
+        mode, oid = tree.modes[j], tree.oids[j]
+        data = subtrees.get(j)
+        if not data:
+            oidx, obj_t, _, data = next(fetched)
+            if not oidx:
+                raise MissingObject(oid)
+            if S_ISDIR(mode):
+                assert obj_t == b'tree'
+                data = _split_tree(repo, oid, data)
+            else:
+                assert obj_t == b'blob'
+        yield mode, offsets[j], data
+
+def _tree_chunks(repo, tree, startofs, prefetch):
     assert(startofs >= 0)
-    # name is the chunk's hex offset in the original file
-    for mode, name, oid in _skip_chunks_before_offset(tree_data, startofs):
-        ofs = int(name, 16)
+    for mode, ofs, data in _chunk_batches(repo, tree, tree.index(startofs),
+                                          prefetch):
         skipmore = max(0, startofs - ofs)
-        _, obj_t, _, it = get_oidx(repo, hexlify(oid))
-        data = b''.join(it)
         if S_ISDIR(mode):
-            assert obj_t == b'tree'
-            yield from _tree_chunks(repo, data, skipmore)
+            yield from _tree_chunks(repo, data, skipmore, prefetch)
         else:
-            assert obj_t == b'blob'
             yield data[skipmore:]
 
 class _ChunkReader:
-    def __init__(self, repo, oid, startofs):
-        _, obj_t, _, it = get_oidx(repo, hexlify(oid))
-        data = b''.join(it)
-        if obj_t == b'tree':
-            self.it = _tree_chunks(repo, data, startofs)
+    def __init__(self, repo, oid, startofs, *, prefetch=False):
+        # The split trees are cached, so seeking (i.e. starting a new
+        # reader) only has to fetch the blobs that are read.
+        tree = cache_get(b'spl:' + oid)
+        if not tree:
+            _, obj_t, _, it = get_oidx(repo, hexlify(oid))
+            data = b''.join(it)
+            if obj_t == b'tree':
+                tree = _split_tree(repo, oid, data)
+        if tree:
+            self.it = _tree_chunks(repo, tree, startofs, prefetch)
             self.blob = None
             self.blobofs = None
         else:
@@ -275,7 +410,9 @@ class _FileReader:
                 return b''
             assert self.ofs < self._size, f'{self.ofs} > {self._size}'
         if not self.reader or self.reader.ofs != self.ofs:
-            self.reader = _ChunkReader(self._repo, self.oid, self.ofs)
+            # Only a local repo can be read from other threads
+            self.reader = _ChunkReader(self._repo, self.oid, self.ofs,
+                                       prefetch=not self._repo.is_remote())
         try:
             buf = self.reader.next(count)
         except:
@@ -347,11 +484,14 @@ _tags = Tags(meta=default_dir_mode)
 _cache = {}
 _cache_keys = []
 _cache_max_items = 30000
+# The cache is shared by threads, e.g. restore's -j workers
+_cache_lock = threading.Lock()
 
 def clear_cache():
     global _cache, _cache_keys
-    _cache = {}
-    _cache_keys = []
+    with _cache_lock:
+        _cache = {}
+        _cache_keys = []
 
 def is_valid_cache_key(x):
     """Return logically true if x looks like it could be a valid cache key
@@ -359,11 +499,12 @@ def is_valid_cache_key(x):
       res:... -> resolution
       itm:OID -> Commit
       rvl:OID -> {'.', commit, '2012...', next_commit, ...}
+      spl:OID -> _SplitTree (one of a chunked file's split trees)
     """
     # Suspect we may eventually add "(container_oid, name) -> ...", and others.
     if isinstance(x, bytes):
         tag = x[:4]
-        if tag in (b'itm:', b'rvl:') and len(x) == 24:
+        if tag in (b'itm:', b'rvl:', b'spl:') and len(x) == 24:
             return True
         if tag == b'res:':
             return True
@@ -373,25 +514,27 @@ def cache_get(key):
     global _cache
     if not is_valid_cache_key(key):
         raise Exception('invalid cache key: ' + repr(key))
-    return _cache.get(key)
+    with _cache_lock:
+        return _cache.get(key)
 
 def cache_notice(key, value, overwrite=False):
     global _cache, _cache_keys, _cache_max_items
     if not is_valid_cache_key(key):
         raise Exception('invalid cache key: ' + repr(key))
-    if key in _cache:
-        if overwrite:
+    with _cache_lock:
+        if key in _cache:
+            if overwrite:
+                _cache[key] = value
+            return
+        if len(_cache) < _cache_max_items:
+            _cache_keys.append(key)
             _cache[key] = value
-        return
-    if len(_cache) < _cache_max_items:
-        _cache_keys.append(key)
+            return
+        victim_i = randrange(0, len(_cache_keys))
+        victim = _cache_keys[victim_i]
+        del _cache[victim]
+        _cache_keys[victim_i] = key
         _cache[key] = value
-        return
-    victim_i = randrange(0, len(_cache_keys))
-    victim = _cache_keys[victim_i]
-    del _cache[victim]
-    _cache_keys[victim_i] = key
-    _cache[key] = value
 
 def _has_metadata_if_needed(item, need_meta):
     if not need_meta:
@@ -746,6 +889,16 @@ def _tree_items_except_dot(oid, entries, names=None, bupm=None, *, repair=False)
             break
         remaining -= 1
 
+def _open_bupm(repo, oid, names):
+    """Return a context manager providing the .bupm.  When every entry
+    is wanted (names is None), read the whole thing into a BytesIO,
+    which Metadata.read() decodes much faster than a stream, otherwise
+    stream it, since the lookup may stop after the first few."""
+    if names is not None:
+        return _FileReader(repo, oid)
+    with _FileReader(repo, oid) as bupm:
+        return BytesIO(bupm.read())
+
 def _get_tree_object(repo, oid):
     _, kind, _, res = get_oidx(repo, hexlify(oid))
     assert kind == b'tree', f'expected oid {oid.hex()} to be tree, not {kind!r}'
@@ -772,7 +925,7 @@ def _split_subtree_items(repo, level, oid, entries, names, want_meta, root=True)
         if not bupm_oid:
             yield from _tree_items_except_dot(oid, entries, names)
         else:
-            with _FileReader(repo, bupm_oid) as bupm:
+            with _open_bupm(repo, bupm_oid, names) as bupm:
                  # skip dummy entry provided for older bups
                 if not Metadata.read(bupm):
                     raise EOFError('EOF instead of split tree placeholder metadata')
@@ -842,7 +995,7 @@ def tree_items(repo, oid, tree_data, names, *, want_meta=True, repair=False):
     # introduced (47891d8951a95b8e0d9ca94387107cdf12ca3d3c).
     if want_meta and bupm_oid:
         if depth is None:
-            with _FileReader(repo, bupm_oid) as bupm:
+            with _open_bupm(repo, bupm_oid, names) as bupm:
                 if not dot_requested: # skip it
                     if not Metadata.read(bupm):
                         raise EOFError('EOF while skipping directory metadata')
@@ -1359,8 +1512,15 @@ def join(repo, ref):
         if typ == b'blob':
             yield from it
         elif typ == b'tree':
-            for ent_mode_, ent_name, ent_oid in tree_iter(b''.join(it)):
-                yield from _join(*get_oidx(repo, hexlify(ent_oid)), path + [ent_name])
+            ents = tree_entries(b''.join(it))
+            fetched = _cat_ahead(repo, [oid for _, _, oid in ents],
+                                 prefetch=not repo.is_remote())
+            for ent_mode_, ent_name, ent_oid in ents:
+                ent_oidx, ent_typ, ent_size, data = next(fetched)
+                if not ent_oidx:
+                    raise MissingObject(ent_oid)
+                yield from _join(ent_oidx, ent_typ, ent_size, (data,),
+                                 path + [ent_name])
         elif typ == b'commit':
             treeline = b''.join(it).split(b'\n', maxsplit=1)[0]
             assert treeline.startswith(b'tree ')
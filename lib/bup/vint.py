@@ -12,6 +12,23 @@ from io import BytesIO
 from bup import _helpers
 
 
+def _peek_unpack(port, types):
+    """Decode types from the input port already has buffered (cf.
+    BufferedReader.peek()), consume it, and return the values, or
+    return None if port can't peek or the data isn't all buffered.
+
+    """
+    peek = getattr(port, 'peek', None)
+    if not peek:
+        return None
+    res = _helpers.vint_unpack_from(types, peek(1))
+    if not res:
+        return None
+    values, end = res
+    port.read(end)
+    return values
+
+
 def write_vuint(port, x):
     port.write(encode_vuint(x))
 
@@ -36,6 +53,9 @@ def encode_vuint(x):
 
 
 def read_vuint(port):
+    values = _peek_unpack(port, 'V')
+    if values:
+        return values[0]
     c = port.read(1)
     if not c:
         return None
@@ -81,6 +101,9 @@ def encode_vint(x):
 
 
 def read_vint(port):
+    values = _peek_unpack(port, 'v')
+    if values:
+        return values[0]
     c = port.read(1)
     if not c:
         return None
@@ -124,6 +147,9 @@ def write_bvec(port, x):
 
 
 def read_bvec(port):
+    values = _peek_unpack(port, 's')
+    if values:
+        return values[0]
     n = read_vuint(port)
     if n is None:
         return None
@@ -148,17 +174,15 @@ def skip_bvec(port):
 def send(port, types, *args):
     if len(types) != len(args):
         raise Exception('number of arguments does not match format string')
-    for (type, value) in zip(types, args):
-        if type == 'V':
-            write_vuint(port, value)
-        elif type == 'v':
-            write_vint(port, value)
-        elif type == 's':
-            write_bvec(port, value)
-        else:
+    for type in types:
+        if type not in 'Vvs':
             raise Exception('unknown xpack format string item "' + type + '"')
+    port.write(pack(types, *args))
 
 def recv(port, types):
+    values = _peek_unpack(port, types)
+    if values:
+        return values
     result = []
     for type in types:
         if type == 'V': decode = read_vuint
@@ -189,5 +213,8 @@ def pack(types, *args):
         return b''.join(ret)
 
 def unpack(types, data):
-    port = BytesIO(data)
+    res = _helpers.vint_unpack_from(types, data)
+    if res:
+        return res[0]
+    port = BytesIO(data) # for the EOFError
     return recv(port, types)
@@ -67,8 +67,8 @@ else:
         assert st.st_uid >= 0, st
         assert st.st_gid >= 0, st
         return st
-    def lstat(path):
-        st = os.lstat(path)
+    def lstat(path, *, dir_fd=None):
+        st = os.lstat(path, dir_fd=dir_fd)
         assert st.st_uid >= 0, st
         assert st.st_gid >= 0, st
         return st
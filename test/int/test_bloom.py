@@ -36,6 +36,30 @@ def test_bloom(tmpdir):
         assert b.k == 5
 
 
+def test_bloom_add_idxs(tmpdir):
+    @dataclass(slots=True)
+    class Idx:
+        name: bytes
+        shatable: bytes
+    ixs = [Idx(name=b'dummy-%d.idx' % i,
+               shatable=b''.join(os.urandom(20) for _ in range(5000)))
+           for i in range(4)]
+    for k in (4, 5):
+        with bloom.create(tmpdir + b'/serial.bloom', expected=20000, k=k) as b:
+            for ix in ixs:
+                b.add_idx(ix)
+        with bloom.create(tmpdir + b'/threaded.bloom', expected=20000,
+                          k=k) as b:
+            b.add_idxs(ixs, threads=3)
+            assert len(b) == 20000
+            assert b.idxnames == [ix.name for ix in ixs]
+        with open(tmpdir + b'/serial.bloom', 'rb') as serial, \
+             open(tmpdir + b'/threaded.bloom', 'rb') as threaded:
+            assert serial.read() == threaded.read()
+        os.unlink(tmpdir + b'/serial.bloom')
+        os.unlink(tmpdir + b'/threaded.bloom')
+
+
 # pylint: disable-next=unused-argument
 def test_large_bloom(tmpdir):
     # Test large (~1GiB) filter.  This may fail on s390 (31-bit
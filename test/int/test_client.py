@@ -8,7 +8,7 @@ import pytest
 from bup import client, git
 from bup.compat import environ
 from bup.config import ConfigError
-from bup.repo import LocalRepo
+from bup.repo import LocalRepo, RemoteRepo
 from bup.url import URL
 import bup.path
 
@@ -217,6 +217,31 @@ def test_legacy_cache_ids():
     assert cid(b'xy', None) == b'xy_' # perhaps only "real" case
 
 
+def test_cat_batch(tmpdir):
+    def joined_batch(repo, refs):
+        return [(oidx, typ, size, b''.join(it) if oidx else None)
+                for oidx, typ, size, it in repo.cat_batch(refs)]
+    environ[b'BUP_DIR'] = bupdir = tmpdir
+    environ[b'GIT_DIR'] = bupdir
+    git.init_repo(bupdir)
+    with local_writer() as lw:
+        oids = [lw.new_blob(s) for s in (s1, s2, s3)]
+        tree = lw.new_tree([(0o100644, b'%d' % i, oid)
+                            for i, oid in enumerate(oids)])
+    refs = [x.hex().encode('ascii') for x in oids + [tree]]
+    refs += [b'0' * 40, refs[0]]
+    with LocalRepo() as repo:
+        expected = []
+        for ref in refs:
+            it = repo.cat(ref)
+            info = next(it)
+            expected.append((*info, b''.join(it) if info[0] else None))
+        assert expected == joined_batch(repo, refs)
+    with RemoteRepo(URL(scheme=b'ssh', path=bupdir)) as repo:
+        assert expected == joined_batch(repo, refs)
+        assert expected == joined_batch(repo, iter(refs))
+
+
 def test_config(tmpdir):
     environ[b'BUP_DIR'] = bupdir = tmpdir
     environ[b'GIT_DIR'] = bupdir = tmpdir
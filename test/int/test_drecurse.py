@@ -0,0 +1,57 @@
+import os
+
+import pytest
+
+from wvpytest import *
+
+from bup import drecurse
+
+
+def test_recursive_dirlist_batched_lstat(tmpdir, monkeypatch):
+    top = tmpdir + b'/src'
+    os.makedirs(top + b'/sub/big')
+    for i in range(2 * drecurse._stat_batch_size + 10):
+        with open(b'%s/sub/big/f-%d' % (top, i), 'wb'):
+            pass
+        if not i % 100:
+            os.mkdir(b'%s/sub/big/d-%d' % (top, i))
+    def listed(threads):
+        return [(path, st.st_ino)
+                for path, st in drecurse.recursive_dirlist([top], False,
+                                                           threads=threads)]
+    expected = listed(1)
+    WVPASSEQ(len(expected), 2 * drecurse._stat_batch_size + 10 + 11 + 3)
+    WVPASSEQ(expected[-1][0], top + b'/')
+    # Consider every lstat slow, so the batches are handed to the pool
+    monkeypatch.setattr(drecurse, '_slow_lstat_ns', 0)
+    WVPASSEQ(listed(4), expected)
+    WVPASSEQ(listed(1), expected)
+
+
+def test_recursive_dirlist_read_ahead_fds(tmpdir):
+    if not os.path.isdir(b'/proc/self/fd'):
+        pytest.skip('no /proc/self/fd')
+    # A deep path with a few siblings for the walk to read ahead at
+    # each level.
+    top = tmpdir + b'/src'
+    depth = 40
+    path = top
+    for i in range(depth):
+        for sib in range(4):
+            os.makedirs(b'%s/%d-%d' % (path, i, sib))
+        path += b'/%d-3' % i # the first visited
+    def walk(threads):
+        base = len(os.listdir(b'/proc/self/fd'))
+        most = 0
+        result = []
+        for path, st in drecurse.recursive_dirlist([top], False,
+                                                   threads=threads):
+            most = max(most, len(os.listdir(b'/proc/self/fd')) - base)
+            result.append((path, st.st_ino))
+        return result, most
+    expected, most = walk(1)
+    WVPASSEQ(len(expected), 4 * depth + 1)
+    WVPASS(most <= depth + 2)
+    actual, most = walk(8)
+    WVPASSEQ(actual, expected)
+    WVPASS(most <= depth + 8 + 2)
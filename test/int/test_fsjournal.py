@@ -0,0 +1,61 @@
+import os
+
+from wvpytest import *
+
+from bup import fsjournal
+
+
+def test_parent_dir():
+    WVPASSEQ(fsjournal.parent_dir(b'/'), b'/')
+    WVPASSEQ(fsjournal.parent_dir(b'/a/'), b'/')
+    WVPASSEQ(fsjournal.parent_dir(b'/a/b/'), b'/a/')
+
+
+def test_journal_rotation(tmpdir):
+    path = tmpdir + b'/journal'
+    jnl = fsjournal.Journal(path)
+    WVPASSEQ(jnl.rotate(), [])
+    WVPASSEQ(jnl.watcher(), None)
+    WVPASSEQ(jnl.state(), None)
+
+    os.mkdir(path)
+    rec = fsjournal._Recorder(jnl)
+    rec.records.update([b'd/a/', b'r/a/b/'])
+    rec.flush()
+    pending = jnl.rotate()
+    WVPASSEQ(len(pending), 1)
+    # The recorder must notice the rotation and start a new file
+    rec.records.update([b'd/a/', b'o'])
+    rec.flush()
+    WVPASS(os.path.exists(jnl.current_path))
+    pending = jnl.rotate()
+    WVPASSEQ(len(pending), 2)
+    WVPASSEQ(jnl.read(pending), {b'd/a/', b'r/a/b/', b'o'})
+
+    jnl.finish(pending, [b'd/c/'], b'1234')
+    WVPASSEQ(jnl.state(), b'1234')
+    for p in pending:
+        WVPASS(not os.path.exists(p))
+    pending = jnl.rotate()
+    WVPASSEQ(len(pending), 1)
+    WVPASSEQ(jnl.read(pending), {b'd/c/'})
+    jnl.finish(pending, (), None)
+    WVPASSEQ(jnl.rotate(), [])
+    WVPASSEQ(jnl.state(), b'1234')
+
+
+def test_journal_sync_timeout(tmpdir):
+    path = tmpdir + b'/journal'
+    os.mkdir(path)
+    os.mkdir(tmpdir + b'/src')
+    jnl = fsjournal.Journal(path)
+    orig_timeout = fsjournal._sync_timeout
+    try:
+        fsjournal._sync_timeout = 0.1
+        # Nothing's watching, so nothing will acknowledge the sentinel
+        WVFAIL(jnl.sync(fsjournal.Watcher(b'1234', [tmpdir + b'/src/'])))
+        WVFAIL(jnl.sync(fsjournal.Watcher(b'1234', [tmpdir + b'/nope/'])))
+    finally:
+        fsjournal._sync_timeout = orig_timeout
+    WVPASSEQ(os.listdir(tmpdir + b'/src'), [])
+    WVPASSEQ(os.listdir(path), [])
@@ -2,14 +2,15 @@
 from binascii import hexlify, unhexlify
 from contextlib import ExitStack
 from functools import partial
+from glob import glob
 from time import localtime
-import struct, os
+import struct, os, threading
 import pytest
 
 from wvpytest import *
 import buptest
 
-from bup import git, path
+from bup import git, lookupstats, oidhash, path
 from bup.compat import environ
 from bup.helpers import OBJECT_EXISTS, finalized, log, mkdirp
 
@@ -112,6 +113,38 @@ def test_encode():
     WVEXCEPT(ValueError, encode_pobj, b'x')
 
 
+def test_tree_encode():
+    def py_tree_encode(shalist):
+        shalist = sorted(shalist, key=git.shalist_item_sort_key)
+        return b''.join(b'%o %s\0%s' % ent for ent in shalist)
+    oid = lambda n: bytes([n]) * 20
+    d, f, x = 0o40000, 0o100644, 0o100755
+    # Directories sort as if they ended with '/'
+    shalist = [(f, b'a.b', oid(1)), (d, b'a', oid(2)), (f, b'a0', oid(3)),
+               (x, b'a-', oid(4)), (d, b'b', oid(5)), (f, b'b/', oid(6)),
+               (0o120000, b'\xff', oid(7)), (0o160000, b'a/', oid(8))]
+    for ents in (shalist, shalist[::-1], shalist[3:] + shalist[:3], []):
+        tree = git.tree_encode(ents)
+        WVPASSEQ(tree, py_tree_encode(ents))
+        WVPASSEQ(git.tree_entries(tree),
+                 sorted(ents, key=git.shalist_item_sort_key))
+        WVPASSEQ(list(git.tree_iter(tree)), git.tree_entries(tree))
+        if ents:
+            WVPASSEQ(git.last_tree_entry(tree), git.tree_entries(tree)[-1])
+    # Ties keep their original order
+    WVPASSEQ(git.tree_encode(iter([(f, b'x', oid(2)), (f, b'x', oid(1))])),
+             py_tree_encode([(f, b'x', oid(2)), (f, b'x', oid(1))]))
+    WVEXCEPT(ValueError, git.tree_encode, [(0, b'x', oid(1))])
+    WVEXCEPT(ValueError, git.tree_encode, [(f, b'', oid(1))])
+    WVEXCEPT(ValueError, git.tree_encode, [(f, b'x\0', oid(1))])
+    WVEXCEPT(ValueError, git.tree_encode, [(f, b'x', oid(1)[1:])])
+    WVEXCEPT(TypeError, git.tree_encode, [(b'100644', b'x', oid(1))])
+    tree = git.tree_encode(shalist)
+    for bad in (tree[:-1], tree + b'1', b'100644x\0' + oid(1),
+                b' x\0' + oid(1), b'100644 \0' + oid(1), b'100648 x\0' + oid(1)):
+        WVEXCEPT(ValueError, git.tree_entries, bad)
+
+
 def test_packs(tmpdir):
     environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
     git.init_repo(bupdir)
@@ -153,6 +186,28 @@ def test_packs(tmpdir):
         WVFAIL(r.exists(b'\0'*20))
 
 
+def test_pipelined_packs(tmpdir):
+    # The objects, and so the packs, should be the same whatever the
+    # number of jobs.
+    blobs = [b'%d' % i * (i % 97) for i in range(3000)]
+    blobs.extend(blobs[:50])
+    packs = {}
+    for jobs in (1, 4):
+        bupdir = tmpdir + b'/bup-%d' % jobs
+        git.init_repo(bupdir)
+        with git.PackWriter(store=git.LocalPackStore(repo_dir=bupdir),
+                            max_pack_objects=1000, jobs=jobs) as w:
+            oids = [w.new_blob(b) for b in blobs]
+            count = w.object_count()
+            tree = w.new_tree([(0o100644, b'%d' % i, oid)
+                               for i, oid in enumerate(oids[:10])])
+        packs[jobs] = (oids, count, tree,
+                       sorted(x for x in os.listdir(bupdir + b'/objects/pack')
+                              if x.endswith(b'.pack')))
+    WVPASSEQ(len(packs[1][3]), 3)
+    WVPASSEQ(packs[4], packs[1])
+
+
 def test_pack_name_lookup(tmpdir):
     environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
     git.init_repo(bupdir)
@@ -409,6 +464,185 @@ def test_cat_pipe(tmpdir):
     assert b'' ==  b''.join(it)
 
 
+def test_object_reader(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    environ[b'GIT_DIR'] = bupdir
+    src = tmpdir + b'/src'
+    mkdirp(src)
+    git.init_repo(bupdir)
+    # Several similar saves, so that a repack produces delta chains
+    for i in range(4):
+        with open(src + b'/data', 'ab') as f:
+            f.write(b''.join(b'%d line %d\n' % (i, j) for j in range(2000)))
+        exc(bup_exe, b'index', src)
+        exc(bup_exe, b'save', b'-n', b'src', src)
+
+    def check_all():
+        oids = [line.split(b' ')[0] for line
+                in exo(b'git', b'rev-list', b'--objects', b'--all').splitlines()]
+        refs = oids + [b'src', b'refs/heads/src', b'0' * 40, b'1' * 40]
+        with finalized(git.ObjectReader(bupdir), lambda x: x.close()) as r, \
+             finalized(git.CatPipe(bupdir), lambda x: x.close()) as cp:
+            for ref in refs:
+                expected = list(cp.get(ref))
+                actual = list(r.get(ref))
+                assert expected[0] == actual[0]
+                assert b''.join(expected[1:]) == b''.join(actual[1:])
+                assert list(cp.get(ref, include_data=False)) \
+                    == list(r.get(ref, include_data=False))
+        return oids
+
+    oids = check_all()
+    # Both offset and ref deltas
+    for use_ofs in (b'true', b'false'):
+        exc(b'git', b'-c', b'repack.useDeltaBaseOffset=' + use_ofs,
+            b'repack', b'-adf')
+        idxs = glob(bupdir + b'/objects/pack/*.idx')
+        assert b'chain length = ' in exo(b'git', b'verify-pack', b'-v', *idxs)
+        assert check_all() == oids
+
+
+def test_object_reader_refresh(tmpdir, monkeypatch):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    git.init_repo(bupdir)
+    pack_dir = bupdir + b'/objects/pack'
+    def write_blob(data, mtime):
+        with git.PackWriter(store=git.LocalPackStore(repo_dir=bupdir)) as w:
+            oid = w.new_blob(data)
+        # Old enough that the mtime can be trusted
+        os.utime(pack_dir, (mtime, mtime))
+        return oid
+    first = write_blob(b'first', 1000)
+    refreshes = []
+    orig_refresh = git.PackIdxList.refresh
+    def refresh(self, *args, **kwargs):
+        if self is r._locator._idxl:
+            refreshes.append(self.dir)
+        return orig_refresh(self, *args, **kwargs)
+    monkeypatch.setattr(git.PackIdxList, 'refresh', refresh)
+    with finalized(git.ObjectReader(bupdir), lambda x: x.close()) as r:
+        WVPASS(r.locate(first))
+        # Misses don't rescan an unchanged pack directory
+        for i in range(3):
+            WVPASSEQ(None, r.locate(b'\1' * 20))
+        WVPASSEQ([], refreshes)
+        # But a new pack is noticed
+        second = write_blob(b'second', 2000)
+        WVPASS(r.locate(second))
+        WVPASSEQ(1, len(refreshes))
+        WVPASSEQ(None, r.locate(b'\1' * 20))
+        WVPASSEQ(1, len(refreshes))
+
+def test_reader_pool_shares_packs(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    git.init_repo(bupdir)
+    with git.PackWriter(store=git.LocalPackStore(repo_dir=bupdir)) as w:
+        oid = w.new_blob(b'shared')
+    with git.ReaderPool(bupdir, jobs=2) as pool:
+        with pool.reader() as r1, pool.reader() as r2:
+            WVPASSNE(r1, r2)
+            loc = r1.locate(oid)
+            WVPASS(loc)
+            WVPASSEQ(loc, r2.locate(oid))
+            WVPASS(r1._locator is r2._locator)
+            WVPASS(r1._packs[loc[0]] is r2._packs[loc[0]])
+            # Closing one reader leaves the other's maps usable
+            r1.close()
+            WVPASSEQ((b'blob', b'shared'), r2.read_at(loc))
+
+def test_object_reader_deep_delta_chain(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    environ[b'GIT_DIR'] = bupdir
+    git.init_repo(bupdir)
+    # A window sliding over random data, so that each blob is best
+    # stored as a delta against the previous one.
+    data = os.urandom(4096 + 64 * 1300)
+    blobs = []
+    for i in range(1300):
+        name = b'%s/blob-%d' % (tmpdir, i)
+        with open(name, 'wb') as f:
+            f.write(data[64 * i : 64 * i + 4096])
+        blobs.append(name)
+    oids = buptest.exo((b'git', b'hash-object', b'-w', b'--stdin-paths'),
+                       input=b'\n'.join(blobs) + b'\n').out.split()
+    buptest.exo((b'git', b'pack-objects', b'-q', b'--depth=4095',
+                 b'--window=10', bupdir + b'/objects/pack/pack'),
+                input=b'\n'.join(oids) + b'\n')
+    idxs = glob(bupdir + b'/objects/pack/*.idx')
+    chains = [int(line.split(b' ')[3][:-1]) for line
+              in exo(b'git', b'verify-pack', b'-v', *idxs).splitlines()
+              if line.startswith(b'chain length = ')]
+    assert max(chains) > 1000
+    with finalized(git.ObjectReader(bupdir), lambda x: x.close()) as r:
+        for oid, name in reversed(list(zip(oids, blobs))):
+            with open(name, 'rb') as f:
+                expected = f.read()
+            it = r.get(oid)
+            assert next(it) == (oid, b'blob', len(expected))
+            assert b''.join(it) == expected
+
+
+def test_cat_batch(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    environ[b'GIT_DIR'] = bupdir
+    src = tmpdir + b'/src'
+    mkdirp(src)
+    for i in range(20):
+        with open(b'%s/%d' % (src, i), 'wb') as f:
+            f.write(b'%d\n' % i * (i + 1))
+    git.init_repo(bupdir)
+    exc(bup_exe, b'index', src)
+    exc(bup_exe, b'save', b'-n', b'src', src)
+    oids = [line.split(b' ')[0] for line
+            in exo(b'git', b'rev-list', b'--objects', b'--all').splitlines()]
+    refs = oids + [b'src', b'0' * 40] + oids
+
+    def expected(include_data):
+        with finalized(git.CatPipe(bupdir), lambda x: x.close()) as cp:
+            for ref in refs:
+                it = cp.get(ref, include_data=include_data)
+                info = next(it)
+                data = b''.join(it) if include_data and info[0] else None
+                yield (*info, data)
+
+    for include_data in (True, False):
+        exp = list(expected(include_data))
+        for batch_command in (True, False):
+            with finalized(git.CatPipe(bupdir), lambda x: x.close()) as cp:
+                cp.have_batch_command = batch_command
+                assert exp == list(cp.get_batch(refs, include_data, window=3))
+                # Abandoning a batch leaves the pipe usable
+                it = cp.get_batch(refs, include_data, window=3)
+                next(it)
+                it.close()
+                assert exp == list(cp.get_batch(refs, include_data))
+        with finalized(git.ObjectReader(bupdir), lambda x: x.close()) as r:
+            assert exp == list(r.get_batch(refs, include_data))
+        for jobs in (1, 3):
+            with git.ReaderPool(bupdir, jobs=jobs) as pool:
+                pool._batch_size = 4
+                assert exp == list(pool.get_batch(refs, include_data))
+                it = pool.get_batch(refs, include_data)
+                next(it)
+                it.close()
+                assert exp == list(pool.get_batch(refs, include_data))
+
+
+def test_apply_delta():
+    apply_delta = git._helpers.apply_delta
+    base = b'0123456789'
+    # sizes 10 and 7, copy 4 bytes from offset 2, then insert b'abc'
+    delta = b'\x0a\x07\x91\x02\x04\x03abc'
+    assert apply_delta(base, delta) == b'2345abc'
+    for bad in (b'\x0b\x07\x91\x02\x04\x03abc', # wrong base size
+                b'\x0a\x08\x91\x02\x04\x03abc', # wrong result size
+                b'\x0a\x07\x91\x08\x04\x03abc', # copy past the end
+                b'\x0a\x07\x91\x02\x04\x04abc', # truncated insert
+                b'\x0a\x07\x00'):                  # reserved opcode
+        with pytest.raises(ValueError):
+            apply_delta(base, bad)
+
+
 def _create_idx(d, i):
     idx = git.PackIdxV2Writer()
     # add 255 vaguely reasonable entries
@@ -467,6 +701,185 @@ def test_midx_close(tmpdir):
             # check that we don't have it open anymore
             WVPASSEQ(False, b'deleted' in fn)
 
+def test_packidxlist_sharing(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    git.init_repo(bupdir)
+    for i in range(3):
+        _create_idx(tmpdir, i)
+    present = struct.pack('18xBB', 1, 7)
+    later = struct.pack('18xBB', 3, 7)
+    with git.PackIdxList(tmpdir) as l1, git.PackIdxList(tmpdir) as l2:
+        # Unchanged idxes are mapped once, and shared by the handles
+        WVPASSEQ(len(l1.packs), 3)
+        WVPASSEQ(set(map(id, l1.packs)), set(map(id, l2.packs)))
+        WVPASS(l1.exists(present))
+        WVPASS(l2.exists(present))
+        with l1.snapshot() as snap:
+            _create_idx(tmpdir, 3)
+            l1.refresh()
+            WVPASS(l1.exists(later))
+            WVPASSEQ(None, l2.exists(later))
+            # The old snapshot is intact until released
+            WVPASSEQ(len(snap.packs), 3)
+            WVPASSEQ(None, snap.exists(later))
+            WVPASS(snap.exists(present))
+            WVPASS(not any(p.closed for p in snap.packs))
+        l2.close()
+        # Everything l1 still uses must remain open
+        WVPASS(not any(p.closed for p in l1.packs))
+        with l1.snapshot() as snap:
+            found = []
+            threads = [threading.Thread(target=lambda:
+                                        found.append(snap.exists(later)))
+                       for _ in range(4)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            WVPASSEQ(found, [OBJECT_EXISTS] * 4)
+
+def test_oidhash(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    git.init_repo(bupdir)
+    for i in range(3):
+        _create_idx(tmpdir, i)
+    # Exercise the 64-bit offset table too
+    idx = git.PackIdxV2Writer()
+    big = struct.pack('18xBB', 9, 1)
+    idx.add(big, 1, 2**33 + 5)
+    idx.add(struct.pack('18xBB', 9, 2), 2, 7)
+    idx.write(os.path.join(tmpdir, b'pack-%s.idx' % (b'9' * 40)), b'9' * 20)
+    oidhash.update(tmpdir, git.open_idx)
+    with oidhash.OidHash(os.path.join(tmpdir, b'bup.oidhash')) as h:
+        WVPASS(h.valid())
+        WVPASSEQ(len(h), 3 * 255 + 2)
+        WVPASSEQ(len(h.idxnames), 4)
+        for i in range(3):
+            for s in range(255):
+                loc = h.exists(struct.pack('18xBB', i, s),
+                               want_source=True, want_offset=True)
+                WVPASSEQ(loc.offset, 100 * s)
+                WVPASSEQ(loc.pack, b'pack-%s.idx' % hexlify(struct.pack('B19x', i)))
+        WVPASSEQ(h.exists(big, want_offset=True).offset, 2**33 + 5)
+        WVPASSEQ(None, h.exists(struct.pack('18xBB', 3, 1)))
+    # Incremental update, and lookups via PackIdxList
+    _create_idx(tmpdir, 3)
+    with git.PackIdxList(tmpdir) as l:
+        WVPASS(l.exists(struct.pack('18xBB', 3, 1)))
+    # The update is made in place, and mustn't disturb a table that's
+    # already open
+    with oidhash.OidHash(os.path.join(tmpdir, b'bup.oidhash')) as old:
+        oidhash.update(tmpdir, git.open_idx)
+        WVPASSEQ(os.fstat(old.file.fileno()).st_ino,
+                 os.stat(os.path.join(tmpdir, b'bup.oidhash')).st_ino)
+        WVPASS(old.valid())
+        WVPASSEQ(len(old.idxnames), 4)
+        WVPASSEQ(None, old.exists(struct.pack('18xBB', 3, 1)))
+        for s in range(255):
+            WVPASS(old.exists(struct.pack('18xBB', 2, s)))
+    with oidhash.OidHash(os.path.join(tmpdir, b'bup.oidhash')) as h:
+        WVPASSEQ(len(h), 4 * 255 + 2)
+        WVPASSEQ(OBJECT_EXISTS, h.exists(struct.pack('18xBB', 3, 1)))
+    with git.PackIdxList(tmpdir) as l:
+        with l.snapshot() as snap:
+            WVPASS(snap.oid_hash)
+            WVPASSEQ(snap.hash_rest, ())
+        WVPASSEQ(l.exists(big, want_offset=True).offset, 2**33 + 5)
+        WVPASSEQ(None, l.exists(struct.pack('18xBB', 4, 1)))
+    # A table covering a removed idx is stale and must be ignored
+    os.unlink(os.path.join(tmpdir, b'pack-%s.idx' % (b'9' * 40)))
+    with git.PackIdxList(tmpdir) as l:
+        with l.snapshot() as snap:
+            WVPASSEQ(None, snap.oid_hash)
+        WVPASSEQ(None, l.exists(big))
+        WVPASS(l.exists(struct.pack('18xBB', 3, 1)))
+    oidhash.update(tmpdir, git.open_idx)
+    with oidhash.OidHash(os.path.join(tmpdir, b'bup.oidhash')) as h:
+        WVPASSEQ(len(h), 4 * 255)
+        WVPASSEQ(None, h.exists(big))
+
+def test_oidhash_full(tmpdir):
+    for i in range(8):
+        _create_idx(tmpdir, i)
+    names = sorted(glob(tmpdir + b'/pack-*.idx'))
+    path = os.path.join(tmpdir, b'bup.oidhash')
+    # Room for about three idxes, so the later ones force
+    # displacements, and eventually don't fit.
+    with open(path, 'w+b') as f, oidhash.create(path, f, 3 * 255, 1) as h:
+        added = []
+        with pytest.raises(oidhash.TableFull):
+            for name in names:
+                with git.open_idx(name) as ix:
+                    h.add_idx(ix)
+                added.append(name)
+        WVPASS(len(added) >= 3)
+        # Nothing that was added before the table filled up was lost,
+        # including the first entries of the idx that didn't fit.
+        partial = len(h) - 255 * len(added)
+        WVPASS(partial > 0)
+        for i in range(len(added) + 1):
+            for s in range(255 if i < len(added) else partial):
+                loc = h.exists(struct.pack('18xBB', i, s), want_offset=True)
+                WVPASSEQ(loc.offset, 100 * s)
+        h.discard()
+
+def test_oidhash_concurrent_reader(tmpdir):
+    for i in range(3):
+        _create_idx(tmpdir, i)
+    path = os.path.join(tmpdir, b'bup.oidhash')
+    with open(path, 'w+b') as f, oidhash.create(path, f, 3 * 255, 0.4) as h:
+        for name in sorted(glob(tmpdir + b'/pack-*.idx')):
+            with git.open_idx(name) as ix:
+                h.add_idx(ix)
+    for i in range(3, 6):
+        _create_idx(tmpdir, i)
+    oids = [struct.pack('18xBB', i, s) for i in range(3) for s in range(255)]
+    misses = []
+    reading, done = threading.Event(), threading.Event()
+    def read(h):
+        while not done.is_set():
+            misses.extend(oid for oid in oids if not h.exists(oid))
+            reading.set()
+    ino = os.stat(path).st_ino
+    with oidhash.OidHash(path) as h:
+        reader = threading.Thread(target=read, args=(h,))
+        reader.start()
+        try:
+            reading.wait()
+            # Fills the table enough to require displacements
+            oidhash.update(tmpdir, git.open_idx)
+        finally:
+            done.set()
+            reader.join()
+    WVPASSEQ([], misses)
+    with oidhash.OidHash(path) as h:
+        WVPASSEQ(len(h), 6 * 255)
+        WVPASSEQ(ino, os.fstat(h.file.fileno()).st_ino)
+
+def test_lookupstats(tmpdir):
+    environ[b'BUP_DIR'] = bupdir = tmpdir + b'/bup'
+    git.init_repo(bupdir)
+    for i in range(3):
+        _create_idx(tmpdir, i)
+    lookupstats.reset()
+    lookupstats.enable()
+    try:
+        with git.PackIdxList(tmpdir) as l:
+            WVPASS(l.exists(struct.pack('18xBB', 1, 7)))
+            WVPASS(l.exists(struct.pack('18xBB', 2, 7)))
+            WVPASSEQ(None, l.exists(struct.pack('18xBB', 3, 7)))
+        stats = lookupstats.report()
+    finally:
+        lookupstats.enabled = False
+        lookupstats.reset()
+    WVPASSEQ(stats['lookups']['idxes'], 3)
+    WVPASSEQ(stats['lookups']['latency']['hit']['count'], 2)
+    WVPASSEQ(stats['lookups']['latency']['miss']['count'], 1)
+    WVPASSEQ(stats['idx']['hits'], 2)
+    # Misses search every idx
+    WVPASS(stats['idx']['searches'] >= 2 + 3)
+    WVPASS(stats['idx']['steps'] >= stats['idx']['searches'])
+
 def test_config(tmpdir):
     cfg_file = os.path.join(os.path.dirname(__file__), 'sample.conf')
     no_such_file = os.path.join(os.path.dirname(__file__), 'nosuch.conf')
@@ -13,6 +13,8 @@ from bup.helpers import \
      detect_fakeroot,
      finalized,
      grafted_path_components,
+     mmap_read,
+     mmap_readwrite_private,
      nullctx,
      parse_num,
      partition,
@@ -309,3 +311,27 @@ def test_valid_save_name():
     WVFAIL(valid(b'foo/bar.lock/baz'))
     WVFAIL(valid(b'.bar/baz'))
     WVFAIL(valid(b'foo/.bar/baz'))
+
+
+def test_mmap_paging_hints(tmpdir):
+    data = os.urandom(3 * 4096 + 17)
+    with open(tmpdir + b'/f', 'wb') as f:
+        f.write(data)
+    for prefault in (None, 'willneed', 'populate'):
+        for hugepages in (False, True):
+            if prefault == 'populate' and hugepages:
+                with open(tmpdir + b'/f', 'rb') as f:
+                    wvexcept(ValueError, mmap_read, f, close=False,
+                             prefault=prefault, hugepages=hugepages)
+                continue
+            with open(tmpdir + b'/f', 'rb') as f, \
+                 mmap_read(f, close=False, prefault=prefault,
+                           hugepages=hugepages) as m:
+                WVPASSEQ(data, m[:])
+            with open(tmpdir + b'/f', 'rb') as f, \
+                 mmap_readwrite_private(f, close=False, prefault=prefault,
+                                        hugepages=hugepages) as m:
+                m[0:4] = b'BLOM'
+                WVPASSEQ(b'BLOM' + data[4:], m[:])
+    with open(tmpdir + b'/f', 'rb') as f:
+        WVPASSEQ(data, f.read())
@@ -0,0 +1,54 @@
+
+import os, pickle
+
+from wvpytest import *
+
+from bup import hlinkdb
+
+
+def saved(db):
+    db.prepare_save()
+    db.commit_save()
+
+
+def test_hlinkdb(tmpdir):
+    path = tmpdir + b'/hlink'
+    # Version 1 (pickle) databases are converted
+    with open(path, 'wb') as f:
+        pickle.dump({b'1:2': [b'/a', b'/b'], b'1:3': [b'/c']}, f, 2)
+    with hlinkdb.HLinkDB(path) as db:
+        WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+        saved(db)
+    with open(path, 'rb') as f:
+        WVPASSEQ(f.read(len(hlinkdb.HLINKDB_HDR)), hlinkdb.HLINKDB_HDR)
+
+    with hlinkdb.HLinkDB(path) as db:
+        WVPASSEQ(db.node_paths(1, 2), [b'/a', b'/b'])
+        WVPASSEQ(db.node_paths(1, 3), [b'/c'])
+        WVPASSEQ(db.node_paths(1, 4), [])
+        db.del_path(b'/a')
+        db.add_path(b'/a', 1, 2)
+        db.add_path(b'/d', 1, 3)
+        db.add_path(b'/c', 0, 7)
+        db.del_path(b'/nonexistent')
+        WVPASSEQ(db.node_paths(1, 2), [b'/b', b'/a'])
+        WVPASSEQ(db.node_paths(1, 3), [b'/d'])
+        WVPASSEQ(db.node_paths(0, 7), [b'/c'])
+        saved(db)
+    with hlinkdb.HLinkDB(path) as db:
+        WVPASSEQ(db.node_paths(1, 2), [b'/b', b'/a'])
+        WVPASSEQ(db.node_paths(1, 3), [b'/d'])
+        WVPASSEQ(db.node_paths(0, 7), [b'/c'])
+        db.add_path(b'/e', 1, 3)
+        # Not saved
+    with hlinkdb.HLinkDB(path) as db:
+        WVPASSEQ(db.node_paths(1, 3), [b'/d'])
+        # Nothing changed, so the file isn't rewritten
+        ino = os.stat(path).st_ino
+        saved(db)
+        WVPASSEQ(os.stat(path).st_ino, ino)
+    with hlinkdb.HLinkDB(path) as db:
+        for p in (b'/a', b'/b', b'/c', b'/d'):
+            db.del_path(p)
+        saved(db)
+    WVPASS(not os.path.exists(path))
@@ -1,5 +1,6 @@
 
-import os, time
+import gc, os, struct, time, weakref
+from functools import cmp_to_key
 
 from wvpytest import *
 
@@ -167,3 +168,241 @@ def test_index_dirty(tmpdir):
                              [b'/a/b/c', b'/a/b/', b'/a/', b'/'])
     finally:
         os.chdir(orig_cwd)
+
+
+def test_index_iter(tmpdir):
+    orig_cwd = os.getcwd()
+    try:
+        os.chdir(tmpdir)
+        ds = xstat.stat(lib_t_dir)
+        fs = xstat.stat(lib_t_dir + b'/test_index.py')
+        tmax = (time.time() - 1) * 10**9
+        with index.MetaStoreWriter(b'index.meta.tmp') as ms, \
+             index.Writer(b'index.tmp', ms, tmax) as w:
+            meta_ofs = ms.store(metadata.empty_metadata)
+            for name in (b'/a/c/y', b'/a/c/', b'/a/bb', b'/a/b/x', b'/a/b/',
+                         b'/a/'):
+                w.add(name, ds if name.endswith(b'/') else fs, meta_ofs)
+            with w.new_reader() as r:
+                WVPASSEQ([e.name for e in r.iter(name=b'/a/b')],
+                         [b'/a/b/x', b'/a/b/'])
+                WVPASSEQ([e.name for e in r.iter(name=b'/a/b/')],
+                         [b'/a/b/x', b'/a/b/'])
+                WVPASSEQ([e.name for e in r.iter(name=b'/a/bb')], [b'/a/bb'])
+                WVPASSEQ([e.name for e in r.iter(name=b'/a/nope')], [])
+                # Don't descend into /a/c/
+                WVPASSEQ([e.name for e in
+                          r.iter(wantrecurse=lambda e: e.name != b'/a/c/')],
+                         [b'/a/c/', b'/a/bb', b'/a/b/x', b'/a/b/', b'/a/',
+                          b'/'])
+                WVPASSEQ(r.find(b'/a/b/x').parent.name, b'/a/b/')
+
+                # An abandoned iterator in a reference cycle is collected
+                class Want:
+                    def __call__(self, e): return True
+                want = Want()
+                want.it = it = r.iter(wantrecurse=want)
+                next(it)
+                WVPASS(gc.is_tracked(it))
+                gone = weakref.ref(want)
+                del want, it
+                gc.collect()
+                WVPASSEQ(gone(), None)
+
+                # Fields are decoded lazily, without clobbering any
+                # that have been set, and written back in place.
+                e = r.find(b'/a/bb')
+                WVPASSEQ(e.size, fs.st_size)
+                WVPASSEQ(e.mtime, min(fs.st_mtime_ns, tmax))
+                e = r.find(b'/a/bb')
+                e.validate(0o100644, index.FAKE_SHA)
+                WVPASSEQ(e.sha, index.FAKE_SHA)
+                WVPASSEQ(e.size, fs.st_size)
+                e.repack()
+                e = r.find(b'/a/bb')
+                WVPASS(e.is_valid())
+                WVPASSEQ((e.gitmode, e.sha), (0o100644, index.FAKE_SHA))
+                WVPASSEQ(e.packed(), r.m[e._ofs:e._ofs + index.SIGLEN])
+    finally:
+        os.chdir(orig_cwd)
+
+
+def test_index_find_and_entry(tmpdir):
+    orig_cwd = os.getcwd()
+    try:
+        os.chdir(tmpdir)
+        ds = xstat.stat(lib_t_dir)
+        fs = xstat.stat(lib_t_dir + b'/test_index.py')
+        tmax = (time.time() - 1) * 10**9
+        names = [b'/a/%d' % i for i in range(20)]
+        names.sort(reverse=True)
+        with index.MetaStoreWriter(b'index.meta.tmp') as ms, \
+             index.Writer(b'index.tmp', ms, tmax) as w:
+            meta_ofs = ms.store(metadata.empty_metadata)
+            for name in names + [b'/a/']:
+                w.add(name, ds if name.endswith(b'/') else fs, meta_ofs)
+            with w.new_reader() as r:
+                WVPASSEQ(len(r), 22)
+                for name in names + [b'/a/', b'/']:
+                    WVPASSEQ(r.find(name).name, name)
+                for name in (b'/a', b'/a/0/', b'/a/20', b'/b/', b'/a/0/x',
+                             b'', b'a/'):
+                    WVPASSEQ(r.find(name), None)
+                WVPASSEQ([e.name for e in r.forward_iter()],
+                         [n[3:] for n in names] + [b'a/', b'/'])
+                WVPASSEQ(r.entry(0).name, names[0][3:])
+                WVPASSEQ(r.entry(21).name, b'/')
+                WVEXCEPT(IndexError, r.entry, 22)
+    finally:
+        os.chdir(orig_cwd)
+
+
+def test_index_v7_conversion(tmpdir):
+    # /, /a/, and /a/b in the version 7 format, i.e. each entry's
+    # NUL terminated basename, followed by its INDEX_SIG record.
+    def v7_entry(name, mode, children_ofs, children_n, meta_ofs):
+        return name + b'\0' + struct.pack(index.INDEX_SIG,
+                                          1, 2, 1, 3, 0, 4, 0, 5, 0, 6,
+                                          mode, 0, index.EMPTY_SHA,
+                                          index.IX_EXISTS,
+                                          children_ofs, children_n, meta_ofs)
+    hdr = b'BUPI\0\0\0\7'
+    b_ofs = len(hdr)
+    data = hdr + v7_entry(b'b', 0o100644, b_ofs + 2 + index.SIGLEN, 0, 7)
+    a_ofs = len(data)
+    data += v7_entry(b'a/', 0o40755, b_ofs, 1, 8)
+    data += v7_entry(b'/', 0o40755, a_ofs, 1, 9)
+    data += struct.pack('!Q', 3)
+    path = tmpdir + b'/index'
+    with open(path, 'wb') as f:
+        f.write(data)
+    # Readers must not modify the index
+    WVEXCEPT(index.Error, index.Reader, path)
+    with open(path, 'rb') as f:
+        WVPASSEQ(f.read(), data)
+    WVPASS(index.convert_v7(path))
+    WVFAIL(index.convert_v7(path))
+    WVFAIL(index.convert_v7(tmpdir + b'/nonexistent'))
+    with index.Reader(path) as r:
+        WVPASSEQ(len(r), 3)
+        WVPASSEQ([(e.name, e.meta_ofs, e.size) for e in r],
+                 [(b'/a/b', 7, 6), (b'/a/', 8, 6), (b'/', 9, 6)])
+        WVPASSEQ(r.find(b'/a/b').mode, 0o100644)
+    with open(path, 'rb') as f:
+        WVPASSEQ(f.read(len(index.INDEX_HDR)), index.INDEX_HDR)
+    with index.Reader(path) as r:
+        WVPASSEQ([e.name for e in r.forward_iter()], [b'b', b'a/', b'/'])
+
+
+def stable_merge(*readers):
+    # Like index.merge(), but with ties going to the earliest reader
+    ents = [(e, i) for i, r in enumerate(readers) for e in r]
+    ents.sort(key=cmp_to_key(lambda x, y: x[0]._cmp(y[0]) or x[1] - y[1]))
+    prev = None
+    for e, i in ents:
+        if e.name != prev:
+            prev = e.name
+            yield e
+
+def test_index_write_merged(tmpdir):
+    orig_cwd = os.getcwd()
+    try:
+        os.chdir(tmpdir)
+        ds = xstat.stat(b'.')
+        fs = xstat.stat(lib_t_dir + b'/test_index.py')
+        tmax = (time.time() - 1) * 10**9
+        with index.MetaStoreWriter(b'index.meta.tmp') as ms:
+            with index.Writer(b'index1', ms, tmax) as w:
+                w.add(b'/a/b/x', fs, 0)
+                w.add(b'/a/b/c', fs, 0)
+                w.add(b'/a/b/', ds, 0)
+                w.add(b'/a/', ds, 0)
+                w.close()
+            with index.Writer(b'index2', ms, tmax) as w:
+                w.add(b'/a/b/n/2', fs, 0)
+                w.add(b'/a/b/c', fs, 0)
+                w.close()
+            with index.Writer(b'index3', ms, tmax) as w:
+                w.add(b'/z', fs, 0)
+                w.add(b'/a/c/n/3', fs, 0)
+                w.add(b'/a/c/', ds, 0)
+                w.close()
+            with index.Writer(b'empty', ms, tmax) as w:
+                w.close()
+            with index.Reader(b'index1') as r1, \
+                 index.Reader(b'index2') as r2, \
+                 index.Reader(b'index3') as r3, \
+                 index.Reader(b'empty') as r0:
+                fake_validate(r1)
+                for name in (b'/a/b/x', b'/a/b/c'):
+                    e = eget(r1, name)
+                    e.invalidate()
+                    e.repack()
+                for readers in ((r2, r1, r3, r0), (r1, r2), (r3,), (r0,)):
+                    with index.Writer(b'expected', ms, tmax) as w:
+                        for e in stable_merge(*readers):
+                            w.add_ixentry(e)
+                        w.close()
+                    index.write_merged(b'merged', readers)
+                    with open(b'expected', 'rb') as f:
+                        expected = f.read()
+                    with open(b'merged', 'rb') as f:
+                        WVPASSEQ(f.read(), expected)
+                    with index.Reader(b'merged') as m:
+                        WVPASSEQ([e.name for e in m],
+                                 [e.name for e in index.merge(*readers)])
+    finally:
+        os.chdir(orig_cwd)
+
+
+def test_metastore_table(tmpdir):
+    ms_path = tmpdir + b'/index.meta'
+    meta = metadata.from_path(lib_t_dir + b'/test_index.py')
+    def stored(ms, count):
+        ofs = []
+        for i in range(count):
+            meta.mtime = i * 10**9
+            ofs.append(ms.store(meta))
+        return ofs
+    # Enough to grow the table a couple of times
+    n = 3 * (1 << index._META_TABLE_MIN_BITS)
+    with index.MetaStoreWriter(ms_path) as ms:
+        first = stored(ms, n)
+        WVPASSEQ(len(set(first)), n)
+        WVPASSEQ(stored(ms, n), first)
+    size = os.stat(ms_path).st_size
+    with index.MetaStoreWriter(ms_path) as ms:
+        WVPASSEQ(stored(ms, n), first)
+    WVPASSEQ(os.stat(ms_path).st_size, size)
+    with index.MetaStoreReader(ms_path) as msr:
+        meta.mtime = 7 * 10**9
+        WVPASSEQ(msr.metadata_at(first[7]).encode(), meta.encode())
+
+    # Records appended without the table are picked up, and a dirty
+    # or missing table is rebuilt.
+    with open(ms_path, 'ab') as f:
+        meta.mtime = -1
+        f.write(meta.encode(include_path=False))
+    with index.MetaStoreWriter(ms_path) as ms:
+        WVPASSEQ(ms.store(meta), size)
+        WVPASSEQ(stored(ms, 3), first[:3])
+        ms._offsets.set_dirty(True)
+        ms.close(abort=True)
+    with index.MetaStoreWriter(ms_path) as ms:
+        WVPASSEQ(stored(ms, n), first)
+    os.unlink(ms_path + b'.ix')
+    with index.MetaStoreWriter(ms_path) as ms:
+        WVPASSEQ(stored(ms, n), first)
+        meta.mtime = -1
+        WVPASSEQ(ms.store(meta), size)
+    WVPASSEQ(os.stat(ms_path).st_size,
+             size + len(meta.encode(include_path=False)))
+
+    # A second writer finds the table dirty, and must replace it
+    # rather than truncating the one the first writer has mapped.
+    with index.MetaStoreWriter(ms_path) as ms:
+        ino = os.stat(ms_path + b'.ix').st_ino
+        with index.MetaStoreWriter(ms_path) as ms2:
+            WVPASSNE(os.stat(ms_path + b'.ix').st_ino, ino)
+            WVPASSEQ(stored(ms2, n), first)
+        WVPASSEQ(stored(ms, n), first)
@@ -1,4 +1,5 @@
 
+from io import BytesIO
 import errno, glob, stat, subprocess
 import os, sys
 import pytest
@@ -149,6 +150,59 @@ def test_metadata_method(tmpdir):
                 WVPASSEQ(m.mtime, 0)
 
 
+def test_native_encode_decode():
+    class Port:
+        # Not a BytesIO, so Metadata.read() uses the python decoder
+        def __init__(self, data): self._f = BytesIO(data)
+        def read(self, n): return self._f.read(n)
+    metas = [metadata.empty_metadata]
+    for i in range(12):
+        m = metadata.Metadata(frozen=False)
+        m.mode = (stat.S_IFLNK | 0o777) if i % 3 == 0 else (stat.S_IFREG | 0o644)
+        m.uid, m.gid, m.rdev = 1000 + i, 100, 0
+        m.user, m.group = b'user', b'group' if i % 2 else b''
+        m.atime, m.mtime, m.ctime = -1500000000 - i, 10**18 + i, i
+        if i % 3 == 0:
+            m.symlink_target = b'target-%d' % i
+            m.size = len(m.symlink_target)
+        elif i % 2:
+            m.size = i * 1000
+        if i % 4 == 1:
+            m.path = b'some/path-%d' % i
+            m.hardlink_target = b'other/path'
+        if i % 4 == 2:
+            m.posix1e_acl = (b'u::rw-', b'u::rw-')
+            m.linux_attr = 0x80000
+            m.linux_xattr = [(b'user.a', b''), (b'user.b', b'x' * 200)]
+        if i % 5 == 4:
+            m.posix1e_acl = (b'u::rwx', b'u::rwx', b'u::r-x', b'u::r-x')
+        if i == 11: # doesn't fit in 64 bits, so the python code handles it
+            m.mtime = 10**30
+        metas.append(m.freeze())
+    for include_path in (True, False):
+        expected = b''.join(m._encode(include_path) for m in metas)
+        WVPASSEQ(metadata.encode_all(metas, include_path), expected)
+        WVPASSEQ(b''.join(m.encode(include_path) for m in metas), expected)
+    data = metadata.encode_all(metas)
+    native, python = BytesIO(data), Port(data)
+    for m in metas:
+        nm = metadata.Metadata.read(native)
+        pm = metadata.Metadata.read(python)
+        WVPASSEQ(nm, m)
+        WVPASSEQ(pm, m)
+        if m is not metadata.empty_metadata:
+            for k in m.__slots__:
+                WVPASSEQ((k, getattr(nm, k)), (k, getattr(pm, k)))
+                WVPASSEQ(type(getattr(nm, k)), type(getattr(pm, k)))
+            if m.posix1e_acl:
+                WVPASSEQ(type(nm.posix1e_acl), tuple)
+                WVPASSEQ(hash(nm.freeze()), hash(m))
+        WVPASSEQ(native.tell(), python._f.tell())
+    WVPASSEQ(metadata.Metadata.read(native), None)
+    for end in range(1, len(metas[1].encode())):
+        WVEXCEPT(EOFError, metadata.Metadata.read, BytesIO(data[1:1 + end]))
+
+
 def _first_err():
     if helpers.saved_errors:
         return str(helpers.saved_errors[0])
@@ -7,8 +7,10 @@ import re
 from buptest import exc as ex, exo
 from wvpytest import *
 
-from bup import git, tree
+from bup import git, metadata, tree
+from bup.hashsplit import GIT_MODE_FILE
 from bup.helpers import mkdirp
+from bup.repo import LocalRepo
 
 
 def test_abbreviate():
@@ -358,3 +360,51 @@ def test_expected_depth_2_split(tmpdir):
     diff = diff_split(split_2, split_tree_for_filenames(split_src, tmpdir))
     stderr.writelines(diff)
     assert not diff
+
+
+def test_stack_out_of_order(tmpdir):
+    bupdir = tmpdir + b'/bup'
+    git.init_repo(bupdir)
+    meta = metadata.from_path(tmpdir)
+    names = [b'%s' % x.encode('ascii') for x in split_src]
+    def blob(repo, name):
+        return repo.write_data(name)
+    for split_trees in (False, True):
+        cfg = {'trees': split_trees}
+        with LocalRepo(bupdir) as repo:
+            # In order
+            stack = tree.Stack(repo, cfg)
+            stack.push(b'', meta)
+            stack.push(b'a', meta)
+            stack.push(b'b', meta)
+            for name in names:
+                stack.append_to_current(name, 0o100644, GIT_MODE_FILE,
+                                        blob(repo, name), meta)
+            b_oid = stack.pop()
+            stack.append_to_current(b'x', 0o100644, GIT_MODE_FILE,
+                                    blob(repo, b'x'), meta)
+            stack.pop()
+            expected = stack.pop()
+
+            # Out of order: the files in b, and so b, a, and the root,
+            # are all finished after everything has been popped.
+            written = {}
+            stack = tree.Stack(repo, cfg)
+            stack.push(b'', meta)
+            stack.push(b'a', meta)
+            stack.push(b'b', meta)
+            pending = [(stack.append_pending(name, 0o100644, GIT_MODE_FILE,
+                                             None), name)
+                       for name in names]
+            WVPASSEQ(stack.pop(on_oid=lambda x: written.setdefault(b'b', x)),
+                     None)
+            stack.append_to_current(b'x', 0o100644, GIT_MODE_FILE,
+                                    blob(repo, b'x'), meta)
+            WVPASSEQ(stack.pop(), None)
+            WVPASSEQ(stack.pop(on_oid=lambda x: written.setdefault(b'', x)),
+                     None)
+            WVPASSEQ(len(stack), 0)
+            for p, name in reversed(pending):
+                WVPASSEQ(written, {})
+                stack.complete(p, blob(repo, name), meta)
+            WVPASSEQ(written, {b'b': b_oid, b'': expected})
@@ -4,7 +4,7 @@ from os import symlink
 from random import Random, randint
 from stat import S_IFDIR, S_IFLNK, S_IFREG, S_ISDIR, S_ISREG
 from time import localtime, strftime, tzset
-import os, sys
+import os, sys, threading
 
 import pytest
 
@@ -60,6 +60,27 @@ def test_cache_behavior():
         vfs._cache_max_items = orig_max
         vfs.clear_cache()
 
+def test_cache_threads():
+    orig_max = vfs._cache_max_items
+    try:
+        vfs._cache_max_items = 8
+        vfs.clear_cache()
+        def notice(n):
+            for i in range(5000):
+                key = b'itm:' + (b'%d-%d' % (n, i)).ljust(20, b'\0')
+                vfs.cache_notice(key, i)
+                vfs.cache_get(key)
+        threads = [threading.Thread(target=notice, args=(n,)) for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        wvpasseq(8, len(vfs._cache))
+        wvpasseq(frozenset(vfs._cache), frozenset(vfs._cache_keys))
+    finally:
+        vfs._cache_max_items = orig_max
+        vfs.clear_cache()
+
 ## The clear_cache() calls below are to make sure that the test starts
 ## from a known state since at the moment the cache entry for a given
 ## item (like a commit) can change.  For example, its meta value might
@@ -382,3 +403,45 @@ def test_tree_depth_parsing():
         with pytest.raises(Exception) as exinfo:
             vfs._parse_tree_depth(x)
         assert 'Could not parse split tree depth' in str(exinfo.value)
+
+def test_split_tree_index():
+    oids = [bytes([i]) * 20 for i in range(3)]
+    tree = vfs._SplitTree(git.tree_encode([(0o100644, b'0000', oids[0]),
+                                           (0o40000, b'0100', oids[1]),
+                                           (0o100644, b'2000', oids[2])]))
+    assert tree.offsets == [0, 0x100, 0x2000]
+    assert tree.oids == oids
+    for ofs, i in ((0, 0), (0xff, 0), (0x100, 1), (0x1fff, 1), (0x2000, 2),
+                   (1 << 40, 2)):
+        assert tree.index(ofs) == i
+
+def test_cat_ahead():
+    class Repo:
+        def __init__(self):
+            self.batches = []
+        def cat_batch(self, refs):
+            self.batches.append(len(refs))
+            for ref in refs:
+                yield ref, b'blob', 1, iter((ref,))
+    orig_max = vfs._max_cat_ahead_bytes
+    try:
+        vfs._max_cat_ahead_bytes = 200
+        oids = [bytes([i]) * 20 for i in range(100)]
+        hexes = [oid.hex().encode('ascii') for oid in oids]
+        for prefetch in (False, True):
+            repo = Repo()
+            got = vfs._cat_ahead(repo, oids, prefetch=prefetch)
+            assert [data for _, _, _, data in got] == hexes
+            # Doubling, but limited by the 40 byte results seen
+            assert repo.batches == [1, 2, 4, 5, 5] + [5] * 16 + [3]
+            repo = Repo()
+            got = vfs._cat_ahead(repo, oids, [100] * 100, prefetch=prefetch)
+            assert [data for _, _, _, data in got] == hexes
+            assert repo.batches == [1] + [2] * 49 + [1]
+        repo = Repo()
+        got = vfs._cat_ahead(repo, oids, prefetch=True)
+        assert next(got)[3] == hexes[0]
+        got.close()
+        assert repo.batches == [1]
+    finally:
+        vfs._max_cat_ahead_bytes = orig_max
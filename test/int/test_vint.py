@@ -1,10 +1,10 @@
 
-from io import BytesIO
+from io import BufferedReader, BytesIO
 from itertools import combinations_with_replacement
 
 from wvpytest import *
 
-from bup import vint
+from bup import _helpers, vint
 
 
 def encode_and_decode_vuint(x):
@@ -94,3 +94,26 @@ def test_pack_and_unpack():
     WVEXCEPT(Exception, vint.pack, 'x', 1)
     WVEXCEPT(Exception, vint.unpack, 's', '')
     WVEXCEPT(Exception, vint.unpack, 'x', '')
+
+
+def test_buffered_recv():
+    # BufferedReader has peek(), so this exercises the C decoder,
+    # including values split across the (small) buffer's refills
+    values = [b'', -1, 0, 10**100, b'foo' * 20, -10**100, 42, b'x']
+    types = 'svVVsvVs'
+    data = vint.pack(types, *values) * 3
+    for bufsize in (1, 2, 7, 64, 4096):
+        f = BufferedReader(BytesIO(data), buffer_size=bufsize)
+        for _ in range(2):
+            WVPASSEQ(vint.recv(f, types), values)
+        for t, v in zip(types, values):
+            read = {'V': vint.read_vuint,
+                    'v': vint.read_vint,
+                    's': vint.read_bvec}[t]
+            WVPASSEQ(read(f), v)
+        WVPASSEQ(vint.read_vuint(f), None)
+    WVPASSEQ(_helpers.vint_unpack_from('VV', b'\x01\x80'), None)
+    WVPASSEQ(_helpers.vint_unpack_from('Vs', b'\x01\x02a'), None)
+    WVPASSEQ(_helpers.vint_unpack_from('Vs', b'\x00\x01\x01a', 1),
+             ([1, b'a'], 4))
+    WVEXCEPT(EOFError, vint.recv, BufferedReader(BytesIO(b'\x01\x05ab')), 'Vs')
@@ -0,0 +1,3 @@
+commit='6e310da925e11733e98c57c6f9a5a0ce881ade95'
+date='2026-10-19 02:23:12 +0000'
+modified=False